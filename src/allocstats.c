@@ -0,0 +1,352 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <fstrace.h>
+#include "allocstats.h"
+
+#ifdef ALLOC_ACCOUNTING
+
+/* The bookkeeping uses malloc(3) directly so it does not account for
+ * itself. */
+
+enum {
+    MAX_SITES = 4096,           /* powers of two */
+    MAX_COMMANDS = 256,
+    BLOCK_BUCKETS = 1 << 16,
+};
+
+typedef struct {
+    const char *key;            /* NULL if the slot is free */
+    uint64_t calls;             /* of commands */
+    uint64_t count, bytes;
+} tally_t;
+
+typedef struct block {
+    struct block *next;
+    void *ptr;
+    size_t size;
+    alloc_subsystem_t owner;
+} block_t;
+
+typedef struct {
+    uint64_t count, bytes, live, peak;
+} usage_t;
+
+static const char *const SUBSYSTEM_NAMES[ALLOC_SUBSYSTEMS] = {
+    [ALLOC_OTHER] = "other",
+    [ALLOC_PARSER] = "parser",
+    [ALLOC_NICKS] = "nicks",
+    [ALLOC_TEXT] = "text",
+    [ALLOC_CACHE] = "cache",
+    [ALLOC_I18N] = "i18n",
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static tally_t sites[MAX_SITES];
+static tally_t commands[MAX_COMMANDS];
+static tally_t overflow = { "(overflow)" };
+static block_t *blocks[BLOCK_BUCKETS];
+static usage_t subsystems[ALLOC_SUBSYSTEMS];
+
+static _Thread_local const char *current_site;
+static _Thread_local tally_t *current_command;
+static _Thread_local alloc_subsystem_t current_subsystem;
+
+static size_t hash_pointer(const void *p)
+{
+    uintptr_t x = (uintptr_t) p;
+    x ^= x >> 17;
+    x *= UINT64_C(0xed5ad4bb);
+    x ^= x >> 11;
+    return x;
+}
+
+static size_t hash_string(const char *s)
+{
+    size_t h = 5381;
+    while (*s)
+        h = h * 33 + (unsigned char) *s++;
+    return h;
+}
+
+/* The sites are string literals, so they are compared by address. */
+static tally_t *site_tally(const char *site)
+{
+    if (!site)
+        site = "-";
+    size_t i = hash_pointer(site);
+    for (size_t n = 0; n < MAX_SITES; n++, i++) {
+        tally_t *tally = &sites[i % MAX_SITES];
+        if (tally->key == site)
+            return tally;
+        if (!tally->key) {
+            tally->key = site;
+            return tally;
+        }
+    }
+    return &overflow;
+}
+
+static tally_t *command_tally(const char *command)
+{
+    size_t i = hash_string(command);
+    for (size_t n = 0; n < MAX_COMMANDS; n++, i++) {
+        tally_t *tally = &commands[i % MAX_COMMANDS];
+        if (!tally->key) {
+            tally->key = strdup(command);
+            return tally->key ? tally : &overflow;
+        }
+        if (!strcmp(tally->key, command))
+            return tally;
+    }
+    return &overflow;
+}
+
+alloc_subsystem_t enter_alloc_subsystem(alloc_subsystem_t subsystem)
+{
+    alloc_subsystem_t outer = current_subsystem;
+    current_subsystem = subsystem;
+    return outer;
+}
+
+void leave_alloc_subsystem(alloc_subsystem_t outer)
+{
+    current_subsystem = outer;
+}
+
+void *enter_alloc_command(const char *command)
+{
+    tally_t *outer = current_command;
+    pthread_mutex_lock(&lock);
+    current_command = command_tally(command);
+    current_command->calls++;
+    pthread_mutex_unlock(&lock);
+    return outer;
+}
+
+void leave_alloc_command(void *outer)
+{
+    current_command = outer;
+}
+
+const char *enter_alloc_site(const char *site)
+{
+    const char *outer = current_site;
+    /* The outermost site is the one in lip's code. */
+    if (!outer)
+        current_site = site;
+    return outer;
+}
+
+void leave_alloc_site(const char *outer)
+{
+    current_site = outer;
+}
+
+static block_t *take_block(void *ptr)
+{
+    for (block_t **b = &blocks[hash_pointer(ptr) % BLOCK_BUCKETS]; *b;
+         b = &(*b)->next)
+        if ((*b)->ptr == ptr) {
+            block_t *block = *b;
+            *b = block->next;
+            return block;
+        }
+    return NULL;
+}
+
+static void put_block(block_t *block)
+{
+    block_t **bucket = &blocks[hash_pointer(block->ptr) % BLOCK_BUCKETS];
+    block->next = *bucket;
+    *bucket = block;
+}
+
+void *base_realloc(void *ptr, size_t size)
+{
+    block_t *block = NULL;
+    if (size)
+        block = malloc(sizeof *block);
+    /* Once realloc(3) has released ptr, another thread may be given the
+     * same address, so the old block is taken out beforehand. */
+    block_t *old_block = NULL;
+    if (ptr) {
+        pthread_mutex_lock(&lock);
+        old_block = take_block(ptr);
+        pthread_mutex_unlock(&lock);
+    }
+    void *result = realloc(ptr, size);
+    pthread_mutex_lock(&lock);
+    if (size && !result) {
+        if (old_block)
+            put_block(old_block); /* ptr is still allocated */
+        pthread_mutex_unlock(&lock);
+        free(block);
+        return NULL;
+    }
+    size_t old_size = 0;
+    alloc_subsystem_t owner = current_subsystem;
+    if (old_block) {
+        old_size = old_block->size;
+        owner = old_block->owner;   /* a realloc keeps the owner */
+        subsystems[owner].live -= old_size;
+        free(old_block);
+    }
+    if (block) {
+        block->ptr = result;
+        block->size = size;
+        block->owner = owner;
+        put_block(block);
+        subsystems[owner].live += size;
+        if (subsystems[owner].live > subsystems[owner].peak)
+            subsystems[owner].peak = subsystems[owner].live;
+        if (size > old_size) {
+            unsigned count = ptr ? 0 : 1;
+            uint64_t bytes = size - old_size;
+            tally_t *tallies[] = {
+                site_tally(current_site),
+                current_command,
+            };
+            for (int i = 0; i < 2; i++)
+                if (tallies[i]) {
+                    tallies[i]->count += count;
+                    tallies[i]->bytes += bytes;
+                }
+            subsystems[owner].count += count;
+            subsystems[owner].bytes += bytes;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+void init_alloc_accounting(void)
+{
+    fs_set_reallocator(base_realloc);
+}
+
+void reset_alloc_stats(void)
+{
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < MAX_SITES; i++)
+        sites[i].count = sites[i].bytes = 0;
+    for (int i = 0; i < MAX_COMMANDS; i++)
+        commands[i].calls = commands[i].count = commands[i].bytes = 0;
+    overflow.count = overflow.bytes = 0;
+    for (int i = 0; i < ALLOC_SUBSYSTEMS; i++) {
+        subsystems[i].count = subsystems[i].bytes = 0;
+        subsystems[i].peak = subsystems[i].live;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* The tallies are copied out under the lock because building JSON or
+ * tracing allocates. */
+typedef struct {
+    tally_t sites[MAX_SITES], commands[MAX_COMMANDS], overflow;
+    usage_t subsystems[ALLOC_SUBSYSTEMS];
+} snapshot_t;
+
+static snapshot_t *take_snapshot(void)
+{
+    snapshot_t *snapshot = malloc(sizeof *snapshot);
+    pthread_mutex_lock(&lock);
+    memcpy(snapshot->sites, sites, sizeof sites);
+    memcpy(snapshot->commands, commands, sizeof commands);
+    snapshot->overflow = overflow;
+    memcpy(snapshot->subsystems, subsystems, sizeof subsystems);
+    pthread_mutex_unlock(&lock);
+    return snapshot;
+}
+
+static void add_tallies(json_thing_t *object, const tally_t *tallies,
+                        size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        if (tallies[i].key && (tallies[i].bytes || tallies[i].calls)) {
+            json_thing_t *entry = json_make_object();
+            if (tallies[i].calls)
+                json_add_to_object(entry, "calls",
+                                   json_make_unsigned(tallies[i].calls));
+            json_add_to_object(entry, "allocations",
+                               json_make_unsigned(tallies[i].count));
+            json_add_to_object(entry, "bytes",
+                               json_make_unsigned(tallies[i].bytes));
+            json_add_to_object(object, tallies[i].key, entry);
+        }
+}
+
+json_thing_t *alloc_stats_json(void)
+{
+    snapshot_t *snapshot = take_snapshot();
+    json_thing_t *stats = json_make_object();
+    json_thing_t *subsystem_stats = json_make_object();
+    for (int i = 0; i < ALLOC_SUBSYSTEMS; i++) {
+        json_thing_t *entry = json_make_object();
+        json_add_to_object(entry, "allocations",
+                           json_make_unsigned(snapshot->subsystems[i].count));
+        json_add_to_object(entry, "bytes",
+                           json_make_unsigned(snapshot->subsystems[i].bytes));
+        json_add_to_object(entry, "live",
+                           json_make_unsigned(snapshot->subsystems[i].live));
+        json_add_to_object(entry, "peak",
+                           json_make_unsigned(snapshot->subsystems[i].peak));
+        json_add_to_object(subsystem_stats, SUBSYSTEM_NAMES[i], entry);
+    }
+    json_add_to_object(stats, "subsystems", subsystem_stats);
+    json_thing_t *command_stats = json_make_object();
+    add_tallies(command_stats, snapshot->commands, MAX_COMMANDS);
+    json_add_to_object(stats, "commands", command_stats);
+    json_thing_t *site_stats = json_make_object();
+    add_tallies(site_stats, snapshot->sites, MAX_SITES);
+    add_tallies(site_stats, &snapshot->overflow, 1);
+    json_add_to_object(stats, "sites", site_stats);
+    free(snapshot);
+    return stats;
+}
+
+FSTRACE_DECL(IRC_ALLOC_SUBSYSTEM,
+             "NAME=%s COUNT=%64u BYTES=%64u LIVE=%64u PEAK=%64u");
+FSTRACE_DECL(IRC_ALLOC_COMMAND,
+             "COMMAND=%s CALLS=%64u COUNT=%64u BYTES=%64u");
+FSTRACE_DECL(IRC_ALLOC_SITE, "SITE=%s COUNT=%64u BYTES=%64u");
+
+void trace_alloc_stats(void)
+{
+    snapshot_t *snapshot = take_snapshot();
+    for (int i = 0; i < ALLOC_SUBSYSTEMS; i++)
+        FSTRACE(IRC_ALLOC_SUBSYSTEM, SUBSYSTEM_NAMES[i],
+                snapshot->subsystems[i].count, snapshot->subsystems[i].bytes,
+                snapshot->subsystems[i].live, snapshot->subsystems[i].peak);
+    for (int i = 0; i < MAX_COMMANDS; i++)
+        if (snapshot->commands[i].key && snapshot->commands[i].calls)
+            FSTRACE(IRC_ALLOC_COMMAND, snapshot->commands[i].key,
+                    snapshot->commands[i].calls, snapshot->commands[i].count,
+                    snapshot->commands[i].bytes);
+    for (int i = 0; i < MAX_SITES; i++)
+        if (snapshot->sites[i].key && snapshot->sites[i].bytes)
+            FSTRACE(IRC_ALLOC_SITE, snapshot->sites[i].key,
+                    snapshot->sites[i].count, snapshot->sites[i].bytes);
+    free(snapshot);
+}
+
+#else
+
+void init_alloc_accounting(void)
+{
+}
+
+void reset_alloc_stats(void)
+{
+}
+
+json_thing_t *alloc_stats_json(void)
+{
+    return NULL;
+}
+
+void trace_alloc_stats(void)
+{
+}
+
+#endif
@@ -0,0 +1,80 @@
+#pragma once
+
+/* Allocation accounting, compiled in with ALLOC_ACCOUNTING (scons
+ * alloc_accounting=1). Every allocation that goes through fsdyn is
+ * charged to the innermost call site, the dispatched command and the
+ * subsystem at the time; each subsystem also has a live byte count
+ * and its high-water mark. Without ALLOC_ACCOUNTING, the scopes
+ * compile to nothing and the reports are empty. */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <encjson.h>
+#include <fsdyn/fsalloc.h>
+#include <fsdyn/charstr.h>
+
+typedef enum {
+    ALLOC_OTHER,
+    ALLOC_PARSER,
+    ALLOC_NICKS,
+    ALLOC_TEXT,                 /* rendering into the text buffers */
+    ALLOC_CACHE,
+    ALLOC_I18N,
+    ALLOC_SUBSYSTEMS
+} alloc_subsystem_t;
+
+#ifdef ALLOC_ACCOUNTING
+
+/* The scopes are per thread and nest; leave with the value returned
+ * on entry. */
+alloc_subsystem_t enter_alloc_subsystem(alloc_subsystem_t subsystem);
+void leave_alloc_subsystem(alloc_subsystem_t outer);
+void *enter_alloc_command(const char *command);
+void leave_alloc_command(void *outer);
+const char *enter_alloc_site(const char *site);
+void leave_alloc_site(const char *outer);
+
+/* The accounting reallocator; chain other reallocators to it. */
+void *base_realloc(void *ptr, size_t size);
+
+#define _ALLOC_STR(x) #x
+#define _ALLOC_SITE(file, line) file ":" _ALLOC_STR(line)
+
+#define ALLOC_AT(call)                                                  \
+    ({                                                                  \
+        const char *_outer_site =                                       \
+            enter_alloc_site(_ALLOC_SITE(__FILE__, __LINE__));          \
+        __typeof__(call) _result = call;                                \
+        leave_alloc_site(_outer_site);                                  \
+        _result;                                                        \
+    })
+
+#define fsalloc(size) ALLOC_AT(fsalloc(size))
+#define fsrealloc(ptr, size) ALLOC_AT(fsrealloc(ptr, size))
+#define charstr_dupstr(s) ALLOC_AT(charstr_dupstr(s))
+#define charstr_dupsubstr(s, end) ALLOC_AT(charstr_dupsubstr(s, end))
+#define charstr_printf(...) ALLOC_AT(charstr_printf(__VA_ARGS__))
+#define charstr_vprintf(format, ap) ALLOC_AT(charstr_vprintf(format, ap))
+#define charstr_join(sep, parts) ALLOC_AT(charstr_join(sep, parts))
+#define charstr_split(s, sep, max) ALLOC_AT(charstr_split(s, sep, max))
+
+#else
+
+#define enter_alloc_subsystem(subsystem) ((void) (subsystem), ALLOC_OTHER)
+#define leave_alloc_subsystem(outer) ((void) (outer))
+#define enter_alloc_command(command) ((void) (command), NULL)
+#define leave_alloc_command(outer) ((void) (outer))
+#define base_realloc realloc
+
+#endif
+
+/* Route fsdyn allocations through base_realloc(). */
+void init_alloc_accounting(void);
+/* Zero the tallies; the live counts are kept and become the new
+ * high-water marks. */
+void reset_alloc_stats(void);
+/* NULL without ALLOC_ACCOUNTING. */
+json_thing_t *alloc_stats_json(void);
+/* One IRC_ALLOC_SUBSYSTEM, IRC_ALLOC_COMMAND or IRC_ALLOC_SITE event
+ * per tally. */
+void trace_alloc_stats(void);
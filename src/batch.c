@@ -0,0 +1,141 @@
+#include <string.h>
+#include <fsdyn/charstr.h>
+#include <fstrace.h>
+#include "batch.h"
+
+struct batch {
+    char *ref, *type;
+    list_t *messages;           /* of batched_message_t */
+};
+
+static void destroy_batched_message(batched_message_t *message)
+{
+    fsfree(message->from);
+    fsfree(message->tag_name);
+    fsfree(message->text);
+    fsfree(message);
+}
+
+static void destroy_batch(batch_t *batch)
+{
+    list_foreach(batch->messages, (void *) destroy_batched_message, NULL);
+    destroy_list(batch->messages);
+    fsfree(batch->ref);
+    fsfree(batch->type);
+    fsfree(batch);
+}
+
+FSTRACE_DECL(IRC_BATCH_OPEN, "REF=%s TYPE=%s");
+
+void open_batch(app_t *app, const char *ref, const char *type)
+{
+    FSTRACE(IRC_BATCH_OPEN, ref, type);
+    if (!app->batches)
+        app->batches = make_list();
+    batch_t *batch = fsalloc(sizeof *batch);
+    batch->ref = charstr_dupstr(ref);
+    batch->type = charstr_dupstr(type);
+    batch->messages = make_list();
+    list_append(app->batches, batch);
+}
+
+static list_elem_t *find_batch_elem(app_t *app, const char *ref)
+{
+    if (!app->batches)
+        return NULL;
+    for (list_elem_t *e = list_get_first(app->batches); e; e = list_next(e)) {
+        batch_t *batch = (batch_t *) list_elem_get_value(e);
+        if (!strcmp(batch->ref, ref))
+            return e;
+    }
+    return NULL;
+}
+
+batch_t *find_batch(app_t *app, const char *ref)
+{
+    list_elem_t *e = find_batch_elem(app, ref);
+    return e ? (batch_t *) list_elem_get_value(e) : NULL;
+}
+
+void batch_message(batch_t *batch, channel_t *channel, time_t t,
+                   const char *from, const char *tag_name, const char *text)
+{
+    batched_message_t *message = fsalloc(sizeof *message);
+    message->channel = channel;
+    message->t = t;
+    message->from = from ? charstr_dupstr(from) : NULL;
+    message->tag_name = charstr_dupstr(tag_name);
+    message->text = charstr_dupstr(text);
+    list_append(batch->messages, message);
+}
+
+/* Take the messages of the channel of the first message out of the
+ * batch, keeping their order. */
+static list_t *take_channel_messages(batch_t *batch)
+{
+    list_t *taken = make_list();
+    channel_t *channel = ((batched_message_t *)
+        list_elem_get_value(list_get_first(batch->messages)))->channel;
+    list_elem_t *e = list_get_first(batch->messages);
+    while (e) {
+        list_elem_t *next = list_next(e);
+        batched_message_t *message =
+            (batched_message_t *) list_elem_get_value(e);
+        if (message->channel == channel) {
+            list_append(taken, message);
+            list_remove(batch->messages, e);
+        }
+        e = next;
+    }
+    return taken;
+}
+
+FSTRACE_DECL(IRC_BATCH_UNKNOWN, "REF=%s");
+FSTRACE_DECL(IRC_BATCH_CLOSE, "REF=%s MESSAGES=%z");
+FSTRACE_DECL(IRC_BATCH_CHANNEL, "REF=%s CHANNEL=%s MESSAGES=%z");
+
+void close_batch(app_t *app, const char *ref)
+{
+    list_elem_t *e = find_batch_elem(app, ref);
+    if (!e) {
+        FSTRACE(IRC_BATCH_UNKNOWN, ref);
+        return;
+    }
+    batch_t *batch = (batch_t *) list_elem_get_value(e);
+    list_remove(app->batches, e);
+    FSTRACE(IRC_BATCH_CLOSE, ref, list_size(batch->messages));
+    while (!list_empty(batch->messages)) {
+        list_t *messages = take_channel_messages(batch);
+        batched_message_t *first =
+            (batched_message_t *) list_elem_get_value(
+                list_get_first(messages));
+        channel_t *channel = first->channel;
+        FSTRACE(IRC_BATCH_CHANNEL, ref, channel->key, list_size(messages));
+        /* The window may have been closed while the batch was open.
+         * Reopen it before logging so that its replay does not pick
+         * up the batch, too. */
+        sink_1_furnish_channel(app->sink, channel);
+        for (list_elem_t *me = list_get_first(messages); me;
+             me = list_next(me)) {
+            batched_message_t *message =
+                (batched_message_t *) list_elem_get_value(me);
+            log_message(channel, message->t, message->from,
+                        message->tag_name, message->text);
+        }
+        sink_1_render_batch(app->sink, channel, messages);
+        list_foreach(messages, (void *) destroy_batched_message, NULL);
+        destroy_list(messages);
+    }
+    if (app->cache_writer)
+        cache_writer_kick(app->cache_writer);
+    destroy_batch(batch);
+}
+
+void discard_batches(app_t *app)
+{
+    if (!app->batches)
+        return;
+    list_foreach(app->batches, (void *) destroy_batch, NULL);
+    destroy_list(app->batches);
+    app->batches = NULL;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "core.h"
+
+/* IRCv3 batches. The messages indicated while dispatching a message
+ * that belongs to an open batch are held back. When the batch ends,
+ * they are logged together and rendered with a single call per
+ * channel, which keeps a bouncer's playback of hundreds of lines from
+ * being rendered one line at a time. */
+
+void open_batch(app_t *app, const char *ref, const char *type);
+/* Log and render the messages of the batch, reopening the windows of
+ * their channels if need be. */
+void close_batch(app_t *app, const char *ref);
+/* Return NULL if there is no such open batch. */
+batch_t *find_batch(app_t *app, const char *ref);
+void batch_message(batch_t *batch, channel_t *channel, time_t t,
+                   const char *from, const char *tag_name, const char *text);
+/* Forget the open batches, e.g., when the connection is lost. */
+void discard_batches(app_t *app);
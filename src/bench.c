@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <glib.h>
+#include <encjson.h>
+#include <fsdyn/charstr.h>
+#include <fsdyn/fsalloc.h>
+#include <fstrace.h>
+#include "core.h"
+#include "benchsink.h"
+#include "metrics.h"
+#include "stage.h"
+
+/* Replays a captured server byte stream through the receive path of
+ * the protocol core: line splitting, act_on_message(), do_it(),
+ * highlighting, the sink and the cache writer. */
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Extract the percent-encoded DATA fields of IRC_RECEIVED events from
+ * fstrace output. */
+static GByteArray *extract_received(const gchar *trace, gsize size)
+{
+    GByteArray *stream = g_byte_array_new();
+    const gchar *end = trace + size;
+    for (const gchar *line = trace; line < end;) {
+        const gchar *eol = memchr(line, '\n', end - line);
+        if (!eol)
+            eol = end;
+        const gchar *event = g_strstr_len(line, eol - line, " IRC_RECEIVED ");
+        const gchar *data =
+            event ? g_strstr_len(event, eol - event, "DATA=") : NULL;
+        if (data)
+            for (const gchar *p = data + 5; p < eol && *p != ' '; p++) {
+                guint8 byte = *p;
+                if (*p == '%' && eol - p > 2 &&
+                    hex_digit(p[1]) >= 0 && hex_digit(p[2]) >= 0) {
+                    byte = hex_digit(p[1]) << 4 | hex_digit(p[2]);
+                    p += 2;
+                }
+                g_byte_array_append(stream, &byte, 1);
+            }
+        line = eol + 1;
+    }
+    return stream;
+}
+
+typedef struct {
+    size_t chunk_size;
+    uint64_t bytes, messages, allocations, ns;
+    stage_stats_t stages[STAGE_COUNT];
+    bool ok;
+} result_t;
+
+static void set_up_cache(app_t *app, const char *cache_dir)
+{
+    g_mkdir_with_parents(cache_dir, 0700);
+    char *cache_prefix = charstr_printf("%s/messages", cache_dir);
+    app->cache_params = (rotatable_params_t) {
+        .uid = geteuid(),
+        .gid = getegid(),
+        .max_files = -1,
+        .max_seconds = -1,
+        .max_bytes = 2 * 1000 * 1000,
+    };
+    app->cache =
+        make_rotatable(cache_prefix, ".log", 200000, &app->cache_params);
+    fsfree(cache_prefix);
+    app->cache_writer =
+        make_cache_writer(app->cache, cache_dir, false, NULL);
+}
+
+static void run(const guint8 *stream, size_t size, size_t chunk_size,
+                unsigned iterations, const char *nick, const char *cache_dir,
+                result_t *result)
+{
+    bench_sink_t sink = { 0 };
+    app_t app = {
+        .config = {
+            .nick = charstr_dupstr(nick),
+        },
+        .state = READY,
+        .channels = make_avl_tree((void *) strcmp),
+        .sink = bench_sink(&sink),
+    };
+    app.async = make_async();
+    app.outq = make_queuestream(app.async);
+    if (cache_dir)
+        set_up_cache(&app, cache_dir);
+    app.input_cursor = app.input_buffer;
+    app.input_end = app.input_buffer + sizeof app.input_buffer;
+    *result = (result_t) { .chunk_size = chunk_size, .ok = true };
+    reset_stage_stats();
+    stage_timing = true;
+    uint64_t allocations = atomic_load(&metrics.allocations);
+    uint64_t start = now_ns();
+    for (unsigned i = 0; result->ok && i < iterations; i++)
+        for (size_t offset = 0; offset < size;) {
+            size_t count = app.input_end - app.input_cursor;
+            if (count > chunk_size)
+                count = chunk_size;
+            if (count > size - offset)
+                count = size - offset;
+            memcpy(app.input_cursor, stream + offset, count);
+            offset += count;
+            if (!split_input(&app, count)) {
+                fprintf(stderr, "lip-bench: receive failed near offset %zu\n",
+                        offset);
+                result->ok = false;
+                break;
+            }
+        }
+    result->ns = now_ns() - start;
+    result->allocations = atomic_load(&metrics.allocations) - allocations;
+    stage_timing = false;
+    for (stage_t stage = 0; stage < STAGE_COUNT; stage++)
+        get_stage_stats(stage, &result->stages[stage]);
+    result->bytes = (uint64_t) size * iterations;
+    result->messages = result->stages[STAGE_PARSE].count;
+    if (app.cache_writer)
+        destroy_cache_writer(app.cache_writer);
+    if (app.cache)
+        destroy_rotatable(app.cache);
+    while (!avl_tree_empty(app.channels)) {
+        avl_elem_t *ae = avl_tree_pop_first(app.channels);
+        channel_t *channel = (channel_t *) avl_elem_get_value(ae);
+        destroy_avl_element(ae);
+        destroy_channel(channel);
+    }
+    destroy_avl_tree(app.channels);
+    queuestream_close(app.outq);
+    destroy_async(app.async);
+    fsfree(app.config.nick);
+}
+
+/* The stage times are inclusive; subtract the nested stages. */
+static uint64_t self_ns(const result_t *result, stage_t stage)
+{
+    const stage_stats_t *s = result->stages;
+    switch (stage) {
+        case STAGE_RECEIVE:
+            return s[STAGE_RECEIVE].ns - s[STAGE_PARSE].ns -
+                s[STAGE_DISPATCH].ns;
+        case STAGE_DISPATCH:
+            return s[STAGE_DISPATCH].ns - s[STAGE_HIGHLIGHT].ns -
+                s[STAGE_RENDER].ns - s[STAGE_LOG].ns;
+        default:
+            return s[stage].ns;
+    }
+}
+
+static double per_second(uint64_t count, uint64_t ns)
+{
+    return ns ? count * 1e9 / ns : 0;
+}
+
+static double ratio(uint64_t numerator, uint64_t denominator)
+{
+    return denominator ? (double) numerator / denominator : 0;
+}
+
+static void report_text(const result_t *result)
+{
+    printf("chunk size %zu: %llu messages, %llu bytes in %.3f s\n",
+           result->chunk_size, (unsigned long long) result->messages,
+           (unsigned long long) result->bytes, result->ns / 1e9);
+    printf("  %.0f msgs/s, %.1f MB/s, %.2f allocs/msg\n",
+           per_second(result->messages, result->ns),
+           per_second(result->bytes, result->ns) / 1e6,
+           ratio(result->allocations, result->messages));
+    for (stage_t stage = 0; stage < STAGE_COUNT; stage++)
+        printf("  %-10s %10llu calls %12.1f ns/msg (self)\n",
+               stage_name(stage),
+               (unsigned long long) result->stages[stage].count,
+               ratio(self_ns(result, stage), result->messages));
+}
+
+static void report_json(const result_t *result)
+{
+    json_thing_t *report = json_make_object();
+    json_add_to_object(report, "chunk_size",
+                       json_make_unsigned(result->chunk_size));
+    json_add_to_object(report, "ok", json_make_boolean(result->ok));
+    json_add_to_object(report, "bytes", json_make_unsigned(result->bytes));
+    json_add_to_object(report, "messages",
+                       json_make_unsigned(result->messages));
+    json_add_to_object(report, "ns", json_make_unsigned(result->ns));
+    json_add_to_object(report, "msgs_per_sec",
+                       json_make_float(per_second(result->messages,
+                                                  result->ns)));
+    json_add_to_object(report, "allocs_per_msg",
+                       json_make_float(ratio(result->allocations,
+                                             result->messages)));
+    json_thing_t *stages = json_make_object();
+    json_add_to_object(report, "stages", stages);
+    for (stage_t stage = 0; stage < STAGE_COUNT; stage++) {
+        json_thing_t *stats = json_make_object();
+        json_add_to_object(stages, stage_name(stage), stats);
+        json_add_to_object(stats, "calls",
+                           json_make_unsigned(result->stages[stage].count));
+        json_add_to_object(stats, "ns",
+                           json_make_unsigned(result->stages[stage].ns));
+        json_add_to_object(stats, "self_ns",
+                           json_make_unsigned(self_ns(result, stage)));
+    }
+    json_thing_t *alloc_stats = alloc_stats_json();
+    if (alloc_stats)
+        json_add_to_object(report, "alloc_stats", alloc_stats);
+    json_utf8_dump(report, stdout);
+    putchar('\n');
+    json_destroy_thing(report);
+}
+
+static void usage(GOptionContext *context)
+{
+    gchar *help = g_option_context_get_help(context, TRUE, NULL);
+    fputs(help, stderr);
+    g_free(help);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    gchar *chunk_sizes = NULL, *nick = NULL, *cache_dir = NULL;
+    gchar *trace_include = NULL, *trace_exclude = NULL;
+    gboolean from_trace = FALSE, json = FALSE;
+    gint iterations = 1;
+    GOptionEntry entries[] = {
+        { "chunk-sizes", 's', 0, G_OPTION_ARG_STRING, &chunk_sizes,
+          "Comma-separated read sizes (default 512)", "SIZES" },
+        { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+          "Feed the capture COUNT times per chunk size", "COUNT" },
+        { "nick", 0, 0, G_OPTION_ARG_STRING, &nick,
+          "Own nick (default lip)", "NICK" },
+        { "cache", 0, 0, G_OPTION_ARG_STRING, &cache_dir,
+          "Log messages into a cache in DIRECTORY", "DIRECTORY" },
+        { "trace", 0, 0, G_OPTION_ARG_NONE, &from_trace,
+          "The capture is fstrace output with IRC_RECEIVED events", NULL },
+        { "json", 0, 0, G_OPTION_ARG_NONE, &json,
+          "Print one JSON object per chunk size", NULL },
+        { "trace-include", 0, 0, G_OPTION_ARG_STRING, &trace_include,
+          "Include trace events", "REGEXP" },
+        { "trace-exclude", 0, 0, G_OPTION_ARG_STRING, &trace_exclude,
+          "Exclude trace events", "REGEXP" },
+        { NULL }
+    };
+    GOptionContext *context =
+        g_option_context_new("CAPTURE - lip receive path benchmark");
+    g_option_context_add_main_entries(context, entries, NULL);
+    GError *error = NULL;
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "lip-bench: %s\n", error->message);
+        g_error_free(error);
+        usage(context);
+    }
+    if (argc != 2 || iterations < 1)
+        usage(context);
+    fstrace_t *trace = fstrace_direct(stderr);
+    fstrace_declare_globals(trace);
+    fstrace_select_regex(trace, trace_include, trace_exclude);
+    gchar *content;
+    gsize size;
+    if (!g_file_get_contents(argv[1], &content, &size, &error)) {
+        fprintf(stderr, "lip-bench: %s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    GByteArray *stream;
+    if (from_trace) {
+        stream = extract_received(content, size);
+        g_free(content);
+    } else stream = g_byte_array_new_take((guint8 *) content, size);
+    list_t *sizes = charstr_split(chunk_sizes ? chunk_sizes : "512", ',', -1U);
+    count_allocations();
+    bool ok = true;
+    for (list_elem_t *e = list_get_first(sizes); e; e = list_next(e)) {
+        const char *s = list_elem_get_value(e);
+        uint64_t chunk_size;
+        if (charstr_to_unsigned(s, -1, 10, &chunk_size) < 0 ||
+            chunk_size == 0) {
+            fprintf(stderr, "lip-bench: bad chunk size %s\n", s);
+            ok = false;
+            break;
+        }
+        result_t result;
+        reset_alloc_stats();
+        run(stream->data, stream->len, chunk_size, iterations,
+            nick ? nick : "lip", cache_dir, &result);
+        if (json)
+            report_json(&result);
+        else report_text(&result);
+        if (!result.ok) {
+            ok = false;
+            break;
+        }
+    }
+    list_foreach(sizes, (void *) fsfree, NULL);
+    destroy_list(sizes);
+    g_byte_array_unref(stream);
+    g_option_context_free(context);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
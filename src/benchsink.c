@@ -0,0 +1,50 @@
+#include <string.h>
+#include "benchsink.h"
+
+static void sink_furnish_channel(void *obj, channel_t *channel)
+{
+}
+
+static void sink_render_message(void *obj, channel_t *channel, time_t t,
+                                const char *from, const char *tag_name,
+                                const char *text)
+{
+    bench_sink_t *sink = obj;
+    sink->lines++;
+    sink->bytes += strlen(text);
+}
+
+static void sink_log_line(void *obj, const char *mood, const char *line)
+{
+    bench_sink_t *sink = obj;
+    sink->lines++;
+    sink->bytes += strlen(line);
+}
+
+static void sink_nick_changed(void *obj, const char *nick)
+{
+}
+
+static void sink_render_batch(void *obj, channel_t *channel,
+                              list_t *messages)
+{
+    for (list_elem_t *e = list_get_first(messages); e; e = list_next(e)) {
+        batched_message_t *message =
+            (batched_message_t *) list_elem_get_value(e);
+        sink_render_message(obj, channel, message->t, message->from,
+                            message->tag_name, message->text);
+    }
+}
+
+static const struct sink_1_vt bench_sink_vt = {
+    .furnish_channel = sink_furnish_channel,
+    .render_message = sink_render_message,
+    .log_line = sink_log_line,
+    .nick_changed = sink_nick_changed,
+    .render_batch = sink_render_batch,
+};
+
+sink_1 bench_sink(bench_sink_t *sink)
+{
+    return (sink_1) { sink, &bench_sink_vt };
+}
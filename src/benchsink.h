@@ -0,0 +1,12 @@
+#pragma once
+
+#include "core.h"
+
+/* The sink of lip-bench and lip-microbench. It renders nothing but
+ * counts what reaches it, which keeps the work from being optimized
+ * out. */
+typedef struct {
+    size_t lines, bytes;
+} bench_sink_t;
+
+sink_1 bench_sink(bench_sink_t *sink);
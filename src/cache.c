@@ -0,0 +1,830 @@
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <zlib.h>
+#include <encjson.h>
+#include <fsdyn/charstr.h>
+#include <fstrace.h>
+#include "allocstats.h"
+#include "cache.h"
+#include "search.h"
+#include "spsc.h"
+
+enum {
+    QUEUE_CAPACITY = 4096,
+    BATCH_RECORDS = 256,
+    BATCH_BYTES = 64 * 1024,
+    BATCH_INTERVAL_MS = 500,
+    FULL_QUEUE_WAIT_MS = 10,
+    FRAME_SIZE = 64 * 1024,     /* uncompressed */
+    READ_CHUNK = 64 * 1024,
+};
+
+typedef struct {
+    char *channel_key, *from, *tag, *text;
+    time_t t;
+    size_t size;                /* approximate */
+    gint64 submitted;           /* g_get_monotonic_time() */
+    cache_mark_t *mark;         /* if not NULL, the rest are unused */
+} record_t;
+
+struct cache_reader {
+    int fd;
+    bool compressed;
+    z_stream zs;
+    Bytef in[READ_CHUNK];
+    off_t in_offset;            /* file offset of in[0] */
+    size_t in_size;
+    bool member_ended, exhausted;
+    bool in_member;             /* a gzip member has been started */
+    bool damaged;
+    off_t frame;                /* file offset of the current frame */
+    size_t frame_offset;        /* uncompressed offset of buf[start] */
+    char *buf;
+    size_t capacity, start, end;
+};
+
+struct cache_writer {
+    rotatable_t *cache;
+    char *directory;
+    bool sync;
+    search_index_t *index;
+    /* the following are accessed by the writer thread only */
+    bool rotated, indexed;
+    /* The live segment is looked up in the index on the first record
+     * after startup or a rotation. */
+    bool segment_known, segment_fresh;
+    search_segment_t segment;
+    FILE *live;                 /* the latest file written to */
+    spsc_t *queue;
+    atomic_size_t pending_bytes;
+    atomic_bool kicked;
+    GThread *thread;
+    GMutex lock;
+    GCond wakeup, progress;
+    /* the following are protected by lock */
+    bool stopping;
+};
+
+static char *dup_maybe(const char *s)
+{
+    return s ? charstr_dupstr(s) : NULL;
+}
+
+static void destroy_record(record_t *record)
+{
+    if (record->mark) {
+        fsfree(record);
+        return;
+    }
+    fsfree(record->channel_key);
+    fsfree(record->from);
+    fsfree(record->tag);
+    fsfree(record->text);
+    fsfree(record);
+}
+
+json_thing_t *decode_cache_record(const char *record, const char **key,
+                                  unsigned long long *t, const char **from,
+                                  const char **tag, const char **text)
+{
+    json_thing_t *message = json_utf8_decode_string(record);
+    if (!message)
+        return NULL;
+    if (json_thing_type(message) != JSON_OBJECT ||
+        !json_object_get_string(message, "channel", key) ||
+        !json_object_get_unsigned(message, "time", t) ||
+        !json_object_get_string(message, "text", text)) {
+        json_destroy_thing(message);
+        return NULL;
+    }
+    if (!json_object_get_string(message, "from", from))
+        *from = NULL;
+    if (!json_object_get_string(message, "tag", tag))
+        *tag = NULL;
+    return message;
+}
+
+static void index_record(cache_writer_t *writer, FILE *cachef,
+                         record_t *record, size_t size)
+{
+    if (!writer->segment_known) {
+        struct stat st;
+        if (fstat(fileno(cachef), &st) < 0)
+            return;
+        writer->segment = search_index_segment(writer->index, st.st_ino,
+                                               writer->segment_fresh);
+        writer->segment_known = true;
+        writer->segment_fresh = false;
+    }
+    long end = ftell(cachef);
+    if (end < 0)
+        return;
+    cache_position_t position = { 0, end - size };
+    search_index_add(writer->index, writer->segment, &position,
+                     record->channel_key, record->t, record->from,
+                     record->text);
+}
+
+static FILE *write_record(cache_writer_t *writer, record_t *record)
+{
+    struct tm utc_stamp;
+    gmtime_r(&record->t, &utc_stamp);
+    switch (rotatable_rotate_maybe(writer->cache, &utc_stamp, 0, false)) {
+        default:
+            return NULL;        /* ? */
+        case ROTATION_ROTATED:
+            writer->rotated = true;
+            writer->segment_known = false;
+            writer->segment_fresh = true;
+            break;
+        case ROTATION_OK:
+            ;
+    }
+    FILE *cachef = rotatable_file(writer->cache);
+    assert(cachef);
+    json_thing_t *message = json_make_object();
+    json_add_to_object(message, "channel",
+                       json_make_string(record->channel_key));
+    json_add_to_object(message, "time", json_make_unsigned(record->t));
+    if (record->from)
+        json_add_to_object(message, "from", json_make_string(record->from));
+    if (record->tag)
+        json_add_to_object(message, "tag", json_make_string(record->tag));
+    json_add_to_object(message, "text", json_make_string(record->text));
+    size_t size = json_utf8_encode(message, NULL, 0) + 1;
+    char *encoding = fsalloc(size);
+    json_utf8_encode(message, encoding, size);
+    json_destroy_thing(message);
+    fwrite(encoding, size, 1, cachef); /* include the terminating '\0' */
+    fsfree(encoding);
+    /* Until build_index() is done, the segment is indexed from the
+     * disk. */
+    if (writer->index && writer->indexed)
+        index_record(writer, cachef, record, size);
+    writer->live = cachef;
+    return cachef;
+}
+
+FSTRACE_DECL(IRC_CACHE_BATCH,
+             "DEPTH=%z RECORDS=%z BYTES=%z LATENCY-US=%64u WRITE-US=%64u");
+FSTRACE_DECL(IRC_CACHE_SYNC_FAIL, "ERR=%e");
+FSTRACE_DECL(IRC_SEARCH_INDEXED, "RECORDS=%z TERMS=%z DURATION-US=%64u");
+
+static void place_mark(cache_writer_t *writer, cache_mark_t *mark)
+{
+    mark->segment = 0;
+    mark->size = -1;
+    if (!writer->live)
+        return;
+    struct stat st;
+    long end = ftell(writer->live);
+    if (end < 0 || fstat(fileno(writer->live), &st) < 0)
+        return;
+    mark->segment = st.st_ino;
+    mark->size = end;
+}
+
+static void write_batch(cache_writer_t *writer)
+{
+    size_t depth = spsc_depth(writer->queue);
+    if (!depth)
+        return;
+    gint64 start = g_get_monotonic_time();
+    gint64 oldest = start;
+    size_t records = 0, bytes = 0;
+    FILE *cachef = NULL;
+    list_t *marks = make_list();
+    record_t *record;
+    while ((record = spsc_pop(writer->queue))) {
+        if (record->mark) {
+            place_mark(writer, record->mark);
+            list_append(marks, record->mark);
+            destroy_record(record);
+            continue;
+        }
+        atomic_fetch_sub(&writer->pending_bytes, record->size);
+        if (record->submitted < oldest)
+            oldest = record->submitted;
+        FILE *f = write_record(writer, record);
+        if (f)
+            cachef = f;
+        records++;
+        bytes += record->size;
+        destroy_record(record);
+    }
+    if (cachef) {
+        fflush(cachef);
+        if (writer->sync && fdatasync(fileno(cachef)) < 0)
+            FSTRACE(IRC_CACHE_SYNC_FAIL);
+    }
+    if (!list_empty(marks)) {
+        g_mutex_lock(&writer->lock);
+        while (!list_empty(marks))
+            ((cache_mark_t *) list_pop_first(marks))->reached = true;
+        g_cond_broadcast(&writer->progress);
+        g_mutex_unlock(&writer->lock);
+    }
+    destroy_list(marks);
+    gint64 end = g_get_monotonic_time();
+    FSTRACE(IRC_CACHE_BATCH, depth, records, bytes,
+            (uint64_t) (end - oldest), (uint64_t) (end - start));
+}
+
+static int message_log_filter(const struct dirent *entity)
+{
+    return charstr_skip_prefix(entity->d_name, "messages") != NULL &&
+        charstr_ends_with(entity->d_name, ".log");
+}
+
+static int message_log_cmp(const struct dirent **a, const struct dirent **b)
+{
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+int scan_cache_segments(const char *directory, struct dirent ***namelist)
+{
+    return scandir(directory, namelist, message_log_filter, message_log_cmp);
+}
+
+FSTRACE_DECL(IRC_CACHE_COMPRESSED,
+             "SEGMENT=%s BEFORE=%64u AFTER=%64u DURATION-US=%64u");
+FSTRACE_DECL(IRC_CACHE_COMPRESS_FAIL, "SEGMENT=%s ERR=%e");
+
+typedef struct {
+    cache_relocation_t *relocations;
+    size_t count, capacity;
+} relocations_t;
+
+static void add_relocation(relocations_t *relocations,
+                           const cache_position_t *from, off_t frame,
+                           size_t offset)
+{
+    if (relocations->count == relocations->capacity) {
+        relocations->capacity = relocations->capacity ?
+            2 * relocations->capacity : 1024;
+        cache_relocation_t *expanded =
+            fsalloc(relocations->capacity * sizeof *expanded);
+        if (relocations->count)
+            memcpy(expanded, relocations->relocations,
+                   relocations->count * sizeof *expanded);
+        fsfree(relocations->relocations);
+        relocations->relocations = expanded;
+    }
+    cache_relocation_t *relocation =
+        &relocations->relocations[relocations->count++];
+    relocation->from = *from;
+    relocation->to.frame = frame;
+    relocation->to.offset = offset;
+}
+
+/* The records of the readers are concatenated into fd, which is
+ * closed in any case. If relocations is not NULL, the old and new
+ * positions of the records are appended to it. A damaged reader fails
+ * the whole operation with EBADMSG so that the original is kept. */
+static bool compress_frames(cache_reader_t **readers, size_t count, int fd,
+                            relocations_t *relocations)
+{
+    gzFile gz = gzdopen(fd, "wb");
+    if (!gz) {
+        close(fd);
+        return false;
+    }
+    off_t frame = 0;
+    size_t frame_size = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *record;
+        cache_position_t from;
+        while ((record = cache_reader_next(readers[i], &from))) {
+            size_t size = strlen(record) + 1;
+            if (relocations)
+                add_relocation(relocations, &from, frame, frame_size);
+            if (gzwrite(gz, record, size) != size) {
+                gzclose(gz);
+                return false;
+            }
+            frame_size += size;
+            if (frame_size >= FRAME_SIZE) {
+                /* Z_FINISH ends the gzip member; the next write
+                 * starts a new one. */
+                gzflush(gz, Z_FINISH);
+                frame = gzoffset(gz);
+                frame_size = 0;
+            }
+        }
+        if (cache_reader_damaged(readers[i])) {
+            gzclose(gz);
+            errno = EBADMSG;
+            return false;
+        }
+    }
+    if (gzflush(gz, Z_FINISH) != Z_OK || fsync(fd) < 0) {
+        gzclose(gz);
+        return false;
+    }
+    return gzclose(gz) == Z_OK;
+}
+
+static bool compress_segment(const char *directory, const char *name,
+                             search_index_t *index)
+{
+    char *path = charstr_printf("%s/%s", directory, name);
+    gint64 start = g_get_monotonic_time();
+    struct stat plain_st;
+    cache_reader_t *reader = open_cache_reader(path);
+    if (!reader || fstat(reader->fd, &plain_st) < 0) {
+        FSTRACE(IRC_CACHE_COMPRESS_FAIL, name);
+        if (reader)
+            close_cache_reader(reader);
+        fsfree(path);
+        return false;
+    }
+    if (reader->compressed) {
+        close_cache_reader(reader);
+        fsfree(path);
+        return true;
+    }
+    /* The hidden temporary file does not match message_log_filter(). */
+    char *temp_path = charstr_printf("%s/.%s.gz", directory, name);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  plain_st.st_mode & 0777);
+    struct stat compressed_st;
+    relocations_t relocations = { NULL, 0, 0 };
+    bool ok = fd >= 0 && compress_frames(&reader, 1, fd, &relocations) &&
+        stat(temp_path, &compressed_st) == 0 &&
+        rename(temp_path, path) == 0;
+    int err = errno;
+    if (!ok) {
+        FSTRACE(IRC_CACHE_COMPRESS_FAIL, name);
+        unlink(temp_path);
+    } else {
+        FSTRACE(IRC_CACHE_COMPRESSED, name, (uint64_t) plain_st.st_size,
+                (uint64_t) compressed_st.st_size,
+                (uint64_t) (g_get_monotonic_time() - start));
+        if (index)
+            search_index_relocate(index, plain_st.st_ino,
+                                  compressed_st.st_ino,
+                                  relocations.relocations,
+                                  relocations.count);
+    }
+    fsfree(relocations.relocations);
+    close_cache_reader(reader);
+    fsfree(temp_path);
+    fsfree(path);
+    errno = err;
+    return ok;
+}
+
+bool compress_cache_segment(const char *directory, const char *name)
+{
+    return compress_segment(directory, name, NULL);
+}
+
+FSTRACE_DECL(IRC_CACHE_MERGED, "TARGET=%s SEGMENTS=%z AFTER=%64u");
+FSTRACE_DECL(IRC_CACHE_MERGE_FAIL, "TARGET=%s ERR=%e");
+
+bool merge_cache_segments(const char *directory, char *const *names,
+                          size_t count)
+{
+    assert(count > 0);
+    cache_reader_t *readers[count];
+    size_t opened = 0;
+    for (; opened < count; opened++) {
+        char *path = charstr_printf("%s/%s", directory, names[opened]);
+        readers[opened] = open_cache_reader(path);
+        fsfree(path);
+        if (!readers[opened])
+            break;
+    }
+    char *path = charstr_printf("%s/%s", directory, names[0]);
+    char *temp_path = charstr_printf("%s/.%s.gz", directory, names[0]);
+    struct stat st;
+    bool ok = opened == count && fstat(readers[0]->fd, &st) == 0;
+    if (ok) {
+        int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      st.st_mode & 0777);
+        ok = fd >= 0 && compress_frames(readers, count, fd, NULL) &&
+            stat(temp_path, &st) == 0 && rename(temp_path, path) == 0;
+    }
+    int err = errno;
+    for (size_t i = 0; i < opened; i++)
+        close_cache_reader(readers[i]);
+    if (ok) {
+        /* A crash here leaves duplicates behind but loses nothing. */
+        for (size_t i = 1; i < count; i++) {
+            char *merged = charstr_printf("%s/%s", directory, names[i]);
+            unlink(merged);
+            fsfree(merged);
+        }
+        FSTRACE(IRC_CACHE_MERGED, names[0], count, (uint64_t) st.st_size);
+    } else {
+        errno = err;
+        FSTRACE(IRC_CACHE_MERGE_FAIL, names[0]);
+        unlink(temp_path);
+    }
+    fsfree(temp_path);
+    fsfree(path);
+    errno = err;
+    return ok;
+}
+
+/* Called between the segments of the maintenance so that marks and
+ * full batches need not wait for all of it. */
+static void yield_to_batches(cache_writer_t *writer)
+{
+    if (atomic_exchange(&writer->kicked, false))
+        write_batch(writer);
+}
+
+/* Compressing in place keeps the segment names intact, so the
+ * rotatable byte budget applies to the compressed sizes. Segments
+ * removed by rotatable are dropped from the search index. */
+static void compress_rotated_segments(cache_writer_t *writer)
+{
+    struct dirent **namelist;
+    int n = scan_cache_segments(writer->directory, &namelist);
+    if (n < 0)
+        return;
+    ino_t live[n + 1];
+    size_t live_count = 0;
+    for (int i = 0; i < n; i++) {
+        if (i < n - 1) {        /* the last one is being written to */
+            yield_to_batches(writer);
+            compress_segment(writer->directory, namelist[i]->d_name,
+                             writer->index);
+        }
+        char *path = charstr_printf("%s/%s", writer->directory,
+                                    namelist[i]->d_name);
+        struct stat st;
+        if (stat(path, &st) == 0)
+            live[live_count++] = st.st_ino;
+        fsfree(path);
+        free(namelist[i]);
+    }
+    free(namelist);
+    if (writer->index)
+        search_index_prune(writer->index, live, live_count);
+}
+
+static void build_index(cache_writer_t *writer)
+{
+    gint64 start = g_get_monotonic_time();
+    struct dirent **namelist;
+    int n = scan_cache_segments(writer->directory, &namelist);
+    if (n < 0)
+        return;
+    for (int i = 0; i < n; i++) {
+        yield_to_batches(writer);
+        char *path = charstr_printf("%s/%s", writer->directory,
+                                    namelist[i]->d_name);
+        search_index_add_segment(writer->index, path);
+        fsfree(path);
+        free(namelist[i]);
+    }
+    free(namelist);
+    writer->indexed = true;
+    writer->segment_known = writer->segment_fresh = false;
+    FSTRACE(IRC_SEARCH_INDEXED, search_index_size(writer->index),
+            search_index_term_count(writer->index),
+            (uint64_t) (g_get_monotonic_time() - start));
+}
+
+/* The existing segments are compressed and indexed after the first
+ * batch so that a flush at startup does not wait for them. */
+static gpointer write_loop(gpointer data)
+{
+    cache_writer_t *writer = data;
+    alloc_subsystem_t outer = enter_alloc_subsystem(ALLOC_CACHE);
+    g_mutex_lock(&writer->lock);
+    for (;;) {
+        gint64 deadline = g_get_monotonic_time() +
+            BATCH_INTERVAL_MS * G_TIME_SPAN_MILLISECOND;
+        while (!writer->stopping && !atomic_load(&writer->kicked))
+            if (!g_cond_wait_until(&writer->wakeup, &writer->lock, deadline))
+                break;
+        bool stopping = writer->stopping;
+        g_mutex_unlock(&writer->lock);
+        atomic_store(&writer->kicked, false);
+        write_batch(writer);
+        g_mutex_lock(&writer->lock);
+        g_cond_broadcast(&writer->progress);
+        if (stopping)
+            break;
+        if (writer->rotated) {
+            writer->rotated = false;
+            g_mutex_unlock(&writer->lock);
+            compress_rotated_segments(writer);
+            if (!writer->indexed)
+                build_index(writer);
+            g_mutex_lock(&writer->lock);
+        }
+    }
+    g_mutex_unlock(&writer->lock);
+    leave_alloc_subsystem(outer);
+    return NULL;
+}
+
+cache_writer_t *make_cache_writer(rotatable_t *cache, const char *directory,
+                                  bool sync, search_index_t *index)
+{
+    cache_writer_t *writer = fsalloc(sizeof *writer);
+    writer->cache = cache;
+    writer->directory = charstr_dupstr(directory);
+    writer->sync = sync;
+    writer->index = index;
+    writer->rotated = true;     /* see write_loop() */
+    writer->indexed = !index;
+    writer->segment_known = writer->segment_fresh = false;
+    writer->live = NULL;
+    writer->queue = make_spsc(QUEUE_CAPACITY);
+    atomic_init(&writer->pending_bytes, 0);
+    atomic_init(&writer->kicked, false);
+    g_mutex_init(&writer->lock);
+    g_cond_init(&writer->wakeup);
+    g_cond_init(&writer->progress);
+    writer->stopping = false;
+    writer->thread = g_thread_new("lip-cache", write_loop, writer);
+    return writer;
+}
+
+void destroy_cache_writer(cache_writer_t *writer)
+{
+    g_mutex_lock(&writer->lock);
+    writer->stopping = true;
+    g_cond_signal(&writer->wakeup);
+    g_mutex_unlock(&writer->lock);
+    g_thread_join(writer->thread);
+    assert(!spsc_depth(writer->queue));
+    destroy_spsc(writer->queue);
+    g_cond_clear(&writer->progress);
+    g_cond_clear(&writer->wakeup);
+    g_mutex_clear(&writer->lock);
+    fsfree(writer->directory);
+    fsfree(writer);
+}
+
+static void kick(cache_writer_t *writer)
+{
+    if (atomic_exchange(&writer->kicked, true))
+        return;
+    g_mutex_lock(&writer->lock);
+    g_cond_signal(&writer->wakeup);
+    g_mutex_unlock(&writer->lock);
+}
+
+FSTRACE_DECL(IRC_CACHE_QUEUE_FULL, "DEPTH=%z");
+
+static void push(cache_writer_t *writer, record_t *record)
+{
+    while (!spsc_push(writer->queue, record)) {
+        FSTRACE(IRC_CACHE_QUEUE_FULL, spsc_depth(writer->queue));
+        kick(writer);
+        g_mutex_lock(&writer->lock);
+        g_cond_wait_until(&writer->progress, &writer->lock,
+                          g_get_monotonic_time() +
+                          FULL_QUEUE_WAIT_MS * G_TIME_SPAN_MILLISECOND);
+        g_mutex_unlock(&writer->lock);
+    }
+}
+
+void cache_writer_submit(cache_writer_t *writer, const char *channel_key,
+                         time_t t, const char *from, const char *tag,
+                         const char *text)
+{
+    alloc_subsystem_t outer = enter_alloc_subsystem(ALLOC_CACHE);
+    record_t *record = fsalloc(sizeof *record);
+    record->channel_key = charstr_dupstr(channel_key);
+    record->from = dup_maybe(from);
+    record->tag = dup_maybe(tag);
+    record->text = charstr_dupstr(text);
+    record->t = t;
+    size_t size = strlen(channel_key) + strlen(text) + 64;
+    if (from)
+        size += strlen(from);
+    record->size = size;
+    record->submitted = g_get_monotonic_time();
+    record->mark = NULL;
+    leave_alloc_subsystem(outer);
+    size_t pending = atomic_fetch_add(&writer->pending_bytes, size) + size;
+    push(writer, record);
+    if (pending >= BATCH_BYTES ||
+        spsc_depth(writer->queue) >= BATCH_RECORDS)
+        kick(writer);
+}
+
+void cache_writer_kick(cache_writer_t *writer)
+{
+    kick(writer);
+}
+
+void cache_writer_flush(cache_writer_t *writer)
+{
+    cache_mark_t mark;
+    cache_writer_mark(writer, &mark);
+    cache_writer_wait(writer, &mark);
+}
+
+void cache_writer_mark(cache_writer_t *writer, cache_mark_t *mark)
+{
+    mark->reached = false;
+    alloc_subsystem_t outer = enter_alloc_subsystem(ALLOC_CACHE);
+    record_t *record = fsalloc(sizeof *record);
+    leave_alloc_subsystem(outer);
+    record->mark = mark;
+    record->size = 0;
+    push(writer, record);
+    kick(writer);
+}
+
+void cache_writer_wait(cache_writer_t *writer, cache_mark_t *mark)
+{
+    g_mutex_lock(&writer->lock);
+    while (!mark->reached)
+        g_cond_wait(&writer->progress, &writer->lock);
+    g_mutex_unlock(&writer->lock);
+}
+
+static void reposition(cache_reader_t *reader, off_t frame)
+{
+    reader->in_offset = frame;
+    reader->in_size = 0;
+    reader->zs.next_in = reader->in;
+    reader->zs.avail_in = 0;
+    reader->member_ended = reader->exhausted = false;
+    reader->in_member = reader->damaged = false;
+    reader->frame = frame;
+    reader->frame_offset = 0;
+    reader->start = reader->end = 0;
+    if (reader->compressed)
+        inflateReset(&reader->zs);
+}
+
+cache_reader_t *open_cache_reader(const char *path)
+{
+    static const unsigned char gzip_magic[] = { 0x1f, 0x8b };
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    unsigned char magic[sizeof gzip_magic];
+    ssize_t count = pread(fd, magic, sizeof magic, 0);
+    if (count < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    cache_reader_t *reader = fsalloc(sizeof *reader);
+    reader->fd = fd;
+    reader->compressed =
+        count == sizeof magic && !memcmp(magic, gzip_magic, sizeof magic);
+    reader->zs = (z_stream) { .zalloc = Z_NULL };
+    if (reader->compressed) {
+        int status = inflateInit2(&reader->zs, 16 + MAX_WBITS);
+        assert(status == Z_OK);
+    }
+    reader->capacity = READ_CHUNK;
+    reader->buf = fsalloc(reader->capacity);
+    reposition(reader, 0);
+    return reader;
+}
+
+void close_cache_reader(cache_reader_t *reader)
+{
+    if (reader->compressed)
+        inflateEnd(&reader->zs);
+    close(reader->fd);
+    fsfree(reader->buf);
+    fsfree(reader);
+}
+
+static void make_room(cache_reader_t *reader)
+{
+    size_t size = reader->end - reader->start;
+    memmove(reader->buf, reader->buf + reader->start, size);
+    reader->start = 0;
+    reader->end = size;
+    if (reader->end < reader->capacity)
+        return;
+    reader->capacity *= 2;
+    char *buf = fsalloc(reader->capacity);
+    memcpy(buf, reader->buf, size);
+    fsfree(reader->buf);
+    reader->buf = buf;
+}
+
+static bool read_plain(cache_reader_t *reader)
+{
+    ssize_t count = pread(reader->fd, reader->buf + reader->end,
+                          reader->capacity - reader->end, reader->in_offset);
+    if (count <= 0) {
+        if (count < 0 || reader->start < reader->end)
+            reader->damaged = true;
+        return false;
+    }
+    reader->in_offset += count;
+    reader->end += count;
+    return true;
+}
+
+static bool read_compressed(cache_reader_t *reader)
+{
+    if (reader->member_ended) {
+        /* Frames hold whole records, so anything left over is a
+         * truncated record. The next frame begins where the previous
+         * one ended. */
+        if (reader->start < reader->end)
+            reader->damaged = true;
+        reader->start = reader->end = 0;
+        reader->frame =
+            reader->in_offset + (reader->zs.next_in - reader->in);
+        reader->frame_offset = 0;
+        inflateReset(&reader->zs);
+        reader->member_ended = false;
+    }
+    if (!reader->zs.avail_in) {
+        reader->in_offset += reader->in_size;
+        ssize_t count = pread(reader->fd, reader->in, sizeof reader->in,
+                              reader->in_offset);
+        if (count <= 0) {
+            if (count < 0 || reader->in_member)
+                reader->damaged = true;
+            return false;
+        }
+        reader->in_size = count;
+        reader->zs.next_in = reader->in;
+        reader->zs.avail_in = count;
+    }
+    reader->zs.next_out = (Bytef *) reader->buf + reader->end;
+    reader->zs.avail_out = reader->capacity - reader->end;
+    int status = inflate(&reader->zs, Z_NO_FLUSH);
+    reader->end = reader->capacity - reader->zs.avail_out;
+    switch (status) {
+        case Z_STREAM_END:
+            reader->member_ended = true;
+            reader->in_member = false;
+            return true;
+        case Z_OK:
+        case Z_BUF_ERROR:
+            reader->in_member = true;
+            return true;
+        default:
+            reader->damaged = true; /* corrupt or trailing garbage */
+            return false;
+    }
+}
+
+const char *cache_reader_next(cache_reader_t *reader,
+                              cache_position_t *position)
+{
+    for (;;) {
+        char *record = reader->buf + reader->start;
+        char *nul = memchr(record, '\0', reader->end - reader->start);
+        if (nul) {
+            if (position) {
+                position->frame = reader->frame;
+                position->offset = reader->frame_offset;
+            }
+            size_t size = nul + 1 - record;
+            reader->start += size;
+            reader->frame_offset += size;
+            return record;
+        }
+        if (reader->exhausted)
+            return NULL;
+        make_room(reader);
+        if (reader->compressed ? !read_compressed(reader) :
+            !read_plain(reader))
+            reader->exhausted = true;
+    }
+}
+
+bool cache_reader_damaged(cache_reader_t *reader)
+{
+    return reader->damaged;
+}
+
+bool cache_reader_seek(cache_reader_t *reader,
+                       const cache_position_t *position)
+{
+    if (!reader->compressed) {
+        if (position->frame) {
+            errno = EINVAL;
+            return false;
+        }
+        reposition(reader, 0);
+        reader->in_offset = reader->frame_offset = position->offset;
+        return true;
+    }
+    reposition(reader, position->frame);
+    while (reader->frame_offset < position->offset)
+        if (!cache_reader_next(reader, NULL) ||
+            reader->frame != position->frame) {
+            errno = EINVAL;
+            return false;
+        }
+    return reader->frame_offset == position->offset;
+}
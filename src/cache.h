@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdbool.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <rotatable/rotatable.h>
+#include <encjson.h>
+
+/* The message cache is written by a dedicated thread. Messages are
+ * handed over through a bounded lock-free queue and written out in
+ * batches, one flush per interval or size threshold. */
+typedef struct cache_writer cache_writer_t;
+
+typedef struct search_index search_index_t;
+
+/* If sync is true, every batch is followed by fdatasync(2). Rotated
+ * segments in directory are compressed by the writer thread. If index
+ * is not NULL, the writer thread builds it from the existing segments
+ * and keeps it up to date. The maintenance yields to marks and
+ * flushes between segments. */
+cache_writer_t *make_cache_writer(rotatable_t *cache, const char *directory,
+                                  bool sync, search_index_t *index);
+
+/* Writes out everything submitted so far and stops the thread. */
+void destroy_cache_writer(cache_writer_t *writer);
+
+/* Called from the GTK thread only. The arguments are copied. */
+void cache_writer_submit(cache_writer_t *writer, const char *channel_key,
+                         time_t t, const char *from, const char *tag,
+                         const char *text);
+
+/* Have everything submitted so far written out without waiting for
+ * the interval to pass. */
+void cache_writer_kick(cache_writer_t *writer);
+
+/* Block until everything submitted so far has been written. */
+void cache_writer_flush(cache_writer_t *writer);
+
+/* Where the live segment ended when a mark was reached. */
+typedef struct {
+    ino_t segment;              /* 0 if nothing has been written */
+    off_t size;
+    bool reached;               /* protected by the writer */
+} cache_mark_t;
+
+/* Queue a mark after everything submitted so far and have it written
+ * out without waiting for the interval to pass. Called from the GTK
+ * thread only. */
+void cache_writer_mark(cache_writer_t *writer, cache_mark_t *mark);
+
+/* Block until the mark has been reached and everything submitted
+ * before it written. May be called from any thread. */
+void cache_writer_wait(cache_writer_t *writer, cache_mark_t *mark);
+
+/* Return the decoded record or NULL if it is not a proper message.
+ * from and tag are set to NULL if missing. The strings point into the
+ * returned JSON object. */
+json_thing_t *decode_cache_record(const char *record, const char **key,
+                                  unsigned long long *t, const char **from,
+                                  const char **tag, const char **text);
+
+/* Compress a rotated segment in place unless it is compressed
+ * already. On failure, errno is set and the segment is left alone; a
+ * damaged segment fails with EBADMSG. */
+bool compress_cache_segment(const char *directory, const char *name);
+
+/* Replace the segments names[0], ..., names[count - 1], which must be
+ * consecutive, with a single compressed segment called names[0]. On
+ * failure, errno is set and the segments are left alone; if any of
+ * them is damaged, the merge fails with EBADMSG. */
+bool merge_cache_segments(const char *directory, char *const *names,
+                          size_t count);
+
+/* Like scandir(3): list the segments of the message cache in
+ * directory in chronological order. The last one is being written
+ * to. */
+int scan_cache_segments(const char *directory, struct dirent ***namelist);
+
+/* Rotated segments are stored as a sequence of independent gzip
+ * members ("frames"), each holding whole records. A position
+ * identifies a record by the file offset of its frame and its
+ * uncompressed offset within the frame. An uncompressed segment is a
+ * single frame at file offset 0. */
+typedef struct {
+    off_t frame;
+    size_t offset;
+} cache_position_t;
+
+/* Where a record moved when its segment was rewritten. */
+typedef struct {
+    cache_position_t from, to;
+} cache_relocation_t;
+
+/* A streaming reader for compressed and uncompressed segments. */
+typedef struct cache_reader cache_reader_t;
+
+/* Return NULL and set errno on failure. */
+cache_reader_t *open_cache_reader(const char *path);
+void close_cache_reader(cache_reader_t *reader);
+
+/* Return the next NUL-terminated record or NULL at the end of the
+ * segment. The record stays valid until the next call. If position
+ * is not NULL, the position of the record is stored in it. */
+const char *cache_reader_next(cache_reader_t *reader,
+                              cache_position_t *position);
+
+/* After cache_reader_next() has returned NULL, tell whether the
+ * segment ended with a read error, a corrupt frame or a truncated
+ * record. */
+bool cache_reader_damaged(cache_reader_t *reader);
+
+/* Make the record at position the next one to be returned. */
+bool cache_reader_seek(cache_reader_t *reader,
+                       const cache_position_t *position);
@@ -0,0 +1,38 @@
+#include <fsdyn/charstr.h>
+#include "casemap.h"
+
+static char scandinavian_lcase(char c)
+{
+    switch (c) {
+        case '[':
+            return '{';
+        case ']':
+            return '}';
+        case '\\':
+            return '|';
+        case '~':
+            return '^';
+        default:
+            return charstr_lcase_char(c);
+    }
+}
+
+char *lcase_string(const char *name)
+{
+    char *key = charstr_dupstr(name);
+    for (char *s = key; *s; s++)
+        *s = scandinavian_lcase(*s);
+    return key;
+}
+
+int lcase_strcmp(const char *a, const char *b)
+{
+    for (;; a++, b++) {
+        unsigned char ca = scandinavian_lcase(*a);
+        unsigned char cb = scandinavian_lcase(*b);
+        if (ca != cb)
+            return ca < cb ? -1 : 1;
+        if (!ca)
+            return 0;
+    }
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+/* Return a copy of name folded according to the IRC (RFC 1459) case
+ * mapping, where []\~ are the uppercase forms of {}|^. */
+char *lcase_string(const char *name);
+
+/* Compare like strcmp(3) after folding both like lcase_string(). */
+int lcase_strcmp(const char *a, const char *b);
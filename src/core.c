@@ -0,0 +1,512 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <async/stringstream.h>
+#include <fsdyn/charstr.h>
+#include <fstrace.h>
+#include "core.h"
+#include "batch.h"
+#include "ind.h"
+#include "metrics.h"
+#include "net.h"
+#include "stage.h"
+#include "tracering.h"
+
+void sink_1_furnish_channel(sink_1 sink, channel_t *channel)
+{
+    sink.vt->furnish_channel(sink.obj, channel);
+}
+
+void sink_1_render_message(sink_1 sink, channel_t *channel, time_t t,
+                           const char *from, const char *tag_name,
+                           const char *text)
+{
+    uint64_t begin = stage_begin();
+    sink.vt->render_message(sink.obj, channel, t, from, tag_name, text);
+    stage_end(STAGE_RENDER, begin);
+}
+
+void sink_1_log_line(sink_1 sink, const char *mood, const char *line)
+{
+    uint64_t begin = stage_begin();
+    sink.vt->log_line(sink.obj, mood, line);
+    stage_end(STAGE_RENDER, begin);
+}
+
+void sink_1_nick_changed(sink_1 sink, const char *nick)
+{
+    sink.vt->nick_changed(sink.obj, nick);
+}
+
+void sink_1_render_batch(sink_1 sink, channel_t *channel, list_t *messages)
+{
+    uint64_t begin = stage_begin();
+    sink.vt->render_batch(sink.obj, channel, messages);
+    stage_end(STAGE_RENDER, begin);
+}
+
+static char *find_space(char *p)
+{
+    while (*p && *p != ' ')
+        p++;
+    return p;
+}
+
+static char *skip_space(char *p)
+{
+    while (*p == ' ')
+        p++;
+    return p;
+}
+
+static char *split_off(char *p)
+{
+    p = find_space(p);
+    char *q = skip_space(p);
+    *p = '\0';
+    return q;
+}
+
+static char *parse_tags(char *p, const char **tags)
+{
+    if (*p != '@') {
+        *tags = NULL;
+        return p;
+    }
+    *tags = ++p;
+    return split_off(p);
+}
+
+static char *parse_prefix(char *p, const char **prefix)
+{
+    if (*p != ':') {
+        *prefix = NULL;
+        return p;
+    }
+    *prefix = ++p;
+    return split_off(p);
+}
+
+/* May return NULL. */
+static char *parse_command(char *p, const char **command)
+{
+    *command = p;
+    if (charstr_char_class(*p) & CHARSTR_DIGIT) {
+        p++;
+        if (!(charstr_char_class(*p++) & CHARSTR_DIGIT) ||
+            !(charstr_char_class(*p++) & CHARSTR_DIGIT))
+            return NULL;
+    } else {
+        if (!(charstr_char_class(*p++) & CHARSTR_ALPHA))
+            return NULL;
+        while (charstr_char_class(*p) & CHARSTR_ALPHA)
+            p++;
+    }
+    switch (*p) {
+        case '\0':
+            return p;
+        case ' ':
+            *p = '\0';
+            return skip_space(p + 1);
+        default:
+            return NULL;
+    }
+}
+
+FSTRACE_DECL(IRC_EMIT, "TEXT=%s");
+FSTRACE_DECL(IRC_EMIT_DISCONNECTED, "");
+
+void emit(app_t *app, const char *text)
+{
+    uint64_t begin = stage_begin();
+    FSTRACE(IRC_EMIT, text);
+    TRACE_RING(TRACE_RING_EMIT, text, strlen(text));
+    if (app->net)
+        net_send(app->net, text);
+    else if (app->outq) {
+        stringstream_t *sstr = copy_stringstream(app->async, text);
+        queuestream_enqueue(app->outq, stringstream_as_bytestream_1(sstr));
+        atomic_fetch_add_explicit(&metrics.bytes_sent, strlen(text),
+                                  memory_order_relaxed);
+    } else FSTRACE(IRC_EMIT_DISCONNECTED);
+    stage_end(STAGE_EMIT, begin);
+}
+
+FSTRACE_DECL(IRC_ACT_ON, "MSG=%A");
+FSTRACE_DECL(IRC_ACT_ON_BAD_COMMAND, "");
+FSTRACE_DECL(IRC_ACT_ON_EMPTY_PARAM, "");
+
+irc_message_t *parse_message(const char *cmd, size_t size)
+{
+    uint64_t begin = stage_begin();
+    FSTRACE(IRC_ACT_ON, cmd, size);
+    TRACE_RING(TRACE_RING_ACT_ON, cmd, size);
+    alloc_subsystem_t outer = enter_alloc_subsystem(ALLOC_PARSER);
+    irc_message_t *msg = fsalloc(sizeof *msg + size + 1);
+    memcpy(msg->buffer, cmd, size);
+    msg->buffer[size] = '\0';
+    char *p = msg->buffer;
+    p = parse_tags(p, &msg->tags);
+    p = parse_prefix(p, &msg->prefix);
+    p = parse_command(p, &msg->command);
+    if (!p) {
+        FSTRACE(IRC_ACT_ON_BAD_COMMAND);
+        fsfree(msg);
+        leave_alloc_subsystem(outer);
+        stage_end(STAGE_PARSE, begin);
+        return NULL;
+    }
+    msg->params = make_list();
+    for (; *p != '\0' && *p != ':' && *p != ' '; p = split_off(p))
+        list_append(msg->params, p);
+    switch (*p) {
+        case '\0':
+            break;
+        case ':':
+            list_append(msg->params, ++p);
+            break;
+        default:
+            FSTRACE(IRC_ACT_ON_EMPTY_PARAM);
+            destroy_message(msg);
+            leave_alloc_subsystem(outer);
+            stage_end(STAGE_PARSE, begin);
+            return NULL;
+    }
+    leave_alloc_subsystem(outer);
+    stage_end(STAGE_PARSE, begin);
+    return msg;
+}
+
+void destroy_message(irc_message_t *msg)
+{
+    destroy_list(msg->params);
+    fsfree(msg);
+}
+
+static char *unescape_tag_value(const char *value, const char *end)
+{
+    char *result = fsalloc(end - value + 1);
+    char *q = result;
+    for (const char *p = value; p < end; p++) {
+        if (*p != '\\') {
+            *q++ = *p;
+            continue;
+        }
+        if (++p == end)
+            break;
+        switch (*p) {
+            case ':':
+                *q++ = ';';
+                break;
+            case 's':
+                *q++ = ' ';
+                break;
+            case 'r':
+                *q++ = '\r';
+                break;
+            case 'n':
+                *q++ = '\n';
+                break;
+            default:
+                *q++ = *p;
+        }
+    }
+    *q = '\0';
+    return result;
+}
+
+char *get_message_tag(const irc_message_t *msg, const char *key)
+{
+    if (!msg->tags)
+        return NULL;
+    size_t key_length = strlen(key);
+    for (const char *p = msg->tags; *p;) {
+        const char *end = strchr(p, ';');
+        if (!end)
+            end = p + strlen(p);
+        if (!strncmp(p, key, key_length)) {
+            const char *q = p + key_length;
+            if (q == end)
+                return charstr_dupstr("");
+            if (*q == '=')
+                return unescape_tag_value(q + 1, end);
+        }
+        p = *end ? end + 1 : end;
+    }
+    return NULL;
+}
+
+/* Return 0 unless the value is of the form YYYY-MM-DDThh:mm:ss.sssZ. */
+static time_t parse_server_time(const char *value)
+{
+    struct tm tm = { 0 };
+    char zone;
+    int n = sscanf(value, "%4d-%2d-%2dT%2d:%2d:%2d%*[.0-9]%c",
+                   &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                   &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &zone);
+    if (n != 7 || zone != 'Z')
+        return 0;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    time_t t = timegm(&tm);
+    return t < 0 ? 0 : t;
+}
+
+/* Set the server-time and batch of the message being dispatched. */
+static void take_tags(app_t *app, const irc_message_t *msg)
+{
+    app->message_time = 0;
+    app->message_batch = NULL;
+    if (!msg->tags)
+        return;
+    char *value;
+    if ((app->caps.enabled & CAP_SERVER_TIME) &&
+        (value = get_message_tag(msg, "time"))) {
+        app->message_time = parse_server_time(value);
+        fsfree(value);
+    }
+    if ((app->caps.enabled & CAP_BATCH) &&
+        (value = get_message_tag(msg, "batch"))) {
+        app->message_batch = find_batch(app, value);
+        fsfree(value);
+    }
+}
+
+bool dispatch_message(app_t *app, const irc_message_t *msg)
+{
+    void *outer_command = enter_alloc_command(msg->command);
+    uint64_t begin = stage_begin();
+    take_tags(app, msg);
+    bool result = do_it(app, msg->prefix, msg->command, msg->params);
+    app->message_time = 0;
+    app->message_batch = NULL;
+    stage_end(STAGE_DISPATCH, begin);
+    leave_alloc_command(outer_command);
+    return result;
+}
+
+bool act_on_message(app_t *app, const char *cmd, size_t size)
+{
+    irc_message_t *msg = parse_message(cmd, size);
+    if (!msg)
+        return false;
+    bool result = dispatch_message(app, msg);
+    destroy_message(msg);
+    return result;
+}
+
+FSTRACE_DECL(IRC_RECEIVE_NUL, "");
+FSTRACE_DECL(IRC_RECEIVE_FAILED_ACT, "");
+FSTRACE_DECL(IRC_RECEIVE_OVERFLOW, "");
+
+bool split_lines(char *buffer, char **cursor, const char *end, size_t count,
+                 bool (*act)(void *obj, const char *line, size_t size),
+                 void *obj)
+{
+    uint64_t begin = stage_begin();
+    atomic_fetch_add_explicit(&metrics.bytes_received, count,
+                              memory_order_relaxed);
+    bool ok = true;
+    char *base = buffer;
+    for (; count--; (*cursor)++) {
+        if (!**cursor) {
+            FSTRACE(IRC_RECEIVE_NUL);
+            ok = false;
+            break;
+        }
+        if (**cursor == '\n' && *cursor != base && (*cursor)[-1] == '\r') {
+            atomic_fetch_add_explicit(&metrics.messages, 1,
+                                      memory_order_relaxed);
+            if (!act(obj, base, *cursor - 1 - base)) {
+                FSTRACE(IRC_RECEIVE_FAILED_ACT);
+                ok = false;
+                break;
+            }
+            base = *cursor + 1;
+        }
+    }
+    if (ok) {
+        size_t tail_size = *cursor - base;
+        memmove(buffer, base, tail_size);
+        *cursor = buffer + tail_size;
+        if (*cursor == end) {
+            FSTRACE(IRC_RECEIVE_OVERFLOW);
+            ok = false;
+        }
+    }
+    stage_end(STAGE_RECEIVE, begin);
+    return ok;
+}
+
+bool split_input(app_t *app, size_t count)
+{
+    return split_lines(app->input_buffer, &app->input_cursor, app->input_end,
+                       count, (void *) act_on_message, app);
+}
+
+static channel_t *make_channel(app_t *app, const char *name, bool autojoin)
+{
+    channel_t *channel = fsalloc(sizeof *channel);
+    channel->app = app;
+    channel->key = lcase_string(name);
+    channel->name = charstr_dupstr(name);
+    channel->autojoin = autojoin;
+    channel->nicks_present = make_list();
+    channel->gui = NULL;
+    channel->traffic.messages = 0;
+    channel->traffic.minute = 0;
+    channel->traffic.current = channel->traffic.previous = 0;
+    sink_1_furnish_channel(app->sink, channel);
+    return channel;
+}
+
+void destroy_channel(channel_t *channel)
+{
+    fsfree(channel->key);
+    fsfree(channel->name);
+    list_foreach(channel->nicks_present, (void *) fsfree, NULL);
+    destroy_list(channel->nicks_present);
+    fsfree(channel);
+}
+
+channel_t *get_channel(app_t *app, const char *name)
+{
+    char *key = lcase_string(name);
+    avl_elem_t *ae = avl_tree_get(app->channels, key);
+    fsfree(key);
+    if (!ae)
+        return NULL;
+    channel_t *channel = (channel_t *) avl_elem_get_value(ae);
+    sink_1_furnish_channel(app->sink, channel);
+    return channel;
+}
+
+channel_t *open_channel(app_t *app, const char *name, unsigned limit,
+                        bool autojoin)
+{
+    channel_t *channel = get_channel(app, name);
+    if (channel)
+        return channel;
+    if (avl_tree_size(app->channels) >= limit)
+        return NULL;
+    channel = make_channel(app, name, autojoin);
+    avl_tree_put(app->channels, channel->key, channel);
+    return channel;
+}
+
+void reset_nick(app_t *app, const char *new_nick)
+{
+    fsfree(app->config.nick);
+    app->config.nick = charstr_dupstr(new_nick);
+    sink_1_nick_changed(app->sink, app->config.nick);
+}
+
+void log_message(channel_t *channel, time_t t, const char *from,
+                 const char *tag_name, const char *text)
+{
+    count_channel_message(channel, t);
+    cache_writer_t *writer = channel->app->cache_writer;
+    if (!writer)
+        return;
+    uint64_t begin = stage_begin();
+    cache_writer_submit(writer, channel->key, t, from, tag_name, text);
+    stage_end(STAGE_LOG, begin);
+}
+
+void indicate_message(channel_t *channel, const char *from,
+                      const char *tag_name, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    char *text = charstr_vprintf(format, ap);
+    va_end(ap);
+    app_t *app = channel->app;
+    time_t t = app->message_time ? app->message_time : time(NULL);
+    if (app->message_batch) {
+        batch_message(app->message_batch, channel, t, from, tag_name, text);
+        fsfree(text);
+        return;
+    }
+    log_message(channel, t, from, tag_name, text);
+    sink_1_render_message(channel->app->sink, channel, t, from, tag_name,
+                          text);
+    fsfree(text);
+}
+
+void logged_command(app_t *app, const char *prefix, const char *command,
+                    list_t *params)
+{
+    char *line = charstr_printf("%s %s", prefix, command);
+    const char *separator = " ";
+    for (list_elem_t *e = list_get_first(params); e; e = list_next(e)) {
+        char *longer = charstr_printf("%s%s%s", line, separator,
+                                      (const char *) list_elem_get_value(e));
+        fsfree(line);
+        line = longer;
+        separator = " ▸";
+    }
+    sink_1_log_line(app->sink, "log", line);
+    fsfree(line);
+}
+
+bool valid_server(const char *address)
+{
+    return *address != '\0';    /* TBD */
+}
+
+bool valid_tcp_port(const char *port, int *number)
+{
+    uint64_t value;
+    if (charstr_to_unsigned(port, -1, 10, &value) < 0)
+        return false;
+    if (value < 1 || value > 0xffff)
+        return false;
+    *number = value;
+    return true;
+}
+
+bool valid_nick(const char *nick)
+{
+    switch (*nick) {
+        case '\0':
+        case '$':
+        case ':':
+        case '#':
+        case '&':
+            return false;
+        default:
+            ;
+    }
+    for (const char *p = nick; *p; p++)
+        switch (*p) {
+            case ' ':
+            case ',':
+            case '*':
+            case '?':
+            case '!':
+            case '@':
+            case '.':
+                return false;
+            default:
+                if (charstr_char_class(*p) & CHARSTR_CONTROL)
+                    return false;
+        }
+    return true;
+}
+
+bool valid_name(const char *name)
+{
+    return true;                /* TBD */
+}
+
+char *read_file(const char *pathname, size_t *count)
+{
+    enum { MAX_SIZE = 1000000 };
+    FILE *f = fopen(pathname, "r");
+    if (!f)
+        return NULL;
+    char *content = fsalloc(MAX_SIZE);
+    *count = fread(content, 1, MAX_SIZE, f);
+    fclose(f);
+    return content;
+}
@@ -0,0 +1,230 @@
+#pragma once
+
+/* The protocol core: message parsing, command dispatch, channel and
+ * nick bookkeeping, highlighting and cache logging. Nothing here
+ * depends on GTK; whatever the user sees goes through the sink. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <async/async.h>
+#include <async/tcp_client.h>
+#include <async/tls_connection.h>
+#include <async/queuestream.h>
+#include <fsdyn/avltree.h>
+#include <fsdyn/list.h>
+#include <rotatable/rotatable.h>
+
+#include "allocstats.h"
+#include "cache.h"
+#include "search.h"
+#include "casemap.h"
+
+#define PROGRAM "lip"
+#define APP_NAME "Lip"
+
+#define _stringify(x) #x
+#define stringify(x) _stringify(x)
+
+enum {
+    BOLD_CONTROL = 'B' & 0x1f,
+    ITALIC_CONTROL = 'R' & 0x1f,
+    UNDERLINE_CONTROL = 'U' & 0x1f,
+    ORIGINAL_CONTROL = 'O' & 0x1f,
+    COLOR_CONTROL = 'C' & 0x1f,
+};
+
+typedef enum {
+    STARTING_UP,
+    CONFIGURING,
+    CONNECTING,
+    READY,
+    DISCONNECTED,               /* waiting to reconnect */
+    ZOMBIE,
+} state_t;
+
+typedef struct {
+    char *key, *name;
+} channel_id_t;
+
+typedef struct channel channel_t;
+typedef struct net net_t;     /* see net.h */
+typedef struct batch batch_t; /* see batch.h */
+
+/* The IRCv3 capabilities we ask for. */
+typedef enum {
+    CAP_SERVER_TIME = 1 << 0,
+    CAP_MESSAGE_TAGS = 1 << 1,
+    CAP_BATCH = 1 << 2,
+} cap_t;
+
+/* A message held back until its batch ends. */
+typedef struct {
+    channel_t *channel;
+    time_t t;
+    char *from;                 /* NULL if none */
+    char *tag_name, *text;
+} batched_message_t;
+
+/* Frontend state, opaque to the core. */
+typedef struct gui gui_t;
+typedef struct channel_gui channel_gui_t;
+
+struct sink_1_vt {
+    /* Called whenever the core looks up a channel so the frontend can
+     * (re)create its window. */
+    void (*furnish_channel)(void *obj, channel_t *channel);
+    /* Render a message on a channel; the message has been logged
+     * already. */
+    void (*render_message)(void *obj, channel_t *channel, time_t t,
+                           const char *from, const char *tag_name,
+                           const char *text);
+    /* Log a line on the console. */
+    void (*log_line)(void *obj, const char *mood, const char *line);
+    /* The server has assigned us a new nick. */
+    void (*nick_changed)(void *obj, const char *nick);
+    /* Render the messages of a batch on a channel in one go; the
+     * messages have been logged already. */
+    void (*render_batch)(void *obj, channel_t *channel,
+                         list_t *messages /* of batched_message_t */);
+};
+
+typedef struct {
+    void *obj;
+    const struct sink_1_vt *vt;
+} sink_1;
+
+void sink_1_furnish_channel(sink_1 sink, channel_t *channel);
+void sink_1_render_message(sink_1 sink, channel_t *channel, time_t t,
+                           const char *from, const char *tag_name,
+                           const char *text);
+void sink_1_log_line(sink_1 sink, const char *mood, const char *line);
+void sink_1_nick_changed(sink_1 sink, const char *nick);
+void sink_1_render_batch(sink_1 sink, channel_t *channel, list_t *messages);
+
+typedef struct {
+    struct {
+        char *trace_include, *trace_exclude;
+        size_t trace_ring_size; /* 0 to trace to stderr */
+        unsigned trace_sample;
+        char *config_file;   /* NULL, absolute or relative to $HOME */
+        char *ca_bundle;     /* NULL for the system CA bundle */
+        char *metrics_socket; /* NULL if not serving metrics */
+        bool reset;
+        bool metrics;        /* time the stages from the start */
+        unsigned stall_threshold_ms; /* 0 for no watchdog */
+        unsigned dead_peer_s;   /* 0 for no deadline */
+    } opts;
+    struct {
+        char *nick, *name, *server;
+        int port;
+        char *last_address;     /* that worked; NULL if unknown */
+        bool use_tls;
+        avl_tree_t *autojoins;  /* of channel_id_t */
+        char *cache_directory;
+        bool cache_sync;
+    } config;
+    const char *home_dir;
+    state_t state;
+    /* The connection, if lip is connected. Without it, emit() sends
+     * through outq in async and split_input() is used directly, as in
+     * lip-bench. */
+    net_t *net;
+    async_t *async;
+    queuestream_t *outq;
+    char input_buffer[512];
+    char *input_cursor, *input_end;
+    avl_tree_t *channels;       /* of key -> channel_t */
+    list_t *replay_batch;       /* of channel_t; NULL unless batching */
+    struct {
+        unsigned offered, enabled; /* of cap_t */
+        bool negotiating;       /* between CAP LS and CAP END */
+    } caps;
+    list_t *batches;            /* of batch_t, open */
+    /* The server-time of the message being dispatched (0 if none) and
+     * the open batch it belongs to (NULL if none). */
+    time_t message_time;
+    batch_t *message_batch;
+    list_t *replays;            /* in progress, see replay.c */
+    rotatable_params_t cache_params;
+    rotatable_t *cache;
+    cache_writer_t *cache_writer; /* NULL if there is no cache */
+    search_index_t *search_index;
+    sink_1 sink;
+    gui_t *gui;
+} app_t;
+
+struct channel {
+    app_t *app;
+    char *key, *name;
+    bool autojoin;
+    list_t *nicks_present;      /* of string */
+    channel_gui_t *gui;         /* owned by the frontend */
+    struct {
+        uint64_t messages;
+        time_t minute;          /* since the epoch */
+        unsigned current, previous; /* counts this and the last minute */
+    } traffic;
+};
+
+void emit(app_t *app, const char *text);
+
+typedef struct {
+    const char *tags;           /* raw, NULL if absent */
+    const char *prefix;         /* NULL if absent */
+    const char *command;
+    list_t *params;             /* of const char * */
+    char buffer[];              /* the strings above point here */
+} irc_message_t;
+
+/* Parse a single message without the CR LF. Return NULL if it is
+ * malformed. Safe to call from any thread. */
+irc_message_t *parse_message(const char *cmd, size_t size);
+void destroy_message(irc_message_t *msg);
+/* The tags are parsed only on demand. Return the unescaped value of
+ * the tag or NULL if it is absent. The value is freed by the caller. */
+char *get_message_tag(const irc_message_t *msg, const char *key);
+bool dispatch_message(app_t *app, const irc_message_t *msg);
+
+/* Parse and act on a single message without the CR LF. */
+bool act_on_message(app_t *app, const char *cmd, size_t size);
+
+/* Call act for every complete line among the count bytes just read in
+ * at *cursor and keep the incomplete tail at the start of buffer.
+ * Return false if the connection should be dropped. */
+bool split_lines(char *buffer, char **cursor, const char *end, size_t count,
+                 bool (*act)(void *obj, const char *line, size_t size),
+                 void *obj);
+
+/* Act on every complete line among the count bytes just read in at
+ * app->input_cursor and keep the incomplete tail in app->input_buffer.
+ * Return false if the connection should be dropped. */
+bool split_input(app_t *app, size_t count);
+
+channel_t *open_channel(app_t *app, const char *name, unsigned limit,
+                        bool autojoin);
+channel_t *get_channel(app_t *app, const char *name);
+/* The frontend must have released channel->gui. */
+void destroy_channel(channel_t *channel);
+void reset_nick(app_t *app, const char *new_nick);
+
+/* Hand the message over to the cache writer. */
+void log_message(channel_t *channel, time_t t, const char *from,
+                 const char *tag_name, const char *text);
+/* Log and render a timestamped message. */
+void indicate_message(channel_t *channel, const char *from,
+                      const char *tag_name, const char *format, ...);
+void logged_command(app_t *app, const char *prefix, const char *command,
+                    list_t *params);
+
+bool valid_server(const char *address);
+bool valid_tcp_port(const char *port, int *number);
+bool valid_nick(const char *nick);
+bool valid_name(const char *name);
+
+char *highlight(channel_t *channel, const char *text);
+/* The two passes of highlight(). */
+char *highlight_nicks(channel_t *channel, const char *text);
+char *highlight_urls(const char *text);
+char *read_file(const char *pathname, size_t *count);
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fsdyn/charstr.h>
+#include <fsdyn/fsalloc.h>
+#include "core.h"
+
+/* Unit tests of the message parser, the line splitter and the case
+ * mapping of the protocol core. Run with "scons check". */
+
+static unsigned failures;
+
+static void check(bool ok, const char *what, int line)
+{
+    if (ok)
+        return;
+    fprintf(stderr, "coretest.c:%d: check failed: %s\n", line, what);
+    failures++;
+}
+
+#define CHECK(cond) check(cond, #cond, __LINE__)
+
+static bool equal(const char *a, const char *b)
+{
+    if (!a || !b)
+        return a == b;
+    return !strcmp(a, b);
+}
+
+static irc_message_t *parse(const char *line)
+{
+    return parse_message(line, strlen(line));
+}
+
+static const char *param(const irc_message_t *msg, size_t i)
+{
+    list_elem_t *e = list_get_first(msg->params);
+    for (; e && i--; e = list_next(e))
+        ;
+    return e ? list_elem_get_value(e) : NULL;
+}
+
+static bool tag_is(const irc_message_t *msg, const char *key,
+                   const char *expected)
+{
+    char *value = get_message_tag(msg, key);
+    bool ok = equal(value, expected);
+    fsfree(value);
+    return ok;
+}
+
+static void test_parse_plain(void)
+{
+    irc_message_t *msg = parse("PING :irc.example.net");
+    CHECK(msg);
+    if (!msg)
+        return;
+    CHECK(!msg->tags);
+    CHECK(!msg->prefix);
+    CHECK(equal(msg->command, "PING"));
+    CHECK(list_size(msg->params) == 1);
+    CHECK(equal(param(msg, 0), "irc.example.net"));
+    destroy_message(msg);
+}
+
+static void test_parse_full(void)
+{
+    irc_message_t *msg =
+        parse("@time=2024-01-02T03:04:05.678Z;batch=a\\sb\\:c;+draft "
+              ":nick!user@host PRIVMSG #chan :hello  world");
+    CHECK(msg);
+    if (!msg)
+        return;
+    CHECK(equal(msg->prefix, "nick!user@host"));
+    CHECK(equal(msg->command, "PRIVMSG"));
+    CHECK(list_size(msg->params) == 2);
+    CHECK(equal(param(msg, 0), "#chan"));
+    CHECK(equal(param(msg, 1), "hello  world"));
+    CHECK(tag_is(msg, "time", "2024-01-02T03:04:05.678Z"));
+    CHECK(tag_is(msg, "batch", "a b;c"));
+    CHECK(tag_is(msg, "+draft", ""));
+    CHECK(tag_is(msg, "bat", NULL));
+    CHECK(tag_is(msg, "account", NULL));
+    destroy_message(msg);
+}
+
+static void test_parse_numeric(void)
+{
+    irc_message_t *msg = parse(":irc.example.net 001 me   extra :Welcome");
+    CHECK(msg);
+    if (!msg)
+        return;
+    CHECK(equal(msg->command, "001"));
+    CHECK(list_size(msg->params) == 3);
+    CHECK(equal(param(msg, 0), "me"));
+    CHECK(equal(param(msg, 1), "extra"));
+    CHECK(equal(param(msg, 2), "Welcome"));
+    destroy_message(msg);
+}
+
+static void test_parse_malformed(void)
+{
+    static const char *const malformed[] = {
+        "",
+        ":irc.example.net",
+        "@time=x",
+        "12 too short",
+        "1234 too long",
+        "PRIV1MSG #chan :x",
+        "-NOTICE",
+    };
+    for (size_t i = 0; i < sizeof malformed / sizeof malformed[0]; i++) {
+        irc_message_t *msg = parse(malformed[i]);
+        if (msg) {
+            fprintf(stderr, "coretest.c: accepted \"%s\"\n", malformed[i]);
+            failures++;
+            destroy_message(msg);
+        }
+    }
+}
+
+typedef struct {
+    list_t *lines;              /* of char * */
+    bool refuse;
+} collector_t;
+
+static bool collect(void *obj, const char *line, size_t size)
+{
+    collector_t *collector = obj;
+    list_append(collector->lines, charstr_dupsubstr(line, line + size));
+    return !collector->refuse;
+}
+
+static bool line_is(collector_t *collector, const char *expected)
+{
+    if (list_empty(collector->lines))
+        return false;
+    char *line = (char *) list_pop_first(collector->lines);
+    bool ok = !strcmp(line, expected);
+    fsfree(line);
+    return ok;
+}
+
+static void clear(collector_t *collector)
+{
+    while (!list_empty(collector->lines))
+        fsfree((char *) list_pop_first(collector->lines));
+}
+
+/* Append the chunk at *cursor and split. */
+static bool feed(char *buffer, size_t size, char **cursor,
+                 collector_t *collector, const char *chunk)
+{
+    size_t count = strlen(chunk);
+    if (count > buffer + size - *cursor)
+        count = buffer + size - *cursor;
+    memcpy(*cursor, chunk, count);
+    return split_lines(buffer, cursor, buffer + size, count, collect,
+                       collector);
+}
+
+static void test_split_lines(void)
+{
+    char buffer[32];
+    char *cursor = buffer;
+    collector_t collector = { make_list(), false };
+    CHECK(feed(buffer, sizeof buffer, &cursor, &collector,
+               "PING :a\r\nPI"));
+    CHECK(list_size(collector.lines) == 1);
+    CHECK(line_is(&collector, "PING :a"));
+    CHECK(cursor == buffer + 2);
+    CHECK(!memcmp(buffer, "PI", 2));
+    CHECK(feed(buffer, sizeof buffer, &cursor, &collector, "NG :b\r"));
+    CHECK(list_empty(collector.lines));
+    CHECK(feed(buffer, sizeof buffer, &cursor, &collector,
+               "\n\r\nX\nY\r\n"));
+    CHECK(list_size(collector.lines) == 3);
+    CHECK(line_is(&collector, "PING :b"));
+    CHECK(line_is(&collector, ""));
+    CHECK(line_is(&collector, "X\nY"));
+    CHECK(cursor == buffer);
+    clear(&collector);
+
+    /* A NUL byte drops the connection. */
+    cursor = buffer;
+    char nul[] = "A\0B\r\n";
+    memcpy(cursor, nul, sizeof nul - 1);
+    CHECK(!split_lines(buffer, &cursor, buffer + sizeof buffer,
+                       sizeof nul - 1, collect, &collector));
+    CHECK(list_empty(collector.lines));
+
+    /* So does a line that does not fit in the buffer. */
+    cursor = buffer;
+    CHECK(!feed(buffer, sizeof buffer, &cursor, &collector,
+                "0123456789012345678901234567890123456789\r\n"));
+    CHECK(list_empty(collector.lines));
+
+    /* And a line the consumer refuses. */
+    cursor = buffer;
+    collector.refuse = true;
+    CHECK(!feed(buffer, sizeof buffer, &cursor, &collector,
+                "A\r\nB\r\n"));
+    CHECK(list_size(collector.lines) == 1);
+    CHECK(line_is(&collector, "A"));
+    clear(&collector);
+    destroy_list(collector.lines);
+}
+
+static void test_casemap(void)
+{
+    char *key = lcase_string("[Nick]\\~");
+    CHECK(equal(key, "{nick}|^"));
+    fsfree(key);
+    CHECK(!lcase_strcmp("[Nick]", "{nick}"));
+    CHECK(!lcase_strcmp("A\\B", "a|b"));
+    CHECK(lcase_strcmp("nick", "nick2") < 0);
+    CHECK(lcase_strcmp("b", "A") > 0);
+}
+
+int main(int argc, char **argv)
+{
+    test_parse_plain();
+    test_parse_full();
+    test_parse_numeric();
+    test_parse_malformed();
+    test_split_lines();
+    test_casemap();
+    if (failures) {
+        fprintf(stderr, "coretest: %u failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,26 +1,34 @@
 #!/usr/bin/env python
 
+import json
 import sys
 
-def main():
-    try:
-        variable, lenconst, cpath, hpath = sys.argv[1:]
-    except ValueError:
-        sys.stderr.write(
-            f"Usage: {sys.argv[0]} variable lenconst cpath hpath\n")
-        sys.exit(1)
-    enctab = { b: f"\\x{b:02x}" for b in range(256) }
-    enctab.update({ b: chr(b) for b in range(ord(" "), ord("~") + 1) })
-    enctab.update({
-        ord('"'): '\\"',
-        ord("\\"): "\\\\",
-        ord("\f"): "\\f",
-        ord("\n"): "\\n",
-        ord("\r"): "\\r",
-        ord("\t"): "\\t",
-        ord("\v"): "\\v",
-        ord("?"): "\\?",        # trigraph avoidance
-    })
+ENCTAB = { b: f"\\x{b:02x}" for b in range(256) }
+ENCTAB.update({ b: chr(b) for b in range(ord(" "), ord("~") + 1) })
+ENCTAB.update({
+    ord('"'): '\\"',
+    ord("\\"): "\\\\",
+    ord("\f"): "\\f",
+    ord("\n"): "\\n",
+    ord("\r"): "\\r",
+    ord("\t"): "\\t",
+    ord("\v"): "\\v",
+    ord("?"): "\\?",        # trigraph avoidance
+})
+
+def literal(data):
+    # A hex escape swallows every hex digit that follows it.
+    out = []
+    hexesc = False
+    for b in data:
+        if hexesc and chr(b) in "0123456789abcdefABCDEF":
+            out.append('""')
+        enc = ENCTAB[b]
+        out.append(enc)
+        hexesc = enc.startswith("\\x")
+    return '"' + "".join(out) + '"'
+
+def embed(variable, lenconst, cpath, hpath):
     data = sys.stdin.buffer.read()
     with sys.stdout if cpath == "-" else open(hpath, "w") as hout:
         hout.write(f"""#pragma once
@@ -31,7 +39,7 @@ extern const char {variable}[];
         cout.write(f'const char {variable}[] =\n"')
         col = 1
         for b in data:
-            enc = enctab[b]
+            enc = ENCTAB[b]
             col += len(enc)
             if col >= 79:
                 cout.write('"\n"')
@@ -39,5 +47,118 @@ extern const char {variable}[];
             cout.write(enc)
         cout.write(f'"\n; /* {variable} */\n')
 
+# Must agree with i18n_hash() in intl.c: 32-bit FNV-1a with the seed
+# mixed into the offset basis.
+def fnv1a(seed, data):
+    h = (2166136261 ^ seed) & 0xffffffff
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xffffffff
+    return h
+
+def perfect_hash(keys):
+    """Hash and displace: a key lands in bucket fnv1a(0, key) % buckets
+    and then in slot fnv1a(displacement[bucket], key) % slots."""
+    buckets = max(1, len(keys) // 4)
+    slots = max(1, len(keys) + len(keys) // 4)
+    members = [[] for _ in range(buckets)]
+    for key in keys:
+        members[fnv1a(0, key) % buckets].append(key)
+    displacements = [0] * buckets
+    table = [None] * slots
+    order = sorted(range(buckets), key=lambda b: -len(members[b]))
+    for b in order:
+        if not members[b]:
+            continue
+        seed = 1
+        while True:
+            positions = [fnv1a(seed, key) % slots for key in members[b]]
+            if len(set(positions)) == len(positions) and \
+               all(table[p] is None for p in positions):
+                break
+            seed += 1
+        displacements[b] = seed
+        for key, p in zip(members[b], positions):
+            table[p] = key
+    return displacements, table
+
+def emit_array(out, decl, items):
+    out.write(f"{decl} = {{\n")
+    for item in items:
+        out.write(f"    {item},\n")
+    out.write("};\n")
+
+def i18n(cpath, hpath):
+    # Later duplicates override earlier ones, like at runtime.
+    pairs = json.load(sys.stdin, object_pairs_hook=lambda pairs: pairs)
+    strings = {}
+    for key, langs in pairs:
+        strings.setdefault(key, {}).update(langs)
+    languages = sorted({ lang for langs in strings.values()
+                         for lang in langs })
+    keys = [key.encode() for key in strings]
+    displacements, table = perfect_hash(keys)
+    with open(hpath, "w") as hout:
+        hout.write(f"""#pragma once
+
+#include <stdint.h>
+
+/* Generated by embed.py from i18n.json. A string s is at index
+ * i18n_hash(i18n_displacements[i18n_hash(0, s) % I18N_BUCKETS], s) %
+ * I18N_SLOTS if anywhere. */
+
+enum {{
+    I18N_LANGUAGES = {len(languages)},
+    I18N_BUCKETS = {len(displacements)},
+    I18N_SLOTS = {len(table)},
+}};
+
+extern const char *const i18n_languages[I18N_LANGUAGES];
+extern const uint32_t i18n_displacements[I18N_BUCKETS];
+/* NULL for an empty slot. */
+extern const char *const i18n_strings[I18N_SLOTS];
+/* NULL if not translated. */
+extern const char *const i18n_translations[I18N_LANGUAGES][I18N_SLOTS];
+""")
+    with open(cpath, "w") as cout:
+        cout.write('#include <stddef.h>\n#include "i18n.h"\n\n')
+        emit_array(cout,
+                   "const char *const i18n_languages[I18N_LANGUAGES]",
+                   (literal(lang.encode()) for lang in languages))
+        cout.write("\n")
+        emit_array(cout,
+                   "const uint32_t i18n_displacements[I18N_BUCKETS]",
+                   (str(d) for d in displacements))
+        cout.write("\n")
+        emit_array(cout, "const char *const i18n_strings[I18N_SLOTS]",
+                   ("NULL" if key is None else literal(key)
+                    for key in table))
+        cout.write("\nconst char *const "
+                   "i18n_translations[I18N_LANGUAGES][I18N_SLOTS] = {\n")
+        for lang in languages:
+            cout.write(f"    {{ /* {lang} */\n")
+            for key in table:
+                translation = None
+                if key is not None:
+                    translation = strings[key.decode()].get(lang)
+                if translation is None:
+                    cout.write("        NULL,\n")
+                else:
+                    cout.write(f"        {literal(translation.encode())},\n")
+            cout.write("    },\n")
+        cout.write("};\n")
+
+def main():
+    if sys.argv[1:2] == ["--i18n"] and len(sys.argv) == 4:
+        i18n(*sys.argv[2:])
+        return
+    try:
+        variable, lenconst, cpath, hpath = sys.argv[1:]
+    except ValueError:
+        sys.stderr.write(
+            f"Usage: {sys.argv[0]} variable lenconst cpath hpath\n"
+            f"       {sys.argv[0]} --i18n cpath hpath\n")
+        sys.exit(1)
+    embed(variable, lenconst, cpath, hpath)
+
 if __name__ == "__main__":
     main()
@@ -0,0 +1,117 @@
+#include <fsdyn/charstr.h>
+#include <fsdyn/integer.h>
+#include "core.h"
+#include "url.h"
+#include "stage.h"
+
+static bool nick_break(int codepoint)
+{
+    switch (charstr_unicode_category(codepoint)) {
+        case UNICODE_CATEGORY_Ll:
+        case UNICODE_CATEGORY_Lm:
+        case UNICODE_CATEGORY_Lo:
+        case UNICODE_CATEGORY_Lt:
+        case UNICODE_CATEGORY_Lu:
+        case UNICODE_CATEGORY_Nd:
+        case UNICODE_CATEGORY_Nl:
+        case UNICODE_CATEGORY_No:
+            return false;
+        default:
+            return true;
+    }
+}
+
+static const char *skip_nick(channel_t *channel, const char *s)
+{
+    for (list_elem_t *e = list_get_first(channel->nicks_present); e;
+         e = list_next(e)) {
+        const char *nick = list_elem_get_value(e);
+        const char *skipped = charstr_skip_prefix(s, nick);
+        if (!skipped)
+            continue;
+        int codepoint;
+        if (!charstr_decode_utf8_codepoint(skipped, NULL, &codepoint) ||
+            nick_break(codepoint))
+            return skipped;
+    }
+    return NULL;
+}
+
+static char *wedge(const char *text, list_t *points, const char *joiner)
+{
+    list_t *snippets = make_list();
+    const char *p = text;
+    for (list_elem_t *e = list_get_first(points); e; e = list_next(e)) {
+        const char *q = text + as_intptr(list_elem_get_value(e));
+        list_append(snippets, charstr_dupsubstr(p, q));
+        p = q;
+    }
+    list_append(snippets, charstr_dupstr(p));
+    char *result = charstr_join(joiner, snippets);
+    list_foreach(snippets, (void *) fsfree, NULL);
+    destroy_list(snippets);
+    return result;
+}
+
+char *highlight_nicks(channel_t *channel, const char *text)
+{
+    list_t *points = make_list();
+    char *lcase = lcase_string(text);
+    const char *s = lcase;
+    while (*s) {
+        const char *skipped = skip_nick(channel, s);
+        if (skipped) {
+            list_append(points, as_integer(s - lcase));
+            list_append(points, as_integer(skipped - lcase));
+            s = skipped;
+            continue;
+        }
+        for (;; s++) {
+            int codepoint;
+            const char *next =
+                charstr_decode_utf8_codepoint(s, NULL, &codepoint);
+            if (!next) {
+                s++;
+                break;
+            }
+            if (nick_break(codepoint)) {
+                s = next;
+                break;
+            }
+        }
+    }
+    fsfree(lcase);
+    static const char NICK_WEDGE[] = { BOLD_CONTROL, '\0' };
+    char *highlighted = wedge(text, points, NICK_WEDGE);
+    destroy_list(points);
+    return highlighted;
+}
+
+char *highlight_urls(const char *text)
+{
+    list_t *points = make_list();
+    const char *p = text;
+    for (;;) {
+        const char *url_end;
+        const char *url = find_url(p, NULL, &url_end);
+        if (!url)
+            break;
+        list_append(points, as_integer(url - text));
+        list_append(points, as_integer(url_end - text));
+        p = url_end;
+    }
+    static const char URL_WEDGE[] = { UNDERLINE_CONTROL, '\0' };
+    char *highlighted = wedge(text, points, URL_WEDGE);
+    destroy_list(points);
+    return highlighted;
+}
+
+char *highlight(channel_t *channel, const char *text)
+{
+    uint64_t begin = stage_begin();
+    char *h_nicks = highlight_nicks(channel, text);
+    char *h_urls = highlight_urls(h_nicks);
+    fsfree(h_nicks);
+    stage_end(STAGE_HIGHLIGHT, begin);
+    return h_urls;
+}
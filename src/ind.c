@@ -2,9 +2,11 @@
 #include <fsdyn/charstr.h>
 #include <encjson.h>
 #include "ind.h"
+#include "batch.h"
 #include "rpl.h"
-#include "util.h"
+#include "core.h"
 #include "intl.h"
+#include "tracering.h"
 
 typedef struct {
     char *server, *nick, *user, *host;
@@ -54,13 +56,9 @@ static void clear_prefix(prefix_parts_t *parts)
 static void log_line(app_t *app, const char *mood, const char *format,
                      va_list ap)
 {
-    GtkTextBuffer *console;
-    bool at_bottom = begin_console_line(app, &console);
     char *line = charstr_vprintf(format, ap);
-    append_text(console, line, mood);
+    sink_1_log_line(app->sink, mood, line);
     fsfree(line);
-    append_text(console, "\n", mood);
-    console_scroll_maybe(app, at_bottom);
 }
 
 static void info(app_t *app, const char *format, ...)
@@ -101,14 +99,17 @@ static void note_join(app_t *app, const prefix_parts_t *parts,
                          parts->nick, parts->user, parts->server);
     else indicate_message(channel, NULL, mood, _("%s (%s@%s) joined"),
                           parts->nick, parts->nick, parts->server);
+    alloc_subsystem_t outer = enter_alloc_subsystem(ALLOC_NICKS);
     char *key = lcase_string(parts->nick);
     for (list_elem_t *e = list_get_first(channel->nicks_present); e;
          e = list_next(e))
         if (!strcmp(key, list_elem_get_value(e))) {
             fsfree(key);
+            leave_alloc_subsystem(outer);
             return;
         }
     list_append(channel->nicks_present, key);
+    leave_alloc_subsystem(outer);
 }
 
 static void distribute(app_t *app, const prefix_parts_t *parts,
@@ -162,6 +163,22 @@ static bool mode(app_t *app, const char *prefix, list_t *params)
     return true;
 }
 
+char *pong_reply(list_t *params)
+{
+    list_elem_t *e1 = list_get_first(params);
+    if (!e1)
+        return NULL;
+    list_elem_t *e2 = list_next(e1);
+    if (!e2)
+        return charstr_printf("PONG :%s\r\n",
+                              (const char *) list_elem_get_value(e1));
+    if (list_next(e2))
+        return NULL;
+    return charstr_printf("PONG %s :%s\r\n",
+                          (const char *) list_elem_get_value(e1),
+                          (const char *) list_elem_get_value(e2));
+}
+
 FSTRACE_DECL(IRC_PING_ILLEGAL, "");
 FSTRACE_DECL(IRC_PONG, "SERVER=%s SERVER2=%s");
 
@@ -176,23 +193,13 @@ static bool ping(app_t *app, const char *prefix, list_t *params)
             return false;
     }
 
+    char *reply = pong_reply(params);
+    emit(app, reply);
+    fsfree(reply);
     list_elem_t *e1 = list_get_first(params);
-    const char *s1 = list_elem_get_value(e1);
     list_elem_t *e2 = list_next(e1);
-    if (!e2) {
-        emit(app, "PONG :");
-        emit(app, s1);
-        emit(app, "\r\n");
-        FSTRACE(IRC_PONG, s1, NULL);
-        return true;
-    }
-    const char *s2 = list_elem_get_value(e2);
-    emit(app, "PONG ");
-    emit(app, s1);
-    emit(app, " :");
-    emit(app, s2);
-    emit(app, "\r\n");
-    FSTRACE(IRC_PONG, s1, s2);
+    FSTRACE(IRC_PONG, list_elem_get_value(e1),
+            e2 ? list_elem_get_value(e2) : NULL);
     return true;
 }
 
@@ -351,6 +358,155 @@ static bool privmsg(app_t *app, const char *prefix, list_t *params)
     return true;
 }
 
+static const struct {
+    const char *name;
+    cap_t cap;
+} WANTED_CAPS[] = {
+    { "server-time", CAP_SERVER_TIME },
+    { "message-tags", CAP_MESSAGE_TAGS },
+    { "batch", CAP_BATCH },
+};
+
+/* Return 0 if the capability (possibly with a value or, in an ACK, a
+ * '-' prefix) is not one we want. */
+static cap_t wanted_cap(const char *token, size_t length)
+{
+    for (int i = 0; i < sizeof WANTED_CAPS / sizeof WANTED_CAPS[0]; i++) {
+        const char *name = WANTED_CAPS[i].name;
+        size_t name_length = strlen(name);
+        if (name_length <= length && !strncmp(token, name, name_length) &&
+            (name_length == length || token[name_length] == '='))
+            return WANTED_CAPS[i].cap;
+    }
+    return 0;
+}
+
+/* Call f for every space-separated capability in the list. */
+static void for_each_cap(const char *caps,
+                         void (*f)(app_t *app, const char *token,
+                                   size_t length),
+                         app_t *app)
+{
+    for (const char *p = caps; *p;) {
+        const char *end = strchr(p, ' ');
+        if (!end)
+            end = p + strlen(p);
+        if (end > p)
+            f(app, p, end - p);
+        p = *end ? end + 1 : end;
+    }
+}
+
+static void note_offered(app_t *app, const char *token, size_t length)
+{
+    app->caps.offered |= wanted_cap(token, length);
+}
+
+static void note_acked(app_t *app, const char *token, size_t length)
+{
+    if (*token == '-')
+        app->caps.enabled &= ~wanted_cap(token + 1, length - 1);
+    else app->caps.enabled |= wanted_cap(token, length);
+}
+
+static void end_negotiation(app_t *app)
+{
+    app->caps.negotiating = false;
+    emit(app, "CAP END\r\n");
+}
+
+static void request_caps(app_t *app)
+{
+    if (!app->caps.offered) {
+        end_negotiation(app);
+        return;
+    }
+    emit(app, "CAP REQ :");
+    const char *separator = "";
+    for (int i = 0; i < sizeof WANTED_CAPS / sizeof WANTED_CAPS[0]; i++)
+        if (app->caps.offered & WANTED_CAPS[i].cap) {
+            emit(app, separator);
+            emit(app, WANTED_CAPS[i].name);
+            separator = " ";
+        }
+    emit(app, "\r\n");
+}
+
+FSTRACE_DECL(IRC_GOT_BAD_CAP, "");
+FSTRACE_DECL(IRC_CAPS_OFFERED, "CAPS=0x%x");
+FSTRACE_DECL(IRC_CAPS_ENABLED, "CAPS=0x%x");
+FSTRACE_DECL(IRC_CAPS_REFUSED, "CAPS=%s");
+
+/*
+ CAP <target> LS [*] :<caps>
+ CAP <target> ACK :<caps>
+ CAP <target> NAK :<caps>
+*/
+static bool cap(app_t *app, const char *prefix, list_t *params)
+{
+    if (list_size(params) < 3 || !app->caps.negotiating) {
+        FSTRACE(IRC_GOT_BAD_CAP);
+        return false;
+    }
+    list_elem_t *e = list_next(list_get_first(params));
+    const char *subcommand = list_elem_get_value(e);
+    const char *caps = list_elem_get_value(list_get_last(params));
+    if (!strcmp(subcommand, "LS")) {
+        for_each_cap(caps, note_offered, app);
+        bool more = list_size(params) > 3 &&
+            !strcmp(list_elem_get_value(list_next(e)), "*");
+        if (!more) {
+            FSTRACE(IRC_CAPS_OFFERED, app->caps.offered);
+            request_caps(app);
+        }
+        return true;
+    }
+    if (!strcmp(subcommand, "ACK")) {
+        for_each_cap(caps, note_acked, app);
+        FSTRACE(IRC_CAPS_ENABLED, app->caps.enabled);
+        end_negotiation(app);
+        return true;
+    }
+    if (!strcmp(subcommand, "NAK")) {
+        FSTRACE(IRC_CAPS_REFUSED, caps);
+        end_negotiation(app);
+        return true;
+    }
+    FSTRACE(IRC_GOT_BAD_CAP);
+    return false;
+}
+
+FSTRACE_DECL(IRC_GOT_BAD_BATCH, "");
+
+/*
+ BATCH +<ref> <type> [<params>]
+ BATCH -<ref>
+*/
+static bool batch(app_t *app, const char *prefix, list_t *params)
+{
+    if (list_empty(params) || !(app->caps.enabled & CAP_BATCH)) {
+        FSTRACE(IRC_GOT_BAD_BATCH);
+        return false;
+    }
+    list_elem_t *e = list_get_first(params);
+    const char *ref = list_elem_get_value(e);
+    switch (*ref) {
+        case '+':
+            if (!list_next(e)) {
+                FSTRACE(IRC_GOT_BAD_BATCH);
+                return false;
+            }
+            open_batch(app, ref + 1, list_elem_get_value(list_next(e)));
+            return true;
+        case '-':
+            close_batch(app, ref + 1);
+            return true;
+        default:
+            FSTRACE(IRC_GOT_BAD_BATCH);
+            return false;
+    }
+}
+
 static json_thing_t *json_repr(const char *prefix, const char *command,
                                list_t *params)
 {
@@ -375,12 +531,7 @@ static void dump_message(app_t *app, const char *prefix, const char *command,
     char encoding[size + 1];
     json_utf8_prettyprint(msg, encoding, size + 1, 0, 2);
     json_destroy_thing(msg);
-    const char *mood = "log";
-    GtkTextBuffer *console;
-    bool at_bottom = begin_console_line(app, &console);
-    append_text(console, encoding, mood);
-    append_text(console, "\n", mood);
-    console_scroll_maybe(app, at_bottom);
+    sink_1_log_line(app->sink, "log", encoding);
 }
 
 FSTRACE_DECL(IRC_DO_COMMAND, "MSG=%I");
@@ -392,6 +543,7 @@ bool do_it(app_t *app, const char *prefix, const char *command, list_t *params)
         FSTRACE(IRC_DO_COMMAND, json_trace, msg);
         json_destroy_thing(msg);
     }
+    TRACE_RING(TRACE_RING_DO_COMMAND, command, strlen(command));
 /*
  PASS <password>
  OPER <user> <password>
@@ -418,6 +570,10 @@ bool do_it(app_t *app, const char *prefix, const char *command, list_t *params)
     bool done = false;
     if (charstr_char_class(*command) & CHARSTR_DIGIT)
         done = numeric(app, prefix, command, params);
+    else if (!strcmp(command, "BATCH"))
+        done = batch(app, prefix, params);
+    else if (!strcmp(command, "CAP"))
+        done = cap(app, prefix, params);
     else if (!strcmp(command, "JOIN"))
         done = join(app, prefix, params);
     else if (!strcmp(command, "MODE"))
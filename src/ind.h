@@ -1,5 +1,8 @@
 #pragma once
 
-#include "lip.h"
+#include "core.h"
 
 bool do_it(app_t *app, const char *prefix, const char *command, list_t *params);
+/* The reply to a PING with the given params or NULL if they are
+ * illegal. */
+char *pong_reply(list_t *params);
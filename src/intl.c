@@ -5,8 +5,7 @@
 #include <encjson.h>
 #include <fsdyn/charstr.h>
 #include <fsdyn/hashtable.h>
-#include <fsdyn/integer.h>
-#include "util.h"
+#include "core.h"
 #include "intl.h"
 #include "i18n.h"
 
@@ -14,8 +13,32 @@
 #define PREFIX /usr/local
 #endif
 
-static hash_table_t *translations; /* string -> string */
-static hash_table_t *interned;     /* uintptr_t -> string */
+/* The built-in translations are a perfect hash table generated by
+ * embed.py; the files in the i18n directories override them. */
+static struct {
+    bool initialized;
+    int language;               /* index to i18n_languages or -1 */
+    const char *overrides[I18N_SLOTS]; /* NULL if not overridden */
+    hash_table_t *extras;       /* strings missing from i18n_strings */
+} intl;
+
+static uint32_t i18n_hash(uint32_t seed, const char *s)
+{
+    uint32_t h = 2166136261U ^ seed;
+    for (; *s; s++)
+        h = (h ^ (unsigned char) *s) * 16777619U;
+    return h;
+}
+
+/* Return the slot of s in i18n_strings or -1. */
+static int i18n_index(const char *s)
+{
+    uint32_t seed = i18n_displacements[i18n_hash(0, s) % I18N_BUCKETS];
+    int i = i18n_hash(seed, s) % I18N_SLOTS;
+    if (!i18n_strings[i] || strcmp(i18n_strings[i], s))
+        return -1;
+    return i;
+}
 
 static void add_translations(json_thing_t *i18n, const char *lang)
 {
@@ -23,18 +46,27 @@ static void add_translations(json_thing_t *i18n, const char *lang)
     for (json_field_t *field = json_object_first(i18n); field;
          field = json_field_next(field)) {
         json_thing_t *langs = json_field_value(field);
-        assert(json_thing_type(langs) == JSON_OBJECT);
         const char *translation;
-        if (json_object_get_string(langs, lang, &translation)) {
-            hash_elem_t *he =
-                hash_table_put(translations,
-                               charstr_dupstr(json_field_name(field)),
-                               charstr_dupstr(translation));
-            if (he) {           /* overridden */
-                fsfree((char *) hash_elem_get_key(he));
-                fsfree((char *) hash_elem_get_value(he));
-                destroy_hash_element(he);
-            }
+        if (json_thing_type(langs) != JSON_OBJECT ||
+            !json_object_get_string(langs, lang, &translation))
+            continue;
+        const char *key = json_field_name(field);
+        int i = i18n_index(key);
+        if (i >= 0) {
+            fsfree((char *) intl.overrides[i]);
+            intl.overrides[i] = charstr_dupstr(translation);
+            continue;
+        }
+        if (!intl.extras)
+            intl.extras =
+                make_hash_table(100, (void *) hash_string, (void *) strcmp);
+        hash_elem_t *he =
+            hash_table_put(intl.extras, charstr_dupstr(key),
+                           charstr_dupstr(translation));
+        if (he) {               /* overridden */
+            fsfree((char *) hash_elem_get_key(he));
+            fsfree((char *) hash_elem_get_value(he));
+            destroy_hash_element(he);
         }
     }
 }
@@ -86,45 +118,45 @@ static void import_local_i18n(const char *lang)
     fsfree(dirpath);
 }
 
+/* The override files are not read at all without LANG. The first
+ * call of _() comes during startup, before any window is built, so
+ * the directory scan stays on the startup path; deferring it would
+ * leave the menus untranslated by the overrides. */
 static void initialize()
 {
+    intl.initialized = true;
+    intl.language = -1;
     const char *lang = getenv("LANG");
-    if (!lang) {
-        translations =
-            make_hash_table(1, (void *) hash_string, (void *) strcmp);
-        interned =
-            make_hash_table(1, (void *) hash_unsigned, (void *) unsigned_cmp);
+    if (!lang)
         return;
-    }
-    json_thing_t *i18n = json_utf8_decode_string(i18n_json);
-    assert(json_thing_type(i18n) == JSON_OBJECT);
-    translations = make_hash_table(1000, (void *) hash_string, (void *) strcmp);
-    unsigned count = 0;
-    for (json_field_t *field = json_object_first(i18n); field;
-         field = json_field_next(field), count++)
-        ;
-    add_translations(i18n, lang);
-    json_destroy_thing(i18n);
-    interned =
-        make_hash_table(count, (void *) hash_unsigned, (void *) unsigned_cmp);
+    for (int i = 0; i < I18N_LANGUAGES; i++)
+        if (!strcmp(i18n_languages[i], lang)) {
+            intl.language = i;
+            break;
+        }
     import_global_i18n(lang);
     import_local_i18n(lang);
 }
 
 const char *_(const char *s)
 {
-    if (!translations)
+    if (!intl.initialized) {
+        alloc_subsystem_t outer = enter_alloc_subsystem(ALLOC_I18N);
         initialize();
-    unsigned_t *intern_key = as_unsigned((uintptr_t) s);
-    hash_elem_t *he = hash_table_get(interned, intern_key);
-    if (he)
-        return hash_elem_get_value(he);
-    he = hash_table_get(translations, s);
-    if (he) {
-        const char *translation = hash_elem_get_value(he);
-        hash_table_put(interned, intern_key, translation);
-        return translation;
+        leave_alloc_subsystem(outer);
+    }
+    int i = i18n_index(s);
+    if (i < 0) {
+        if (intl.extras) {
+            hash_elem_t *he = hash_table_get(intl.extras, s);
+            if (he)
+                return hash_elem_get_value(he);
+        }
+        return s;
     }
-    hash_table_put(interned, intern_key, s);
+    if (intl.overrides[i])
+        return intl.overrides[i];
+    if (intl.language >= 0 && i18n_translations[intl.language][i])
+        return i18n_translations[intl.language][i];
     return s;
 }
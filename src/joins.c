@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fsdyn/charstr.h>
+#include <fstrace.h>
+#include "joins.h"
+
+enum {
+    MAX_LINE = 512,             /* including CR LF */
+    STAGGER_MS = 2000,          /* between lines */
+};
+
+static void forget_timer(app_t *app)
+{
+    struct join_queue *joins = &app->gui->joins;
+    if (joins->timer) {
+        g_source_remove(joins->timer);
+        joins->timer = 0;
+    }
+    joins->staggered = false;
+}
+
+void cancel_joins(app_t *app)
+{
+    struct join_queue *joins = &app->gui->joins;
+    forget_timer(app);
+    if (joins->channels) {
+        destroy_list(joins->channels);
+        joins->channels = NULL;
+    }
+}
+
+/* Higher is joined earlier. */
+static int priority(channel_t *channel)
+{
+    GtkWidget *window = channel->gui ? channel->gui->window : NULL;
+    if (!window)
+        return 0;
+    if (gtk_window_is_active(GTK_WINDOW(window)))
+        return 2;
+    return 1;
+}
+
+static int cmp_channels(const void *a, const void *b)
+{
+    channel_t *ca = *(channel_t **) a, *cb = *(channel_t **) b;
+    int pa = priority(ca), pb = priority(cb);
+    if (pa != pb)
+        return pb - pa;
+    if (ca->traffic.minute != cb->traffic.minute)
+        return ca->traffic.minute > cb->traffic.minute ? -1 : 1;
+    return strcmp(ca->key, cb->key);
+}
+
+static void sort_queue(app_t *app)
+{
+    list_t *queue = app->gui->joins.channels;
+    size_t count = list_size(queue);
+    channel_t **channels = fsalloc(count * sizeof *channels);
+    for (size_t i = 0; i < count; i++)
+        channels[i] = list_pop_first(queue);
+    qsort(channels, count, sizeof *channels, cmp_channels);
+    for (size_t i = 0; i < count; i++)
+        list_append(queue, channels[i]);
+    fsfree(channels);
+}
+
+FSTRACE_DECL(IRC_JOIN_TOO_LONG, "CHANNEL=%s");
+FSTRACE_DECL(IRC_JOIN_BATCH, "CHANNELS=%u LEFT=%z");
+
+static gboolean send_line(app_t *app)
+{
+    struct join_queue *joins = &app->gui->joins;
+    joins->timer = 0;
+    joins->staggered = false;
+    /* The windows may have changed since the last line. */
+    sort_queue(app);
+    static const size_t room = MAX_LINE - sizeof "JOIN \r\n" + 1;
+    char line[MAX_LINE];
+    size_t length = 0;
+    unsigned count = 0;
+    list_elem_t *e;
+    while ((e = list_get_first(joins->channels))) {
+        channel_t *channel = (channel_t *) list_elem_get_value(e);
+        size_t name_length = strlen(channel->name);
+        if (name_length > room) {
+            FSTRACE(IRC_JOIN_TOO_LONG, channel->name);
+            list_remove(joins->channels, e);
+            continue;
+        }
+        if (length + !!count + name_length > room)
+            break;
+        if (count)
+            line[length++] = ',';
+        memcpy(line + length, channel->name, name_length);
+        length += name_length;
+        count++;
+        list_remove(joins->channels, e);
+    }
+    line[length] = '\0';
+    FSTRACE(IRC_JOIN_BATCH, count, list_size(joins->channels));
+    if (count) {
+        emit(app, "JOIN ");
+        emit(app, line);
+        emit(app, "\r\n");
+    }
+    if (list_empty(joins->channels)) {
+        destroy_list(joins->channels);
+        joins->channels = NULL;
+        return G_SOURCE_REMOVE;
+    }
+    joins->timer = g_timeout_add(STAGGER_MS, G_SOURCE_FUNC(send_line), app);
+    joins->staggered = true;
+    return G_SOURCE_REMOVE;
+}
+
+void flush_joins(app_t *app)
+{
+    struct join_queue *joins = &app->gui->joins;
+    if (!joins->channels || joins->staggered)
+        return;
+    forget_timer(app);
+    send_line(app);
+}
+
+void queue_join(channel_t *channel)
+{
+    app_t *app = channel->app;
+    struct join_queue *joins = &app->gui->joins;
+    if (!joins->channels)
+        joins->channels = make_list();
+    for (list_elem_t *e = list_get_first(joins->channels); e;
+         e = list_next(e))
+        if (list_elem_get_value(e) == channel)
+            return;
+    list_append(joins->channels, channel);
+    if (!joins->timer)
+        joins->timer = g_idle_add(G_SOURCE_FUNC(send_line), app);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "lip.h"
+
+/* Channels are joined in batches. The JOINs queued during a turn of
+ * the main loop are packed into as few "JOIN a,b,c" lines as the
+ * message size limit allows. The channels whose windows are in use or
+ * that have seen recent traffic go first; the lines after the first
+ * one are sent at intervals so the flood of NAMES and topic replies
+ * stays within the server's limits and our rendering. */
+
+void queue_join(channel_t *channel);
+
+/* Send the first line of the queued JOINs now. */
+void flush_joins(app_t *app);
+
+/* Forget the queued JOINs, e.g., when the connection is lost. */
+void cancel_joins(app_t *app);
@@ -6,10 +6,12 @@
 #include <errno.h>
 #include <dirent.h>
 #include <assert.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include <glib-unix.h>
+#include <gio/gunixsocketaddress.h>
 
-#include <async/stringstream.h>
 #include <fsdyn/charstr.h>
 #include <fsdyn/list.h>
 #include <fstrace.h>
@@ -19,6 +21,15 @@
 #include "rpl.h"
 #include "util.h"
 #include "intl.h"
+#include "replay.h"
+#include "notify.h"
+#include "joins.h"
+#include "batch.h"
+#include "metrics.h"
+#include "net.h"
+#include "stage.h"
+#include "tracering.h"
+#include "watchdog.h"
 
 static const char *const APPLICATION_ID = "net.pacujo.lip";
 
@@ -35,6 +46,8 @@ static const char *trace_state(void *p)
             return "CONNECTING";
         case READY:
             return "READY";
+        case DISCONNECTED:
+            return "DISCONNECTED";
         case ZOMBIE:
             return "ZOMBIE";
         default:
@@ -50,275 +63,256 @@ static void set_state(app_t *app, state_t state)
     app->state = state;
 }
 
-static char *find_space(char *p)
+static void quit(app_t *app)
 {
-    while (*p && *p != ' ')
-        p++;
-    return p;
+    if (app->state == ZOMBIE)
+        return;
+    set_state(app, ZOMBIE);
+    if (app->gui->reconnect_timer) {
+        g_source_remove(app->gui->reconnect_timer);
+        app->gui->reconnect_timer = 0;
+    }
+    if (app->cache_writer)
+        cache_writer_flush(app->cache_writer);
+    g_application_quit(G_APPLICATION(app->gui->gapp));
 }
 
-static char *skip_space(char *p)
+/* Registration waits for CAP END if the server knows CAP; otherwise
+ * the CAP LS is just ignored. */
+static void log_in(app_t *app)
 {
-    while (*p == ' ')
-        p++;
-    return p;
+    app->caps.offered = app->caps.enabled = 0;
+    app->caps.negotiating = true;
+    emit(app, "CAP LS 302\r\n");
+    emit(app, "NICK ");
+    emit(app, app->config.nick);
+    emit(app, " \r\n");
+    emit(app, "USER ");
+    emit(app, app->config.nick);
+    emit(app, " 0 * :");
+    emit(app, app->config.name);
+    emit(app, "\r\n");
 }
 
-static char *split_off(char *p)
+/* Return false if there is nothing to join (name is a nick). */
+static bool join_channel(app_t *app, const char *name, bool autojoin)
 {
-    p = find_space(p);
-    char *q = skip_space(p);
-    *p = '\0';
-    return q;
+    channel_t *channel = open_channel(app, name, UINT_MAX, autojoin);
+    if (valid_nick(channel->name))
+        return false;
+    queue_join(channel);
+    return true;
 }
 
-static char *parse_prefix(char *p, const char **prefix)
+/* Return the number of JOINs sent. */
+static unsigned autojoin_channels(app_t *app)
 {
-    if (*p != ':') {
-        *prefix = NULL;
-        return p;
+    /* The channel windows are replayed together in a single pass over
+     * the cache. */
+    gint64 started = g_get_monotonic_time();
+    app->replay_batch = make_list();
+    unsigned count = 0;
+    for (avl_elem_t *ae = avl_tree_get_first(app->config.autojoins); ae;
+         ae = avl_tree_next(ae)) {
+        channel_id_t *chid = (channel_id_t *) avl_elem_get_value(ae);
+        if (join_channel(app, chid->name, true))
+            count++;
     }
-    *prefix = ++p;
-    return split_off(p);
+    list_t *channels = app->replay_batch;
+    app->replay_batch = NULL;
+    replay_autojoins(app, channels, started);
+    destroy_list(channels);
+    return count;
 }
 
-/* May return NULL. */
-static char *parse_command(char *p, const char **command)
+/* After a reconnect, the channels joined by hand are joined again as
+ * well. The channel state and windows have been kept. */
+static unsigned rejoin_channels(app_t *app)
 {
-    *command = p;
-    if (charstr_char_class(*p) & CHARSTR_DIGIT) {
-        p++;
-        if (!(charstr_char_class(*p++) & CHARSTR_DIGIT) ||
-            !(charstr_char_class(*p++) & CHARSTR_DIGIT))
-            return NULL;
-    } else {
-        if (!(charstr_char_class(*p++) & CHARSTR_ALPHA))
-            return NULL;
-        while (charstr_char_class(*p) & CHARSTR_ALPHA)
-            p++;
-    }
-    switch (*p) {
-        case '\0':
-            return p;
-        case ' ':
-            *p = '\0';
-            return skip_space(p + 1);
-        default:
-            return NULL;
+    unsigned count = autojoin_channels(app);
+    for (avl_elem_t *ae = avl_tree_get_first(app->channels); ae;
+         ae = avl_tree_next(ae)) {
+        channel_t *channel = (channel_t *) avl_elem_get_value(ae);
+        if (!channel->autojoin && join_channel(app, channel->name, false))
+            count++;
     }
+    return count;
 }
 
-FSTRACE_DECL(IRC_EMIT, "TEXT=%s");
+FSTRACE_DECL(IRC_RESUMED, "MS=%64u");
 
-void emit(app_t *app, const char *text)
+static void resumed(app_t *app)
 {
-    FSTRACE(IRC_EMIT, text);
-    stringstream_t *sstr = copy_stringstream(app->async, text);
-    queuestream_enqueue(app->outq, stringstream_as_bytestream_1(sstr));
+    uint64_t ms = (g_get_monotonic_time() - app->gui->dropped_at) /
+        G_TIME_SPAN_MILLISECOND;
+    FSTRACE(IRC_RESUMED, ms);
+    app->gui->dropped_at = 0;
+    metrics.reconnects++;
+    metrics.resume_ms = ms;
+    if (ms > metrics.max_resume_ms)
+        metrics.max_resume_ms = ms;
 }
 
-FSTRACE_DECL(IRC_ACT_ON, "MSG=%A");
-FSTRACE_DECL(IRC_ACT_ON_BAD_COMMAND, "");
-FSTRACE_DECL(IRC_ACT_ON_EMPTY_PARAM, "");
-
-static bool act_on_message(app_t *app, const char *cmd, size_t size)
+/* The address is tried first on the next start. */
+static void remember_address(app_t *app, const char *address)
 {
-    FSTRACE(IRC_ACT_ON, cmd, size);
-    char buf[size + 1];
-    memcpy(buf, cmd, size);
-    buf[size] = '\0';
-    char *p = buf;
-    const char *prefix;
-    p = parse_prefix(p, &prefix);
-    const char *command;
-    p = parse_command(p, &command);
-    if (!p) {
-        FSTRACE(IRC_ACT_ON_BAD_COMMAND);
-        return false;
-    }
-    list_t *params = make_list();
-    for (; *p != '\0' && *p != ':' && *p != ' '; p = split_off(p))
-        list_append(params, p);
-    switch (*p) {
-        case '\0':
-            break;
-        case ':':
-            list_append(params, ++p);
-            break;
-        default:
-            FSTRACE(IRC_ACT_ON_EMPTY_PARAM);
-            return false;
-    }
-    bool result = do_it(app, prefix, command, params);
-    destroy_list(params);
-    return result;
-}
-
-static void quit(app_t *app)
-{
-    if (app->state == ZOMBIE)
+    if (app->config.last_address &&
+        !strcmp(app->config.last_address, address))
         return;
-    set_state(app, ZOMBIE);
-    if (app->async)
-        async_quit_loop(app->async);
-    g_application_quit(G_APPLICATION(app->gui.gapp));
+    fsfree(app->config.last_address);
+    app->config.last_address = charstr_dupstr(address);
+    save_session(app);
 }
 
-FSTRACE_DECL(IRC_RECEIVE_FAIL, "ERR=%e");
-FSTRACE_DECL(IRC_RECEIVE_SPURIOUS, "");
-FSTRACE_DECL(IRC_RECEIVE_NUL, "");
-FSTRACE_DECL(IRC_RECEIVE_FAILED_ACT, "");
-FSTRACE_DECL(IRC_RECEIVE_AGAIN, "");
-FSTRACE_DECL(IRC_RECEIVE, "");
-FSTRACE_DECL(IRC_DISCONNECTED, "");
-FSTRACE_DECL(IRC_RECEIVED, "DATA=%A");
-FSTRACE_DECL(IRC_RECEIVE_OVERFLOW, "");
-
-static void receive(app_t *app)
+static void established(app_t *app)
 {
-    if (app->state != READY) {
-        FSTRACE(IRC_RECEIVE_SPURIOUS);
+    set_state(app, READY);
+    app->gui->reconnect_attempts = 0;
+    log_in(app);
+    if (!app->gui->dropped_at) {
+        autojoin_channels(app);
+        flush_joins(app);
         return;
     }
-    for (;;) {
-        ssize_t count =
-            bytestream_1_read(app->input, app->input_cursor,
-                              app->input_end - app->input_cursor);
-        if (count < 0) {
-            if (errno != EAGAIN) {
-                FSTRACE(IRC_RECEIVE_FAIL);
-                quit(app);
-                return;
-            }
-            FSTRACE(IRC_RECEIVE_AGAIN);
-            assert(errno == EAGAIN);
-            return;
-        }
-        if (count == 0) {
-            FSTRACE(IRC_DISCONNECTED);
-            quit(app);
-            return;
-        }
-        FSTRACE(IRC_RECEIVED, app->input_cursor, count);
-        char *base = app->input_buffer;
-        for (; count--; app->input_cursor++) {
-            if (!*app->input_cursor) {
-                FSTRACE(IRC_RECEIVE_NUL);
-                quit(app);
-                return;
-            }
-            if (*app->input_cursor == '\n' &&
-                app->input_cursor != base && app->input_cursor[-1] == '\r') {
-                if (!act_on_message(app, base, app->input_cursor - 1 - base)) {
-                    FSTRACE(IRC_RECEIVE_FAILED_ACT);
-                    quit(app);
-                    return;
-                }
-                base = app->input_cursor + 1;
-            }
-        }
-        size_t tail_size = app->input_cursor - base;
-        memmove(app->input_buffer, base, tail_size);
-        app->input_cursor = app->input_buffer + tail_size;
-        if (app->input_cursor == app->input_end) {
-            FSTRACE(IRC_RECEIVE_OVERFLOW);
-            quit(app);
-            return;
-        }
-    }
+    app->gui->rejoins_pending = rejoin_channels(app);
+    flush_joins(app);
+    if (!app->gui->rejoins_pending)
+        resumed(app);
 }
 
-static void log_in(app_t *app)
+/* A resume is complete when the server has confirmed every rejoin. */
+static void note_rejoin(app_t *app, const irc_message_t *msg)
 {
-    emit(app, "NICK ");
-    emit(app, app->config.nick);
-    emit(app, " \r\n");
-    emit(app, "USER ");
-    emit(app, app->config.nick);
-    emit(app, " 0 * :");
-    emit(app, app->config.name);
-    emit(app, "\r\n");
+    if (!app->gui->dropped_at || strcmp(msg->command, "JOIN") ||
+        !msg->prefix)
+        return;
+    const char *rest = charstr_skip_prefix(msg->prefix, app->config.nick);
+    if (rest && (*rest == '!' || *rest == '\0') &&
+        !--app->gui->rejoins_pending)
+        resumed(app);
 }
 
-static void join_channel(app_t *app, const char *name, bool autojoin)
+enum {
+    RECONNECT_MIN_MS = 1000,
+    RECONNECT_MAX_MS = 5 * 60 * 1000,
+};
+
+static void connect_to_irc_server(app_t *app);
+
+static gboolean reconnect(app_t *app)
 {
-    channel_t *channel = open_channel(app, name, UINT_MAX, autojoin);
-    if (valid_nick(channel->name))
-        return;
-    emit(app, "JOIN ");
-    emit(app, channel->name);
-    emit(app, "\r\n");
+    app->gui->reconnect_timer = 0;
+    connect_to_irc_server(app);
+    return G_SOURCE_REMOVE;
 }
 
-static void autojoin_channels(app_t *app)
+FSTRACE_DECL(IRC_RECONNECT_SCHEDULED, "ATTEMPT=%u MS=%u");
+
+/* The delay doubles with every failed attempt up to a limit; the
+ * actual delay is drawn from its upper half to spread out clients
+ * that lost the same server. */
+static void schedule_reconnect(app_t *app)
 {
-    for (avl_elem_t *ae = avl_tree_get_first(app->config.autojoins); ae;
-         ae = avl_tree_next(ae)) {
-        channel_id_t *chid = (channel_id_t *) avl_elem_get_value(ae);
-        join_channel(app, chid->name, true);
-    }
+    unsigned attempt = app->gui->reconnect_attempts++;
+    unsigned ceiling = RECONNECT_MAX_MS;
+    if (attempt < 16 && RECONNECT_MIN_MS << attempt < RECONNECT_MAX_MS)
+        ceiling = RECONNECT_MIN_MS << attempt;
+    unsigned ms = ceiling / 2 + g_random_int_range(0, ceiling / 2 + 1);
+    FSTRACE(IRC_RECONNECT_SCHEDULED, attempt, ms);
+    char *line = charstr_printf(_("Disconnected; reconnecting in %.1f s"),
+                                ms / 1000.0);
+    sink_1_log_line(app->sink, "log", line);
+    fsfree(line);
+    app->gui->reconnect_timer =
+        g_timeout_add(ms, G_SOURCE_FUNC(reconnect), app);
 }
 
-FSTRACE_DECL(IRC_ESTABLISH_FAIL, "ERR=%e");
-FSTRACE_DECL(IRC_ESTABLISH_SPURIOUS, "");
-FSTRACE_DECL(IRC_ESTABLISH_AGAIN, "");
-FSTRACE_DECL(IRC_ESTABLISHED, "");
-
-static void establish(app_t *app)
+static void connection_lost(app_t *app)
 {
-    if (app->state != CONNECTING) {
-        FSTRACE(IRC_ESTABLISH_SPURIOUS);
+    cancel_joins(app);
+    discard_batches(app);
+    destroy_net(app->net);
+    app->net = NULL;
+    if (app->state == ZOMBIE)
         return;
-    }
-    app->tcp_conn = tcp_client_establish(app->client);
-    if (!app->tcp_conn) {
-        if (errno != EAGAIN) {
-            FSTRACE(IRC_ESTABLISH_FAIL);
-            set_state(app, ZOMBIE);
-            async_quit_loop(app->async);
-            return;
+    if (app->state == READY && !app->gui->dropped_at)
+        app->gui->dropped_at = g_get_monotonic_time();
+    set_state(app, DISCONNECTED);
+    schedule_reconnect(app);
+}
+
+FSTRACE_DECL(IRC_NET_EVENT, "TYPE=%d");
+
+static gboolean take_net_events(gint fd, GIOCondition condition, app_t *app)
+{
+    net_event_t *event;
+    while ((event = net_next_event(app->net))) {
+        FSTRACE(IRC_NET_EVENT, event->type);
+        net_event_type_t type = event->type;
+        switch (type) {
+            case NET_ESTABLISHED:
+                remember_address(app, event->address);
+                established(app);
+                break;
+            case NET_PONG:
+                count_lag(event->rtt_us,
+                          g_get_monotonic_time() - event->ping_sent);
+                update_main_title(app);
+                break;
+            case NET_MESSAGE: {
+                const char *outer = enter_section("dispatch");
+                dispatch_message(app, event->message);
+                note_rejoin(app, event->message);
+                leave_section(outer);
+                break;
+            }
+            default:
+                break;
+        }
+        destroy_net_event(event);
+        if (type == NET_FAILED || type == NET_CLOSED) {
+            connection_lost(app);
+            return G_SOURCE_REMOVE;
         }
-        FSTRACE(IRC_ESTABLISH_AGAIN);
-        return;
-    }
-    FSTRACE(IRC_ESTABLISHED);
-    tcp_client_close(app->client);
-    set_state(app, READY);
-    app->input_cursor = app->input_buffer;
-    app->input_end = app->input_buffer + sizeof app->input_buffer;
-    app->outq = make_queuestream(app->async);
-    bytestream_1 plain_output = queuestream_as_bytestream_1(app->outq);
-    bytestream_1 tcp_input = tcp_get_input_stream(app->tcp_conn);
-    if (app->config.use_tls) {
-        app->tls_conn =
-            open_tls_client_2(app->async, tcp_input, TLS_SYSTEM_CA_BUNDLE,
-                              app->config.server);
-        tcp_set_output_stream(app->tcp_conn,
-                              tls_get_encrypted_output_stream(app->tls_conn));
-        tls_set_plain_output_stream(app->tls_conn, plain_output);
-        app->input = tls_get_plain_input_stream(app->tls_conn);
-    } else {
-        app->tls_conn = NULL;
-        tcp_set_output_stream(app->tcp_conn, plain_output);
-        app->input = tcp_input;
     }
-    action_1 receive_cb = { app, (act_1) receive };
-    bytestream_1_register_callback(app->input, receive_cb);
-    async_execute(app->async, receive_cb);
-    log_in(app);
-    autojoin_channels(app);
+    return G_SOURCE_CONTINUE;
 }
 
-FSTRACE_DECL(IRC_POLL_ASYNC, "");
+FSTRACE_DECL(IRC_DUMP_TRACE_RING, "");
 
-static gboolean poll_async(gint fd, GIOCondition condition, app_t *app)
+static gboolean dump_trace_ring_to_stderr(app_t *app)
 {
-    FSTRACE(IRC_POLL_ASYNC);
-    return async_poll_2(app->async) >= 0 ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+    FSTRACE(IRC_DUMP_TRACE_RING);
+    dump_trace_ring(STDERR_FILENO);
+    return G_SOURCE_CONTINUE;
+}
+
+/* With --trace-ring, the hot events are recorded in binary and
+ * fstrace writes the rest into the ring as text. */
+static bool init_trace_ring(app_t *app)
+{
+    if (!open_trace_ring(app->opts.trace_ring_size, app->opts.trace_sample,
+                         app->opts.trace_include, app->opts.trace_exclude))
+        return false;
+    char *exclude;
+    if (app->opts.trace_exclude)
+        exclude = charstr_printf("(%s)|%s", app->opts.trace_exclude,
+                                 TRACE_RING_NATIVE_EVENTS);
+    else exclude = charstr_dupstr(TRACE_RING_NATIVE_EVENTS);
+    fstrace_t *trace = fstrace_direct(trace_ring_stream());
+    fstrace_declare_globals(trace);
+    fstrace_select_regex(trace, app->opts.trace_include, exclude);
+    fsfree(exclude);
+    dump_trace_ring_on_crash();
+    g_unix_signal_add(SIGUSR2, G_SOURCE_FUNC(dump_trace_ring_to_stderr),
+                      app);
+    return true;
 }
 
 static void init_tracing(app_t *app)
 {
+    if (app->opts.trace_ring_size && init_trace_ring(app))
+        return;
     fstrace_t *trace = fstrace_direct(stderr);
     fstrace_declare_globals(trace);
     fstrace_select_regex(trace, app->opts.trace_include,
@@ -327,22 +321,15 @@ static void init_tracing(app_t *app)
 
 static void connect_to_irc_server(app_t *app)
 {
-    app->client =
-        open_tcp_client(app->async, app->config.server, app->config.port);
-    action_1 establish_cb = { app, (act_1) establish };
-    tcp_client_register_callback(app->client, establish_cb);
-    async_execute(app->async, establish_cb);
+    app->net = make_net(app->config.server, app->config.port,
+                        app->config.use_tls, app->opts.ca_bundle,
+                        app->config.last_address,
+                        app->opts.dead_peer_s);
+    g_unix_fd_add(net_event_fd(app->net), G_IO_IN,
+                  (GUnixFDSourceFunc) take_net_events, app);
     set_state(app, CONNECTING);
 }
 
-static void attach_async_to_gtk(app_t *app)
-{
-    GSource *source = g_unix_fd_source_new(async_fd(app->async), G_IO_IN);
-    g_source_set_callback(source, G_SOURCE_FUNC(poll_async), app, NULL);
-    g_source_attach(source, NULL);
-    async_poll_2(app->async);
-}
-
 static double get_pixel_width(GdkRectangle *geometry)
 {
     GdkMonitor *monitor =
@@ -397,60 +384,23 @@ static bool valid_channel_name(const char *name)
         }
 }
 
-static channel_t *make_channel(app_t *app, const gchar *name, bool autojoin)
-{
-    channel_t *channel = fsalloc(sizeof *channel);
-    channel->app = app;
-    channel->key = lcase_string(name);
-    channel->name = charstr_dupstr(name);
-    channel->autojoin = autojoin;
-    channel->window = NULL;
-    channel->nicks_present = make_list();
-    time_t t0 = 0;
-    localtime_r(&t0, &channel->timestamp);
-    furnish_channel(channel);
-    return channel;
-}
-
-static void destroy_channel(channel_t *channel)
-{
-    fsfree(channel->key);
-    fsfree(channel->name);
-    list_foreach(channel->nicks_present, (void *) fsfree, NULL);
-    destroy_list(channel->nicks_present);
-    fsfree(channel);
-}
-
-channel_t *open_channel(app_t *app, const gchar *name, unsigned limit,
-                        bool autojoin)
-{
-    channel_t *channel = get_channel(app, name);
-    if (channel)
-        return channel;
-    if (avl_tree_size(app->channels) >= limit)
-        return NULL;
-    channel = make_channel(app, name, autojoin);
-    avl_tree_put(app->channels, channel->key, channel);
-    return channel;
-}
-
 static void join_ok_response(app_t *app)
 {
-    const gchar *text = gtk_entry_get_text(GTK_ENTRY(app->gui.join_channel));
+    const gchar *text = gtk_entry_get_text(GTK_ENTRY(app->gui->join_channel));
     if (!valid_nick(text) && !valid_channel_name(text)) {
         modal_error_dialog(ensure_main_window(app),
                            _("Bad nick or channel name"));
         return;
     }
     join_channel(app, text, false);
-    gtk_widget_destroy(app->gui.join_dialog);
-    app->gui.join_dialog = NULL;
+    gtk_widget_destroy(app->gui->join_dialog);
+    app->gui->join_dialog = NULL;
 }
 
 static void join_cancel_response(app_t *app)
 {
-    gtk_widget_destroy(app->gui.join_dialog);
-    app->gui.join_dialog = NULL;
+    gtk_widget_destroy(app->gui->join_dialog);
+    app->gui->join_dialog = NULL;
 }
 
 static void join_response(app_t *app, gint response_id)
@@ -516,7 +466,7 @@ static void join_dialog_select_row(GtkListBox *, GtkListBoxRow *row, app_t *app)
     GList *children = gtk_container_get_children(GTK_CONTAINER(row));
     GtkWidget *label = g_list_first(children)->data;
     g_list_free(children);
-    gtk_entry_set_text(GTK_ENTRY(app->gui.join_channel), 
+    gtk_entry_set_text(GTK_ENTRY(app->gui->join_channel), 
                        gtk_label_get_label(GTK_LABEL(label)));
 }
 
@@ -553,32 +503,542 @@ static void join_activated(GSimpleAction *action, GVariant *parameter,
                            gpointer user_data)
 {
     app_t *app = user_data;
-    if (app->gui.join_dialog) {
+    if (app->gui->join_dialog) {
         gtk_window_present(GTK_WINDOW(ensure_main_window(app)));
         return;
     }
-    app->gui.join_dialog =
+    app->gui->join_dialog =
         gtk_dialog_new_with_buttons(_("Join Channel"),
                                     GTK_WINDOW(ensure_main_window(app)),
                                     GTK_DIALOG_DESTROY_WITH_PARENT,
                                     _("_Cancel"), GTK_RESPONSE_CANCEL,
                                     _("_OK"), GTK_RESPONSE_OK,
                                     NULL);
-    g_signal_connect_swapped(app->gui.join_dialog, "response",
+    g_signal_connect_swapped(app->gui->join_dialog, "response",
                              G_CALLBACK(join_response), app);
     GtkWidget *content_area =
-        gtk_dialog_get_content_area(GTK_DIALOG(app->gui.join_dialog));
-    app->gui.join_channel = entry_cell(content_area, _("Channel"), "");
+        gtk_dialog_get_content_area(GTK_DIALOG(app->gui->join_dialog));
+    app->gui->join_channel = entry_cell(content_area, _("Channel"), "");
     channels_gui(app, content_area);
-    g_signal_connect(app->gui.join_dialog, "key_press_event",
+    g_signal_connect(app->gui->join_dialog, "key_press_event",
                      G_CALLBACK(join_dialog_key_press), app);
-    gtk_widget_show_all(app->gui.join_dialog);
+    gtk_widget_show_all(app->gui->join_dialog);
+}
+
+static void search_dialog_destroyed(GtkWidget *, app_t *app)
+{
+    app->gui->search_dialog = NULL;
+    if (app->gui->search_timer) {
+        g_source_remove(app->gui->search_timer);
+        app->gui->search_timer = 0;
+    }
+    app->gui->search_generation++;
+    app->gui->context_generation++;
+}
+
+/* Control characters are dropped; color digits are left in place. */
+static char *plain_text(const char *text)
+{
+    char *plain = charstr_dupstr(text);
+    char *p = plain, *q = plain;
+    while (*p)
+        if (charstr_char_class(*p) & CHARSTR_CONTROL)
+            p++;
+        else *q++ = *p++;
+    *q = '\0';
+    return plain;
+}
+
+static GtkWidget *search_hit_row(search_hit_t *hit)
+{
+    struct tm tm;
+    localtime_r(&hit->t, &tm);
+    char stamp[30];
+    strftime(stamp, sizeof stamp, "(%F %R)", &tm);
+    char *text = plain_text(hit->text);
+    char *summary;
+    if (hit->from)
+        summary = charstr_printf("%s %s %s>%s", stamp, hit->channel_key,
+                                 hit->from, text);
+    else summary = charstr_printf("%s %s %s", stamp, hit->channel_key, text);
+    fsfree(text);
+    GtkWidget *label = gtk_label_new(summary);
+    fsfree(summary);
+    gtk_label_set_ellipsize(GTK_LABEL(label), PANGO_ELLIPSIZE_END);
+    gtk_widget_set_halign(label, GTK_ALIGN_START);
+    GtkWidget *row = gtk_list_box_row_new();
+    gtk_container_add(GTK_CONTAINER(row), label);
+    g_object_set_data_full(G_OBJECT(row), "hit", hit,
+                           (GDestroyNotify) destroy_search_hit);
+    return row;
+}
+
+enum {
+    SEARCH_DELAY_MS = 250,      /* after the last keystroke */
+    MAX_SEARCH_HITS = 100,
+    CONTEXT_BEFORE = 10,
+    CONTEXT_AFTER = 10,
+};
+
+/* A query or, if hit is not NULL, a context fetch. */
+typedef struct {
+    app_t *app;
+    unsigned generation;
+    char *directory, *query;
+    search_hit_t *hit;
+    list_t *hits;               /* of search_hit_t */
+} search_job_t;
+
+static void destroy_search_job(search_job_t *job)
+{
+    if (job->hits) {
+        list_foreach(job->hits, (void *) destroy_search_hit, NULL);
+        destroy_list(job->hits);
+    }
+    if (job->hit)
+        destroy_search_hit(job->hit);
+    fsfree(job->directory);
+    fsfree(job->query);
+    fsfree(job);
+}
+
+/* Results of superseded queries are dropped. */
+static gboolean show_search_hits(gpointer data)
+{
+    search_job_t *job = data;
+    app_t *app = job->app;
+    if (job->generation == app->gui->search_generation) {
+        GtkWidget *listbox = app->gui->search_results;
+        GList *children =
+            gtk_container_get_children(GTK_CONTAINER(listbox));
+        for (GList *child = children; child; child = child->next)
+            gtk_widget_destroy(child->data);
+        g_list_free(children);
+        GtkTextBuffer *buffer =
+            gtk_text_view_get_buffer(
+                GTK_TEXT_VIEW(app->gui->search_context));
+        gtk_text_buffer_set_text(buffer, "", -1);
+        app->gui->context_generation++;
+        while (!list_empty(job->hits)) {
+            search_hit_t *hit = (search_hit_t *) list_pop_first(job->hits);
+            gtk_list_box_insert(GTK_LIST_BOX(listbox), search_hit_row(hit),
+                                -1);
+        }
+        gtk_widget_show_all(listbox);
+    }
+    destroy_search_job(job);
+    return G_SOURCE_REMOVE;
+}
+
+/* The context of a hit that is no longer selected is dropped. */
+static gboolean show_search_context(gpointer data)
+{
+    search_job_t *job = data;
+    app_t *app = job->app;
+    if (job->generation == app->gui->context_generation) {
+        GtkTextBuffer *buffer =
+            gtk_text_view_get_buffer(
+                GTK_TEXT_VIEW(app->gui->search_context));
+        gtk_text_buffer_set_text(buffer, "", -1);
+        for (list_elem_t *e = list_get_first(job->hits); e;
+             e = list_next(e)) {
+            const search_hit_t *line = list_elem_get_value(e);
+            struct tm tm;
+            localtime_r(&line->t, &tm);
+            char stamp[30];
+            strftime(stamp, sizeof stamp, "(%F %R) ", &tm);
+            append_text(buffer, stamp, NULL);
+            if (line->from) {
+                append_text(buffer, line->from, NULL);
+                append_text(buffer, ">", NULL);
+            }
+            bool is_hit = line->position.frame == job->hit->position.frame &&
+                line->position.offset == job->hit->position.offset;
+            append_text(buffer, line->text, is_hit ? "mine" : line->tag);
+            append_text(buffer, "\n", NULL);
+        }
+    }
+    destroy_search_job(job);
+    return G_SOURCE_REMOVE;
+}
+
+/* Called in the search thread. */
+static void run_search(gpointer data, gpointer user_data)
+{
+    search_job_t *job = data;
+    if (job->hit) {
+        job->hits = search_hit_context(job->app->search_index, job->hit,
+                                       CONTEXT_BEFORE, CONTEXT_AFTER);
+        g_idle_add(show_search_context, job);
+        return;
+    }
+    job->hits = search_index_query(job->app->search_index, job->directory,
+                                   job->query, MAX_SEARCH_HITS);
+    g_idle_add(show_search_hits, job);
+}
+
+static void push_search_job(app_t *app, search_job_t *job)
+{
+    if (!app->gui->searcher)
+        /* A single thread keeps the jobs in order. */
+        app->gui->searcher =
+            g_thread_pool_new(run_search, NULL, 1, FALSE, NULL);
+    g_thread_pool_push(app->gui->searcher, job, NULL);
+}
+
+static gboolean start_search(app_t *app)
+{
+    app->gui->search_timer = 0;
+    search_job_t *job = fsalloc(sizeof *job);
+    job->app = app;
+    job->generation = app->gui->search_generation;
+    job->directory = charstr_dupstr(app->config.cache_directory);
+    job->query =
+        charstr_dupstr(gtk_entry_get_text(GTK_ENTRY(app->gui->search_entry)));
+    job->hit = NULL;
+    job->hits = NULL;
+    push_search_job(app, job);
+    return G_SOURCE_REMOVE;
+}
+
+static void search_changed(GtkSearchEntry *entry, app_t *app)
+{
+    app->gui->search_generation++;
+    if (app->gui->search_timer)
+        g_source_remove(app->gui->search_timer);
+    app->gui->search_timer =
+        g_timeout_add(SEARCH_DELAY_MS, G_SOURCE_FUNC(start_search), app);
+}
+
+static void search_hit_activated(GtkListBox *, GtkListBoxRow *row,
+                                 app_t *app)
+{
+    search_hit_t *hit = g_object_get_data(G_OBJECT(row), "hit");
+    GtkTextBuffer *buffer =
+        gtk_text_view_get_buffer(GTK_TEXT_VIEW(app->gui->search_context));
+    gtk_text_buffer_set_text(buffer, "", -1);
+    search_job_t *job = fsalloc(sizeof *job);
+    job->app = app;
+    job->generation = ++app->gui->context_generation;
+    job->directory = job->query = NULL;
+    job->hit = copy_search_hit(hit);
+    job->hits = NULL;
+    push_search_job(app, job);
+    channel_t *channel = get_channel(app, hit->channel_key);
+    if (channel) {
+        furnish_channel(channel);
+        gtk_window_present(GTK_WINDOW(channel->gui->window));
+    }
+}
+
+static GtkWidget *scrolled(GtkWidget *child)
+{
+    GtkWidget *sw = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(sw),
+                                   GTK_POLICY_AUTOMATIC,
+                                   GTK_POLICY_AUTOMATIC);
+    gtk_container_add(GTK_CONTAINER(sw), child);
+    return sw;
+}
+
+static void search_activated(GSimpleAction *action, GVariant *parameter,
+                             gpointer user_data)
+{
+    app_t *app = user_data;
+    if (!app->search_index)
+        return;
+    if (app->gui->search_dialog) {
+        gtk_window_present(GTK_WINDOW(app->gui->search_dialog));
+        gtk_widget_grab_focus(app->gui->search_entry);
+        return;
+    }
+    app->gui->search_dialog =
+        gtk_dialog_new_with_buttons(_("Search"),
+                                    GTK_WINDOW(ensure_main_window(app)),
+                                    GTK_DIALOG_DESTROY_WITH_PARENT,
+                                    _("_Close"), GTK_RESPONSE_CLOSE,
+                                    NULL);
+    gtk_window_set_default_size(GTK_WINDOW(app->gui->search_dialog),
+                                app->gui->default_width,
+                                app->gui->default_height);
+    g_signal_connect(app->gui->search_dialog, "response",
+                     G_CALLBACK(gtk_widget_destroy), NULL);
+    g_signal_connect(app->gui->search_dialog, "destroy",
+                     G_CALLBACK(search_dialog_destroyed), app);
+    GtkWidget *content_area =
+        gtk_dialog_get_content_area(GTK_DIALOG(app->gui->search_dialog));
+    app->gui->search_entry = gtk_search_entry_new();
+    add_margin(app->gui->search_entry);
+    gtk_box_pack_start(GTK_BOX(content_area), app->gui->search_entry,
+                       FALSE, FALSE, 0);
+    g_signal_connect(app->gui->search_entry, "search-changed",
+                     G_CALLBACK(search_changed), app);
+    GtkWidget *paned = gtk_paned_new(GTK_ORIENTATION_VERTICAL);
+    gtk_box_pack_start(GTK_BOX(content_area), paned, TRUE, TRUE, 0);
+    app->gui->search_results = gtk_list_box_new();
+    gtk_list_box_set_activate_on_single_click(
+        GTK_LIST_BOX(app->gui->search_results), FALSE);
+    g_signal_connect(app->gui->search_results, "row-activated",
+                     G_CALLBACK(search_hit_activated), app);
+    gtk_paned_pack1(GTK_PANED(paned), scrolled(app->gui->search_results),
+                    TRUE, FALSE);
+    app->gui->search_context = build_passive_text_view();
+    gtk_paned_pack2(GTK_PANED(paned), scrolled(app->gui->search_context),
+                    TRUE, FALSE);
+    gtk_widget_show_all(app->gui->search_dialog);
+    gtk_widget_grab_focus(app->gui->search_entry);
+}
+
+static char *format_diagnostics(app_t *app)
+{
+    list_t *lines = make_list();
+    list_append(lines,
+                charstr_printf(_("Messages received: %llu\n"
+                                 "Bytes received: %llu\n"
+                                 "Bytes sent: %llu\n"
+                                 "Allocations: %llu\n\n"),
+                               (unsigned long long)
+                               atomic_load(&metrics.messages),
+                               (unsigned long long)
+                               atomic_load(&metrics.bytes_received),
+                               (unsigned long long)
+                               atomic_load(&metrics.bytes_sent),
+                               (unsigned long long)
+                               atomic_load(&metrics.allocations)));
+    if (metrics.reconnects)
+        list_append(lines,
+                    charstr_printf(_("Reconnects: %llu (last resume %llu ms, "
+                                     "slowest %llu ms)\n\n"),
+                                   (unsigned long long) metrics.reconnects,
+                                   (unsigned long long) metrics.resume_ms,
+                                   (unsigned long long)
+                                   metrics.max_resume_ms));
+    if (metrics.lag.samples) {
+        list_append(lines,
+                    charstr_printf(_("Lag: %llu ms to the server, %llu ms "
+                                     "locally (%llu samples)\n"),
+                                   (unsigned long long)
+                                   metrics.lag.rtt_us / 1000,
+                                   (unsigned long long)
+                                   metrics.lag.local_us / 1000,
+                                   (unsigned long long)
+                                   metrics.lag.samples));
+        for (unsigned i = 0; i < LAG_BUCKETS; i++)
+            if (metrics.lag.buckets[i])
+                list_append(lines,
+                            i < LAG_BUCKETS - 1 ?
+                            charstr_printf("  < %6llu ms %10llu\n",
+                                           (unsigned long long)
+                                           lag_bucket_ceiling_ms(i),
+                                           (unsigned long long)
+                                           metrics.lag.buckets[i]) :
+                            charstr_printf("  ≥ %6llu ms %10llu\n",
+                                           (unsigned long long)
+                                           lag_bucket_ceiling_ms(i - 1),
+                                           (unsigned long long)
+                                           metrics.lag.buckets[i]));
+        list_append(lines, charstr_dupstr("\n"));
+    }
+    if (atomic_load(&metrics.tls_connections))
+        list_append(lines,
+                    charstr_printf(_("TLS connections: %llu "
+                                     "(last %llu ms to the first data)\n\n"),
+                                   (unsigned long long)
+                                   atomic_load(&metrics.tls_connections),
+                                   (unsigned long long)
+                                   atomic_load(&metrics.tls_first_data_ms)));
+    list_append(lines,
+                charstr_printf("%-10s %10s %9s %9s %9s %9s %9s\n",
+                               _("Stage"), _("Count"), _("Mean µs"),
+                               "p50", "p99", "p99.9", _("Max")));
+    for (stage_t stage = 0; stage < STAGE_COUNT; stage++) {
+        stage_stats_t stats;
+        get_stage_stats(stage, &stats);
+        double mean = stats.count ? (double) stats.ns / stats.count : 0;
+        list_append(lines,
+                    charstr_printf("%-10s %10llu %9.1f %9.1f %9.1f %9.1f "
+                                   "%9.1f\n",
+                                   stage_name(stage),
+                                   (unsigned long long) stats.count,
+                                   mean / 1e3,
+                                   stage_percentile(&stats, 0.5) / 1e3,
+                                   stage_percentile(&stats, 0.99) / 1e3,
+                                   stage_percentile(&stats, 0.999) / 1e3,
+                                   stats.max_ns / 1e3));
+    }
+    list_append(lines,
+                charstr_printf("\n%-20s %10s %10s\n", _("Channel"),
+                               _("Messages"), _("Last min")));
+    for (avl_elem_t *ae = avl_tree_get_first(app->channels); ae;
+         ae = avl_tree_next(ae)) {
+        channel_t *channel = (channel_t *) avl_elem_get_value(ae);
+        list_append(lines,
+                    charstr_printf("%-20s %10llu %10u\n", channel->name,
+                                   (unsigned long long)
+                                   channel->traffic.messages,
+                                   channel_messages_last_minute(channel)));
+    }
+    list_t *stalls = get_stalls();
+    if (!list_empty(stalls))
+        list_append(lines, charstr_printf("\n%s\n", _("Recent stalls:")));
+    while (!list_empty(stalls)) {
+        stall_t *stall = (stall_t *) list_pop_first(stalls);
+        struct tm tm;
+        localtime_r(&stall->t, &tm);
+        char when[20];
+        strftime(when, sizeof when, "%T", &tm);
+        list_append(lines,
+                    charstr_printf("%s %6llu ms %s\n    %s\n", when,
+                                   (unsigned long long) stall->ms,
+                                   stall->section ? stall->section : "-",
+                                   stall->backtrace ? stall->backtrace : "-"));
+        destroy_stall(stall);
+    }
+    destroy_list(stalls);
+    char *text = charstr_join("", lines);
+    list_foreach(lines, (void *) fsfree, NULL);
+    destroy_list(lines);
+    return text;
+}
+
+static gboolean refresh_diagnostics(app_t *app)
+{
+    char *text = format_diagnostics(app);
+    GtkTextBuffer *buffer =
+        gtk_text_view_get_buffer(GTK_TEXT_VIEW(app->gui->diagnostics_view));
+    gtk_text_buffer_set_text(buffer, text, -1);
+    fsfree(text);
+    return G_SOURCE_CONTINUE;
+}
+
+static void diagnostics_dialog_destroyed(GtkWidget *, app_t *app)
+{
+    g_source_remove(app->gui->diagnostics_refresh);
+    app->gui->diagnostics_dialog = NULL;
+}
+
+static void diagnostics_activated(GSimpleAction *action, GVariant *parameter,
+                                  gpointer user_data)
+{
+    app_t *app = user_data;
+    if (app->gui->diagnostics_dialog) {
+        gtk_window_present(GTK_WINDOW(app->gui->diagnostics_dialog));
+        return;
+    }
+    enable_metrics();
+    app->gui->diagnostics_dialog =
+        gtk_dialog_new_with_buttons(_("Diagnostics"),
+                                    GTK_WINDOW(ensure_main_window(app)),
+                                    GTK_DIALOG_DESTROY_WITH_PARENT,
+                                    _("_Close"), GTK_RESPONSE_CLOSE,
+                                    NULL);
+    gtk_window_set_default_size(GTK_WINDOW(app->gui->diagnostics_dialog),
+                                app->gui->default_width,
+                                app->gui->default_height / 2);
+    g_signal_connect(app->gui->diagnostics_dialog, "response",
+                     G_CALLBACK(gtk_widget_destroy), NULL);
+    g_signal_connect(app->gui->diagnostics_dialog, "destroy",
+                     G_CALLBACK(diagnostics_dialog_destroyed), app);
+    GtkWidget *content_area =
+        gtk_dialog_get_content_area(GTK_DIALOG(app->gui->diagnostics_dialog));
+    app->gui->diagnostics_view = gtk_text_view_new();
+    gtk_text_view_set_monospace(GTK_TEXT_VIEW(app->gui->diagnostics_view),
+                                TRUE);
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(app->gui->diagnostics_view),
+                               FALSE);
+    gtk_text_view_set_cursor_visible(
+        GTK_TEXT_VIEW(app->gui->diagnostics_view), FALSE);
+    add_margin(app->gui->diagnostics_view);
+    gtk_box_pack_start(GTK_BOX(content_area),
+                       scrolled(app->gui->diagnostics_view), TRUE, TRUE, 0);
+    refresh_diagnostics(app);
+    app->gui->diagnostics_refresh =
+        g_timeout_add_seconds(1, G_SOURCE_FUNC(refresh_diagnostics), app);
+    gtk_widget_show_all(app->gui->diagnostics_dialog);
+}
+
+FSTRACE_DECL(IRC_METRICS_DUMP, "");
+
+static gboolean dump_metrics_to_stderr(app_t *app)
+{
+    FSTRACE(IRC_METRICS_DUMP);
+    enable_metrics();
+    json_thing_t *dump = dump_metrics(app);
+    json_utf8_dump(dump, stderr);
+    fputc('\n', stderr);
+    json_destroy_thing(dump);
+    return G_SOURCE_CONTINUE;
+}
+
+FSTRACE_DECL(IRC_METRICS_SERVE, "");
+FSTRACE_DECL(IRC_METRICS_SERVE_FAIL, "ERR=%s");
+
+/* Each connection to the metrics socket gets a JSON dump. */
+static gboolean serve_metrics(GSocketService *, GSocketConnection *conn,
+                              GObject *, app_t *app)
+{
+    FSTRACE(IRC_METRICS_SERVE);
+    enable_metrics();
+    json_thing_t *dump = dump_metrics(app);
+    char *text;
+    size_t size;
+    FILE *f = open_memstream(&text, &size);
+    json_utf8_dump(dump, f);
+    fputc('\n', f);
+    fclose(f);
+    json_destroy_thing(dump);
+    GOutputStream *output =
+        g_io_stream_get_output_stream(G_IO_STREAM(conn));
+    GError *error = NULL;
+    if (!g_output_stream_write_all(output, text, size, NULL, NULL, &error)) {
+        FSTRACE(IRC_METRICS_SERVE_FAIL, error->message);
+        g_error_free(error);
+    }
+    free(text);
+    g_io_stream_close(G_IO_STREAM(conn), NULL, NULL);
+    return TRUE;
+}
+
+FSTRACE_DECL(IRC_METRICS_LISTEN_FAIL, "PATH=%s ERR=%s");
+
+static void serve_metrics_on_signal_and_socket(app_t *app)
+{
+    g_unix_signal_add(SIGUSR1, G_SOURCE_FUNC(dump_metrics_to_stderr), app);
+    if (!app->opts.metrics_socket)
+        return;
+    unlink(app->opts.metrics_socket);
+    GSocketAddress *address =
+        g_unix_socket_address_new(app->opts.metrics_socket);
+    GSocketService *service = g_socket_service_new();
+    GError *error = NULL;
+    if (!g_socket_listener_add_address(G_SOCKET_LISTENER(service), address,
+                                       G_SOCKET_TYPE_STREAM,
+                                       G_SOCKET_PROTOCOL_DEFAULT,
+                                       NULL, NULL, &error)) {
+        FSTRACE(IRC_METRICS_LISTEN_FAIL, app->opts.metrics_socket,
+                error->message);
+        fprintf(stderr, PROGRAM ": %s: %s\n", app->opts.metrics_socket,
+                error->message);
+        g_error_free(error);
+        g_object_unref(service);
+    } else {
+        g_signal_connect(service, "incoming", G_CALLBACK(serve_metrics),
+                         app);
+        app->gui->metrics_service = service;
+    }
+    g_object_unref(address);
+}
+
+static void dump_trace_activated(GSimpleAction *action, GVariant *parameter,
+                                 gpointer user_data)
+{
+    dump_trace_ring_to_stderr(user_data);
 }
 
 static void accelerate(app_t *app, const gchar *action, const gchar *accel)
 {
     const gchar *accels[] = { accel, NULL };
-    gtk_application_set_accels_for_action(GTK_APPLICATION(app->gui.gapp),
+    gtk_application_set_accels_for_action(GTK_APPLICATION(app->gui->gapp),
                                           action, accels);
 }
 
@@ -656,99 +1116,100 @@ static char *interface(char *entries)
     return xml_tagged(entries, "interface", NULL);
 }
 
+static const char *const FOREGROUND_LABELS[16] = {
+    "White Text(0)", "Black Text(1)", "Blue Text(2)", "Green Text(3)",
+    "Red Text(4)", "Brown Text(5)", "Purple Text(6)", "Orange Text(7)",
+    "Yellow Text(8)", "Light Green Text(9)", "Cyan Text(10)",
+    "Light Cyan Text(11)", "Light Blue Text(12)", "Pink Text(13)",
+    "Grey Text(14)", "Light Grey Text(15)",
+};
+
+static const char *const BACKGROUND_LABELS[16] = {
+    "on White(0)", "on Black(1)", "on Blue(2)", "on Green(3)", "on Red(4)",
+    "on Brown(5)", "on Purple(6)", "on Orange(7)", "on Yellow(8)",
+    "on Light Green(9)", "on Cyan(10)", "on Light Cyan(11)",
+    "on Light Blue(12)", "on Pink(13)", "on Grey(14)", "on Light Grey(15)",
+};
+
+static void append_color_item(GMenu *menu, const char *label,
+                              const char *code)
+{
+    GMenuItem *item = g_menu_item_new(label, NULL);
+    g_menu_item_set_action_and_target(item, "win.color", "s", code);
+    g_menu_append_item(menu, item);
+    g_object_unref(item);
+}
+
+static void append_section(GMenu *menu, GMenu *section)
+{
+    g_menu_append_section(menu, NULL, G_MENU_MODEL(section));
+    g_object_unref(section);
+}
+
+static void append_submenu(GMenu *menu, const char *label, GMenu *submenu)
+{
+    g_menu_append_submenu(menu, label, G_MENU_MODEL(submenu));
+    g_object_unref(submenu);
+}
+
+static GMenu *build_background_menu(unsigned fg)
+{
+    GMenu *bg_items = g_menu_new();
+    char code[sizeof "FFBB"];
+    for (unsigned bg = 0; bg < 16; bg++) {
+        snprintf(code, sizeof code, "%02u%02u", fg, bg);
+        append_color_item(bg_items, _(BACKGROUND_LABELS[bg]), code);
+    }
+    GMenu *current = g_menu_new();
+    snprintf(code, sizeof code, "%02u", fg);
+    append_color_item(current, _("on Current Background"), code);
+    GMenu *menu = g_menu_new();
+    append_section(menu, bg_items);
+    append_section(menu, current);
+    return menu;
+}
+
+/* The color submenu is built directly rather than through GtkBuilder
+ * since it has 273 items, all of which activate win.color. */
+static void fill_color_section(GMenu *section)
+{
+    GMenu *fg_items = g_menu_new();
+    for (unsigned fg = 0; fg < 16; fg++)
+        append_submenu(fg_items, _(FOREGROUND_LABELS[fg]),
+                       build_background_menu(fg));
+    GMenu *no_color = g_menu_new();
+    append_color_item(no_color, _("_No Color"), "");
+    GMenu *color_menu = g_menu_new();
+    append_section(color_menu, fg_items);
+    append_section(color_menu, no_color);
+    append_submenu(section, _("_Color"), color_menu);
+}
+
 static GMenuModel *set_menubar(app_t *app, char *menu_xml)
 {
     GtkBuilder *builder = gtk_builder_new_from_string(menu_xml, -1);
     fsfree(menu_xml);
     GMenuModel *model =
         G_MENU_MODEL(gtk_builder_get_object(builder, "menubar"));
-    gtk_application_set_menubar(app->gui.gapp, model);
+    fill_color_section(G_MENU(gtk_builder_get_object(builder, "colors")));
+    gtk_application_set_menubar(app->gui->gapp, model);
     g_clear_object(&builder);
     return model;
 }
 
-static char *build_color_item(const char *label, const char *fg_code,
-                              const char *bg_code)
-{
-    char *action_name = charstr_printf("win.color%s%s", fg_code, bg_code);
-    char *color_item = item(label, action_name);
-    fsfree(action_name);
-    return color_item;
-}
-
-static char *build_background_items(const char *fg_code)
-{
-    char *bg_items =
-        glue(build_color_item(_("on White(0)"), fg_code, "00"),
-             build_color_item(_("on Black(1)"), fg_code, "01"),
-             build_color_item(_("on Blue(2)"), fg_code, "02"),
-             build_color_item(_("on Green(3)"), fg_code, "03"),
-             build_color_item(_("on Red(4)"), fg_code, "04"),
-             build_color_item(_("on Brown(5)"), fg_code, "05"),
-             build_color_item(_("on Purple(6)"), fg_code, "06"),
-             build_color_item(_("on Orange(7)"), fg_code, "07"),
-             build_color_item(_("on Yellow(8)"), fg_code, "08"),
-             build_color_item(_("on Light Green(9)"), fg_code, "09"),
-             build_color_item(_("on Cyan(10)"), fg_code, "10"),
-             build_color_item(_("on Light Cyan(11)"), fg_code, "11"),
-             build_color_item(_("on Light Blue(12)"), fg_code, "12"),
-             build_color_item(_("on Pink(13)"), fg_code, "13"),
-             build_color_item(_("on Grey(14)"), fg_code, "14"),
-             build_color_item(_("on Light Grey(15)"), fg_code, "15"),
-             (char *) NULL);
-    char *action_name = charstr_printf("win.color%s", fg_code);
-    char *items =
-        glue(section(bg_items),
-             section(item(_("on Current Background"), action_name)),
-             (char *) NULL);
-    fsfree(action_name);
-    return items;
-}
-
-static char *build_foreground_menu(const char *label, const char *fg_code)
-{
-    return menu(label, build_background_items(fg_code));
-}
-
-static char *build_color_menu()
-{
-    char *fg_items =
-        glue(build_foreground_menu(_("White Text(0)"), "00"),
-             build_foreground_menu(_("Black Text(1)"), "01"),
-             build_foreground_menu(_("Blue Text(2)"), "02"),
-             build_foreground_menu(_("Green Text(3)"), "03"),
-             build_foreground_menu(_("Red Text(4)"), "04"),
-             build_foreground_menu(_("Brown Text(5)"), "05"),
-             build_foreground_menu(_("Purple Text(6)"), "06"),
-             build_foreground_menu(_("Orange Text(7)"), "07"),
-             build_foreground_menu(_("Yellow Text(8)"), "08"),
-             build_foreground_menu(_("Light Green Text(9)"), "09"),
-             build_foreground_menu(_("Cyan Text(10)"), "10"),
-             build_foreground_menu(_("Light Cyan Text(11)"), "11"),
-             build_foreground_menu(_("Light Blue Text(12)"), "12"),
-             build_foreground_menu(_("Pink Text(13)"), "13"),
-             build_foreground_menu(_("Grey Text(14)"), "14"),
-             build_foreground_menu(_("Light Grey Text(15)"), "15"),
-             (char *) NULL);
-    char *color_menu =
-        menu(_("_Color"),
-             glue(section(fg_items),
-                  section(item(_("_No Color"), "win.color")),
-                  (char *) NULL));
-    return color_menu;
-}
-
 static void notification_acked(GSimpleAction *action, GVariant *parameter,
                                gpointer user_data)
 {
     app_t *app = user_data;
     const char *channel_key;
     g_variant_get(parameter, "&s", &channel_key);
-    g_application_withdraw_notification(G_APPLICATION(app->gui.gapp),
+    g_application_withdraw_notification(G_APPLICATION(app->gui->gapp),
                                         channel_key);
     channel_t *channel = get_channel(app, channel_key);
-    if (channel)
-        gtk_window_present(GTK_WINDOW(channel->window));
+    if (channel) {
+        furnish_channel(channel);
+        gtk_window_present(GTK_WINDOW(channel->gui->window));
+    }
 }
 
 static void build_menus(app_t *app)
@@ -757,10 +1218,13 @@ static void build_menus(app_t *app)
         { "quit", quit_activated },
         { "join", join_activated },
         { "join", join_activated },
+        { "search", search_activated },
+        { "diagnostics", diagnostics_activated },
+        { "dump-trace", dump_trace_activated },
         { "notif-acked", notification_acked, "s" },
         { NULL }
     };
-    g_action_map_add_action_entries(G_ACTION_MAP(app->gui.gapp),
+    g_action_map_add_action_entries(G_ACTION_MAP(app->gui->gapp),
                                     app_entries, -1, app);
     char *file_items = glue(item(_("_Close"), "win.close"),
                             item(_("_Quit"), "app.quit"),
@@ -774,13 +1238,21 @@ static void build_menus(app_t *app)
     char *hide_item = item(_("_Hide"), "win.hide");
     char *edit_menu = menu(_("_Edit"),
                            glue(section(style_items),
-                                section(build_color_menu()),
+                                xml_tagged(charstr_dupstr(""), "section",
+                                           "id='colors'"),
                                 section(hide_item),
                                 (char *) NULL));
     char *chat_items = glue(item(_("_Join..."), "app.join"),
+                            item(_("_Search..."), "app.search"),
                             item(_("_Autojoin"), "win.autojoin"),
                             (char *) NULL);
-    char *chat_menu = menu(_("_Chat"), section(chat_items));
+    char *diagnostics_items = glue(item(_("_Diagnostics"), "app.diagnostics"),
+                                   item(_("Dump _Trace"), "app.dump-trace"),
+                                   (char *) NULL);
+    char *chat_menu = menu(_("_Chat"),
+                           glue(section(chat_items),
+                                section(diagnostics_items),
+                                (char *) NULL));
     set_menubar(app,
                 interface(menubar(section(glue(file_menu,
                                                edit_menu,
@@ -794,35 +1266,36 @@ static void build_menus(app_t *app)
     accelerate(app, "win.original", _("<Ctrl>O"));
     accelerate(app, "win.hide", _("<Ctrl>H"));
     accelerate(app, "app.join", _("<Ctrl>J"));
+    accelerate(app, "app.search", _("<Ctrl>F"));
 }
 
 static void destroy_main_window(GtkWidget *, app_t *app)
 {
-    app->gui.app_window = NULL;
+    app->gui->app_window = NULL;
 }
 
 static GtkWidget *ensure_main_window(app_t *app)
 {
     assert(app->state > CONFIGURING);
-    if (app->gui.app_window) {
-        gtk_window_present(GTK_WINDOW(app->gui.app_window));
-        return app->gui.app_window;
+    if (app->gui->app_window) {
+        gtk_window_present(GTK_WINDOW(app->gui->app_window));
+        return app->gui->app_window;
     }
-    app->gui.app_window = gtk_application_window_new(app->gui.gapp);
-    gtk_window_set_icon(GTK_WINDOW(app->gui.app_window), app->gui.icon);
-    gtk_window_set_title(GTK_WINDOW(app->gui.app_window), APP_NAME);
-    add_window_actions(app->gui.app_window, NULL);
-    gtk_window_set_default_size(GTK_WINDOW(app->gui.app_window),
-                                app->gui.default_width,
-                                app->gui.default_height);
-    app->gui.scrolled_window =
-        build_chat_log(&app->gui.console, &app->gui.end_of_console);
-    gtk_container_add(GTK_CONTAINER(app->gui.app_window),
-                      app->gui.scrolled_window);
-    gtk_widget_show_all(app->gui.app_window);
-    g_signal_connect(G_OBJECT(app->gui.app_window), "destroy",
+    app->gui->app_window = gtk_application_window_new(app->gui->gapp);
+    gtk_window_set_icon(GTK_WINDOW(app->gui->app_window), app->gui->icon);
+    gtk_window_set_title(GTK_WINDOW(app->gui->app_window), APP_NAME);
+    add_window_actions(app->gui->app_window, NULL);
+    gtk_window_set_default_size(GTK_WINDOW(app->gui->app_window),
+                                app->gui->default_width,
+                                app->gui->default_height);
+    app->gui->scrolled_window =
+        build_chat_log(&app->gui->console, &app->gui->end_of_console);
+    gtk_container_add(GTK_CONTAINER(app->gui->app_window),
+                      app->gui->scrolled_window);
+    gtk_widget_show_all(app->gui->app_window);
+    g_signal_connect(G_OBJECT(app->gui->app_window), "destroy",
                      G_CALLBACK(destroy_main_window), app);
-    return app->gui.app_window;
+    return app->gui->app_window;
 }
 
 static void collect_autojoins(app_t *app)
@@ -830,7 +1303,7 @@ static void collect_autojoins(app_t *app)
     avl_tree_t *old_autojoins = avl_tree_copy(app->config.autojoins);
     while (!avl_tree_empty(app->config.autojoins))
         destroy_avl_element(avl_tree_pop_first(app->config.autojoins));
-    GtkWidget *listbox = app->gui.configuration_autojoins;
+    GtkWidget *listbox = app->gui->configuration_autojoins;
     for (gint i = 0; !avl_tree_empty(old_autojoins); i++) {
         avl_elem_t *ae = avl_tree_pop_first(old_autojoins);
         channel_id_t *chid = (channel_id_t *) avl_elem_get_value(ae);
@@ -868,43 +1341,48 @@ static bool set_up_cache_directory(app_t *app, const gchar *cache_dir)
                        &app->cache_params);
     assert(app->cache);
     fsfree(cache_prefix);
+    app->search_index = make_search_index();
+    app->cache_writer =
+        make_cache_writer(app->cache, cache_dir, app->config.cache_sync,
+                          app->search_index);
     return true;
 }
 
 static void configuration_ok_response(app_t *app)
 {
     const gchar *nick =
-        gtk_entry_get_text(GTK_ENTRY(app->gui.configuration_nick));
+        gtk_entry_get_text(GTK_ENTRY(app->gui->configuration_nick));
     const gchar *name =
-        gtk_entry_get_text(GTK_ENTRY(app->gui.configuration_name));
+        gtk_entry_get_text(GTK_ENTRY(app->gui->configuration_name));
     const gchar *server =
-        gtk_entry_get_text(GTK_ENTRY(app->gui.configuration_server));
+        gtk_entry_get_text(GTK_ENTRY(app->gui->configuration_server));
     const gchar *port =
-        gtk_entry_get_text(GTK_ENTRY(app->gui.configuration_port));
+        gtk_entry_get_text(GTK_ENTRY(app->gui->configuration_port));
     const gboolean use_tls =
-        gtk_switch_get_state(GTK_SWITCH(app->gui.configuration_use_tls));
+        gtk_switch_get_state(GTK_SWITCH(app->gui->configuration_use_tls));
     const gchar *cache_dir = 
-        gtk_entry_get_text(GTK_ENTRY(app->gui.configuration_cache_dir));
+        gtk_entry_get_text(GTK_ENTRY(app->gui->configuration_cache_dir));
     if (!valid_nick(nick)) {
-        modal_error_dialog(app->gui.configuration_window, _("Bad nick"));
+        modal_error_dialog(app->gui->configuration_window, _("Bad nick"));
         return;
     }
     if (!valid_name(name)) {
-        modal_error_dialog(app->gui.configuration_window, _("Bad name"));
+        modal_error_dialog(app->gui->configuration_window, _("Bad name"));
         return;
     }
     if (!valid_server(server)) {
-        modal_error_dialog(app->gui.configuration_window, _("Bad server host"));
+        modal_error_dialog(app->gui->configuration_window,
+                           _("Bad server host"));
         return;
     }
     int port_number;
     if (!valid_tcp_port(port, &port_number)) {
-        modal_error_dialog(app->gui.configuration_window,
+        modal_error_dialog(app->gui->configuration_window,
                            _("Bad TCP port number"));
         return;
     }
     if (!set_up_cache_directory(app, cache_dir)) {
-        modal_error_dialog(app->gui.configuration_window,
+        modal_error_dialog(app->gui->configuration_window,
                            _("Failed to set up cache directory"));
         return;
     }
@@ -912,11 +1390,13 @@ static void configuration_ok_response(app_t *app)
     app->config.name = charstr_dupstr(name);
     app->config.server = charstr_dupstr(server);
     app->config.port = port_number;
+    fsfree(app->config.last_address);
+    app->config.last_address = NULL;
     app->config.use_tls = use_tls;
     collect_autojoins(app);
     app->config.cache_directory = charstr_dupstr(cache_dir);
-    gtk_widget_destroy(app->gui.configuration_window);
-    app->gui.configuration_window = NULL;
+    gtk_widget_destroy(app->gui->configuration_window);
+    app->gui->configuration_window = NULL;
     save_session(app);
     set_state(app, CONNECTING);
     ensure_main_window(app);
@@ -925,8 +1405,8 @@ static void configuration_ok_response(app_t *app)
 
 static void configuration_cancel_response(app_t *app)
 {
-    gtk_widget_destroy(app->gui.configuration_window);
-    app->gui.configuration_window = NULL;
+    gtk_widget_destroy(app->gui->configuration_window);
+    app->gui->configuration_window = NULL;
     quit(app);
 }
 
@@ -963,7 +1443,7 @@ static void configuration_dialog_change_cache(GtkButton *, app_t *app)
 {
     GtkFileChooserNative *dialog =
         gtk_file_chooser_native_new(_(APP_NAME ": Cache Directory"),
-                                    GTK_WINDOW(app->gui.configuration_window),
+                                    GTK_WINDOW(app->gui->configuration_window),
                                     GTK_FILE_CHOOSER_ACTION_CREATE_FOLDER,
                                     _("_Select"),
                                     _("_Cancel"));
@@ -971,7 +1451,7 @@ static void configuration_dialog_change_cache(GtkButton *, app_t *app)
     gint response = gtk_native_dialog_run(GTK_NATIVE_DIALOG(dialog));
     if (response == GTK_RESPONSE_ACCEPT) {
         char *path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-        gtk_entry_set_text(GTK_ENTRY(app->gui.configuration_cache_dir), path);
+        gtk_entry_set_text(GTK_ENTRY(app->gui->configuration_cache_dir), path);
         g_clear_object(&path);
     }
     g_object_unref(dialog);
@@ -982,17 +1462,17 @@ static void port_gui(app_t *app, GtkWidget *content_area)
     GtkWidget *port_row = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, one_em());
     gtk_container_add(GTK_CONTAINER(content_area), port_row);
     char *port = charstr_printf("%d", app->config.port);
-    app->gui.configuration_port = entry_cell(port_row, _("TCP Port"), port);
+    app->gui->configuration_port = entry_cell(port_row, _("TCP Port"), port);
     fsfree(port);
-    app->gui.configuration_use_tls =
+    app->gui->configuration_use_tls =
         checkbox(port_row, _("Use TLS"), app->config.use_tls);
-    add_margin(app->gui.configuration_use_tls);
+    add_margin(app->gui->configuration_use_tls);
 }
 
 static void autojoin_gui(app_t *app, GtkWidget *content_area)
 {
     if (avl_tree_empty(app->config.autojoins)) {
-        app->gui.configuration_autojoins = NULL;
+        app->gui->configuration_autojoins = NULL;
         return;
     }
     GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
@@ -1005,7 +1485,8 @@ static void autojoin_gui(app_t *app, GtkWidget *content_area)
     gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(sw),
                                    GTK_POLICY_AUTOMATIC,
                                    GTK_POLICY_AUTOMATIC);
-    GtkWidget *listbox = app->gui.configuration_autojoins = gtk_list_box_new();
+    GtkWidget *listbox = gtk_list_box_new();
+    app->gui->configuration_autojoins = listbox;
     gtk_container_add(GTK_CONTAINER(sw), listbox);
     gtk_list_box_set_selection_mode(GTK_LIST_BOX(listbox),
                                     GTK_SELECTION_MULTIPLE);
@@ -1023,7 +1504,7 @@ static void cache_dir_gui(app_t *app, GtkWidget *content_area)
 {
     GtkWidget *cache_row = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, one_em());
     gtk_container_add(GTK_CONTAINER(content_area), cache_row);
-    app->gui.configuration_cache_dir = entry_cell(cache_row,
+    app->gui->configuration_cache_dir = entry_cell(cache_row,
                                                   _("Cache Directory"),
                                                   app->config.cache_directory);
     GtkWidget *change_cache = gtk_button_new_with_label(_("Change..."));
@@ -1036,14 +1517,15 @@ static void cache_dir_gui(app_t *app, GtkWidget *content_area)
 static void configure(app_t *app)
 {
     assert(app->state == CONFIGURING);
-    assert(!app->gui.configuration_window);
+    assert(!app->gui->configuration_window);
     load_session(app);
-    app->gui.configuration_window = gtk_application_window_new(app->gui.gapp);
-    gtk_window_set_icon(GTK_WINDOW(app->gui.configuration_window),
-                        app->gui.icon);
+    app->gui->configuration_window =
+        gtk_application_window_new(app->gui->gapp);
+    gtk_window_set_icon(GTK_WINDOW(app->gui->configuration_window),
+                        app->gui->icon);
     GtkWidget *dialog =
         gtk_dialog_new_with_buttons(_(APP_NAME ": Configuration"),
-                                    GTK_WINDOW(app->gui.configuration_window),
+                                    GTK_WINDOW(app->gui->configuration_window),
                                     GTK_DIALOG_DESTROY_WITH_PARENT,
                                     _("_Cancel"), GTK_RESPONSE_CANCEL,
                                     _("_OK"), GTK_RESPONSE_OK,
@@ -1052,11 +1534,11 @@ static void configure(app_t *app)
                              G_CALLBACK(configuration_response), app);
     GtkWidget *content_area =
         gtk_dialog_get_content_area(GTK_DIALOG(dialog));
-    app->gui.configuration_nick =
+    app->gui->configuration_nick =
         entry_cell(content_area, _("Your Nick"), app->config.nick);
-    app->gui.configuration_name =
+    app->gui->configuration_name =
         entry_cell(content_area, _("Your Name"), app->config.name);
-    app->gui.configuration_server =
+    app->gui->configuration_server =
         entry_cell(content_area, _("Server Host"), app->config.server);
     port_gui(app, content_area);
     autojoin_gui(app, content_area);
@@ -1081,6 +1563,7 @@ static void activate(GtkApplication *, app_t *app)
             return;
         case CONNECTING:
         case READY:
+        case DISCONNECTED:
             FSTRACE(IRC_ACTIVATE_REMOTE_CONFIGURED);
             ensure_main_window(app);
             return;
@@ -1090,14 +1573,17 @@ static void activate(GtkApplication *, app_t *app)
     }
     init_tracing(app);
     FSTRACE(IRC_ACTIVATE);
+    if (app->opts.metrics)
+        enable_metrics();
+    if (app->opts.stall_threshold_ms)
+        start_watchdog(app->opts.stall_threshold_ms);
+    serve_metrics_on_signal_and_socket(app);
     set_state(app, CONFIGURING);
-    app->async = make_async();
-    attach_async_to_gtk(app);
     build_menus(app);
     GdkRectangle geometry;
-    app->gui.pixel_width = get_pixel_width(&geometry);
-    app->gui.default_width = geometry.width / 2;
-    app->gui.default_height = geometry.height * 5 / 6;
+    app->gui->pixel_width = get_pixel_width(&geometry);
+    app->gui->default_width = geometry.width / 2;
+    app->gui->default_height = geometry.height * 5 / 6;
     configure(app);
 }
 
@@ -1110,6 +1596,34 @@ static void shut_down(GtkApplication *, app_t *app)
 }
 
 
+/* A byte count with an optional K, M or G suffix. */
+static bool parse_size(const char *arg, size_t *size)
+{
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (errno || end == arg || *arg == '-')
+        return false;
+    switch (*end) {
+        case 'G':
+            n *= 1024;
+            /* fall through */
+        case 'M':
+            n *= 1024;
+            /* fall through */
+        case 'K':
+            n *= 1024;
+            end++;
+            break;
+        default:
+            break;
+    }
+    if (*end || n > SIZE_MAX)
+        return false;
+    *size = n;
+    return true;
+}
+
 FSTRACE_DECL(IRC_COMMAND_OPTIONS, "");
 
 static gint command_options(GtkApplication *, GVariantDict *options, app_t *app)
@@ -1134,34 +1648,117 @@ static gint command_options(GtkApplication *, GVariantDict *options, app_t *app)
         fsfree(app->opts.trace_exclude);
         app->opts.trace_exclude = charstr_dupstr(arg);
     }
+    if (g_variant_dict_lookup(options, "trace-ring", "s", &arg) &&
+        (!parse_size(arg, &app->opts.trace_ring_size) ||
+         app->opts.trace_ring_size < TRACE_RING_MIN_SIZE)) {
+        fprintf(stderr, _(PROGRAM ": bad --trace-ring size\n"));
+        return EXIT_FAILURE;
+    }
+    gint sample;
+    if (g_variant_dict_lookup(options, "trace-sample", "i", &sample)) {
+        if (sample < 1) {
+            fprintf(stderr, _(PROGRAM ": bad --trace-sample\n"));
+            return EXIT_FAILURE;
+        }
+        app->opts.trace_sample = sample;
+    }
+    if (g_variant_dict_lookup(options, "ca-bundle", "s", &arg)) {
+        fsfree(app->opts.ca_bundle);
+        app->opts.ca_bundle = charstr_dupstr(arg);
+    }
+    app->opts.metrics =
+        g_variant_dict_lookup(options, "metrics", "b", NULL);
+    gint threshold;
+    if (g_variant_dict_lookup(options, "stall-threshold", "i", &threshold)) {
+        if (threshold < 0) {
+            fprintf(stderr, _(PROGRAM ": bad --stall-threshold\n"));
+            return EXIT_FAILURE;
+        }
+        app->opts.stall_threshold_ms = threshold;
+    }
+    gint dead_peer;
+    if (g_variant_dict_lookup(options, "dead-peer-timeout", "i", &dead_peer)) {
+        if (dead_peer < 0) {
+            fprintf(stderr, _(PROGRAM ": bad --dead-peer-timeout\n"));
+            return EXIT_FAILURE;
+        }
+        app->opts.dead_peer_s = dead_peer;
+    }
+    if (g_variant_dict_lookup(options, "metrics-socket", "s", &arg)) {
+        fsfree(app->opts.metrics_socket);
+        app->opts.metrics_socket = charstr_dupstr(arg);
+    }
     return -1;                  /* carry on */
 }
 
 static void add_command_options(app_t *app)
 {
-    g_application_add_main_option(G_APPLICATION(app->gui.gapp),
+    g_application_add_main_option(G_APPLICATION(app->gui->gapp),
                                   "config", 'c',
                                   G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
                                   _("Configuration file "
                                     "(absolute or relative to $HOME)"),
                                   _("PATH"));
-    g_application_add_main_option(G_APPLICATION(app->gui.gapp),
+    g_application_add_main_option(G_APPLICATION(app->gui->gapp),
                                   "unconfigured", 0,
                                   G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_NONE,
                                   _("No configuration file"), NULL);
-    g_application_add_main_option(G_APPLICATION(app->gui.gapp),
+    g_application_add_main_option(G_APPLICATION(app->gui->gapp),
                                   "reset", 0,
                                   G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_NONE,
                                   _("Reset configuration"), NULL);
-    g_application_add_main_option(G_APPLICATION(app->gui.gapp),
+    g_application_add_main_option(G_APPLICATION(app->gui->gapp),
                                   "trace-include", 0,
                                   G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
                                   _("Specify trace events"), _("REGEXP"));
-    g_application_add_main_option(G_APPLICATION(app->gui.gapp),
+    g_application_add_main_option(G_APPLICATION(app->gui->gapp),
                                   "trace-exclude", 0,
                                   G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
                                   _("Exclude trace events"), _("REGEXP"));
-    g_signal_connect(app->gui.gapp, "handle-local-options",
+    g_application_add_main_option(G_APPLICATION(app->gui->gapp),
+                                  "trace-ring", 0,
+                                  G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
+                                  _("Trace into an in-memory ring instead "
+                                    "of stderr (dumped on SIGUSR2)"),
+                                  _("SIZE"));
+    g_application_add_main_option(G_APPLICATION(app->gui->gapp),
+                                  "trace-sample", 0,
+                                  G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+                                  _("Keep every Nth binary event in the "
+                                    "trace ring"),
+                                  "N");
+    g_application_add_main_option(G_APPLICATION(app->gui->gapp),
+                                  "ca-bundle", 0,
+                                  G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
+                                  _("Trust the CA certificates in the file "
+                                    "instead of the system's"),
+                                  _("PATH"));
+    g_application_add_main_option(G_APPLICATION(app->gui->gapp),
+                                  "metrics", 0,
+                                  G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_NONE,
+                                  _("Time the processing stages from the "
+                                    "start"), NULL);
+    g_application_add_main_option(G_APPLICATION(app->gui->gapp),
+                                  "metrics-socket", 0,
+                                  G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_STRING,
+                                  _("Serve the metrics in JSON on a UNIX "
+                                    "socket"),
+                                  _("PATH"));
+    g_application_add_main_option(G_APPLICATION(app->gui->gapp),
+                                  "stall-threshold", 0,
+                                  G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+                                  _("Report main loop stalls longer than MS "
+                                    "milliseconds (default 100, 0 to "
+                                    "disable)"),
+                                  "MS");
+    g_application_add_main_option(G_APPLICATION(app->gui->gapp),
+                                  "dead-peer-timeout", 0,
+                                  G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_INT,
+                                  _("Reconnect if nothing is received for "
+                                    "SECONDS seconds (default 120, 0 to "
+                                    "disable)"),
+                                  _("SECONDS"));
+    g_signal_connect(app->gui->gapp, "handle-local-options",
                      G_CALLBACK(command_options), app);
 }
 
@@ -1183,18 +1780,24 @@ static GdkPixbuf *get_app_icon()
 
 int main(int argc, char **argv)
 {
+    gui_t gui = {
+        .gapp = gtk_application_new(APPLICATION_ID, G_APPLICATION_FLAGS_NONE),
+        .icon = get_app_icon(),
+    };
     app_t app = {
         .config = {
             .autojoins = make_avl_tree((void *) strcmp),
         },
-        .gui = {
-            .gapp = gtk_application_new(APPLICATION_ID,
-                                        G_APPLICATION_FLAGS_NONE),
-            .icon = get_app_icon(),
-        },
+        .gui = &gui,
         .state = STARTING_UP,
         .channels = make_avl_tree((void *) strcmp),
+        .replays = make_list(),
     };
+    init_alloc_accounting();
+    app.opts.trace_sample = 1;
+    app.opts.stall_threshold_ms = 100;
+    app.opts.dead_peer_s = 120;
+    app.sink = gui_sink(&app);
     app.home_dir = getenv("HOME");
     if (!app.home_dir || *app.home_dir != '/') {
         fprintf(stderr, _(PROGRAM ": no HOME in the environment\n"));
@@ -1202,32 +1805,56 @@ int main(int argc, char **argv)
     }
     app.opts.config_file =
         charstr_printf("%s/.config/lip/config.json", app.home_dir);
-    g_signal_connect(app.gui.gapp, "activate", G_CALLBACK(activate), &app);
-    g_signal_connect(app.gui.gapp, "shutdown", G_CALLBACK(shut_down), &app);
+    g_signal_connect(app.gui->gapp, "activate", G_CALLBACK(activate), &app);
+    g_signal_connect(app.gui->gapp, "shutdown", G_CALLBACK(shut_down), &app);
     add_command_options(&app);
-    int status = g_application_run(G_APPLICATION(app.gui.gapp), argc, argv);
-    if (app.async)
-        destroy_async(app.async);
+    int status = g_application_run(G_APPLICATION(app.gui->gapp), argc, argv);
+    flush_session(&app);
+    stop_watchdog();
+    trace_alloc_stats();
+    cancel_joins(&app);
+    discard_batches(&app);
+    if (app.net)
+        destroy_net(app.net);
+    cancel_replays(&app);
+    destroy_list(app.replays);
+    if (app.gui->searcher)
+        g_thread_pool_free(app.gui->searcher, FALSE, TRUE);
+    if (app.cache_writer)
+        destroy_cache_writer(app.cache_writer);
+    if (app.search_index)
+        destroy_search_index(app.search_index);
     if (app.cache)
         destroy_rotatable(app.cache);
     while (!avl_tree_empty(app.channels)) {
         avl_elem_t *ae = avl_tree_pop_first(app.channels);
         channel_t *channel = (channel_t *) avl_elem_get_value(ae);
         destroy_avl_element(ae);
+        if (channel->gui)
+            discard_notification(channel);
+        fsfree(channel->gui);
         destroy_channel(channel);
     }
     destroy_avl_tree(app.channels);
+    if (app.gui->metrics_service) {
+        g_socket_service_stop(app.gui->metrics_service);
+        g_object_unref(app.gui->metrics_service);
+        unlink(app.opts.metrics_socket);
+    }
     /* TODO: disconnect */
     fsfree(app.config.nick);
     fsfree(app.config.name);
     fsfree(app.config.server);
+    fsfree(app.config.last_address);
     fsfree(app.config.cache_directory);
-    g_object_unref(app.gui.icon);
-    g_clear_object(&app.gui.gapp);
+    g_object_unref(app.gui->icon);
+    g_clear_object(&app.gui->gapp);
     clear_autojoins(&app);
     destroy_avl_tree(app.config.autojoins);
     fsfree(app.opts.trace_include);
     fsfree(app.opts.trace_exclude);
+    fsfree(app.opts.ca_bundle);
+    fsfree(app.opts.metrics_socket);
     fsfree(app.opts.config_file);
     return status;
 }
@@ -4,88 +4,70 @@
 
 #include <gtk/gtk.h>
 
-#include <async/async.h>
-#include <async/tcp_client.h>
-#include <async/tls_connection.h>
-#include <async/queuestream.h>
-#include <fsdyn/avltree.h>
-#include <rotatable/rotatable.h>
+#include "core.h"
 
-#define PROGRAM "lip"
-#define APP_NAME "Lip"
-
-typedef enum {
-    STARTING_UP,
-    CONFIGURING,
-    CONNECTING,
-    READY,
-    ZOMBIE,
-} state_t;
-
-typedef struct {
-    char *key, *name;
-} channel_id_t;
-
-typedef struct {
-    struct {
-        char *trace_include, *trace_exclude;
-        char *config_file;   /* NULL, absolute or relative to $HOME */
-        bool reset;
-    } opts;
-    struct {
-        char *nick, *name, *server;
-        int port;
-        bool use_tls;
-        avl_tree_t *autojoins;  /* of channel_id_t */
-        char *cache_directory;
-    } config;
-    const char *home_dir;
-    async_t *async;
-    state_t state;
-    tcp_client_t *client;
-    tcp_conn_t *tcp_conn;
-    tls_conn_t *tls_conn;
-    queuestream_t *outq;
-    bytestream_1 input;
-    char input_buffer[512];
-    char *input_cursor, *input_end;
-    avl_tree_t *channels;       /* of key -> channel_t */
-    rotatable_params_t cache_params;
-    rotatable_t *cache;
-    struct {
-        GtkApplication *gapp;
-        GdkPixbuf *icon;
-        gint default_width, default_height;
-        double pixel_width;
-        GtkWidget *configuration_window;
-        GtkWidget *configuration_nick;
-        GtkWidget *configuration_name;
-        GtkWidget *configuration_server;
-        GtkWidget *configuration_port;
-        GtkWidget *configuration_use_tls;
-        GtkWidget *configuration_autojoins;
-        GtkWidget *configuration_cache_dir;
-        GtkWidget *app_window;
-        GtkWidget *scrolled_window;;
-        GtkWidget *console;
-        GtkTextMark *end_of_console;
-        struct tm timestamp;
-        GtkWidget *join_dialog;
-        GtkWidget *join_channel;
-    } gui;
-} app_t;
+struct gui {
+    GtkApplication *gapp;
+    GdkPixbuf *icon;
+    gint default_width, default_height;
+    double pixel_width;
+    GtkWidget *configuration_window;
+    GtkWidget *configuration_nick;
+    GtkWidget *configuration_name;
+    GtkWidget *configuration_server;
+    GtkWidget *configuration_port;
+    GtkWidget *configuration_use_tls;
+    GtkWidget *configuration_autojoins;
+    GtkWidget *configuration_cache_dir;
+    GtkWidget *app_window;
+    GtkWidget *scrolled_window;;
+    GtkWidget *console;
+    GtkTextMark *end_of_console;
+    struct tm timestamp;
+    GtkWidget *join_dialog;
+    GtkWidget *join_channel;
+    GtkWidget *search_dialog;
+    GtkWidget *search_entry;
+    GtkWidget *search_results;
+    GtkWidget *search_context;
+    guint search_timer;         /* 0 unless a query is due */
+    unsigned search_generation; /* of the latest query */
+    unsigned context_generation; /* of the latest context fetch */
+    GThreadPool *searcher;
+    GtkWidget *diagnostics_dialog;
+    GtkWidget *diagnostics_view;
+    guint diagnostics_refresh;
+    GSocketService *metrics_service; /* NULL unless --metrics-socket */
+    guint session_timer;        /* 0 unless a save is pending */
+    GThreadPool *session_writer;
+    /* Reconnection */
+    guint reconnect_timer;      /* 0 unless a reconnect is scheduled */
+    unsigned reconnect_attempts; /* since the last success */
+    gint64 dropped_at;          /* monotonic µs; 0 unless resuming */
+    unsigned rejoins_pending;   /* JOINs not yet confirmed */
+    struct join_queue {
+        list_t *channels;       /* of channel_t; NULL if none queued */
+        guint timer;            /* 0 unless a line is due */
+        bool staggered;         /* timer is for a later line */
+    } joins;
+    struct notification_budget {
+        unsigned tokens;
+        gint64 refilled;        /* monotonic ms; 0 before first use */
+    } notification_budget;
+};
 
-typedef struct {
-    app_t *app;
-    char *key, *name;
-    bool autojoin;
-    list_t *nicks_present;      /* of string */
+struct channel_gui {
     GtkWidget *window;
+    unsigned window_serial;     /* incremented when window is destroyed */
     GtkWidget *input_view, *chat_view;
     GtkTextMark *end_of_chat_view;
     struct tm timestamp;
-} channel_t;
-
-void emit(app_t *app, const char *text);
-channel_t *open_channel(app_t *app, const gchar *name, unsigned limit,
-                        bool autojoin);
+    struct pending_notification {
+        guint timer;            /* 0 unless a notification is pending */
+        unsigned messages;
+        list_t *senders;        /* of distinct nicks; NULL if none */
+        char *from, *text;      /* of the latest mention or message */
+        bool mention;
+        gint64 mentioned;       /* monotonic ms of the last mention sent */
+    } notification;
+};
@@ -0,0 +1,464 @@
+#define _GNU_SOURCE             /* strptime(3) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <fsdyn/charstr.h>
+#include <fstrace.h>
+#include "cache.h"
+#include "casemap.h"
+#include "search.h"
+
+/* lip-logtool inspects and maintains the message cache offline. The
+ * read-only commands process the segments in parallel and stream
+ * their output in chronological order. The maintenance commands
+ * rewrite rotated segments and should not be run while lip is
+ * running. */
+
+static const char *const DEFAULT_CACHE_DIR = ".cache/lip/main";
+
+typedef struct {
+    char *channel_key;          /* or NULL */
+    char *from;                 /* or NULL */
+    GRegex *text;               /* or NULL */
+    unsigned long long since, until;
+} filter_t;
+
+typedef struct job job_t;
+
+typedef struct {
+    char *directory;
+    filter_t filter;
+    bool (*process)(job_t *job, cache_reader_t *reader);
+    GMutex lock;
+    GCond done;
+} tool_t;
+
+struct job {
+    tool_t *tool;
+    char *name;
+    FILE *output;               /* anonymous temporary file */
+    bool finished, ok;          /* protected by tool->lock */
+};
+
+static bool matches(const filter_t *filter, const char *key,
+                    unsigned long long t, const char *from, const char *text)
+{
+    if (filter->channel_key && strcmp(key, filter->channel_key))
+        return false;
+    if (filter->from && (!from || lcase_strcmp(from, filter->from)))
+        return false;
+    if (t < filter->since || t >= filter->until)
+        return false;
+    return !filter->text || g_regex_match(filter->text, text, 0, NULL);
+}
+
+/* Control characters are dropped; color digits are left in place. */
+static void print_plain(FILE *f, const char *text)
+{
+    for (const char *p = text; *p; p++)
+        if (!(charstr_char_class(*p) & CHARSTR_CONTROL))
+            putc(*p, f);
+}
+
+static bool grep_segment(job_t *job, cache_reader_t *reader)
+{
+    const filter_t *filter = &job->tool->filter;
+    const char *record;
+    while ((record = cache_reader_next(reader, NULL))) {
+        const char *key, *from, *tag, *text;
+        unsigned long long t;
+        json_thing_t *message =
+            decode_cache_record(record, &key, &t, &from, &tag, &text);
+        if (!message)
+            continue;
+        if (matches(filter, key, t, from, text)) {
+            time_t stamp = t;
+            struct tm tm;
+            localtime_r(&stamp, &tm);
+            char date[40];
+            strftime(date, sizeof date, "%F %T", &tm);
+            fprintf(job->output, "%s %s ", date, key);
+            if (from)
+                fprintf(job->output, "%s>", from);
+            print_plain(job->output, text);
+            putc('\n', job->output);
+        }
+        json_destroy_thing(message);
+    }
+    return true;
+}
+
+static bool export_segment(job_t *job, cache_reader_t *reader)
+{
+    const filter_t *filter = &job->tool->filter;
+    const char *record;
+    while ((record = cache_reader_next(reader, NULL))) {
+        const char *key, *from, *tag, *text;
+        unsigned long long t;
+        json_thing_t *message =
+            decode_cache_record(record, &key, &t, &from, &tag, &text);
+        if (!message)
+            continue;
+        /* The records are compact JSON already. */
+        if (matches(filter, key, t, from, text))
+            fprintf(job->output, "%s\n", record);
+        json_destroy_thing(message);
+    }
+    return true;
+}
+
+static bool verify_segment(job_t *job, cache_reader_t *reader)
+{
+    size_t records = 0, bad = 0, out_of_order = 0;
+    unsigned long long latest = 0;
+    const char *record;
+    while ((record = cache_reader_next(reader, NULL))) {
+        records++;
+        const char *key, *from, *tag, *text;
+        unsigned long long t;
+        json_thing_t *message =
+            decode_cache_record(record, &key, &t, &from, &tag, &text);
+        if (!message) {
+            bad++;
+            continue;
+        }
+        if (t < latest)
+            out_of_order++;
+        else latest = t;
+        json_destroy_thing(message);
+    }
+    bool damaged = cache_reader_damaged(reader);
+    fprintf(job->output, "%s: %zu records, %zu bad, %zu out of order%s\n",
+            job->name, records, bad, out_of_order,
+            damaged ? ", DAMAGED" : "");
+    return !bad && !damaged;
+}
+
+/* Called in a pool thread. */
+static void run_job(gpointer data, gpointer user_data)
+{
+    job_t *job = data;
+    tool_t *tool = job->tool;
+    char *path = charstr_printf("%s/%s", tool->directory, job->name);
+    cache_reader_t *reader = open_cache_reader(path);
+    fsfree(path);
+    bool ok;
+    if (!reader) {
+        fprintf(job->output, "%s: %s\n", job->name, strerror(errno));
+        ok = false;
+    } else {
+        ok = tool->process(job, reader);
+        close_cache_reader(reader);
+    }
+    g_mutex_lock(&tool->lock);
+    job->finished = true;
+    job->ok = ok;
+    g_cond_broadcast(&tool->done);
+    g_mutex_unlock(&tool->lock);
+}
+
+static void copy_out(FILE *from, FILE *to)
+{
+    char buf[BUFSIZ];
+    size_t count;
+    rewind(from);
+    while ((count = fread(buf, 1, sizeof buf, from)) > 0)
+        fwrite(buf, 1, count, to);
+}
+
+/* Run tool->process on every segment in parallel. The outputs are
+ * written to stdout in chronological order as soon as they are
+ * complete. */
+static bool scan(tool_t *tool, FILE *out)
+{
+    struct dirent **namelist;
+    int n = scan_cache_segments(tool->directory, &namelist);
+    if (n < 0) {
+        fprintf(stderr, "lip-logtool: %s: %s\n", tool->directory,
+                strerror(errno));
+        return false;
+    }
+    job_t *jobs = fsalloc((n + 1) * sizeof *jobs);
+    GThreadPool *pool =
+        g_thread_pool_new(run_job, NULL, g_get_num_processors(), FALSE,
+                          NULL);
+    bool ok = true;
+    int queued = 0;
+    for (; queued < n; queued++) {
+        job_t *job = &jobs[queued];
+        job->output = tmpfile();
+        if (!job->output) {
+            fprintf(stderr, "lip-logtool: tmpfile: %s\n", strerror(errno));
+            ok = false;
+            break;
+        }
+        job->tool = tool;
+        job->name = charstr_dupstr(namelist[queued]->d_name);
+        job->finished = false;
+        g_thread_pool_push(pool, job, NULL);
+    }
+    for (int i = 0; i < n; i++)
+        free(namelist[i]);
+    free(namelist);
+    for (int i = 0; i < queued; i++) {
+        g_mutex_lock(&tool->lock);
+        while (!jobs[i].finished)
+            g_cond_wait(&tool->done, &tool->lock);
+        g_mutex_unlock(&tool->lock);
+        copy_out(jobs[i].output, out);
+        fflush(out);
+        fclose(jobs[i].output);
+        if (!jobs[i].ok)
+            ok = false;
+        fsfree(jobs[i].name);
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+    fsfree(jobs);
+    return ok;
+}
+
+static off_t segment_size(const char *directory, const char *name)
+{
+    char *path = charstr_printf("%s/%s", directory, name);
+    struct stat st;
+    off_t size = stat(path, &st) < 0 ? -1 : st.st_size;
+    fsfree(path);
+    return size;
+}
+
+/* Merge runs of consecutive rotated segments while the sum of their
+ * sizes stays below target_size, then compress any uncompressed
+ * rotated segments. */
+static bool compact(const char *directory, off_t target_size)
+{
+    struct dirent **namelist;
+    int n = scan_cache_segments(directory, &namelist);
+    if (n < 0) {
+        fprintf(stderr, "lip-logtool: %s: %s\n", directory, strerror(errno));
+        return false;
+    }
+    bool ok = true;
+    char *run[n + 1];
+    size_t run_length = 0;
+    off_t run_size = 0;
+    for (int i = 0; i < n; i++) {
+        /* The last one is being written to. */
+        off_t size = i < n - 1 ? segment_size(directory,
+                                              namelist[i]->d_name) : -1;
+        if (run_length && (size < 0 || run_size + size > target_size)) {
+            if (run_length > 1) {
+                printf("merging %zu segments into %s\n", run_length, run[0]);
+                if (!merge_cache_segments(directory, run, run_length)) {
+                    fprintf(stderr, "lip-logtool: skipped %s..%s: %s\n",
+                            run[0], run[run_length - 1], strerror(errno));
+                    ok = false;
+                }
+            } else if (!compress_cache_segment(directory, run[0])) {
+                fprintf(stderr, "lip-logtool: skipped %s: %s\n", run[0],
+                        strerror(errno));
+                ok = false;
+            }
+            run_length = 0;
+            run_size = 0;
+        }
+        if (size >= 0) {
+            run[run_length++] = namelist[i]->d_name;
+            run_size += size;
+        }
+    }
+    for (int i = 0; i < n; i++)
+        free(namelist[i]);
+    free(namelist);
+    return ok;
+}
+
+static void index_job(gpointer data, gpointer user_data)
+{
+    search_index_add_segment(user_data, data);
+    fsfree(data);
+}
+
+/* Rewrite every rotated segment into seekable frames and build a
+ * search index over the whole cache to check that every record can be
+ * indexed. */
+static bool reindex(const char *directory)
+{
+    struct dirent **namelist;
+    int n = scan_cache_segments(directory, &namelist);
+    if (n < 0) {
+        fprintf(stderr, "lip-logtool: %s: %s\n", directory, strerror(errno));
+        return false;
+    }
+    bool ok = true;
+    for (int i = 0; i < n - 1; i++) {
+        char *name = namelist[i]->d_name;
+        if (!merge_cache_segments(directory, &name, 1)) {
+            fprintf(stderr, "lip-logtool: skipped %s: %s\n", name,
+                    strerror(errno));
+            ok = false;
+        }
+    }
+    gint64 start = g_get_monotonic_time();
+    search_index_t *index = make_search_index();
+    GThreadPool *pool =
+        g_thread_pool_new(index_job, index, g_get_num_processors(), FALSE,
+                          NULL);
+    for (int i = 0; i < n; i++) {
+        g_thread_pool_push(pool, charstr_printf("%s/%s", directory,
+                                                namelist[i]->d_name),
+                           NULL);
+        free(namelist[i]);
+    }
+    free(namelist);
+    g_thread_pool_free(pool, FALSE, TRUE);
+    printf("%d segments, %zu records, %zu terms, %.3f s\n",
+           n, search_index_size(index), search_index_term_count(index),
+           (g_get_monotonic_time() - start) / 1e6);
+    destroy_search_index(index);
+    return ok;
+}
+
+static bool parse_time(const char *s, unsigned long long *t)
+{
+    static const char *const formats[] = {
+        "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M:%S",
+        "%Y-%m-%dT%H:%M", "%Y-%m-%d %H:%M", "%Y-%m-%d", NULL
+    };
+    for (int i = 0; formats[i]; i++) {
+        struct tm tm = { .tm_isdst = -1 };
+        const char *end = strptime(s, formats[i], &tm);
+        if (end && !*end) {
+            *t = mktime(&tm);
+            return true;
+        }
+    }
+    char *end;
+    errno = 0;
+    unsigned long long seconds = strtoull(s, &end, 10);
+    if (errno || end == s || *end)
+        return false;
+    *t = seconds;
+    return true;
+}
+
+static void usage(GOptionContext *context)
+{
+    gchar *help = g_option_context_get_help(context, TRUE, NULL);
+    fputs(help, stderr);
+    g_free(help);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    gchar *channel = NULL, *from = NULL, *text = NULL;
+    gchar *since = NULL, *until = NULL;
+    gchar *trace_include = NULL, *trace_exclude = NULL;
+    gint target_size = 1000000;
+    GOptionEntry entries[] = {
+        { "channel", 'c', 0, G_OPTION_ARG_STRING, &channel,
+          "Only messages on CHANNEL", "CHANNEL" },
+        { "from", 'f', 0, G_OPTION_ARG_STRING, &from,
+          "Only messages from NICK", "NICK" },
+        { "text", 't', 0, G_OPTION_ARG_STRING, &text,
+          "Only messages matching REGEXP (case-insensitive)", "REGEXP" },
+        { "since", 0, 0, G_OPTION_ARG_STRING, &since,
+          "Only messages at or after TIME (YYYY-MM-DD[THH:MM[:SS]] "
+          "or seconds since the epoch)", "TIME" },
+        { "until", 0, 0, G_OPTION_ARG_STRING, &until,
+          "Only messages before TIME", "TIME" },
+        { "target-size", 0, 0, G_OPTION_ARG_INT, &target_size,
+          "Merge segments up to BYTES (compact)", "BYTES" },
+        { "trace-include", 0, 0, G_OPTION_ARG_STRING, &trace_include,
+          "Include trace events", "REGEXP" },
+        { "trace-exclude", 0, 0, G_OPTION_ARG_STRING, &trace_exclude,
+          "Exclude trace events", "REGEXP" },
+        { NULL }
+    };
+    GOptionContext *context =
+        g_option_context_new("COMMAND [DIRECTORY] - lip message cache tool");
+    g_option_context_set_summary(context,
+                                 "Commands:\n"
+                                 "  grep     print matching messages\n"
+                                 "  export   print matching records as "
+                                 "JSON Lines\n"
+                                 "  verify   check record integrity\n"
+                                 "  compact  merge small rotated segments\n"
+                                 "  reindex  rewrite rotated segments into "
+                                 "seekable frames\n"
+                                 "\n"
+                                 "DIRECTORY defaults to ~/.cache/lip/main. "
+                                 "Do not run compact or reindex\n"
+                                 "while lip is running.");
+    g_option_context_add_main_entries(context, entries, NULL);
+    GError *error = NULL;
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "lip-logtool: %s\n", error->message);
+        g_error_free(error);
+        usage(context);
+    }
+    if (argc < 2 || argc > 3)
+        usage(context);
+    fstrace_t *trace = fstrace_direct(stderr);
+    fstrace_declare_globals(trace);
+    fstrace_select_regex(trace, trace_include, trace_exclude);
+    tool_t tool = {
+        .filter = {
+            .since = 0,
+            .until = ULLONG_MAX,
+        },
+    };
+    if (argc == 3)
+        tool.directory = charstr_dupstr(argv[2]);
+    else tool.directory =
+             charstr_printf("%s/%s", g_get_home_dir(), DEFAULT_CACHE_DIR);
+    if (channel)
+        tool.filter.channel_key = lcase_string(channel);
+    if (from)
+        tool.filter.from = charstr_dupstr(from);
+    if (text) {
+        tool.filter.text = g_regex_new(text, G_REGEX_CASELESS, 0, &error);
+        if (!tool.filter.text) {
+            fprintf(stderr, "lip-logtool: %s\n", error->message);
+            return EXIT_FAILURE;
+        }
+    }
+    if ((since && !parse_time(since, &tool.filter.since)) ||
+        (until && !parse_time(until, &tool.filter.until))) {
+        fprintf(stderr, "lip-logtool: bad time\n");
+        return EXIT_FAILURE;
+    }
+    g_mutex_init(&tool.lock);
+    g_cond_init(&tool.done);
+    const char *command = argv[1];
+    bool ok = false;
+    if (!strcmp(command, "grep")) {
+        tool.process = grep_segment;
+        ok = scan(&tool, stdout);
+    } else if (!strcmp(command, "export")) {
+        tool.process = export_segment;
+        ok = scan(&tool, stdout);
+    } else if (!strcmp(command, "verify")) {
+        tool.process = verify_segment;
+        ok = scan(&tool, stdout);
+    } else if (!strcmp(command, "compact"))
+        ok = compact(tool.directory, target_size);
+    else if (!strcmp(command, "reindex"))
+        ok = reindex(tool.directory);
+    else usage(context);
+    g_cond_clear(&tool.done);
+    g_mutex_clear(&tool.lock);
+    if (tool.filter.text)
+        g_regex_unref(tool.filter.text);
+    fsfree(tool.filter.from);
+    fsfree(tool.filter.channel_key);
+    fsfree(tool.directory);
+    g_option_context_free(context);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
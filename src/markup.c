@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fsdyn/charstr.h>
+#include "markup.h"
+
+const char *const BOLD_MARKUP = "🄱";
+const char *const ITALIC_MARKUP = "🄸";
+const char *const UNDERLINE_MARKUP = "🅄";
+const char *const ORIGINAL_MARKUP = "🄾";
+const char *const COLOR_MARKUP = "🄲";
+const char *const HIDE_MARKUP = "🗝";
+
+char *escape_xml(const char *text)
+{
+    list_t *snippets = make_list();
+    const char *p = text;
+    const char *q = p;
+    for (;;)
+        switch (*q) {
+            case '\0':
+                list_append(snippets, charstr_dupstr(p));
+                char *escaped = charstr_join("", snippets);
+                list_foreach(snippets, (void *) fsfree, NULL);
+                destroy_list(snippets);
+                return escaped;
+            case '&':
+                list_append(snippets, charstr_dupsubstr(p, q));
+                list_append(snippets, charstr_dupstr("&amp;"));
+                p = ++q;
+                break;
+            case '<':
+                list_append(snippets, charstr_dupsubstr(p, q));
+                list_append(snippets, charstr_dupstr("&lt;"));
+                p = ++q;
+                break;
+            default:
+                q++;
+        }
+}
+
+const char *adjust_style(const char *q, irc_text_style_t *style)
+{
+    switch (*q++) {
+        default:
+            abort();
+        case 'B' & 0x1f:
+            style->bold = !style->bold;
+            return q;
+        case 'O' & 0x1f:
+            style->bold = style->underline = style->italic = false;
+            style->fg_color = style->bg_color = -1U;
+            return q;
+        case 'R' & 0x1f:
+            style->italic = !style->italic;
+            return q;
+        case 'U' & 0x1f:
+            style->underline = !style->underline;
+            return q;
+        case 'C' & 0x1f:
+            ;
+    }
+    if (!(charstr_char_class(*q) & CHARSTR_DIGIT)) {
+        style->fg_color = style->bg_color = -1;
+        return q;
+    }
+    style->fg_color = *q++ - '0';
+    if (charstr_char_class(*q) & CHARSTR_DIGIT)
+        style->fg_color = style->fg_color * 10 + *q++ - '0';
+    if (q[0] != ',' || !(charstr_char_class(q[1]) & CHARSTR_DIGIT))
+        return q;
+    style->bg_color = *++q - '0';
+    if (charstr_char_class(*++q) & CHARSTR_DIGIT)
+        style->bg_color = style->bg_color * 10 + *q++ - '0';
+    return q;
+}
+
+char *markup_to_wire(const char *text)
+{
+    size_t length = strlen(text);
+    char *converted = fsalloc(length + 1);
+    char *q = converted;
+    const char *p = text;
+    const char *next;
+    for (; *p; p = next) {
+        if ((next = charstr_skip_prefix(p, BOLD_MARKUP)))
+            *q++ = BOLD_CONTROL;
+        else if ((next = charstr_skip_prefix(p, ITALIC_MARKUP)))
+            *q++ = ITALIC_CONTROL;
+        else if ((next = charstr_skip_prefix(p, UNDERLINE_MARKUP)))
+            *q++ = UNDERLINE_CONTROL;
+        else if ((next = charstr_skip_prefix(p, ORIGINAL_MARKUP)))
+            *q++ = ORIGINAL_CONTROL;
+        else if ((next = charstr_skip_prefix(p, COLOR_MARKUP)))
+            *q++ = COLOR_CONTROL;
+        else if (!(next = charstr_skip_prefix(p, HIDE_MARKUP))) {
+            next = charstr_decode_utf8_codepoint(p, NULL, NULL);
+            while (p != next)
+                *q++ = *p++;
+        }
+    }
+    *q = '\0';
+    return converted;
+}
+
+char *markup_to_archive(const char *text)
+{
+    size_t length = strlen(text);
+    char *converted = fsalloc(length + 1);
+    char *q = converted;
+    const char *p = text;
+    const char *next;
+    for (; *p; p = next)
+        if ((next = charstr_skip_prefix(p, BOLD_MARKUP)))
+            *q++ = BOLD_CONTROL;
+        else if ((next = charstr_skip_prefix(p, ITALIC_MARKUP)))
+            *q++ = ITALIC_CONTROL;
+        else if ((next = charstr_skip_prefix(p, UNDERLINE_MARKUP)))
+            *q++ = UNDERLINE_CONTROL;
+        else if ((next = charstr_skip_prefix(p, ORIGINAL_MARKUP)))
+            *q++ = ORIGINAL_CONTROL;
+        else if ((next = charstr_skip_prefix(p, COLOR_MARKUP)))
+            *q++ = COLOR_CONTROL;
+        else if ((next = charstr_skip_prefix(p, HIDE_MARKUP))) {
+            while (p != next)
+                *q++ = *p++;
+            for (; *p; p = next) {
+                if ((next = charstr_skip_prefix(p, HIDE_MARKUP)))
+                    break;
+                next = charstr_decode_utf8_codepoint(p, NULL, NULL);
+            }
+        } else {
+            next = charstr_decode_utf8_codepoint(p, NULL, NULL);
+            while (p != next)
+                *q++ = *p++;
+        }
+    *q = '\0';
+    return converted;
+}
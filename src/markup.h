@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include "core.h"
+
+/* The GUI input box marks styles up with these symbols; they are
+ * converted to mIRC control characters when the message is sent. */
+extern const char *const BOLD_MARKUP;
+extern const char *const ITALIC_MARKUP;
+extern const char *const UNDERLINE_MARKUP;
+extern const char *const ORIGINAL_MARKUP;
+extern const char *const COLOR_MARKUP;
+extern const char *const HIDE_MARKUP;
+
+typedef struct {
+    bool bold, underline, italic;
+    unsigned fg_color, bg_color;
+} irc_text_style_t;
+
+char *escape_xml(const char *text);
+
+/* q points to a control character. Return the position after the
+ * control sequence. */
+const char *adjust_style(const char *q, irc_text_style_t *style);
+
+/* Hidden text is dropped on the wire but kept in the archive. */
+char *markup_to_wire(const char *text);
+char *markup_to_archive(const char *text);
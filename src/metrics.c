@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <time.h>
+#include <fsdyn/fsalloc.h>
+#include "metrics.h"
+#include "stage.h"
+#include "watchdog.h"
+
+metrics_t metrics;
+
+static bool enabled;
+static struct timespec enabled_at;
+
+static void *(*system_realloc)(void *ptr, size_t size) = base_realloc;
+
+static void *counting_realloc(void *ptr, size_t size)
+{
+    if (!ptr && size)
+        atomic_fetch_add_explicit(&metrics.allocations, 1,
+                                  memory_order_relaxed);
+    return system_realloc(ptr, size);
+}
+
+void count_allocations(void)
+{
+    fs_set_reallocator(counting_realloc);
+}
+
+void enable_metrics(void)
+{
+    if (enabled)
+        return;
+    enabled = true;
+    clock_gettime(CLOCK_MONOTONIC, &enabled_at);
+    stage_timing = true;
+    count_allocations();
+}
+
+/* Roll the per-minute counts over to the given minute. */
+static void advance_minute(channel_t *channel, time_t minute)
+{
+    if (minute == channel->traffic.minute)
+        return;
+    if (minute == channel->traffic.minute + 1)
+        channel->traffic.previous = channel->traffic.current;
+    else channel->traffic.previous = 0;
+    channel->traffic.current = 0;
+    channel->traffic.minute = minute;
+}
+
+void count_channel_message(channel_t *channel, time_t t)
+{
+    advance_minute(channel, t / 60);
+    channel->traffic.current++;
+    channel->traffic.messages++;
+}
+
+unsigned channel_messages_last_minute(channel_t *channel)
+{
+    advance_minute(channel, time(NULL) / 60);
+    return channel->traffic.previous;
+}
+
+static json_thing_t *dump_stage(stage_t stage)
+{
+    stage_stats_t stats;
+    get_stage_stats(stage, &stats);
+    json_thing_t *result = json_make_object();
+    json_add_to_object(result, "count", json_make_unsigned(stats.count));
+    json_add_to_object(result, "mean_ns",
+                       json_make_unsigned(stats.count ?
+                                          stats.ns / stats.count : 0));
+    static const struct {
+        const char *name;
+        double fraction;
+    } percentiles[] = {
+        { "p50_ns", 0.5 },
+        { "p90_ns", 0.9 },
+        { "p99_ns", 0.99 },
+        { "p999_ns", 0.999 },
+    };
+    for (int i = 0; i < sizeof percentiles / sizeof percentiles[0]; i++)
+        json_add_to_object(result, percentiles[i].name,
+                           json_make_unsigned(
+                               stage_percentile(&stats,
+                                                percentiles[i].fraction)));
+    json_add_to_object(result, "max_ns", json_make_unsigned(stats.max_ns));
+    return result;
+}
+
+/* Exponentially weighted like TCP's SRTT with a gain of 1/8. */
+static void smooth(uint64_t *average, uint64_t sample, bool first)
+{
+    if (first)
+        *average = sample;
+    else *average = (*average * 7 + sample) / 8;
+}
+
+uint64_t lag_bucket_ceiling_ms(unsigned bucket)
+{
+    return UINT64_C(1) << bucket;
+}
+
+void count_lag(uint64_t network_us, uint64_t total_us)
+{
+    bool first = !metrics.lag.samples++;
+    smooth(&metrics.lag.rtt_us, network_us, first);
+    uint64_t local_us = total_us > network_us ? total_us - network_us : 0;
+    smooth(&metrics.lag.local_us, local_us, first);
+    unsigned bucket = 0;
+    while (bucket < LAG_BUCKETS - 1 &&
+           network_us >= lag_bucket_ceiling_ms(bucket) * 1000)
+        bucket++;
+    metrics.lag.buckets[bucket]++;
+}
+
+static json_thing_t *dump_lag(void)
+{
+    json_thing_t *result = json_make_object();
+    json_add_to_object(result, "samples",
+                       json_make_unsigned(metrics.lag.samples));
+    json_add_to_object(result, "rtt_us",
+                       json_make_unsigned(metrics.lag.rtt_us));
+    json_add_to_object(result, "local_us",
+                       json_make_unsigned(metrics.lag.local_us));
+    json_thing_t *buckets = json_make_array();
+    for (unsigned i = 0; i < LAG_BUCKETS; i++)
+        json_add_to_array(buckets, json_make_unsigned(metrics.lag.buckets[i]));
+    json_add_to_object(result, "buckets", buckets);
+    return result;
+}
+
+json_thing_t *dump_metrics(app_t *app)
+{
+    json_thing_t *dump = json_make_object();
+    if (enabled) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double seconds = now.tv_sec - enabled_at.tv_sec +
+            (now.tv_nsec - enabled_at.tv_nsec) * 1e-9;
+        json_add_to_object(dump, "timing_s", json_make_float(seconds));
+    }
+    json_add_to_object(dump, "messages",
+                       json_make_unsigned(atomic_load(&metrics.messages)));
+    json_add_to_object(dump, "bytes_received",
+                       json_make_unsigned(
+                           atomic_load(&metrics.bytes_received)));
+    json_add_to_object(dump, "bytes_sent",
+                       json_make_unsigned(atomic_load(&metrics.bytes_sent)));
+    json_add_to_object(dump, "allocations",
+                       json_make_unsigned(atomic_load(&metrics.allocations)));
+    json_add_to_object(dump, "reconnects",
+                       json_make_unsigned(metrics.reconnects));
+    if (metrics.reconnects) {
+        json_add_to_object(dump, "last_resume_ms",
+                           json_make_unsigned(metrics.resume_ms));
+        json_add_to_object(dump, "max_resume_ms",
+                           json_make_unsigned(metrics.max_resume_ms));
+    }
+    uint64_t connections = atomic_load(&metrics.tls_connections);
+    json_add_to_object(dump, "tls_connections",
+                       json_make_unsigned(connections));
+    if (connections)
+        json_add_to_object(dump, "tls_first_data_ms",
+                           json_make_unsigned(
+                               atomic_load(&metrics.tls_first_data_ms)));
+    json_add_to_object(dump, "lag", dump_lag());
+    json_thing_t *stages = json_make_object();
+    for (stage_t stage = 0; stage < STAGE_COUNT; stage++)
+        json_add_to_object(stages, stage_name(stage), dump_stage(stage));
+    json_add_to_object(dump, "stages", stages);
+    json_thing_t *channels = json_make_object();
+    for (avl_elem_t *ae = avl_tree_get_first(app->channels); ae;
+         ae = avl_tree_next(ae)) {
+        channel_t *channel = (channel_t *) avl_elem_get_value(ae);
+        json_thing_t *traffic = json_make_object();
+        json_add_to_object(traffic, "messages",
+                           json_make_unsigned(channel->traffic.messages));
+        json_add_to_object(traffic, "last_minute",
+                           json_make_unsigned(
+                               channel_messages_last_minute(channel)));
+        json_add_to_object(channels, channel->name, traffic);
+    }
+    json_add_to_object(dump, "channels", channels);
+    json_thing_t *stalls = json_make_array();
+    list_t *recent = get_stalls();
+    while (!list_empty(recent)) {
+        stall_t *stall = (stall_t *) list_pop_first(recent);
+        json_thing_t *entry = json_make_object();
+        json_add_to_object(entry, "time", json_make_integer(stall->t));
+        json_add_to_object(entry, "ms", json_make_unsigned(stall->ms));
+        if (stall->section)
+            json_add_to_object(entry, "section",
+                               json_make_string(stall->section));
+        if (stall->backtrace)
+            json_add_to_object(entry, "backtrace",
+                               json_make_string(stall->backtrace));
+        json_add_to_array(stalls, entry);
+        destroy_stall(stall);
+    }
+    destroy_list(recent);
+    json_add_to_object(dump, "stalls", stalls);
+    return dump;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <encjson.h>
+#include "core.h"
+
+/* Process-wide counters. The atomic ones are bumped by other threads:
+ * the traffic counters and the TLS connection figures by the network
+ * thread and allocations by every thread. The rest belong to the main
+ * thread. */
+enum {
+    LAG_BUCKETS = 16,           /* < 1 ms, < 2 ms, < 4 ms, ... */
+};
+
+typedef struct {
+    atomic_uint_fast64_t messages, bytes_received, bytes_sent;
+    uint64_t reconnects;
+    uint64_t resume_ms, max_resume_ms; /* from drop to rejoined */
+    struct {
+        uint64_t samples;
+        /* Smoothed: the round trip to the server and our own delay
+         * in handing the reply over to the main thread on top of it. */
+        uint64_t rtt_us, local_us;
+        uint64_t buckets[LAG_BUCKETS]; /* of the round trip */
+    } lag;
+    atomic_uint_fast64_t allocations;
+    atomic_uint_fast64_t tls_connections;
+    /* The latest, from TCP establishment to the first decrypted byte,
+     * i.e., the handshake plus however long the server takes to say
+     * something. asynctls does not report the end of the handshake. */
+    atomic_uint_fast64_t tls_first_data_ms;
+} metrics_t;
+
+extern metrics_t metrics;
+
+/* Start timing the stages and counting allocations; until somebody
+ * asks for the metrics, only the plain counters are kept. */
+void enable_metrics(void);
+/* Count the allocations in metrics.allocations without enabling the
+ * rest, e.g., for the benchmarks. */
+void count_allocations(void);
+/* Count a message logged on the channel at time t. */
+void count_channel_message(channel_t *channel, time_t t);
+/* Return the number of messages logged on the channel during the
+ * previous full minute. */
+unsigned channel_messages_last_minute(channel_t *channel);
+/* Count a reply to our PING: network_us is the round trip seen by the
+ * network thread and total_us the delay until the main thread saw the
+ * reply. */
+void count_lag(uint64_t network_us, uint64_t total_us);
+/* Return the upper bound of a lag bucket in milliseconds. */
+uint64_t lag_bucket_ceiling_ms(unsigned bucket);
+/* Return the counters, the stage latencies and the per-channel message
+ * rates. */
+json_thing_t *dump_metrics(app_t *app);
@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+#include <encjson.h>
+#include <fsdyn/charstr.h>
+#include <fsdyn/fsalloc.h>
+#include "util.h"
+#include "url.h"
+#include "benchsink.h"
+#include "metrics.h"
+#include "stage.h"
+
+/* Micro-benchmarks for the text processing done for every message. */
+
+enum {
+    CORPUS_LINES = 200,
+    NICKS = 50,
+    MANY_NICKS = 10000,
+    BUFFER_LINES = 500,         /* the text buffer is cleared in between */
+};
+
+typedef struct {
+    const char *name;
+    char *lines[CORPUS_LINES];
+    channel_t *channel;         /* for highlight_nicks() */
+} corpus_t;
+
+typedef struct {
+    const char *name;
+    /* Process a line; the result is freed by the caller. */
+    void *(*op)(corpus_t *corpus, const char *line, GtkTextBuffer *buffer);
+} function_t;
+
+static uint32_t rng = 2463534242;
+
+static uint32_t random_number(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static const char *pick(const char *const *words, size_t count)
+{
+    return words[random_number() % count];
+}
+
+static char *make_line(const char *const *words, size_t count,
+                       unsigned length)
+{
+    list_t *parts = make_list();
+    for (unsigned i = 0; i < length; i++)
+        list_append(parts, charstr_dupstr(pick(words, count)));
+    char *line = charstr_join(" ", parts);
+    list_foreach(parts, (void *) fsfree, NULL);
+    destroy_list(parts);
+    return line;
+}
+
+static const char *const ASCII_WORDS[] = {
+    "the", "build", "is", "green", "again", "anyone", "seen", "this",
+    "crash", "on", "startup?", "patch", "welcome", "release", "notes",
+    "lol", "ok", "<grin>", "&", "nick1:", "Nick22,",
+};
+
+static const char *const MIRC_WORDS[] = {
+    "\0034,12red\003", "\002bold\002", "\037under\037", "\035it\035",
+    "\0039green", "\00312,1blue\017", "plain", "\003", "\0031,0x\003",
+};
+
+static const char *const URL_WORDS[] = {
+    "see", "https://example.com/a/b?c=d", "http://[::1]:8080/x",
+    "www.example.org", "ftp://files.example.net/pub/", "and",
+    "https://en.wikipedia.org/wiki/IRC_(protocol)", "<https://x.y/z>",
+};
+
+static const char *const UTF8_WORDS[] = {
+    "日本語の", "テキスト", "Привет", "мир", "Καλημέρα", "κόσμε",
+    "räksmörgås", "😀", "中文", "한국어", "עברית", "العربية",
+};
+
+static channel_t *make_bench_channel(app_t *app, const char *name,
+                                     unsigned nicks)
+{
+    channel_t *channel = open_channel(app, name, -1U, false);
+    for (unsigned i = 0; i < nicks; i++) {
+        char *nick = charstr_printf("Nick%u", i);
+        list_append(channel->nicks_present, lcase_string(nick));
+        fsfree(nick);
+    }
+    return channel;
+}
+
+static void fill(corpus_t *corpus, const char *const *words, size_t count)
+{
+    for (int i = 0; i < CORPUS_LINES; i++)
+        corpus->lines[i] = make_line(words, count, 5 + random_number() % 20);
+}
+
+/* Replace the mIRC control characters with the input box markup. */
+static char *to_markup(const char *line)
+{
+    list_t *parts = make_list();
+    for (const char *p = line; *p; p++)
+        switch (*p) {
+            case BOLD_CONTROL:
+                list_append(parts, charstr_dupstr(BOLD_MARKUP));
+                break;
+            case ITALIC_CONTROL:
+                list_append(parts, charstr_dupstr(ITALIC_MARKUP));
+                break;
+            case UNDERLINE_CONTROL:
+                list_append(parts, charstr_dupstr(UNDERLINE_MARKUP));
+                break;
+            case ORIGINAL_CONTROL:
+                list_append(parts, charstr_dupstr(ORIGINAL_MARKUP));
+                break;
+            case COLOR_CONTROL:
+                list_append(parts, charstr_dupstr(COLOR_MARKUP));
+                break;
+            default:
+                list_append(parts, charstr_dupsubstr(p, p + 1));
+        }
+    char *markup = charstr_join("", parts);
+    list_foreach(parts, (void *) fsfree, NULL);
+    destroy_list(parts);
+    return markup;
+}
+
+static void *op_escape_xml(corpus_t *corpus, const char *line,
+                           GtkTextBuffer *buffer)
+{
+    return escape_xml(line);
+}
+
+static void *op_append_text(corpus_t *corpus, const char *line,
+                            GtkTextBuffer *buffer)
+{
+    append_text(buffer, line, "theirs");
+    return NULL;
+}
+
+static void *op_adjust_style(corpus_t *corpus, const char *line,
+                             GtkTextBuffer *buffer)
+{
+    irc_text_style_t style = { .fg_color = -1U, .bg_color = -1U };
+    for (const char *p = line; *p;)
+        switch (*p) {
+            case BOLD_CONTROL:
+            case COLOR_CONTROL:
+            case ORIGINAL_CONTROL:
+            case ITALIC_CONTROL:
+            case UNDERLINE_CONTROL:
+                p = adjust_style(p, &style);
+                break;
+            default:
+                p++;
+        }
+    return NULL;
+}
+
+static void *op_highlight_nicks(corpus_t *corpus, const char *line,
+                                GtkTextBuffer *buffer)
+{
+    return highlight_nicks(corpus->channel, line);
+}
+
+static void *op_highlight_urls(corpus_t *corpus, const char *line,
+                               GtkTextBuffer *buffer)
+{
+    return highlight_urls(line);
+}
+
+static void *op_find_url(corpus_t *corpus, const char *line,
+                         GtkTextBuffer *buffer)
+{
+    const char *url_end;
+    for (const char *p = line; find_url(p, NULL, &url_end); p = url_end)
+        ;
+    return NULL;
+}
+
+static void *op_markup_to_wire(corpus_t *corpus, const char *line,
+                               GtkTextBuffer *buffer)
+{
+    return markup_to_wire(line);
+}
+
+static void *op_markup_to_archive(corpus_t *corpus, const char *line,
+                                  GtkTextBuffer *buffer)
+{
+    return markup_to_archive(line);
+}
+
+static void *op_lcase_string(corpus_t *corpus, const char *line,
+                             GtkTextBuffer *buffer)
+{
+    return lcase_string(line);
+}
+
+static const function_t FUNCTIONS[] = {
+    { "escape_xml", op_escape_xml },
+    { "append_text", op_append_text },
+    { "adjust_style", op_adjust_style },
+    { "highlight_nicks", op_highlight_nicks },
+    { "highlight_urls", op_highlight_urls },
+    { "find_url", op_find_url },
+    { "markup_to_wire", op_markup_to_wire },
+    { "markup_to_archive", op_markup_to_archive },
+    { "lcase_string", op_lcase_string },
+};
+
+typedef struct {
+    uint64_t ops, ns, allocations;
+} measurement_t;
+
+static void measure(const function_t *function, corpus_t *corpus,
+                    uint64_t min_ns, GtkTextBuffer *buffer,
+                    measurement_t *m)
+{
+    *m = (measurement_t) { 0 };
+    while (m->ns < min_ns)
+        for (int i = 0; i < CORPUS_LINES; i++) {
+            if (m->ops % BUFFER_LINES == 0)
+                gtk_text_buffer_set_text(buffer, "", 0);
+            uint64_t before = atomic_load(&metrics.allocations);
+            uint64_t start = now_ns();
+            void *result = function->op(corpus, corpus->lines[i], buffer);
+            m->ns += now_ns() - start;
+            m->allocations += atomic_load(&metrics.allocations) - before;
+            fsfree(result);
+            m->ops++;
+        }
+}
+
+static double per_op(uint64_t total, uint64_t ops)
+{
+    return ops ? (double) total / ops : 0;
+}
+
+static json_thing_t *load_baseline(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return NULL;
+    json_thing_t *baseline = json_utf8_decode_file(f, 10000000);
+    fclose(f);
+    if (baseline && json_thing_type(baseline) != JSON_OBJECT) {
+        json_destroy_thing(baseline);
+        return NULL;
+    }
+    return baseline;
+}
+
+/* The baseline stores exact totals; the ratios are recomputed. */
+static bool get_baseline(json_thing_t *baseline, const char *key,
+                         measurement_t *m)
+{
+    json_thing_t *entry;
+    unsigned long long ops, ns, allocs;
+    if (!baseline || !json_object_get_object(baseline, key, &entry) ||
+        !json_object_get_unsigned(entry, "ops", &ops) ||
+        !json_object_get_unsigned(entry, "ns", &ns) ||
+        !json_object_get_unsigned(entry, "allocations", &allocs) || !ops)
+        return false;
+    *m = (measurement_t) { .ops = ops, .ns = ns, .allocations = allocs };
+    return true;
+}
+
+static void usage(GOptionContext *context)
+{
+    gchar *help = g_option_context_get_help(context, TRUE, NULL);
+    fputs(help, stderr);
+    g_free(help);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    gchar *filter = NULL, *baseline_path = NULL, *save_path = NULL;
+    gboolean json = FALSE;
+    gint min_ms = 200;
+    GOptionEntry entries[] = {
+        { "filter", 'f', 0, G_OPTION_ARG_STRING, &filter,
+          "Only benchmarks (FUNCTION/CORPUS) matching REGEXP", "REGEXP" },
+        { "min-time", 't', 0, G_OPTION_ARG_INT, &min_ms,
+          "Run each benchmark for at least MS milliseconds (default 200)",
+          "MS" },
+        { "baseline", 'b', 0, G_OPTION_ARG_FILENAME, &baseline_path,
+          "Compare against results saved earlier", "PATH" },
+        { "save", 's', 0, G_OPTION_ARG_FILENAME, &save_path,
+          "Save the results as a baseline", "PATH" },
+        { "json", 0, 0, G_OPTION_ARG_NONE, &json,
+          "Print the results in JSON", NULL },
+        { NULL }
+    };
+    GOptionContext *context =
+        g_option_context_new("- lip text processing micro-benchmarks");
+    g_option_context_add_main_entries(context, entries, NULL);
+    GError *error = NULL;
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "lip-microbench: %s\n", error->message);
+        g_error_free(error);
+        usage(context);
+    }
+    if (argc != 1 || min_ms < 1)
+        usage(context);
+    GRegex *selection = NULL;
+    if (filter) {
+        selection = g_regex_new(filter, 0, 0, &error);
+        if (!selection) {
+            fprintf(stderr, "lip-microbench: %s\n", error->message);
+            return EXIT_FAILURE;
+        }
+    }
+    json_thing_t *baseline = NULL;
+    if (baseline_path && !(baseline = load_baseline(baseline_path))) {
+        fprintf(stderr, "lip-microbench: cannot read %s\n", baseline_path);
+        return EXIT_FAILURE;
+    }
+    gtk_init_check(NULL, NULL);
+    GtkTextBuffer *buffer = gtk_text_buffer_new(NULL);
+    bench_sink_t sink = { 0 };
+    app_t app = {
+        .config = {
+            .nick = charstr_dupstr("nick1"),
+        },
+        .channels = make_avl_tree((void *) strcmp),
+        .sink = bench_sink(&sink),
+    };
+    corpus_t corpora[] = {
+        { "ascii" }, { "mirc" }, { "urls" }, { "utf8" }, { "nicks" },
+        { "markup" },
+    };
+    fill(&corpora[0], ASCII_WORDS, G_N_ELEMENTS(ASCII_WORDS));
+    fill(&corpora[1], MIRC_WORDS, G_N_ELEMENTS(MIRC_WORDS));
+    fill(&corpora[2], URL_WORDS, G_N_ELEMENTS(URL_WORDS));
+    fill(&corpora[3], UTF8_WORDS, G_N_ELEMENTS(UTF8_WORDS));
+    fill(&corpora[4], ASCII_WORDS, G_N_ELEMENTS(ASCII_WORDS));
+    for (int i = 0; i < CORPUS_LINES; i++)
+        corpora[5].lines[i] = to_markup(corpora[1].lines[i]);
+    channel_t *channel = make_bench_channel(&app, "#bench", NICKS);
+    channel_t *big_channel =
+        make_bench_channel(&app, "#crowd", MANY_NICKS);
+    for (size_t i = 0; i < G_N_ELEMENTS(corpora); i++)
+        corpora[i].channel = channel;
+    corpora[4].channel = big_channel;
+    json_thing_t *results = json_make_object();
+    count_allocations();
+    for (size_t f = 0; f < G_N_ELEMENTS(FUNCTIONS); f++)
+        for (size_t c = 0; c < G_N_ELEMENTS(corpora); c++) {
+            char *key =
+                charstr_printf("%s/%s", FUNCTIONS[f].name, corpora[c].name);
+            if (selection && !g_regex_match(selection, key, 0, NULL)) {
+                fsfree(key);
+                continue;
+            }
+            measurement_t m;
+            reset_alloc_stats();
+            measure(&FUNCTIONS[f], &corpora[c], min_ms * UINT64_C(1000000),
+                    buffer, &m);
+            json_thing_t *alloc_stats = alloc_stats_json();
+            double ns = per_op(m.ns, m.ops);
+            double allocs = per_op(m.allocations, m.ops);
+            json_thing_t *result = json_make_object();
+            json_add_to_object(result, "ns_per_op", json_make_float(ns));
+            json_add_to_object(result, "allocs_per_op",
+                               json_make_float(allocs));
+            json_add_to_object(result, "ops", json_make_unsigned(m.ops));
+            json_add_to_object(result, "ns", json_make_unsigned(m.ns));
+            json_add_to_object(result, "allocations",
+                               json_make_unsigned(m.allocations));
+            if (alloc_stats)
+                json_add_to_object(result, "alloc_stats", alloc_stats);
+            measurement_t base = { 0 };
+            bool compared = get_baseline(baseline, key, &base);
+            double base_ns = per_op(base.ns, base.ops);
+            double base_allocs = per_op(base.allocations, base.ops);
+            if (compared) {
+                json_add_to_object(result, "ns_change",
+                                   json_make_float(ns / base_ns - 1));
+                json_add_to_object(result, "allocs_change",
+                                   json_make_float(allocs - base_allocs));
+            }
+            json_add_to_object(results, key, result);
+            if (!json && compared)
+                printf("%-28s %10.1f ns/op %+7.1f%% %8.2f allocs/op %+.2f\n",
+                       key, ns, 100 * (ns / base_ns - 1), allocs,
+                       allocs - base_allocs);
+            else if (!json)
+                printf("%-28s %10.1f ns/op %8.2f allocs/op\n",
+                       key, ns, allocs);
+            fflush(stdout);
+            fsfree(key);
+        }
+    if (json) {
+        json_utf8_dump(results, stdout);
+        putchar('\n');
+    }
+    bool ok = true;
+    if (save_path) {
+        FILE *f = fopen(save_path, "w");
+        if (f) {
+            json_utf8_dump(results, f);
+            fclose(f);
+        } else {
+            fprintf(stderr, "lip-microbench: cannot write %s\n", save_path);
+            ok = false;
+        }
+    }
+    json_destroy_thing(results);
+    if (baseline)
+        json_destroy_thing(baseline);
+    for (size_t c = 0; c < G_N_ELEMENTS(corpora); c++)
+        for (int i = 0; i < CORPUS_LINES; i++)
+            fsfree(corpora[c].lines[i]);
+    while (!avl_tree_empty(app.channels)) {
+        avl_elem_t *ae = avl_tree_pop_first(app.channels);
+        channel_t *channel = (channel_t *) avl_elem_get_value(ae);
+        destroy_avl_element(ae);
+        destroy_channel(channel);
+    }
+    destroy_avl_tree(app.channels);
+    fsfree(app.config.nick);
+    g_object_unref(buffer);
+    if (selection)
+        g_regex_unref(selection);
+    g_option_context_free(context);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,647 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <glib.h>
+#include <async/async.h>
+#include <async/tcp_connection.h>
+#include <async/tls_connection.h>
+#include <async/queuestream.h>
+#include <async/stringstream.h>
+#include <encjson.h>
+#include <fsdyn/charstr.h>
+#include <fsdyn/list.h>
+#include <fstrace.h>
+
+/* A mock IRC server for load testing lip on loopback. Every registered
+ * client receives the traffic of the simulated channels #load0,
+ * #load1, ... Each PRIVMSG begins with "LAT<t>", where t is the
+ * g_get_monotonic_time() of the send. Run lip with
+ * --trace-include=IRC_PLAY_MESSAGE and feed the trace to --latency to
+ * get the end-to-end latency percentiles.
+ *
+ * To time the startup replay, autojoin #load0... in lip, run it once
+ * to fill the cache and then again with
+ * --trace-include='IRC_PLAY_MESSAGE|IRC_AUTOJOIN_READY'; --latency
+ * reports the time until every autojoined window had its history. */
+
+static const char *const SERVER_NAME = "irc.mock.example";
+
+enum {
+    TICK_MS = 10,
+    SPLIT_HEAL_S = 5,
+    NAMES_LINE_MAX = 400,
+};
+
+typedef struct mockd mockd_t;
+
+typedef struct {
+    mockd_t *mockd;
+    list_elem_t *loc;           /* in mockd->clients */
+    tcp_conn_t *tcp_conn;
+    tls_conn_t *tls_conn;       /* or NULL */
+    queuestream_t *outq;
+    bytestream_1 input;
+    char input_buffer[512];
+    size_t input_size;
+    char *nick;
+    bool has_user, registered;
+    bool negotiating;           /* between CAP LS and CAP END */
+    bool tagged;                /* server-time, message-tags and batch */
+    unsigned batches;           /* started so far */
+} client_t;
+
+struct mockd {
+    struct {
+        int port;
+        gboolean ipv6;          /* ::1 instead of 127.0.0.1 */
+        char *tls_cert, *tls_key;
+        int channels, rate, users, names;
+        int storm_interval, storm_size;
+        int netsplit_interval;
+        int playback;
+        int duration;
+    } opts;
+    async_t *async;
+    tcp_server_t *server;
+    list_t *clients;            /* of client_t */
+    double *credit;             /* per channel */
+    uint32_t rng;
+    uint64_t last_tick, next_storm, next_netsplit, heal_split;
+    uint64_t started;
+    size_t sent;
+};
+
+static uint32_t random_number(mockd_t *mockd)
+{
+    /* xorshift32 */
+    uint32_t x = mockd->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return mockd->rng = x;
+}
+
+static void send_line(client_t *client, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    char *line = charstr_vprintf(format, ap);
+    va_end(ap);
+    char *crlf = charstr_printf("%s\r\n", line);
+    fsfree(line);
+    stringstream_t *sstr = copy_stringstream(client->mockd->async, crlf);
+    fsfree(crlf);
+    queuestream_enqueue(client->outq, stringstream_as_bytestream_1(sstr));
+}
+
+static void broadcast(mockd_t *mockd, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    char *line = charstr_vprintf(format, ap);
+    va_end(ap);
+    for (list_elem_t *e = list_get_first(mockd->clients); e;
+         e = list_next(e)) {
+        client_t *client = (client_t *) list_elem_get_value(e);
+        if (client->registered)
+            send_line(client, "%s", line);
+    }
+    fsfree(line);
+}
+
+static const char *const WORDS[] = {
+    "the", "build", "is", "green", "again", "anyone", "seen", "this",
+    "crash", "on", "startup", "?", "patch", "welcome", "release", "notes",
+    "räksmörgås", "日本語", "https://example.com/issue/42", "lol", "ok",
+};
+
+static char *chatter(mockd_t *mockd, const char *mention)
+{
+    list_t *words = make_list();
+    list_append(words, charstr_printf("LAT%lld",
+                                      (long long) g_get_monotonic_time()));
+    if (mention && random_number(mockd) % 10 == 0)
+        list_append(words, charstr_printf("%s:", mention));
+    unsigned count = 3 + random_number(mockd) % 12;
+    for (unsigned i = 0; i < count; i++) {
+        unsigned k = random_number(mockd) % G_N_ELEMENTS(WORDS);
+        list_append(words, charstr_dupstr(WORDS[k]));
+    }
+    char *text = charstr_join(" ", words);
+    list_foreach(words, (void *) fsfree, NULL);
+    destroy_list(words);
+    return text;
+}
+
+static void post(mockd_t *mockd, client_t *client, int channel)
+{
+    unsigned user = random_number(mockd) % mockd->opts.users;
+    char *text = chatter(mockd, client->nick);
+    send_line(client, ":user%u!u%u@users.mock.example PRIVMSG #load%d :%s",
+              user, user, channel, text);
+    fsfree(text);
+    mockd->sent++;
+}
+
+static void send_names(client_t *client, const char *channel)
+{
+    mockd_t *mockd = client->mockd;
+    char *names = charstr_dupstr("");
+    for (int i = 0; i < mockd->opts.names; i++) {
+        char *more = charstr_printf("%s%s%suser%d", names, *names ? " " : "",
+                                    i % 20 ? "" : "@", i);
+        fsfree(names);
+        names = more;
+        if (strlen(names) >= NAMES_LINE_MAX || i + 1 == mockd->opts.names) {
+            send_line(client, ":%s 353 %s = %s :%s", SERVER_NAME,
+                      client->nick, channel, names);
+            fsfree(names);
+            names = charstr_dupstr("");
+        }
+    }
+    fsfree(names);
+    send_line(client, ":%s 366 %s %s :End of /NAMES list.", SERVER_NAME,
+              client->nick, channel);
+}
+
+/* Bouncer-style playback right after the join. A client that has
+ * enabled the IRCv3 capabilities gets it as a batch of messages
+ * stamped an hour back, one second apart. */
+static void play_back(client_t *client, const char *channel)
+{
+    mockd_t *mockd = client->mockd;
+    if (!mockd->opts.playback)
+        return;
+    unsigned ref = ++client->batches;
+    if (client->tagged)
+        send_line(client, ":%s BATCH +pb%u chathistory %s", SERVER_NAME, ref,
+                  channel);
+    time_t start = time(NULL) - 3600;
+    for (int i = 0; i < mockd->opts.playback; i++) {
+        unsigned user = random_number(mockd) % mockd->opts.users;
+        char *text = chatter(mockd, NULL);
+        if (client->tagged) {
+            time_t t = start + i;
+            struct tm tm;
+            gmtime_r(&t, &tm);
+            char stamp[32];
+            strftime(stamp, sizeof stamp, "%FT%T.000Z", &tm);
+            send_line(client,
+                      "@batch=pb%u;time=%s :user%u!u%u@users.mock.example "
+                      "PRIVMSG %s :%s",
+                      ref, stamp, user, user, channel, text);
+        } else send_line(client,
+                         ":user%u!u%u@users.mock.example PRIVMSG %s :%s",
+                         user, user, channel, text);
+        fsfree(text);
+        mockd->sent++;
+    }
+    if (client->tagged)
+        send_line(client, ":%s BATCH -pb%u", SERVER_NAME, ref);
+}
+
+static void welcome(client_t *client)
+{
+    client->registered = true;
+    send_line(client, ":%s 001 %s :Welcome to the mock network %s",
+              SERVER_NAME, client->nick, client->nick);
+    send_line(client, ":%s 372 %s :- This server is for testing only.",
+              SERVER_NAME, client->nick);
+    send_line(client, ":%s 376 %s :End of /MOTD command.", SERVER_NAME,
+              client->nick);
+}
+
+FSTRACE_DECL(IRC_MOCKD_COMMAND, "NICK=%s LINE=%s");
+
+static void act(client_t *client, char *line)
+{
+    FSTRACE(IRC_MOCKD_COMMAND, client->nick, line);
+    if (*line == ':') {
+        line = strchr(line, ' ');
+        if (!line)
+            return;
+        line++;
+    }
+    list_t *words = charstr_split(line, ' ', 2);
+    const char *command = list_elem_get_value(list_get_first(words));
+    list_elem_t *e = list_next(list_get_first(words));
+    const char *arg = e ? list_elem_get_value(e) : "";
+    if (*arg == ':')
+        arg++;
+    if (!strcmp(command, "CAP")) {
+        const char *target = client->nick ? client->nick : "*";
+        if (charstr_skip_prefix(arg, "LS")) {
+            client->negotiating = true;
+            send_line(client, ":%s CAP %s LS :server-time message-tags batch",
+                      SERVER_NAME, target);
+        } else if (charstr_skip_prefix(arg, "REQ")) {
+            const char *caps = strchr(arg, ':');
+            client->tagged = true;
+            send_line(client, ":%s CAP %s ACK :%s", SERVER_NAME, target,
+                      caps ? caps + 1 : "");
+        } else if (!strcmp(arg, "END")) {
+            client->negotiating = false;
+            if (client->nick && client->has_user && !client->registered)
+                welcome(client);
+        }
+    } else if (!strcmp(command, "NICK")) {
+        fsfree(client->nick);
+        client->nick = charstr_dupstr(arg);
+        if (client->has_user && !client->negotiating && !client->registered)
+            welcome(client);
+    } else if (!strcmp(command, "USER")) {
+        client->has_user = true;
+        if (client->nick && !client->negotiating && !client->registered)
+            welcome(client);
+    } else if (!strcmp(command, "PING"))
+        send_line(client, ":%s PONG %s :%s", SERVER_NAME, SERVER_NAME, arg);
+    else if (!strcmp(command, "JOIN") && client->registered) {
+        list_t *channels = charstr_split(arg, ',', -1U);
+        for (list_elem_t *ce = list_get_first(channels); ce;
+             ce = list_next(ce)) {
+            const char *channel = list_elem_get_value(ce);
+            send_line(client, ":%s!%s@client.mock.example JOIN %s",
+                      client->nick, client->nick, channel);
+            send_names(client, channel);
+            play_back(client, channel);
+        }
+        list_foreach(channels, (void *) fsfree, NULL);
+        destroy_list(channels);
+    }
+    list_foreach(words, (void *) fsfree, NULL);
+    destroy_list(words);
+}
+
+FSTRACE_DECL(IRC_MOCKD_DISCONNECTED, "NICK=%s");
+
+static void close_client(client_t *client)
+{
+    FSTRACE(IRC_MOCKD_DISCONNECTED, client->nick);
+    list_remove(client->mockd->clients, client->loc);
+    if (client->tls_conn)
+        tls_close(client->tls_conn);
+    tcp_close(client->tcp_conn);
+    fsfree(client->nick);
+    fsfree(client);
+}
+
+static void receive(client_t *client)
+{
+    for (;;) {
+        char *buffer = client->input_buffer;
+        size_t room = sizeof client->input_buffer - client->input_size;
+        if (!room) {
+            close_client(client);   /* line too long */
+            return;
+        }
+        ssize_t count =
+            bytestream_1_read(client->input, buffer + client->input_size,
+                              room);
+        if (count < 0) {
+            if (errno != EAGAIN)
+                close_client(client);
+            return;
+        }
+        if (count == 0) {
+            close_client(client);
+            return;
+        }
+        client->input_size += count;
+        char *base = buffer, *end = buffer + client->input_size;
+        for (char *p = base; p < end; p++)
+            if (*p == '\n') {
+                *p = '\0';
+                if (p > base && p[-1] == '\r')
+                    p[-1] = '\0';
+                act(client, base);
+                base = p + 1;
+            }
+        client->input_size = end - base;
+        memmove(buffer, base, client->input_size);
+    }
+}
+
+FSTRACE_DECL(IRC_MOCKD_ACCEPTED, "TLS=%d");
+
+static void accept_clients(mockd_t *mockd)
+{
+    tcp_conn_t *tcp_conn;
+    while ((tcp_conn = tcp_accept(mockd->server, NULL, NULL))) {
+        client_t *client = fsalloc(sizeof *client);
+        *client = (client_t) {
+            .mockd = mockd,
+            .tcp_conn = tcp_conn,
+            .outq = make_queuestream(mockd->async),
+        };
+        bytestream_1 plain_output = queuestream_as_bytestream_1(client->outq);
+        bytestream_1 tcp_input = tcp_get_input_stream(tcp_conn);
+        if (mockd->opts.tls_cert) {
+            client->tls_conn =
+                open_tls_server_2(mockd->async, tcp_input,
+                                  mockd->opts.tls_cert, mockd->opts.tls_key);
+            tcp_set_output_stream(tcp_conn,
+                                  tls_get_encrypted_output_stream(
+                                      client->tls_conn));
+            tls_set_plain_output_stream(client->tls_conn, plain_output);
+            client->input = tls_get_plain_input_stream(client->tls_conn);
+        } else {
+            tcp_set_output_stream(tcp_conn, plain_output);
+            client->input = tcp_input;
+        }
+        client->loc = list_append(mockd->clients, client);
+        FSTRACE(IRC_MOCKD_ACCEPTED, client->tls_conn != NULL);
+        action_1 receive_cb = { client, (act_1) receive };
+        bytestream_1_register_callback(client->input, receive_cb);
+        async_execute(mockd->async, receive_cb);
+    }
+}
+
+/* A JOIN/PART/QUIT storm on a random channel. */
+static void storm(mockd_t *mockd)
+{
+    int channel = random_number(mockd) % mockd->opts.channels;
+    for (int i = 0; i < mockd->opts.storm_size; i++) {
+        unsigned guest = random_number(mockd);
+        broadcast(mockd, ":guest%u!g@guests.mock.example JOIN #load%d",
+                  guest, channel);
+        if (random_number(mockd) % 2)
+            broadcast(mockd, ":guest%u!g@guests.mock.example PART #load%d",
+                      guest, channel);
+        else broadcast(mockd, ":guest%u!g@guests.mock.example QUIT :Bye",
+                       guest);
+    }
+}
+
+/* Half of the users quit at once; they come back after a while. */
+static void netsplit(mockd_t *mockd, bool heal)
+{
+    for (int user = mockd->opts.users / 2; user < mockd->opts.users; user++)
+        if (!heal)
+            broadcast(mockd, ":user%d!u%d@users.mock.example QUIT "
+                      ":%s split.mock.example", user, user, SERVER_NAME);
+        else for (int channel = 0; channel < mockd->opts.channels; channel++)
+                 broadcast(mockd, ":user%d!u%d@users.mock.example JOIN "
+                           "#load%d", user, user, channel);
+}
+
+FSTRACE_DECL(IRC_MOCKD_DONE, "SENT=%z");
+
+static void tick(mockd_t *mockd)
+{
+    uint64_t now = async_now(mockd->async);
+    if (mockd->opts.duration &&
+        now - mockd->started >= mockd->opts.duration * ASYNC_S) {
+        FSTRACE(IRC_MOCKD_DONE, mockd->sent);
+        fprintf(stderr, "lip-mockd: sent %zu messages\n", mockd->sent);
+        async_quit_loop(mockd->async);
+        return;
+    }
+    double elapsed = (double) (now - mockd->last_tick) / ASYNC_S;
+    mockd->last_tick = now;
+    for (int channel = 0; channel < mockd->opts.channels; channel++) {
+        mockd->credit[channel] += mockd->opts.rate * elapsed;
+        for (; mockd->credit[channel] >= 1; mockd->credit[channel]--)
+            for (list_elem_t *e = list_get_first(mockd->clients); e;
+                 e = list_next(e)) {
+                client_t *client = (client_t *) list_elem_get_value(e);
+                if (client->registered)
+                    post(mockd, client, channel);
+            }
+    }
+    if (mockd->next_storm && now >= mockd->next_storm) {
+        storm(mockd);
+        mockd->next_storm = now + mockd->opts.storm_interval * ASYNC_S;
+    }
+    if (mockd->heal_split && now >= mockd->heal_split) {
+        netsplit(mockd, true);
+        mockd->heal_split = 0;
+    }
+    if (mockd->next_netsplit && now >= mockd->next_netsplit) {
+        netsplit(mockd, false);
+        mockd->heal_split = now + SPLIT_HEAL_S * ASYNC_S;
+        mockd->next_netsplit = now + mockd->opts.netsplit_interval * ASYNC_S;
+    }
+    async_timer_start(mockd->async, now + TICK_MS * ASYNC_MS,
+                      (action_1) { mockd, (act_1) tick });
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static bool get_number(const char *line, const char *field, int64_t *value)
+{
+    const char *p = strstr(line, field);
+    if (!p)
+        return false;
+    char *end;
+    *value = strtoll(p + strlen(field), &end, 10);
+    return end != p + strlen(field);
+}
+
+/* Read the IRC_PLAY_MESSAGE events of a lip trace and report the
+ * latency percentiles in microseconds, along with the last
+ * IRC_AUTOJOIN_READY. */
+static bool report_latency(const char *path, bool json)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "lip-mockd: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    GArray *latencies = g_array_new(FALSE, FALSE, sizeof(int64_t));
+    int64_t autojoins = -1, autojoin_us = -1;
+    char line[4096];
+    while (fgets(line, sizeof line, f)) {
+        int64_t played, sent;
+        if (strstr(line, " IRC_AUTOJOIN_READY ")) {
+            get_number(line, "CHANNELS=", &autojoins);
+            get_number(line, "DURATION-US=", &autojoin_us);
+        } else if (strstr(line, " IRC_PLAY_MESSAGE ") &&
+            get_number(line, "MONOTONIC-US=", &played) &&
+            get_number(line, "TEXT=LAT", &sent)) {
+            int64_t latency = played - sent;
+            g_array_append_val(latencies, latency);
+        }
+    }
+    fclose(f);
+    size_t count = latencies->len;
+    int64_t *values = (int64_t *) latencies->data;
+    qsort(values, count, sizeof *values, compare_latencies);
+    static const double percentiles[] = { 50, 90, 99, 99.9, 100 };
+    json_thing_t *report = json_make_object();
+    json_add_to_object(report, "messages", json_make_unsigned(count));
+    if (!json)
+        printf("%zu messages\n", count);
+    for (size_t i = 0; count && i < G_N_ELEMENTS(percentiles); i++) {
+        size_t k = (size_t) (percentiles[i] / 100 * (count - 1) + 0.5);
+        char *name = charstr_printf("p%g_us", percentiles[i]);
+        json_add_to_object(report, name, json_make_integer(values[k]));
+        if (!json)
+            printf("  p%-5g %10.3f ms\n", percentiles[i], values[k] / 1e3);
+        fsfree(name);
+    }
+    if (autojoin_us >= 0) {
+        json_add_to_object(report, "autojoins",
+                           json_make_integer(autojoins));
+        json_add_to_object(report, "autojoin_ready_us",
+                           json_make_integer(autojoin_us));
+        if (!json)
+            printf("%lld autojoined channels ready in %.3f ms\n",
+                   (long long) autojoins, autojoin_us / 1e3);
+    }
+    if (json) {
+        json_utf8_dump(report, stdout);
+        putchar('\n');
+    }
+    json_destroy_thing(report);
+    g_array_free(latencies, TRUE);
+    return count > 0 || autojoin_us >= 0;
+}
+
+static void usage(GOptionContext *context)
+{
+    gchar *help = g_option_context_get_help(context, TRUE, NULL);
+    fputs(help, stderr);
+    g_free(help);
+    exit(EXIT_FAILURE);
+}
+
+static bool listen_on_loopback(mockd_t *mockd)
+{
+    if (mockd->opts.ipv6) {
+        struct sockaddr_in6 address = {
+            .sin6_family = AF_INET6,
+            .sin6_port = htons(mockd->opts.port),
+            .sin6_addr = IN6ADDR_LOOPBACK_INIT,
+        };
+        mockd->server = tcp_listen(mockd->async,
+                                   (struct sockaddr *) &address,
+                                   sizeof address);
+    } else {
+        struct sockaddr_in address = {
+            .sin_family = AF_INET,
+            .sin_port = htons(mockd->opts.port),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        };
+        mockd->server = tcp_listen(mockd->async,
+                                   (struct sockaddr *) &address,
+                                   sizeof address);
+    }
+    if (!mockd->server)
+        return false;
+    action_1 accept_cb = { mockd, (act_1) accept_clients };
+    tcp_register_server_callback(mockd->server, accept_cb);
+    async_execute(mockd->async, accept_cb);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    mockd_t mockd = {
+        .opts = {
+            .port = 6667,
+            .channels = 10,
+            .rate = 1,
+            .users = 100,
+            .names = -1,
+            .storm_size = 50,
+        },
+        .rng = 2463534242,
+    };
+    gchar *latency = NULL, *trace_include = NULL, *trace_exclude = NULL;
+    gboolean json = FALSE;
+    GOptionEntry entries[] = {
+        { "port", 'p', 0, G_OPTION_ARG_INT, &mockd.opts.port,
+          "Listen on 127.0.0.1:PORT (default 6667)", "PORT" },
+        { "ipv6", '6', 0, G_OPTION_ARG_NONE, &mockd.opts.ipv6,
+          "Listen on [::1]:PORT instead", NULL },
+        { "tls-cert", 0, 0, G_OPTION_ARG_FILENAME, &mockd.opts.tls_cert,
+          "Serve TLS with the PEM certificate chain", "PATH" },
+        { "tls-key", 0, 0, G_OPTION_ARG_FILENAME, &mockd.opts.tls_key,
+          "The PEM private key for --tls-cert", "PATH" },
+        { "channels", 'c', 0, G_OPTION_ARG_INT, &mockd.opts.channels,
+          "Simulate COUNT channels #load0... (default 10)", "COUNT" },
+        { "rate", 'r', 0, G_OPTION_ARG_INT, &mockd.opts.rate,
+          "Messages per second per channel (default 1)", "RATE" },
+        { "users", 'u', 0, G_OPTION_ARG_INT, &mockd.opts.users,
+          "Simulated users (default 100)", "COUNT" },
+        { "names", 0, 0, G_OPTION_ARG_INT, &mockd.opts.names,
+          "Nicks in a NAMES reply (default: --users)", "COUNT" },
+        { "storm-interval", 0, 0, G_OPTION_ARG_INT,
+          &mockd.opts.storm_interval,
+          "A JOIN/PART/QUIT storm every SECONDS", "SECONDS" },
+        { "storm-size", 0, 0, G_OPTION_ARG_INT, &mockd.opts.storm_size,
+          "Guests per storm (default 50)", "COUNT" },
+        { "netsplit-interval", 0, 0, G_OPTION_ARG_INT,
+          &mockd.opts.netsplit_interval,
+          "A netsplit every SECONDS", "SECONDS" },
+        { "playback", 0, 0, G_OPTION_ARG_INT, &mockd.opts.playback,
+          "Play back COUNT messages after each JOIN", "COUNT" },
+        { "duration", 'd', 0, G_OPTION_ARG_INT, &mockd.opts.duration,
+          "Exit after SECONDS", "SECONDS" },
+        { "latency", 0, 0, G_OPTION_ARG_FILENAME, &latency,
+          "Report latency percentiles from a lip trace and exit", "PATH" },
+        { "json", 0, 0, G_OPTION_ARG_NONE, &json,
+          "Report in JSON", NULL },
+        { "trace-include", 0, 0, G_OPTION_ARG_STRING, &trace_include,
+          "Include trace events", "REGEXP" },
+        { "trace-exclude", 0, 0, G_OPTION_ARG_STRING, &trace_exclude,
+          "Exclude trace events", "REGEXP" },
+        { NULL }
+    };
+    GOptionContext *context =
+        g_option_context_new("- mock IRC server for load testing lip");
+    g_option_context_add_main_entries(context, entries, NULL);
+    GError *error = NULL;
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "lip-mockd: %s\n", error->message);
+        g_error_free(error);
+        usage(context);
+    }
+    if (argc != 1 || mockd.opts.channels < 0 || mockd.opts.rate < 0 ||
+        mockd.opts.users < 1 || mockd.opts.storm_size < 0 ||
+        !mockd.opts.tls_cert != !mockd.opts.tls_key)
+        usage(context);
+    if (latency)
+        return report_latency(latency, json) ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (mockd.opts.names < 0)
+        mockd.opts.names = mockd.opts.users;
+    fstrace_t *trace = fstrace_direct(stderr);
+    fstrace_declare_globals(trace);
+    fstrace_select_regex(trace, trace_include, trace_exclude);
+    mockd.async = make_async();
+    mockd.clients = make_list();
+    mockd.credit = fsalloc((mockd.opts.channels + 1) * sizeof *mockd.credit);
+    for (int i = 0; i < mockd.opts.channels; i++)
+        mockd.credit[i] = 0;
+    if (!listen_on_loopback(&mockd)) {
+        fprintf(stderr, "lip-mockd: cannot listen on port %d: %s\n",
+                mockd.opts.port, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    uint64_t now = async_now(mockd.async);
+    mockd.started = mockd.last_tick = now;
+    if (mockd.opts.storm_interval > 0)
+        mockd.next_storm = now + mockd.opts.storm_interval * ASYNC_S;
+    if (mockd.opts.netsplit_interval > 0)
+        mockd.next_netsplit = now + mockd.opts.netsplit_interval * ASYNC_S;
+    tick(&mockd);
+    int status = async_loop(mockd.async) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    while (!list_empty(mockd.clients))
+        close_client((client_t *) list_elem_get_value(
+                         list_get_first(mockd.clients)));
+    destroy_list(mockd.clients);
+    tcp_close_server(mockd.server);
+    fsfree(mockd.credit);
+    destroy_async(mockd.async);
+    g_option_context_free(context);
+    return status;
+}
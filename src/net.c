@@ -0,0 +1,687 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <glib.h>
+#include <async/stringstream.h>
+#include <async/tcp_connection.h>
+#include <fsdyn/charstr.h>
+#include <fstrace.h>
+#include "net.h"
+#include "ind.h"
+#include "metrics.h"
+#include "spsc.h"
+#include "tracering.h"
+
+enum {
+    QUEUE_CAPACITY = 4096,
+    FULL_QUEUE_DELAY_US = 1000,
+    MAX_OUTPUT_WAITS = 1000,    /* of FULL_QUEUE_DELAY_US each */
+    ATTEMPT_DELAY_MS = 250,     /* before trying the next address */
+    PING_INTERVAL_S = 30,       /* unless the dead peer timeout is shorter */
+};
+
+#define PING_TOKEN_PREFIX "lip-"
+
+/* A connection attempt to one resolved address. */
+typedef struct {
+    net_t *net;
+    int fd;
+    char address[INET6_ADDRSTRLEN];
+} attempt_t;
+
+struct net {
+    char *server, *ca_bundle;
+    char *preferred;            /* address to try first; NULL if none */
+    int port;
+    bool use_tls;
+    GThread *thread;
+    atomic_bool stopping;
+    spsc_t *events;             /* to the owner, of net_event_t */
+    spsc_t *output;             /* from the owner, of strings */
+    int event_fd, output_fd;    /* eventfds signaling the queues */
+    /* The rest is only touched by the network thread. */
+    async_t *async;
+    struct addrinfo *addresses;
+    list_t *candidates;         /* of struct addrinfo, in the order tried */
+    list_t *attempts;           /* of attempt_t, in progress */
+    async_timer_t *attempt_timer; /* NULL unless the next one is due */
+    tcp_conn_t *tcp_conn;
+    tls_conn_t *tls_conn;
+    queuestream_t *outq;
+    bytestream_1 input;
+    bool closed;
+    uint64_t tls_started;       /* 0 unless waiting for the first data */
+    unsigned dead_peer_s;       /* 0 for no deadline */
+    async_timer_t *ping_timer;  /* NULL until connected */
+    unsigned ping_token;
+    int64_t ping_sent;          /* monotonic µs; 0 unless outstanding */
+    int64_t last_traffic;       /* monotonic µs */
+    bool events_pushed;         /* since the owner was last woken up */
+    /* Room for the IRCv3 message tags on top of the 512 bytes. */
+    char input_buffer[8191 + 512];
+    char *input_cursor, *input_end;
+};
+
+static void signal_fd(int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof one) < 0)
+        assert(errno == EAGAIN); /* the counter is saturated */
+}
+
+static void clear_fd(int fd)
+{
+    uint64_t count;
+    if (read(fd, &count, sizeof count) < 0)
+        assert(errno == EAGAIN);
+}
+
+static void send_output(net_t *net);
+
+FSTRACE_DECL(IRC_NET_EVENTS_FULL, "DEPTH=%z");
+
+/* While the event queue is full, the output queue is drained so that
+ * an owner blocked in net_send() can get back to taking events. */
+static void push(net_t *net, net_event_t *event)
+{
+    while (!spsc_push(net->events, event)) {
+        FSTRACE(IRC_NET_EVENTS_FULL, spsc_depth(net->events));
+        if (atomic_load(&net->stopping)) {
+            destroy_net_event(event);
+            return;
+        }
+        signal_fd(net->event_fd);
+        send_output(net);
+        g_usleep(FULL_QUEUE_DELAY_US);
+    }
+    net->events_pushed = true;
+}
+
+static void push_event(net_t *net, net_event_type_t type,
+                       irc_message_t *message, const char *address)
+{
+    net_event_t *event = fsalloc(sizeof *event);
+    *event = (net_event_t) {
+        .type = type,
+        .message = message,
+        .address = address ? charstr_dupstr(address) : NULL,
+    };
+    push(net, event);
+}
+
+/* The owner is woken up once per batch of events. */
+static void wake_owner(net_t *net)
+{
+    if (net->events_pushed) {
+        net->events_pushed = false;
+        signal_fd(net->event_fd);
+    }
+}
+
+static void close_transport(net_t *net)
+{
+    if (!net->tcp_conn)
+        return;
+    queuestream_terminate(net->outq);
+    net->outq = NULL;
+    if (net->tls_conn) {
+        tls_close(net->tls_conn);
+        net->tls_conn = NULL;
+    }
+    tcp_close(net->tcp_conn);
+    net->tcp_conn = NULL;
+}
+
+static void close_connection(net_t *net)
+{
+    close_transport(net);
+    net->closed = true;
+    push_event(net, NET_CLOSED, NULL, NULL);
+}
+
+FSTRACE_DECL(IRC_NET_SEND_UNCONNECTED, "TEXT=%s");
+
+static void net_send_now(net_t *net, const char *text)
+{
+    if (!net->outq || net->closed) {
+        FSTRACE(IRC_NET_SEND_UNCONNECTED, text);
+        return;
+    }
+    stringstream_t *sstr = copy_stringstream(net->async, text);
+    queuestream_enqueue(net->outq, stringstream_as_bytestream_1(sstr));
+    atomic_fetch_add_explicit(&metrics.bytes_sent, strlen(text),
+                              memory_order_relaxed);
+}
+
+FSTRACE_DECL(IRC_NET_LAG, "TOKEN=%u US=%64d");
+
+/* Return true if the message is the reply to our own PING. */
+static bool take_pong(net_t *net, const irc_message_t *msg)
+{
+    if (strcmp(msg->command, "PONG") || list_empty(msg->params))
+        return false;
+    const char *token =
+        charstr_skip_prefix(list_elem_get_value(list_get_last(msg->params)),
+                            PING_TOKEN_PREFIX);
+    if (!token)
+        return false;
+    char expected[12];
+    snprintf(expected, sizeof expected, "%u", net->ping_token);
+    if (!net->ping_sent || strcmp(token, expected))
+        return true;            /* stale */
+    net_event_t *event = fsalloc(sizeof *event);
+    *event = (net_event_t) {
+        .type = NET_PONG,
+        .ping_sent = net->ping_sent,
+        .rtt_us = g_get_monotonic_time() - net->ping_sent,
+    };
+    FSTRACE(IRC_NET_LAG, net->ping_token, event->rtt_us);
+    net->ping_sent = 0;
+    push(net, event);
+    return true;
+}
+
+FSTRACE_DECL(IRC_NET_PONG, "SERVER=%s");
+
+/* PINGs are answered here so a busy GTK thread cannot delay the
+ * PONGs. */
+static bool act_on_line(net_t *net, const char *line, size_t size)
+{
+    irc_message_t *msg = parse_message(line, size);
+    if (!msg)
+        return false;
+    if (take_pong(net, msg)) {
+        destroy_message(msg);
+        return true;
+    }
+    if (!strcmp(msg->command, "PING")) {
+        char *reply = pong_reply(msg->params);
+        if (reply) {
+            FSTRACE(IRC_NET_PONG,
+                    (const char *) list_elem_get_value(
+                        list_get_first(msg->params)));
+            net_send_now(net, reply);
+            fsfree(reply);
+            destroy_message(msg);
+            return true;
+        }
+    }
+    push_event(net, NET_MESSAGE, msg, NULL);
+    return true;
+}
+
+FSTRACE_DECL(IRC_TLS_FIRST_DATA, "MS=%64u");
+
+/* The time to the first decrypted byte includes the server's delay in
+ * sending it on top of the handshake. */
+static void note_first_data(net_t *net)
+{
+    uint64_t ms = (async_now(net->async) - net->tls_started) / ASYNC_MS;
+    net->tls_started = 0;
+    FSTRACE(IRC_TLS_FIRST_DATA, ms);
+    atomic_fetch_add(&metrics.tls_connections, 1);
+    atomic_store(&metrics.tls_first_data_ms, ms);
+}
+
+FSTRACE_DECL(IRC_RECEIVE_FAIL, "ERR=%e");
+FSTRACE_DECL(IRC_RECEIVE_SPURIOUS, "");
+FSTRACE_DECL(IRC_RECEIVE_AGAIN, "");
+FSTRACE_DECL(IRC_DISCONNECTED, "");
+FSTRACE_DECL(IRC_RECEIVED, "DATA=%A");
+
+static void receive(net_t *net)
+{
+    if (net->closed) {
+        FSTRACE(IRC_RECEIVE_SPURIOUS);
+        return;
+    }
+    for (;;) {
+        ssize_t count =
+            bytestream_1_read(net->input, net->input_cursor,
+                              net->input_end - net->input_cursor);
+        if (count < 0) {
+            if (errno != EAGAIN) {
+                FSTRACE(IRC_RECEIVE_FAIL);
+                close_connection(net);
+                break;
+            }
+            FSTRACE(IRC_RECEIVE_AGAIN);
+            break;
+        }
+        if (count == 0) {
+            FSTRACE(IRC_DISCONNECTED);
+            close_connection(net);
+            break;
+        }
+        FSTRACE(IRC_RECEIVED, net->input_cursor, count);
+        net->last_traffic = g_get_monotonic_time();
+        if (net->tls_started)
+            note_first_data(net);
+        TRACE_RING(TRACE_RING_RECEIVED, net->input_cursor, count);
+        if (!split_lines(net->input_buffer, &net->input_cursor,
+                         net->input_end, count, (void *) act_on_line, net)) {
+            close_connection(net);
+            break;
+        }
+    }
+    wake_owner(net);
+}
+
+static void describe_address(const struct addrinfo *ai,
+                             char address[INET6_ADDRSTRLEN])
+{
+    const void *raw;
+    if (ai->ai_family == AF_INET6)
+        raw = &((const struct sockaddr_in6 *) ai->ai_addr)->sin6_addr;
+    else raw = &((const struct sockaddr_in *) ai->ai_addr)->sin_addr;
+    if (!inet_ntop(ai->ai_family, raw, address, INET6_ADDRSTRLEN))
+        strcpy(address, "?");
+}
+
+static unsigned ping_interval_s(net_t *net)
+{
+    unsigned interval = PING_INTERVAL_S;
+    if (net->dead_peer_s && net->dead_peer_s / 3 < interval)
+        interval = net->dead_peer_s / 3;
+    return interval ? interval : 1;
+}
+
+static void ping_timeout(net_t *net);
+
+static void start_ping_timer(net_t *net)
+{
+    action_1 ping_cb = { net, (act_1) ping_timeout };
+    net->ping_timer =
+        async_timer_start(net->async,
+                          async_now(net->async) +
+                          ping_interval_s(net) * ASYNC_S,
+                          ping_cb);
+}
+
+FSTRACE_DECL(IRC_NET_DEAD_PEER, "SILENT_S=%64d");
+FSTRACE_DECL(IRC_NET_PING, "TOKEN=%u");
+
+/* A new PING is sent only once the previous one has been answered so
+ * that a slow reply is measured in full. */
+static void ping_timeout(net_t *net)
+{
+    net->ping_timer = NULL;
+    if (net->closed)
+        return;
+    int64_t now = g_get_monotonic_time();
+    int64_t silent = now - net->last_traffic;
+    if (net->dead_peer_s &&
+        silent >= net->dead_peer_s * G_TIME_SPAN_SECOND) {
+        FSTRACE(IRC_NET_DEAD_PEER, silent / G_TIME_SPAN_SECOND);
+        close_connection(net);
+        wake_owner(net);
+        return;
+    }
+    if (!net->ping_sent) {
+        net->ping_token++;
+        char *ping = charstr_printf("PING :" PING_TOKEN_PREFIX "%u\r\n",
+                                    net->ping_token);
+        FSTRACE(IRC_NET_PING, net->ping_token);
+        net_send_now(net, ping);
+        fsfree(ping);
+        net->ping_sent = now;
+    }
+    start_ping_timer(net);
+}
+
+/* Called when the first attempt has succeeded. */
+static void set_up_streams(net_t *net)
+{
+    net->last_traffic = g_get_monotonic_time();
+    start_ping_timer(net);
+    net->input_cursor = net->input_buffer;
+    net->input_end = net->input_buffer + sizeof net->input_buffer;
+    net->outq = make_queuestream(net->async);
+    bytestream_1 plain_output = queuestream_as_bytestream_1(net->outq);
+    bytestream_1 tcp_input = tcp_get_input_stream(net->tcp_conn);
+    if (net->use_tls) {
+        net->tls_started = async_now(net->async);
+        net->tls_conn =
+            open_tls_client_2(net->async, tcp_input,
+                              net->ca_bundle ? net->ca_bundle :
+                              TLS_SYSTEM_CA_BUNDLE,
+                              net->server);
+        tcp_set_output_stream(net->tcp_conn,
+                              tls_get_encrypted_output_stream(net->tls_conn));
+        tls_set_plain_output_stream(net->tls_conn, plain_output);
+        net->input = tls_get_plain_input_stream(net->tls_conn);
+    } else {
+        net->tls_conn = NULL;
+        tcp_set_output_stream(net->tcp_conn, plain_output);
+        net->input = tcp_input;
+    }
+    action_1 receive_cb = { net, (act_1) receive };
+    bytestream_1_register_callback(net->input, receive_cb);
+    async_execute(net->async, receive_cb);
+}
+
+static void abandon_attempt(attempt_t *attempt)
+{
+    async_unregister(attempt->net->async, attempt->fd);
+    close(attempt->fd);
+    fsfree(attempt);
+}
+
+static void forget_attempt(attempt_t *attempt)
+{
+    list_t *attempts = attempt->net->attempts;
+    for (list_elem_t *e = list_get_first(attempts); e; e = list_next(e))
+        if (list_elem_get_value(e) == attempt) {
+            list_remove(attempts, e);
+            return;
+        }
+}
+
+static void cancel_attempt_timer(net_t *net)
+{
+    if (net->attempt_timer) {
+        async_timer_cancel(net->async, net->attempt_timer);
+        net->attempt_timer = NULL;
+    }
+}
+
+/* Stop trying the remaining addresses. */
+static void stop_attempts(net_t *net)
+{
+    cancel_attempt_timer(net);
+    while (!list_empty(net->attempts))
+        abandon_attempt((attempt_t *) list_pop_first(net->attempts));
+    while (!list_empty(net->candidates))
+        list_pop_first(net->candidates);
+}
+
+FSTRACE_DECL(IRC_ESTABLISH_FAIL, "");
+
+static void fail_if_exhausted(net_t *net)
+{
+    if (!list_empty(net->attempts) || !list_empty(net->candidates) ||
+        net->closed)
+        return;
+    FSTRACE(IRC_ESTABLISH_FAIL);
+    net->closed = true;
+    push_event(net, NET_FAILED, NULL, NULL);
+    wake_owner(net);
+}
+
+static void start_next_attempt(net_t *net);
+
+FSTRACE_DECL(IRC_ESTABLISH_SPURIOUS, "ADDRESS=%s");
+FSTRACE_DECL(IRC_ESTABLISH_ATTEMPT_FAIL, "ADDRESS=%s ERR=%e");
+FSTRACE_DECL(IRC_ESTABLISHED, "ADDRESS=%s");
+
+static void probe_attempt(attempt_t *attempt)
+{
+    net_t *net = attempt->net;
+    int err;
+    socklen_t errlen = sizeof err;
+    if (getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+        err = errno;
+    if (!err) {
+        struct sockaddr_storage peer;
+        socklen_t peerlen = sizeof peer;
+        if (getpeername(attempt->fd, (struct sockaddr *) &peer,
+                        &peerlen) < 0) {
+            FSTRACE(IRC_ESTABLISH_SPURIOUS, attempt->address);
+            return;
+        }
+    }
+    forget_attempt(attempt);
+    if (err) {
+        errno = err;
+        FSTRACE(IRC_ESTABLISH_ATTEMPT_FAIL, attempt->address);
+        abandon_attempt(attempt);
+        /* Don't wait for the timer if nothing else is in the air. */
+        if (list_empty(net->attempts)) {
+            cancel_attempt_timer(net);
+            start_next_attempt(net);
+        }
+        fail_if_exhausted(net);
+        return;
+    }
+    FSTRACE(IRC_ESTABLISHED, attempt->address);
+    stop_attempts(net);
+    async_unregister(net->async, attempt->fd);
+    net->tcp_conn = tcp_adopt_connection(net->async, attempt->fd);
+    push_event(net, NET_ESTABLISHED, NULL, attempt->address);
+    wake_owner(net);
+    fsfree(attempt);
+    set_up_streams(net);
+}
+
+static void attempt_timeout(net_t *net)
+{
+    net->attempt_timer = NULL;
+    start_next_attempt(net);
+}
+
+FSTRACE_DECL(IRC_ESTABLISH_ATTEMPT, "ADDRESS=%s");
+
+/* Start connecting to the next candidate address. If there are more,
+ * the one after it is tried unless this one succeeds or fails soon
+ * enough. */
+static void start_next_attempt(net_t *net)
+{
+    while (!list_empty(net->candidates)) {
+        struct addrinfo *ai = list_pop_first(net->candidates);
+        attempt_t *attempt = fsalloc(sizeof *attempt);
+        attempt->net = net;
+        describe_address(ai, attempt->address);
+        FSTRACE(IRC_ESTABLISH_ATTEMPT, attempt->address);
+        attempt->fd = socket(ai->ai_family,
+                             ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                             ai->ai_protocol);
+        if (attempt->fd < 0) {
+            FSTRACE(IRC_ESTABLISH_ATTEMPT_FAIL, attempt->address);
+            fsfree(attempt);
+            continue;
+        }
+        if (connect(attempt->fd, ai->ai_addr, ai->ai_addrlen) < 0 &&
+            errno != EINPROGRESS) {
+            FSTRACE(IRC_ESTABLISH_ATTEMPT_FAIL, attempt->address);
+            close(attempt->fd);
+            fsfree(attempt);
+            continue;
+        }
+        list_append(net->attempts, attempt);
+        action_1 probe_cb = { attempt, (act_1) probe_attempt };
+        async_register(net->async, attempt->fd, probe_cb);
+        async_execute(net->async, probe_cb);
+        if (!list_empty(net->candidates)) {
+            action_1 timeout_cb = { net, (act_1) attempt_timeout };
+            net->attempt_timer =
+                async_timer_start(net->async,
+                                  async_now(net->async) +
+                                  ATTEMPT_DELAY_MS * ASYNC_MS,
+                                  timeout_cb);
+        }
+        return;
+    }
+    fail_if_exhausted(net);
+}
+
+/* The preferred address goes first. The rest alternate between the
+ * address families starting with the one the resolver put first. */
+static void order_candidates(net_t *net)
+{
+    list_t *families[2] = { make_list(), make_list() };
+    int first_family = net->addresses->ai_family;
+    for (struct addrinfo *ai = net->addresses; ai; ai = ai->ai_next) {
+        char address[INET6_ADDRSTRLEN];
+        describe_address(ai, address);
+        if (net->preferred && !strcmp(address, net->preferred))
+            list_append(net->candidates, ai);
+        else list_append(families[ai->ai_family != first_family], ai);
+    }
+    while (!list_empty(families[0]) || !list_empty(families[1]))
+        for (int i = 0; i < 2; i++)
+            if (!list_empty(families[i]))
+                list_append(net->candidates, list_pop_first(families[i]));
+    destroy_list(families[0]);
+    destroy_list(families[1]);
+}
+
+FSTRACE_DECL(IRC_RESOLVE_FAIL, "SERVER=%s ERR=%s");
+FSTRACE_DECL(IRC_RESOLVED, "SERVER=%s");
+
+/* Resolving blocks only the network thread. */
+static void establish(net_t *net)
+{
+    const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    char port[12];
+    snprintf(port, sizeof port, "%d", net->port);
+    int status = getaddrinfo(net->server, port, &hints, &net->addresses);
+    if (status) {
+        FSTRACE(IRC_RESOLVE_FAIL, net->server, gai_strerror(status));
+        net->addresses = NULL;
+        fail_if_exhausted(net);
+        return;
+    }
+    FSTRACE(IRC_RESOLVED, net->server);
+    order_candidates(net);
+    start_next_attempt(net);
+}
+
+static void send_output(net_t *net)
+{
+    char *text;
+    while ((text = spsc_pop(net->output))) {
+        net_send_now(net, text);
+        fsfree(text);
+    }
+}
+
+static void take_output(net_t *net)
+{
+    clear_fd(net->output_fd);
+    send_output(net);
+    if (atomic_load(&net->stopping))
+        async_quit_loop(net->async);
+}
+
+FSTRACE_DECL(IRC_NET_LOOP_FAIL, "ERR=%e");
+
+static gpointer run(gpointer data)
+{
+    net_t *net = data;
+    net->async = make_async();
+    action_1 output_cb = { net, (act_1) take_output };
+    async_register(net->async, net->output_fd, output_cb);
+    net->candidates = make_list();
+    net->attempts = make_list();
+    establish(net);
+    async_execute(net->async, output_cb);
+    if (async_loop(net->async) < 0)
+        FSTRACE(IRC_NET_LOOP_FAIL);
+    stop_attempts(net);
+    close_transport(net);
+    if (net->ping_timer)
+        async_timer_cancel(net->async, net->ping_timer);
+    destroy_list(net->candidates);
+    destroy_list(net->attempts);
+    if (net->addresses)
+        freeaddrinfo(net->addresses);
+    async_unregister(net->async, net->output_fd);
+    destroy_async(net->async);
+    return NULL;
+}
+
+net_t *make_net(const char *server, int port, bool use_tls,
+                const char *ca_bundle, const char *preferred,
+                unsigned dead_peer_s)
+{
+    net_t *net = fsalloc(sizeof *net);
+    *net = (net_t) {
+        .server = charstr_dupstr(server),
+        .ca_bundle = ca_bundle ? charstr_dupstr(ca_bundle) : NULL,
+        .preferred = preferred ? charstr_dupstr(preferred) : NULL,
+        .port = port,
+        .use_tls = use_tls,
+        .dead_peer_s = dead_peer_s,
+        .events = make_spsc(QUEUE_CAPACITY),
+        .output = make_spsc(QUEUE_CAPACITY),
+        .event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+        .output_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+    };
+    atomic_init(&net->stopping, false);
+    net->thread = g_thread_new("lip-net", run, net);
+    return net;
+}
+
+void destroy_net(net_t *net)
+{
+    atomic_store(&net->stopping, true);
+    signal_fd(net->output_fd);
+    g_thread_join(net->thread);
+    net_event_t *event;
+    while ((event = spsc_pop(net->events)))
+        destroy_net_event(event);
+    char *text;
+    while ((text = spsc_pop(net->output)))
+        fsfree(text);
+    destroy_spsc(net->events);
+    destroy_spsc(net->output);
+    close(net->event_fd);
+    close(net->output_fd);
+    fsfree(net->server);
+    fsfree(net->ca_bundle);
+    fsfree(net->preferred);
+    fsfree(net);
+}
+
+FSTRACE_DECL(IRC_NET_OUTPUT_FULL, "DEPTH=%z");
+FSTRACE_DECL(IRC_NET_OUTPUT_DROPPED, "TEXT=%s");
+
+void net_send(net_t *net, const char *text)
+{
+    char *copy = charstr_dupstr(text);
+    for (unsigned waits = 0; !spsc_push(net->output, copy); waits++) {
+        FSTRACE(IRC_NET_OUTPUT_FULL, spsc_depth(net->output));
+        if (atomic_load(&net->stopping) || waits == MAX_OUTPUT_WAITS) {
+            FSTRACE(IRC_NET_OUTPUT_DROPPED, copy);
+            fsfree(copy);
+            return;
+        }
+        signal_fd(net->output_fd);
+        g_usleep(FULL_QUEUE_DELAY_US);
+    }
+    signal_fd(net->output_fd);
+}
+
+int net_event_fd(net_t *net)
+{
+    return net->event_fd;
+}
+
+net_event_t *net_next_event(net_t *net)
+{
+    net_event_t *event = spsc_pop(net->events);
+    if (event)
+        return event;
+    /* Clear before looking again so an event pushed in between is
+     * either seen now or signaled anew. */
+    clear_fd(net->event_fd);
+    return spsc_pop(net->events);
+}
+
+void destroy_net_event(net_event_t *event)
+{
+    if (event->message)
+        destroy_message(event->message);
+    fsfree(event->address);
+    fsfree(event);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "core.h"
+
+/* A connection to the IRC server run by a thread of its own. The
+ * thread runs an async loop that connects, does TLS, splits the input
+ * into messages, parses them and answers PINGs. Connecting tries the
+ * resolved addresses in parallel, each one a moment after the
+ * previous one, alternating between IPv6 and IPv4; the first to
+ * succeed wins. Once connected, the thread PINGs the server
+ * periodically to measure the lag and declares the connection closed
+ * if nothing at all has been received for a while. Everything else is
+ * handed to the owner (the GTK thread) as events over a lock-free
+ * queue; the text to send comes back over another. */
+
+typedef enum {
+    NET_ESTABLISHED,
+    NET_MESSAGE,
+    NET_PONG,                   /* the reply to our own PING */
+    NET_FAILED,                 /* could not connect */
+    NET_CLOSED,                 /* disconnected or protocol error */
+} net_event_type_t;
+
+typedef struct {
+    net_event_type_t type;
+    irc_message_t *message;     /* NET_MESSAGE only */
+    char *address;              /* NET_ESTABLISHED only, numeric */
+    /* NET_PONG only: */
+    int64_t ping_sent;          /* g_get_monotonic_time() */
+    int64_t rtt_us;             /* as seen by the network thread */
+} net_event_t;
+
+/* Start connecting right away. ca_bundle may be NULL for the system
+ * CA bundle. The numeric preferred address, if not NULL, is tried
+ * first if the server still resolves to it. A connection silent for
+ * dead_peer_s seconds (0 for never) is closed. */
+net_t *make_net(const char *server, int port, bool use_tls,
+                const char *ca_bundle, const char *preferred,
+                unsigned dead_peer_s);
+/* Stop the thread and drop the connection. */
+void destroy_net(net_t *net);
+
+/* The remaining functions are for the owner thread only. */
+
+/* Queue text for sending. If the network thread has not made room in
+ * the queue within a second, or the connection is being torn down,
+ * the text is dropped. */
+void net_send(net_t *net, const char *text);
+
+/* Becomes readable when there are events. */
+int net_event_fd(net_t *net);
+/* Return NULL when there are no more events for now. */
+net_event_t *net_next_event(net_t *net);
+void destroy_net_event(net_event_t *event);
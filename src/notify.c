@@ -0,0 +1,196 @@
+#include <string.h>
+#include <fsdyn/charstr.h>
+#include <fstrace.h>
+#include "notify.h"
+#include "intl.h"
+
+enum {
+    COALESCE_MS = 2000,         /* per channel */
+    BURST = 4,                  /* notifications without delay */
+    REFILL_MS = 15000,          /* one more notification allowed */
+    MAX_SENDERS = 100,          /* counted per notification */
+    MAX_TEXT = 50,              /* characters shown */
+};
+
+static bool is_nick_char(char c)
+{
+    return (charstr_char_class(c) & (CHARSTR_ALPHA | CHARSTR_DIGIT)) ||
+        (c && strchr("[]\\`_^{|}-", c));
+}
+
+static bool mentions(const char *text, const char *nick)
+{
+    if (!*nick)
+        return false;
+    char *haystack = lcase_string(text);
+    char *needle = lcase_string(nick);
+    size_t length = strlen(needle);
+    bool found = false;
+    for (const char *p = haystack; !found && (p = strstr(p, needle)); p++)
+        found = (p == haystack || !is_nick_char(p[-1])) &&
+            !is_nick_char(p[length]);
+    fsfree(needle);
+    fsfree(haystack);
+    return found;
+}
+
+/* Strip the control characters and shorten. */
+static char *summarize(const char *text)
+{
+    char *summary = charstr_dupstr(text);
+    char *q = summary;
+    for (const char *p = text; *p; p++)
+        if (!(charstr_char_class(*p) & CHARSTR_CONTROL))
+            *q++ = *p;
+    *q = '\0';
+    if (q - summary > MAX_TEXT)
+        strcpy(summary + MAX_TEXT - 5, "[...]");
+    return summary;
+}
+
+void discard_notification(channel_t *channel)
+{
+    struct pending_notification *pending = &channel->gui->notification;
+    if (pending->timer) {
+        g_source_remove(pending->timer);
+        pending->timer = 0;
+    }
+    if (pending->senders) {
+        list_foreach(pending->senders, (void *) fsfree, NULL);
+        destroy_list(pending->senders);
+        pending->senders = NULL;
+    }
+    fsfree(pending->from);
+    pending->from = NULL;
+    fsfree(pending->text);
+    pending->text = NULL;
+    pending->messages = 0;
+    pending->mention = false;
+}
+
+/* Replenish the shared budget and return how long until the next
+ * notification is allowed (0 if right away). */
+static gint64 budget_wait_ms(app_t *app)
+{
+    gint64 now = g_get_monotonic_time() / G_TIME_SPAN_MILLISECOND;
+    struct notification_budget *budget = &app->gui->notification_budget;
+    if (!budget->refilled) {
+        budget->tokens = BURST;
+        budget->refilled = now;
+    }
+    while (budget->tokens < BURST && now - budget->refilled >= REFILL_MS) {
+        budget->tokens++;
+        budget->refilled += REFILL_MS;
+    }
+    if (budget->tokens == BURST)
+        budget->refilled = now;
+    if (budget->tokens)
+        return 0;
+    return budget->refilled + REFILL_MS - now;
+}
+
+FSTRACE_DECL(IRC_NOTIFY,
+             "CHANNEL=%s MESSAGES=%u SENDERS=%u MENTION=%u");
+
+static void send_pending(channel_t *channel)
+{
+    app_t *app = channel->app;
+    struct pending_notification *pending = &channel->gui->notification;
+    unsigned senders = list_size(pending->senders);
+    FSTRACE(IRC_NOTIFY, channel->name, pending->messages, senders,
+            pending->mention);
+    char *title = charstr_printf("%s: %s", _(APP_NAME), channel->name);
+    GNotification *notification = g_notification_new(title);
+    fsfree(title);
+    char *body;
+    if (pending->messages == 1 || pending->mention)
+        body = charstr_printf("%s> %s", pending->from, pending->text);
+    else if (senders == 1)
+        body = charstr_printf(_("%u new messages from %s"),
+                              pending->messages, pending->from);
+    else body = charstr_printf(_("%u new messages from %u people"),
+                               pending->messages, senders);
+    g_notification_set_body(notification, body);
+    fsfree(body);
+    if (pending->mention)
+        g_notification_set_priority(notification,
+                                    G_NOTIFICATION_PRIORITY_HIGH);
+    g_notification_set_icon(notification, G_ICON(app->gui->icon));
+    char *detailed_action = charstr_printf("app.notif-acked::%s", channel->key);
+    g_notification_set_default_action(notification, detailed_action);
+    fsfree(detailed_action);
+    g_application_send_notification(G_APPLICATION(app->gui->gapp),
+                                    channel->key, notification);
+    g_object_unref(notification);
+    if (app->gui->notification_budget.tokens)
+        app->gui->notification_budget.tokens--;
+    discard_notification(channel);
+}
+
+FSTRACE_DECL(IRC_NOTIFY_DEFERRED, "CHANNEL=%s MS=%64u");
+
+static gboolean pending_timeout(channel_t *channel)
+{
+    struct pending_notification *pending = &channel->gui->notification;
+    pending->timer = 0;
+    gint64 wait_ms = budget_wait_ms(channel->app);
+    if (wait_ms) {
+        FSTRACE(IRC_NOTIFY_DEFERRED, channel->name, wait_ms);
+        pending->timer =
+            g_timeout_add(wait_ms, G_SOURCE_FUNC(pending_timeout), channel);
+        return G_SOURCE_REMOVE;
+    }
+    send_pending(channel);
+    return G_SOURCE_REMOVE;
+}
+
+void notify_message(channel_t *channel, const char *from,
+                    const char *tag_name, const char *text)
+{
+    if (!from || !strcmp(tag_name, "mine"))
+        return;
+    GtkWidget *window = channel->gui->window;
+    if (window && gtk_window_is_active(GTK_WINDOW(window)))
+        return;
+    struct pending_notification *pending = &channel->gui->notification;
+    if (!pending->senders)
+        pending->senders = make_list();
+    bool known = false;
+    for (list_elem_t *e = list_get_first(pending->senders);
+         !known && e; e = list_next(e))
+        known = !strcmp(list_elem_get_value(e), from);
+    if (!known && list_size(pending->senders) < MAX_SENDERS)
+        list_append(pending->senders, charstr_dupstr(from));
+    pending->messages++;
+    bool mention = mentions(text, channel->app->config.nick);
+    if (mention || !pending->mention) {
+        fsfree(pending->from);
+        pending->from = charstr_dupstr(from);
+        fsfree(pending->text);
+        pending->text = summarize(text);
+    }
+    if (mention) {
+        pending->mention = true;
+        gint64 now = g_get_monotonic_time() / G_TIME_SPAN_MILLISECOND;
+        if (now - pending->mentioned >= COALESCE_MS &&
+            !budget_wait_ms(channel->app)) {
+            pending->mentioned = now;
+            send_pending(channel);
+            return;
+        }
+    }
+    if (!pending->timer)
+        pending->timer =
+            g_timeout_add(COALESCE_MS, G_SOURCE_FUNC(pending_timeout),
+                          channel);
+}
+
+void withdraw_notification(channel_t *channel)
+{
+    if (!channel->gui)
+        return;
+    discard_notification(channel);
+    app_t *app = channel->app;
+    g_application_withdraw_notification(G_APPLICATION(app->gui->gapp),
+                                        channel->key);
+}
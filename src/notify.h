@@ -0,0 +1,26 @@
+#pragma once
+
+#include "lip.h"
+
+/* Desktop notifications of incoming messages. The messages of a
+ * channel are coalesced for a couple of seconds into a single
+ * notification ("12 new messages from 4 people"). Nothing is
+ * notified while the channel window has the focus, and the
+ * notifications of all channels share a rate limit. A message that
+ * mentions our nick is notified right away if the rate limit allows
+ * and no mention was notified on the channel within the coalescing
+ * period; otherwise it is coalesced like the rest, and the pending
+ * notification shows the latest mention. */
+
+/* Note a message rendered on the channel. Only messages from other
+ * people count. */
+void notify_message(channel_t *channel, const char *from,
+                    const char *tag_name, const char *text);
+
+/* Withdraw the channel's notification and forget the pending
+ * messages, e.g., when the user looks at the channel or closes its
+ * window. */
+void withdraw_notification(channel_t *channel);
+
+/* Forget the pending messages without touching the notification. */
+void discard_notification(channel_t *channel);
@@ -0,0 +1,442 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <fsdyn/charstr.h>
+#include <fsdyn/hashtable.h>
+#include <fstrace.h>
+#include "replay.h"
+#include "util.h"
+#include "watchdog.h"
+
+enum {
+    BATCH_SIZE = 50,            /* messages per idle callback */
+};
+
+typedef struct {
+    channel_t *channel;
+    unsigned window_serial;
+    atomic_bool done;           /* window closed or chat view full */
+    /* Set by the replay thread once it has handed over enough messages
+     * to fill the chat view; older ones are not decoded. */
+    atomic_bool enough;
+    size_t handed_over;         /* accessed by the replay thread only */
+} target_t;
+
+typedef struct {
+    target_t *target;
+    time_t t;
+    char *from, *tag, *text;
+} replayed_t;
+
+typedef struct replay replay_t;
+
+typedef struct {
+    replay_t *replay;
+    char *path;
+    /* The size of the segment when the replay started or -1. Later
+     * records are played live. The limit counts the bytes of the
+     * records read, which compressing the segment leaves intact. */
+    off_t limit;
+    /* Opened up front if limited, before a rotation can rename it. */
+    cache_reader_t *reader;
+    list_t *messages;           /* of replayed_t, oldest first */
+    bool decoded;               /* protected by replay->lock */
+} segment_t;
+
+struct replay {
+    app_t *app;
+    target_t *targets;
+    size_t target_count;
+    hash_table_t *keys;         /* key -> target_t; read-only */
+    cache_mark_t mark;          /* where the live messages begin */
+    /* set up by the replay thread */
+    segment_t *segments;
+    size_t segment_count;
+    GThread *thread;
+    GAsyncQueue *batches;       /* of list_t of replayed_t, newest first */
+    atomic_bool cancelled;
+    GMutex lock;
+    GCond decoded;
+    /* the following are accessed by the GTK thread only */
+    list_elem_t *loc;           /* in app->replays */
+    gint64 started, first_delivery;
+    gint64 autojoin_started;    /* 0 unless replaying the autojoins */
+    size_t delivered;
+};
+
+/* Queued after the last batch. */
+static char end_of_replay;
+
+static char *dup_maybe(const char *s)
+{
+    return s ? charstr_dupstr(s) : NULL;
+}
+
+static void destroy_replayed(replayed_t *message)
+{
+    fsfree(message->from);
+    fsfree(message->tag);
+    fsfree(message->text);
+    fsfree(message);
+}
+
+static void destroy_messages(list_t *messages)
+{
+    list_foreach(messages, (void *) destroy_replayed, NULL);
+    destroy_list(messages);
+}
+
+static bool wanted(target_t *target)
+{
+    return !atomic_load(&target->done);
+}
+
+static bool worth_decoding(target_t *target)
+{
+    return wanted(target) && !atomic_load(&target->enough);
+}
+
+static bool any_worth_decoding(replay_t *replay)
+{
+    for (size_t i = 0; i < replay->target_count; i++)
+        if (worth_decoding(&replay->targets[i]))
+            return true;
+    return false;
+}
+
+/* Called in a pool thread. */
+static void decode_segment(gpointer data, gpointer user_data)
+{
+    segment_t *segment = data;
+    replay_t *replay = segment->replay;
+    cache_reader_t *reader = segment->reader;
+    segment->reader = NULL;
+    if (!reader && !atomic_load(&replay->cancelled) &&
+        any_worth_decoding(replay))
+        reader = open_cache_reader(segment->path);
+    if (reader) {
+        const char *record;
+        off_t consumed = 0;
+        while (!atomic_load(&replay->cancelled) &&
+               (record = cache_reader_next(reader, NULL))) {
+            if (segment->limit >= 0 && consumed >= segment->limit)
+                break;
+            consumed += strlen(record) + 1;
+            const char *key, *from, *tag, *text;
+            unsigned long long t;
+            json_thing_t *message =
+                decode_cache_record(record, &key, &t, &from, &tag, &text);
+            if (!message)
+                continue;
+            hash_elem_t *he = hash_table_get(replay->keys, key);
+            if (he) {
+                target_t *target = (target_t *) hash_elem_get_value(he);
+                if (worth_decoding(target)) {
+                    replayed_t *replayed = fsalloc(sizeof *replayed);
+                    replayed->target = target;
+                    replayed->t = t;
+                    replayed->from = dup_maybe(from);
+                    replayed->tag = dup_maybe(tag);
+                    replayed->text = charstr_dupstr(text);
+                    list_append(segment->messages, replayed);
+                }
+            }
+            json_destroy_thing(message);
+        }
+        close_cache_reader(reader);
+    }
+    g_mutex_lock(&replay->lock);
+    segment->decoded = true;
+    g_cond_broadcast(&replay->decoded);
+    g_mutex_unlock(&replay->lock);
+}
+
+static gboolean deliver(gpointer data);
+
+static void enqueue(replay_t *replay, void *item)
+{
+    g_async_queue_push(replay->batches, item);
+    g_idle_add(deliver, replay);
+}
+
+/* Segments after the one the mark is in only hold live messages. */
+static void scan_segments(replay_t *replay)
+{
+    const char *directory = replay->app->config.cache_directory;
+    struct dirent **namelist;
+    int n = scan_cache_segments(directory, &namelist);
+    replay->segment_count = 0;
+    replay->segments =
+        fsalloc(((n < 0 ? 0 : n) + 1) * sizeof *replay->segments);
+    bool past_mark = false;
+    for (int i = 0; i < n; i++) {
+        char *path = charstr_printf("%s/%s", directory, namelist[i]->d_name);
+        free(namelist[i]);
+        struct stat st;
+        if (past_mark || stat(path, &st) < 0) {
+            fsfree(path);
+            continue;
+        }
+        segment_t *segment = &replay->segments[replay->segment_count++];
+        segment->replay = replay;
+        segment->path = path;
+        segment->limit = -1;
+        if (!replay->mark.segment) {
+            /* Nothing written yet; the last one is live. */
+            if (i == n - 1)
+                segment->limit = st.st_size;
+        } else if (st.st_ino == replay->mark.segment) {
+            segment->limit = replay->mark.size;
+            past_mark = true;
+        }
+        segment->reader =
+            segment->limit >= 0 ? open_cache_reader(path) : NULL;
+        segment->messages = make_list();
+        segment->decoded = false;
+    }
+    if (n >= 0)
+        free(namelist);
+}
+
+/* Return false if the target has been handed over enough messages
+ * already. */
+static bool hand_over(replayed_t *message)
+{
+    target_t *target = message->target;
+    if (target->handed_over >= MAX_LINE_COUNT)
+        return false;
+    if (++target->handed_over == MAX_LINE_COUNT)
+        atomic_store(&target->enough, true);
+    return true;
+}
+
+/* The replay thread waits for the most recent messages to be on disk,
+ * decodes the segments in a thread pool and hands the messages over in
+ * batches, newest first. Only as many segments are decoded ahead as
+ * there are threads in the pool, and no more once every target has
+ * enough messages. */
+static gpointer replay_loop(gpointer data)
+{
+    replay_t *replay = data;
+    alloc_subsystem_t outer = enter_alloc_subsystem(ALLOC_CACHE);
+    cache_writer_wait(replay->app->cache_writer, &replay->mark);
+    scan_segments(replay);
+    size_t ahead = g_get_num_processors();
+    GThreadPool *pool =
+        g_thread_pool_new(decode_segment, NULL, ahead, FALSE, NULL);
+    size_t next = replay->segment_count; /* the newest one not queued */
+    for (size_t i = replay->segment_count;
+         i-- && !atomic_load(&replay->cancelled);) {
+        if (!any_worth_decoding(replay))
+            break;
+        while (next && i + 1 - next < ahead)
+            g_thread_pool_push(pool, &replay->segments[--next], NULL);
+        segment_t *segment = &replay->segments[i];
+        g_mutex_lock(&replay->lock);
+        while (!segment->decoded)
+            g_cond_wait(&replay->decoded, &replay->lock);
+        g_mutex_unlock(&replay->lock);
+        list_t *batch = make_list();
+        while (!list_empty(segment->messages)) {
+            replayed_t *message =
+                (replayed_t *) list_pop_last(segment->messages);
+            if (!hand_over(message)) {
+                destroy_replayed(message);
+                continue;
+            }
+            list_append(batch, message);
+            if (list_size(batch) == BATCH_SIZE) {
+                enqueue(replay, batch);
+                batch = make_list();
+            }
+        }
+        if (list_empty(batch))
+            destroy_list(batch);
+        else enqueue(replay, batch);
+    }
+    /* Let the segments still being decoded stop early. */
+    for (size_t i = 0; i < replay->target_count; i++)
+        atomic_store(&replay->targets[i].enough, true);
+    g_thread_pool_free(pool, FALSE, TRUE);
+    enqueue(replay, &end_of_replay);
+    leave_alloc_subsystem(outer);
+    return NULL;
+}
+
+static bool is_at_bottom(GtkWidget *view)
+{
+    GtkAdjustment *adj =
+        gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(view));
+    gdouble value = gtk_adjustment_get_value(adj);
+    gdouble page = gtk_adjustment_get_page_size(adj);
+    gdouble upper = gtk_adjustment_get_upper(adj);
+    return value + page >= upper;
+}
+
+static bool target_closed(target_t *target)
+{
+    return target->channel->gui->window_serial != target->window_serial;
+}
+
+static void destroy_replay(replay_t *replay)
+{
+    g_thread_join(replay->thread);
+    void *item;
+    while ((item = g_async_queue_try_pop(replay->batches)))
+        if (item != &end_of_replay)
+            destroy_messages(item);
+    g_async_queue_unref(replay->batches);
+    for (size_t i = 0; i < replay->segment_count; i++) {
+        if (replay->segments[i].reader)
+            close_cache_reader(replay->segments[i].reader);
+        destroy_messages(replay->segments[i].messages);
+        fsfree(replay->segments[i].path);
+    }
+    fsfree(replay->segments);
+    hash_elem_t *he;
+    while ((he = hash_table_pop(replay->keys)))
+        destroy_hash_element(he);
+    destroy_hash_table(replay->keys);
+    fsfree(replay->targets);
+    g_mutex_clear(&replay->lock);
+    g_cond_clear(&replay->decoded);
+    fsfree(replay);
+}
+
+FSTRACE_DECL(IRC_REPLAY_BATCH, "MESSAGES=%z DURATION-US=%64u");
+FSTRACE_DECL(IRC_AUTOJOIN_READY, "CHANNELS=%z DURATION-US=%64u");
+FSTRACE_DECL(IRC_REPLAY_DONE,
+             "CHANNELS=%z SEGMENTS=%z MESSAGES=%z CANCELLED=%d "
+             "FIRST-US=%64u TOTAL-US=%64u");
+
+static void finish(replay_t *replay)
+{
+    gint64 now = g_get_monotonic_time();
+    gint64 first = replay->first_delivery ? replay->first_delivery : now;
+    FSTRACE(IRC_REPLAY_DONE, replay->target_count, replay->segment_count,
+            replay->delivered, (int) atomic_load(&replay->cancelled),
+            (uint64_t) (first - replay->started),
+            (uint64_t) (now - replay->started));
+    if (replay->autojoin_started)
+        FSTRACE(IRC_AUTOJOIN_READY, replay->target_count,
+                (uint64_t) (now - replay->autojoin_started));
+    list_remove(replay->app->replays, replay->loc);
+    destroy_replay(replay);
+}
+
+static void play_batch(replay_t *replay, list_t *batch)
+{
+    gint64 start = g_get_monotonic_time();
+    if (!replay->first_delivery)
+        replay->first_delivery = start;
+    bool at_bottom[replay->target_count];
+    for (size_t i = 0; i < replay->target_count; i++) {
+        target_t *target = &replay->targets[i];
+        if (target_closed(target))
+            atomic_store(&target->done, true);
+        at_bottom[i] =
+            wanted(target) && is_at_bottom(target->channel->gui->chat_view);
+    }
+    size_t count = list_size(batch);
+    while (!list_empty(batch)) {
+        replayed_t *message = (replayed_t *) list_pop_first(batch);
+        target_t *target = message->target;
+        if (wanted(target) &&
+            !prepend_message(target->channel, message->t, message->from,
+                             message->tag, message->text))
+            atomic_store(&target->done, true);
+        destroy_replayed(message);
+    }
+    destroy_list(batch);
+    bool all_done = true;
+    for (size_t i = 0; i < replay->target_count; i++) {
+        channel_t *channel = replay->targets[i].channel;
+        if (at_bottom[i])
+            gtk_text_view_scroll_mark_onscreen(
+                GTK_TEXT_VIEW(channel->gui->chat_view),
+                channel->gui->end_of_chat_view);
+        if (wanted(&replay->targets[i]))
+            all_done = false;
+    }
+    if (all_done)
+        atomic_store(&replay->cancelled, true);
+    replay->delivered += count;
+    FSTRACE(IRC_REPLAY_BATCH, count,
+            (uint64_t) (g_get_monotonic_time() - start));
+}
+
+/* Every idle callback consumes exactly one queued item, so the replay
+ * can be destroyed once the end marker is reached. */
+static gboolean deliver(gpointer data)
+{
+    replay_t *replay = data;
+    const char *outer = enter_section("replay");
+    void *item = g_async_queue_pop(replay->batches);
+    if (item == &end_of_replay)
+        finish(replay);
+    else play_batch(replay, item);
+    leave_section(outer);
+    return G_SOURCE_REMOVE;
+}
+
+static void start_replay(app_t *app, list_t *channels,
+                         gint64 autojoin_started)
+{
+    if (list_empty(channels))
+        return;
+    const char *outer = enter_section("replay_channels");
+    replay_t *replay = fsalloc(sizeof *replay);
+    replay->app = app;
+    replay->started = g_get_monotonic_time();
+    replay->autojoin_started = autojoin_started;
+    replay->first_delivery = 0;
+    replay->delivered = 0;
+    cache_writer_mark(app->cache_writer, &replay->mark);
+    replay->target_count = list_size(channels);
+    replay->targets =
+        fsalloc(replay->target_count * sizeof *replay->targets);
+    replay->keys =
+        make_hash_table(replay->target_count, (void *) hash_string,
+                        (void *) strcmp);
+    size_t i = 0;
+    for (list_elem_t *e = list_get_first(channels); e; e = list_next(e)) {
+        channel_t *channel = (channel_t *) list_elem_get_value(e);
+        target_t *target = &replay->targets[i++];
+        target->channel = channel;
+        target->window_serial = channel->gui->window_serial;
+        atomic_init(&target->done, false);
+        atomic_init(&target->enough, false);
+        target->handed_over = 0;
+        hash_elem_t *he = hash_table_put(replay->keys, channel->key, target);
+        if (he)
+            destroy_hash_element(he);
+    }
+    replay->batches = g_async_queue_new();
+    atomic_init(&replay->cancelled, false);
+    g_mutex_init(&replay->lock);
+    g_cond_init(&replay->decoded);
+    replay->loc = list_append(app->replays, replay);
+    replay->thread = g_thread_new("lip-replay", replay_loop, replay);
+    leave_section(outer);
+}
+
+void replay_channels(app_t *app, list_t *channels)
+{
+    start_replay(app, channels, 0);
+}
+
+void replay_autojoins(app_t *app, list_t *channels, gint64 started)
+{
+    start_replay(app, channels, started);
+}
+
+void cancel_replays(app_t *app)
+{
+    while (!list_empty(app->replays)) {
+        replay_t *replay = (replay_t *) list_pop_first(app->replays);
+        atomic_store(&replay->cancelled, true);
+        destroy_replay(replay);
+    }
+}
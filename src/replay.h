@@ -0,0 +1,21 @@
+#pragma once
+
+#include <fsdyn/list.h>
+#include "lip.h"
+
+/* Fill the chat views of channels (of channel_t) from the message
+ * cache without blocking the GTK thread. The cache is scanned once
+ * for all of the channels; the segments are decoded in parallel by a
+ * thread pool. The messages are delivered in batches from an idle
+ * source, newest first, so the latest history shows up first. A
+ * channel drops out of the replay when its window is closed or its
+ * chat view is full. */
+void replay_channels(app_t *app, list_t *channels);
+
+/* Like replay_channels() for the autojoined channels. IRC_AUTOJOIN_READY
+ * reports the time from started (a g_get_monotonic_time()) until every
+ * channel has its history. */
+void replay_autojoins(app_t *app, list_t *channels, gint64 started);
+
+/* Stop every replay in progress. Called at shutdown. */
+void cancel_replays(app_t *app);
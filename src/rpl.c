@@ -1,28 +1,17 @@
 #include <fsdyn/charstr.h>
 #include "rpl.h"
-#include "util.h"
+#include "core.h"
 #include "intl.h"
 
-static void append_rest(GtkTextBuffer *chat_buffer, list_elem_t *e,
-                        const gchar *tag_name)
-{
-    if (e)
-        for (;;) {
-            append_text(chat_buffer, list_elem_get_value(e), tag_name);
-            e = list_next(e);
-            if (!e)
-                break;
-            append_text(chat_buffer, " ", tag_name);
-        }
-    append_text(chat_buffer, "\n", tag_name);
-}
-
 static void console_info(app_t *app, list_elem_t *e)
 {
-    GtkTextBuffer *console;
-    bool at_bottom = begin_console_line(app, &console);
-    append_rest(console, e, NULL);
-    console_scroll_maybe(app, at_bottom);
+    list_t *words = make_list();
+    for (; e; e = list_next(e))
+        list_append(words, list_elem_get_value(e));
+    char *line = charstr_join(" ", words);
+    destroy_list(words);
+    sink_1_log_line(app->sink, NULL, line);
+    fsfree(line);
 }
 
 FSTRACE_DECL(IRC_RPL_WELCOME, "");
@@ -111,6 +100,7 @@ static bool is_channel_membership_prefix(char c)
 
 static void update_channel_nicks(channel_t *channel, const char *nicks)
 {
+    alloc_subsystem_t outer = enter_alloc_subsystem(ALLOC_NICKS);
     list_foreach(channel->nicks_present, (void *) fsfree, NULL);
     destroy_list(channel->nicks_present);
     channel->nicks_present = make_list();
@@ -125,6 +115,7 @@ static void update_channel_nicks(channel_t *channel, const char *nicks)
         fsfree(nick);
     }
     destroy_list(nick_list);
+    leave_alloc_subsystem(outer);
 }
 
 FSTRACE_DECL(IRC_RPL_NAMREPLY, "");
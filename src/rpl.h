@@ -1,6 +1,6 @@
 #pragma once
 
-#include "lip.h"
+#include "core.h"
 
 bool numeric(app_t *app, const char *prefix, const char *command,
              list_t *params);
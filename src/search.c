@@ -0,0 +1,718 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <glib.h>
+#include <encjson.h>
+#include <fsdyn/charstr.h>
+#include <fsdyn/hashtable.h>
+#include <fstrace.h>
+#include "search.h"
+
+enum {
+    MAX_TOKEN_SIZE = 64,
+    DEAD_SEGMENT = UINT32_MAX,  /* the record was not relocated */
+};
+
+typedef struct {
+    char *token;
+    uint32_t *ids;              /* ascending record ids */
+    size_t count, capacity;
+} postings_t;
+
+typedef struct {
+    ino_t inode;
+    bool retired;
+} segment_t;
+
+typedef struct {
+    search_segment_t segment;
+    cache_position_t position;
+    const char *channel_key;    /* interned */
+    time_t t;
+} indexed_record_t;
+
+/* A copy of a matching record. */
+typedef struct {
+    ino_t inode;
+    cache_position_t position;
+    char *channel_key;
+    time_t t;
+} match_t;
+
+struct search_index {
+    GMutex lock;
+    segment_t *segments;        /* by search_segment_t */
+    size_t segment_count, segment_capacity;
+    hash_table_t *vocabulary;   /* token -> postings_t */
+    postings_t **terms;
+    size_t term_count, term_capacity;
+    hash_table_t *channels;     /* interned channel keys */
+    indexed_record_t *records;  /* by id */
+    size_t record_count, record_capacity;
+};
+
+static void *expand(void *array, size_t count, size_t *capacity, size_t size)
+{
+    if (count < *capacity)
+        return array;
+    *capacity = *capacity ? 2 * *capacity : 16;
+    void *expanded = fsalloc(*capacity * size);
+    if (count)
+        memcpy(expanded, array, count * size);
+    fsfree(array);
+    return expanded;
+}
+
+search_index_t *make_search_index(void)
+{
+    search_index_t *index = fsalloc(sizeof *index);
+    g_mutex_init(&index->lock);
+    index->segments = NULL;
+    index->segment_count = index->segment_capacity = 0;
+    index->vocabulary =
+        make_hash_table(10000, (void *) hash_string, (void *) strcmp);
+    index->terms = NULL;
+    index->term_count = index->term_capacity = 0;
+    index->channels =
+        make_hash_table(100, (void *) hash_string, (void *) strcmp);
+    index->records = NULL;
+    index->record_count = index->record_capacity = 0;
+    return index;
+}
+
+void destroy_search_index(search_index_t *index)
+{
+    for (size_t i = 0; i < index->term_count; i++) {
+        postings_t *postings = index->terms[i];
+        hash_elem_t *he = hash_table_get(index->vocabulary, postings->token);
+        hash_table_remove(index->vocabulary, he);
+        destroy_hash_element(he);
+        fsfree(postings->token);
+        fsfree(postings->ids);
+        fsfree(postings);
+    }
+    fsfree(index->terms);
+    destroy_hash_table(index->vocabulary);
+    hash_elem_t *he;
+    while ((he = hash_table_pop(index->channels))) {
+        fsfree((char *) hash_elem_get_key(he));
+        destroy_hash_element(he);
+    }
+    destroy_hash_table(index->channels);
+    fsfree(index->records);
+    fsfree(index->segments);
+    g_mutex_clear(&index->lock);
+    fsfree(index);
+}
+
+static const char *intern(search_index_t *index, const char *channel_key)
+{
+    hash_elem_t *he = hash_table_get(index->channels, channel_key);
+    if (he)
+        return hash_elem_get_key(he);
+    char *key = charstr_dupstr(channel_key);
+    hash_table_put(index->channels, key, key);
+    return key;
+}
+
+static const char *skip_color(const char *p)
+{
+    for (int i = 0; i < 2 && charstr_char_class(*p) & CHARSTR_DIGIT; i++)
+        p++;
+    if (p[0] != ',' || !(charstr_char_class(p[1]) & CHARSTR_DIGIT))
+        return p;
+    p++;
+    for (int i = 0; i < 2 && charstr_char_class(*p) & CHARSTR_DIGIT; i++)
+        p++;
+    return p;
+}
+
+/* Call f for every case-folded token of text. */
+static void tokenize(const char *text,
+                     void (*f)(void *obj, const char *token), void *obj)
+{
+    gchar *valid = g_utf8_make_valid(text, -1);
+    gchar *folded = g_utf8_casefold(valid, -1);
+    g_free(valid);
+    const gchar *p = folded;
+    while (*p) {
+        if (*p == ('C' & 0x1f)) {
+            p = skip_color(p + 1);
+            continue;
+        }
+        if (!g_unichar_isalnum(g_utf8_get_char(p))) {
+            p = g_utf8_next_char(p);
+            continue;
+        }
+        const gchar *start = p;
+        while (*p && g_unichar_isalnum(g_utf8_get_char(p)))
+            p = g_utf8_next_char(p);
+        char token[MAX_TOKEN_SIZE + 1];
+        size_t size = p - start;
+        if (size > MAX_TOKEN_SIZE)
+            size = MAX_TOKEN_SIZE;  /* may split a character; harmless */
+        memcpy(token, start, size);
+        token[size] = '\0';
+        f(obj, token);
+    }
+    g_free(folded);
+}
+
+typedef struct {
+    search_index_t *index;
+    uint32_t id;
+} posting_context_t;
+
+static void post(void *obj, const char *token)
+{
+    posting_context_t *context = obj;
+    search_index_t *index = context->index;
+    postings_t *postings;
+    hash_elem_t *he = hash_table_get(index->vocabulary, token);
+    if (he)
+        postings = (postings_t *) hash_elem_get_value(he);
+    else {
+        postings = fsalloc(sizeof *postings);
+        postings->token = charstr_dupstr(token);
+        postings->ids = NULL;
+        postings->count = postings->capacity = 0;
+        hash_table_put(index->vocabulary, postings->token, postings);
+        index->terms = expand(index->terms, index->term_count,
+                              &index->term_capacity, sizeof *index->terms);
+        index->terms[index->term_count++] = postings;
+    }
+    if (postings->count && postings->ids[postings->count - 1] == context->id)
+        return;                 /* repeated token */
+    postings->ids = expand(postings->ids, postings->count,
+                           &postings->capacity, sizeof *postings->ids);
+    postings->ids[postings->count++] = context->id;
+}
+
+/* Return the segment with the inode number or -1. */
+static ssize_t find_segment(search_index_t *index, ino_t inode)
+{
+    for (size_t i = index->segment_count; i--;)
+        if (index->segments[i].inode == inode && !index->segments[i].retired)
+            return i;
+    return -1;
+}
+
+static void retire_segment(search_index_t *index, ino_t inode)
+{
+    ssize_t i = find_segment(index, inode);
+    if (i >= 0)
+        index->segments[i].retired = true;
+}
+
+static search_segment_t add_segment(search_index_t *index, ino_t inode)
+{
+    index->segments = expand(index->segments, index->segment_count,
+                             &index->segment_capacity,
+                             sizeof *index->segments);
+    segment_t *segment = &index->segments[index->segment_count];
+    segment->inode = inode;
+    segment->retired = false;
+    return index->segment_count++;
+}
+
+search_segment_t search_index_segment(search_index_t *index, ino_t inode,
+                                      bool fresh)
+{
+    g_mutex_lock(&index->lock);
+    ssize_t i = find_segment(index, inode);
+    search_segment_t segment;
+    if (i >= 0 && !fresh)
+        segment = i;
+    else {
+        if (i >= 0)
+            index->segments[i].retired = true;
+        segment = add_segment(index, inode);
+    }
+    g_mutex_unlock(&index->lock);
+    return segment;
+}
+
+void search_index_add(search_index_t *index, search_segment_t segment,
+                      const cache_position_t *position,
+                      const char *channel_key, time_t t,
+                      const char *from, const char *text)
+{
+    g_mutex_lock(&index->lock);
+    index->records = expand(index->records, index->record_count,
+                            &index->record_capacity, sizeof *index->records);
+    posting_context_t context = {
+        .index = index,
+        .id = index->record_count++,
+    };
+    indexed_record_t *record = &index->records[context.id];
+    record->segment = segment;
+    record->position = *position;
+    record->channel_key = intern(index, channel_key);
+    record->t = t;
+    if (from)
+        tokenize(from, post, &context);
+    tokenize(text, post, &context);
+    g_mutex_unlock(&index->lock);
+}
+
+void search_index_add_segment(search_index_t *index, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) < 0)
+        return;
+    cache_reader_t *reader = open_cache_reader(path);
+    if (!reader)
+        return;
+    search_segment_t segment = search_index_segment(index, st.st_ino, true);
+    const char *record;
+    cache_position_t position;
+    while ((record = cache_reader_next(reader, &position))) {
+        const char *key, *from, *tag, *text;
+        unsigned long long t;
+        json_thing_t *message =
+            decode_cache_record(record, &key, &t, &from, &tag, &text);
+        if (!message)
+            continue;
+        search_index_add(index, segment, &position, key, t, from, text);
+        json_destroy_thing(message);
+    }
+    close_cache_reader(reader);
+}
+
+static int position_cmp(const cache_position_t *a, const cache_position_t *b)
+{
+    if (a->frame != b->frame)
+        return a->frame < b->frame ? -1 : 1;
+    if (a->offset != b->offset)
+        return a->offset < b->offset ? -1 : 1;
+    return 0;
+}
+
+static const cache_relocation_t *
+find_relocation(const cache_position_t *position,
+                const cache_relocation_t *relocations, size_t count)
+{
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        int cmp = position_cmp(&relocations[middle].from, position);
+        if (!cmp)
+            return &relocations[middle];
+        if (cmp < 0)
+            low = middle + 1;
+        else high = middle;
+    }
+    return NULL;
+}
+
+void search_index_relocate(search_index_t *index, ino_t old_inode,
+                           ino_t new_inode,
+                           const cache_relocation_t *relocations,
+                           size_t count)
+{
+    g_mutex_lock(&index->lock);
+    ssize_t segment = find_segment(index, old_inode);
+    if (segment < 0) {
+        g_mutex_unlock(&index->lock);
+        return;
+    }
+    retire_segment(index, new_inode);
+    index->segments[segment].inode = new_inode;
+    for (size_t i = 0; i < index->record_count; i++) {
+        indexed_record_t *record = &index->records[i];
+        if (record->segment != segment)
+            continue;
+        const cache_relocation_t *relocation =
+            find_relocation(&record->position, relocations, count);
+        if (relocation)
+            record->position = relocation->to;
+        else record->segment = DEAD_SEGMENT;
+    }
+    g_mutex_unlock(&index->lock);
+}
+
+static bool is_live(ino_t inode, const ino_t *live, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        if (live[i] == inode)
+            return true;
+    return false;
+}
+
+static bool record_is_live(search_index_t *index,
+                           const indexed_record_t *record)
+{
+    return record->segment != DEAD_SEGMENT &&
+        !index->segments[record->segment].retired;
+}
+
+void search_index_prune(search_index_t *index,
+                        const ino_t *live, size_t count)
+{
+    g_mutex_lock(&index->lock);
+    for (size_t i = 0; i < index->segment_count; i++)
+        if (!is_live(index->segments[i].inode, live, count))
+            index->segments[i].retired = true;
+    uint32_t *renumbering =
+        fsalloc((index->record_count + 1) * sizeof *renumbering);
+    size_t live_count = 0;
+    for (size_t i = 0; i < index->record_count; i++)
+        if (record_is_live(index, &index->records[i])) {
+            renumbering[i] = live_count;
+            index->records[live_count++] = index->records[i];
+        } else renumbering[i] = UINT32_MAX;
+    if (live_count == index->record_count) {
+        fsfree(renumbering);
+        g_mutex_unlock(&index->lock);
+        return;
+    }
+    index->record_count = live_count;
+    for (size_t i = 0; i < index->term_count; i++) {
+        postings_t *postings = index->terms[i];
+        size_t n = 0;
+        for (size_t j = 0; j < postings->count; j++) {
+            uint32_t id = renumbering[postings->ids[j]];
+            if (id != UINT32_MAX)
+                postings->ids[n++] = id;
+        }
+        postings->count = n;
+    }
+    fsfree(renumbering);
+    g_mutex_unlock(&index->lock);
+}
+
+size_t search_index_size(search_index_t *index)
+{
+    g_mutex_lock(&index->lock);
+    size_t size = index->record_count;
+    g_mutex_unlock(&index->lock);
+    return size;
+}
+
+size_t search_index_term_count(search_index_t *index)
+{
+    g_mutex_lock(&index->lock);
+    size_t count = index->term_count;
+    g_mutex_unlock(&index->lock);
+    return count;
+}
+
+static void collect_token(void *obj, const char *token)
+{
+    list_append(obj, charstr_dupstr(token));
+}
+
+static int postings_cmp(const void *a, const void *b)
+{
+    const postings_t *pa = *(postings_t *const *) a;
+    const postings_t *pb = *(postings_t *const *) b;
+    if (pa->count < pb->count)
+        return -1;
+    return pa->count > pb->count;
+}
+
+/* Keep the candidates that appear in postings. Both are ascending. */
+static size_t intersect(uint32_t *candidates, size_t count,
+                        const postings_t *postings)
+{
+    size_t n = 0, j = 0;
+    for (size_t i = 0; i < count; i++) {
+        while (j < postings->count && postings->ids[j] < candidates[i])
+            j++;
+        if (j == postings->count)
+            break;
+        if (postings->ids[j] == candidates[i])
+            candidates[n++] = candidates[i];
+    }
+    return n;
+}
+
+/* Return the matching records (of match_t), newest first. */
+static list_t *match(search_index_t *index, list_t *tokens, size_t limit)
+{
+    list_t *matches = make_list();
+    size_t token_count = list_size(tokens);
+    if (!token_count)
+        return matches;
+    postings_t *lists[token_count];
+    g_mutex_lock(&index->lock);
+    size_t n = 0;
+    for (list_elem_t *e = list_get_first(tokens); e; e = list_next(e)) {
+        hash_elem_t *he = hash_table_get(index->vocabulary,
+                                         list_elem_get_value(e));
+        if (!he) {
+            g_mutex_unlock(&index->lock);
+            return matches;
+        }
+        lists[n++] = (postings_t *) hash_elem_get_value(he);
+    }
+    qsort(lists, n, sizeof *lists, postings_cmp);
+    size_t count = lists[0]->count;
+    uint32_t *candidates = fsalloc((count + 1) * sizeof *candidates);
+    memcpy(candidates, lists[0]->ids, count * sizeof *candidates);
+    for (size_t i = 1; i < n && count; i++)
+        count = intersect(candidates, count, lists[i]);
+    for (size_t i = count; i-- && list_size(matches) < limit;) {
+        indexed_record_t *record = &index->records[candidates[i]];
+        if (!record_is_live(index, record))
+            continue;
+        match_t *copy = fsalloc(sizeof *copy);
+        copy->inode = index->segments[record->segment].inode;
+        copy->position = record->position;
+        copy->channel_key = charstr_dupstr(record->channel_key);
+        copy->t = record->t;
+        list_append(matches, copy);
+    }
+    g_mutex_unlock(&index->lock);
+    fsfree(candidates);
+    return matches;
+}
+
+typedef struct {
+    ino_t inode;
+    char *path;
+} segment_path_t;
+
+static list_t *segment_paths(const char *directory)
+{
+    list_t *paths = make_list();
+    struct dirent **namelist;
+    int n = scan_cache_segments(directory, &namelist);
+    if (n < 0)
+        return paths;
+    for (int i = 0; i < n; i++) {
+        char *path = charstr_printf("%s/%s", directory, namelist[i]->d_name);
+        free(namelist[i]);
+        struct stat st;
+        if (stat(path, &st) < 0) {
+            fsfree(path);
+            continue;
+        }
+        segment_path_t *sp = fsalloc(sizeof *sp);
+        sp->inode = st.st_ino;
+        sp->path = path;
+        list_append(paths, sp);
+    }
+    free(namelist);
+    return paths;
+}
+
+static const char *find_path(list_t *paths, ino_t inode)
+{
+    for (list_elem_t *e = list_get_first(paths); e; e = list_next(e)) {
+        const segment_path_t *sp = list_elem_get_value(e);
+        if (sp->inode == inode)
+            return sp->path;
+    }
+    return NULL;
+}
+
+static void destroy_segment_path(segment_path_t *sp)
+{
+    fsfree(sp->path);
+    fsfree(sp);
+}
+
+/* The record at the position must still be the one indexed; the
+ * segment may have been replaced since the query. */
+static bool load_hit(search_hit_t *hit)
+{
+    cache_reader_t *reader = open_cache_reader(hit->path);
+    if (!reader)
+        return false;
+    const char *record;
+    bool ok = false;
+    if (cache_reader_seek(reader, &hit->position) &&
+        (record = cache_reader_next(reader, NULL))) {
+        const char *key, *from, *tag, *text;
+        unsigned long long t;
+        json_thing_t *message =
+            decode_cache_record(record, &key, &t, &from, &tag, &text);
+        if (message && (strcmp(key, hit->channel_key) ||
+                        (time_t) t != hit->t)) {
+            json_destroy_thing(message);
+            message = NULL;
+        }
+        if (message) {
+            hit->from = from ? charstr_dupstr(from) : NULL;
+            hit->tag = tag ? charstr_dupstr(tag) : NULL;
+            hit->text = charstr_dupstr(text);
+            json_destroy_thing(message);
+            ok = true;
+        }
+    }
+    close_cache_reader(reader);
+    return ok;
+}
+
+FSTRACE_DECL(IRC_SEARCH_QUERY,
+             "TOKENS=%z HITS=%z MATCH-US=%64u TOTAL-US=%64u");
+
+list_t *search_index_query(search_index_t *index, const char *directory,
+                           const char *query, size_t limit)
+{
+    gint64 start = g_get_monotonic_time();
+    list_t *tokens = make_list();
+    tokenize(query, collect_token, tokens);
+    list_t *matches = match(index, tokens, limit);
+    gint64 matched = g_get_monotonic_time();
+    list_t *paths = segment_paths(directory);
+    list_t *hits = make_list();
+    while (!list_empty(matches)) {
+        match_t *record = (match_t *) list_pop_first(matches);
+        const char *path = find_path(paths, record->inode);
+        if (path) {
+            search_hit_t *hit = fsalloc(sizeof *hit);
+            hit->path = charstr_dupstr(path);
+            hit->inode = record->inode;
+            hit->position = record->position;
+            hit->channel_key = record->channel_key;
+            hit->from = hit->tag = hit->text = NULL;
+            hit->t = record->t;
+            if (load_hit(hit))
+                list_append(hits, hit);
+            else destroy_search_hit(hit);
+        } else fsfree(record->channel_key);
+        fsfree(record);
+    }
+    destroy_list(matches);
+    list_foreach(paths, (void *) destroy_segment_path, NULL);
+    destroy_list(paths);
+    FSTRACE(IRC_SEARCH_QUERY, list_size(tokens), list_size(hits),
+            (uint64_t) (matched - start),
+            (uint64_t) (g_get_monotonic_time() - start));
+    list_foreach(tokens, (void *) fsfree, NULL);
+    destroy_list(tokens);
+    return hits;
+}
+
+static search_hit_t *make_hit(const search_hit_t *of,
+                              const cache_position_t *position,
+                              const char *key, time_t t, const char *from,
+                              const char *tag, const char *text)
+{
+    search_hit_t *hit = fsalloc(sizeof *hit);
+    hit->path = charstr_dupstr(of->path);
+    hit->inode = of->inode;
+    hit->position = *position;
+    hit->channel_key = charstr_dupstr(key);
+    hit->from = from ? charstr_dupstr(from) : NULL;
+    hit->tag = tag ? charstr_dupstr(tag) : NULL;
+    hit->text = charstr_dupstr(text);
+    hit->t = t;
+    return hit;
+}
+
+search_hit_t *copy_search_hit(const search_hit_t *hit)
+{
+    return make_hit(hit, &hit->position, hit->channel_key, hit->t,
+                    hit->from, hit->tag, hit->text);
+}
+
+/* Find the position of the earliest of the before records of the
+ * channel that precede hit in its segment. */
+static bool find_context_start(search_index_t *index,
+                               const search_hit_t *hit, unsigned before,
+                               cache_position_t *start)
+{
+    g_mutex_lock(&index->lock);
+    ssize_t segment = find_segment(index, hit->inode);
+    size_t i = index->record_count;
+    if (segment >= 0)
+        while (i--) {
+            const indexed_record_t *record = &index->records[i];
+            if (record->segment == segment &&
+                !position_cmp(&record->position, &hit->position))
+                break;
+        }
+    bool found = segment >= 0 && i != (size_t) -1;
+    if (found) {
+        const char *channel_key = index->records[i].channel_key;
+        *start = hit->position;
+        /* Records are indexed in the order of the segment. */
+        for (unsigned n = 0; n < before && i--;) {
+            const indexed_record_t *record = &index->records[i];
+            if (record->segment == segment &&
+                record->channel_key == channel_key) {
+                *start = record->position;
+                n++;
+            }
+        }
+    }
+    g_mutex_unlock(&index->lock);
+    return found;
+}
+
+static cache_reader_t *open_context(search_index_t *index,
+                                    const search_hit_t *hit,
+                                    unsigned before)
+{
+    struct stat st;
+    if (stat(hit->path, &st) < 0 || st.st_ino != hit->inode)
+        return NULL;            /* replaced since the query */
+    cache_reader_t *reader = open_cache_reader(hit->path);
+    if (!reader)
+        return NULL;
+    cache_position_t start;
+    if (!find_context_start(index, hit, before, &start) ||
+        cache_reader_seek(reader, &start))
+        return reader;
+    close_cache_reader(reader);
+    return open_cache_reader(hit->path);
+}
+
+FSTRACE_DECL(IRC_SEARCH_CONTEXT, "LINES=%z US=%64u");
+
+list_t *search_hit_context(search_index_t *index, const search_hit_t *hit,
+                           unsigned before, unsigned after)
+{
+    gint64 start = g_get_monotonic_time();
+    list_t *context = make_list();
+    cache_reader_t *reader = open_context(index, hit, before);
+    if (!reader)
+        return context;
+    const char *record;
+    cache_position_t position;
+    bool found = false;
+    unsigned remaining = after;
+    while (remaining && (record = cache_reader_next(reader, &position))) {
+        const char *key, *from, *tag, *text;
+        unsigned long long t;
+        json_thing_t *message =
+            decode_cache_record(record, &key, &t, &from, &tag, &text);
+        if (!message)
+            continue;
+        if (strcmp(key, hit->channel_key)) {
+            json_destroy_thing(message);
+            continue;
+        }
+        bool is_hit = !position_cmp(&position, &hit->position);
+        list_append(context, make_hit(hit, &position, key, t, from, tag,
+                                      text));
+        json_destroy_thing(message);
+        if (found)
+            remaining--;
+        else if (is_hit)
+            found = true;
+        else if (list_size(context) > before)
+            destroy_search_hit((search_hit_t *) list_pop_first(context));
+    }
+    close_cache_reader(reader);
+    if (!found)
+        while (!list_empty(context))
+            destroy_search_hit((search_hit_t *) list_pop_first(context));
+    FSTRACE(IRC_SEARCH_CONTEXT, list_size(context),
+            (uint64_t) (g_get_monotonic_time() - start));
+    return context;
+}
+
+void destroy_search_hit(search_hit_t *hit)
+{
+    fsfree(hit->path);
+    fsfree(hit->channel_key);
+    fsfree(hit->from);
+    fsfree(hit->tag);
+    fsfree(hit->text);
+    fsfree(hit);
+}
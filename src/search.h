@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <fsdyn/list.h>
+#include "cache.h"
+
+/* An in-memory inverted index over the message cache. It maps
+ * case-folded tokens to the positions of the cached records.
+ * Segments are found by their inode numbers, which stay put when
+ * rotatable renames a segment. The index is updated by the cache
+ * writer thread and queried from the GTK thread. */
+typedef struct search_index search_index_t;
+
+/* The index numbers the segments itself, and a file created under the
+ * inode number of a deleted segment gets a new number, so the records
+ * of the deleted segment do not resurface in it. */
+typedef uint32_t search_segment_t;
+
+typedef struct {
+    char *path;
+    ino_t inode;
+    cache_position_t position;
+    char *channel_key, *from, *tag, *text;
+    time_t t;
+} search_hit_t;
+
+search_index_t *make_search_index(void);
+void destroy_search_index(search_index_t *index);
+
+/* Return the number of the segment with the inode number. If fresh
+ * is true, the file has just been created and whatever was indexed
+ * under the inode number before is forgotten. */
+search_segment_t search_index_segment(search_index_t *index, ino_t inode,
+                                      bool fresh);
+
+void search_index_add(search_index_t *index, search_segment_t segment,
+                      const cache_position_t *position,
+                      const char *channel_key, time_t t,
+                      const char *from, const char *text);
+
+/* Index every record of a segment. */
+void search_index_add_segment(search_index_t *index, const char *path);
+
+/* The segment has been rewritten into a new file. The relocations
+ * are in ascending order of their original positions; records without
+ * one are dropped. */
+void search_index_relocate(search_index_t *index, ino_t old_inode,
+                           ino_t new_inode,
+                           const cache_relocation_t *relocations,
+                           size_t count);
+
+/* Forget every segment whose inode number is not listed. */
+void search_index_prune(search_index_t *index,
+                        const ino_t *live, size_t count);
+
+/* The number of indexed records and distinct tokens. */
+size_t search_index_size(search_index_t *index);
+size_t search_index_term_count(search_index_t *index);
+
+/* Return a list of search_hit_t, newest first. A record matches if it
+ * contains every token of the query. */
+list_t *search_index_query(search_index_t *index, const char *directory,
+                           const char *query, size_t limit);
+
+/* Return a list of search_hit_t around hit on the same channel,
+ * oldest first, including hit itself. Decoding starts from the
+ * earliest of the records before hit that the index knows of rather
+ * than from the beginning of the segment. */
+list_t *search_hit_context(search_index_t *index, const search_hit_t *hit,
+                           unsigned before, unsigned after);
+
+search_hit_t *copy_search_hit(const search_hit_t *hit);
+void destroy_search_hit(search_hit_t *hit);
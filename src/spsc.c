@@ -0,0 +1,67 @@
+#include <stdatomic.h>
+#include <fsdyn/fsalloc.h>
+#include "spsc.h"
+
+enum { CACHE_LINE = 64 };
+
+struct spsc {
+    /* head is advanced by the consumer, tail by the producer; keep
+     * them on separate cache lines */
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+    _Alignas(CACHE_LINE) size_t mask;
+    void **slots;
+};
+
+spsc_t *make_spsc(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    spsc_t *queue = fsalloc(sizeof *queue);
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    queue->mask = size - 1;
+    queue->slots = fsalloc(size * sizeof *queue->slots);
+    return queue;
+}
+
+void destroy_spsc(spsc_t *queue)
+{
+    fsfree(queue->slots);
+    fsfree(queue);
+}
+
+bool spsc_push(spsc_t *queue, void *item)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if (tail - head > queue->mask)
+        return false;
+    queue->slots[tail & queue->mask] = item;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+void *spsc_pop(spsc_t *queue)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head == tail)
+        return NULL;
+    void *item = queue->slots[head & queue->mask];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return item;
+}
+
+size_t spsc_depth(spsc_t *queue)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    return tail - head;
+}
+
+size_t spsc_capacity(spsc_t *queue)
+{
+    return queue->mask + 1;
+}
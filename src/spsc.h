@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A bounded, lock-free queue of pointers between exactly one
+ * producer thread and exactly one consumer thread. */
+typedef struct spsc spsc_t;
+
+/* The capacity is rounded up to a power of two. */
+spsc_t *make_spsc(size_t capacity);
+void destroy_spsc(spsc_t *queue);
+
+/* Producer side. Return false if the queue is full. */
+bool spsc_push(spsc_t *queue, void *item);
+
+/* Consumer side. Return NULL if the queue is empty. */
+void *spsc_pop(spsc_t *queue);
+
+/* Either side; the answer may be stale by the time it is used. */
+size_t spsc_depth(spsc_t *queue);
+size_t spsc_capacity(spsc_t *queue);
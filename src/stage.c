@@ -0,0 +1,123 @@
+#include <time.h>
+#include "stage.h"
+
+atomic_bool stage_timing;
+
+typedef struct {
+    atomic_uint_fast64_t count, ns, max_ns;
+    atomic_uint_fast64_t buckets[STAGE_BUCKETS];
+} shared_stats_t;
+
+static shared_stats_t shared_stats[STAGE_COUNT];
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+uint64_t stage_begin(void)
+{
+    return stage_timing ? now_ns() : 0;
+}
+
+static unsigned bucket(uint64_t ns)
+{
+    if (ns < 1 << STAGE_SUB_BITS)
+        return ns;
+    unsigned exponent = 63 - __builtin_clzll(ns);
+    unsigned shift = exponent - STAGE_SUB_BITS;
+    return (shift + 1) << STAGE_SUB_BITS |
+        (ns >> shift & ((1 << STAGE_SUB_BITS) - 1));
+}
+
+/* The smallest value in the bucket. */
+static uint64_t bucket_floor(unsigned i)
+{
+    if (i < 1 << STAGE_SUB_BITS)
+        return i;
+    unsigned shift = (i >> STAGE_SUB_BITS) - 1;
+    uint64_t mantissa =
+        1 << STAGE_SUB_BITS | (i & ((1 << STAGE_SUB_BITS) - 1));
+    return mantissa << shift;
+}
+
+void stage_end(stage_t stage, uint64_t begin)
+{
+    if (!stage_timing)
+        return;
+    uint64_t ns = now_ns() - begin;
+    shared_stats_t *stats = &shared_stats[stage];
+    atomic_fetch_add_explicit(&stats->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->ns, ns, memory_order_relaxed);
+    uint_fast64_t max_ns =
+        atomic_load_explicit(&stats->max_ns, memory_order_relaxed);
+    while (ns > max_ns &&
+           !atomic_compare_exchange_weak_explicit(&stats->max_ns, &max_ns, ns,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+        ;
+    atomic_fetch_add_explicit(&stats->buckets[bucket(ns)], 1,
+                              memory_order_relaxed);
+}
+
+const char *stage_name(stage_t stage)
+{
+    switch (stage) {
+        case STAGE_RECEIVE:
+            return "receive";
+        case STAGE_PARSE:
+            return "parse";
+        case STAGE_DISPATCH:
+            return "dispatch";
+        case STAGE_HIGHLIGHT:
+            return "highlight";
+        case STAGE_RENDER:
+            return "render";
+        case STAGE_LOG:
+            return "log";
+        case STAGE_EMIT:
+            return "emit";
+        default:
+            return "?";
+    }
+}
+
+void get_stage_stats(stage_t stage, stage_stats_t *stats)
+{
+    shared_stats_t *shared = &shared_stats[stage];
+    stats->count = atomic_load_explicit(&shared->count, memory_order_relaxed);
+    stats->ns = atomic_load_explicit(&shared->ns, memory_order_relaxed);
+    stats->max_ns =
+        atomic_load_explicit(&shared->max_ns, memory_order_relaxed);
+    for (unsigned i = 0; i < STAGE_BUCKETS; i++)
+        stats->buckets[i] =
+            atomic_load_explicit(&shared->buckets[i], memory_order_relaxed);
+}
+
+void reset_stage_stats(void)
+{
+    for (stage_t stage = 0; stage < STAGE_COUNT; stage++) {
+        shared_stats_t *shared = &shared_stats[stage];
+        atomic_store(&shared->count, 0);
+        atomic_store(&shared->ns, 0);
+        atomic_store(&shared->max_ns, 0);
+        for (unsigned i = 0; i < STAGE_BUCKETS; i++)
+            atomic_store(&shared->buckets[i], 0);
+    }
+}
+
+uint64_t stage_percentile(const stage_stats_t *stats, double fraction)
+{
+    uint64_t rank = fraction * stats->count;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < STAGE_BUCKETS - 1; i++) {
+        seen += stats->buckets[i];
+        if (seen > rank) {
+            uint64_t ceiling = bucket_floor(i + 1) - 1;
+            return ceiling < stats->max_ns ? ceiling : stats->max_ns;
+        }
+    }
+    return stats->max_ns;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Per-stage timing of the receive path. The counters are updated only
+ * while stage_timing is set, by the network thread (STAGE_RECEIVE and
+ * STAGE_PARSE) and the main thread (the rest), so they are kept
+ * atomically; read them through get_stage_stats(). The times
+ * are inclusive: STAGE_RECEIVE covers everything else, and
+ * STAGE_DISPATCH covers highlighting, rendering, logging and any
+ * replies emitted. */
+typedef enum {
+    STAGE_RECEIVE,              /* line splitting */
+    STAGE_PARSE,                /* act_on_message() up to do_it() */
+    STAGE_DISPATCH,             /* do_it() */
+    STAGE_HIGHLIGHT,
+    STAGE_RENDER,               /* the sink */
+    STAGE_LOG,                  /* handing over to the cache writer */
+    STAGE_EMIT,                 /* emit() up to the output queue */
+    STAGE_COUNT
+} stage_t;
+
+/* The latency histograms have log-linear buckets: each power of two
+ * is split into 1 << STAGE_SUB_BITS buckets, which keeps the relative
+ * error under 12.5%. */
+enum {
+    STAGE_SUB_BITS = 3,
+    STAGE_BUCKETS = (64 - STAGE_SUB_BITS + 1) << STAGE_SUB_BITS,
+};
+
+/* A snapshot of the counters of a stage. */
+typedef struct {
+    uint64_t count, ns, max_ns;
+    uint64_t buckets[STAGE_BUCKETS];
+} stage_stats_t;
+
+extern atomic_bool stage_timing;
+
+/* CLOCK_MONOTONIC in nanoseconds. */
+uint64_t now_ns(void);
+
+/* Return a timestamp for stage_end() (0 unless stage_timing). */
+uint64_t stage_begin(void);
+void stage_end(stage_t stage, uint64_t begin);
+const char *stage_name(stage_t stage);
+void get_stage_stats(stage_t stage, stage_stats_t *stats);
+void reset_stage_stats(void);
+
+/* Return an upper bound for the given fraction (0..1) of the samples
+ * in the snapshot. */
+uint64_t stage_percentile(const stage_stats_t *stats, double fraction);
@@ -0,0 +1,280 @@
+#define _GNU_SOURCE             /* fopencookie(3) */
+#include <regex.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fsdyn/fsalloc.h>
+#include "tracering.h"
+
+typedef struct {
+    uint64_t ns;                /* CLOCK_MONOTONIC */
+    uint32_t length;            /* before truncation */
+    uint16_t size;              /* of the data that follows */
+    uint16_t event;
+} record_header_t;
+
+enum {
+    MAX_RECORD_SIZE = UINT16_MAX,
+};
+
+bool trace_ring_selected[TRACE_RING_EVENTS];
+
+const char *const TRACE_RING_NATIVE_EVENTS =
+    "^(IRC_RECEIVED|IRC_ACT_ON|IRC_DO_COMMAND|IRC_EMIT)$";
+
+static const char *const EVENT_NAMES[TRACE_RING_EVENTS] = {
+    [TRACE_RING_TEXT] = "TEXT",
+    [TRACE_RING_RECEIVED] = "IRC_RECEIVED",
+    [TRACE_RING_ACT_ON] = "IRC_ACT_ON",
+    [TRACE_RING_DO_COMMAND] = "IRC_DO_COMMAND",
+    [TRACE_RING_EMIT] = "IRC_EMIT",
+};
+
+/* Records come from the network thread (IRC_RECEIVED, IRC_ACT_ON), the
+ * main thread (IRC_DO_COMMAND, IRC_EMIT) and, as fstrace text, from
+ * every thread that traces, so the ring has a spin lock. The sampling
+ * counters are atomic so skipped records need not take it. The crash
+ * dump ignores the lock. */
+static struct {
+    uint8_t *bytes;
+    size_t capacity, max_data;
+    uint64_t head, tail;        /* tail is the oldest record */
+    unsigned sample;
+    atomic_uint counters[TRACE_RING_EVENTS];
+    atomic_flag lock;
+} ring = { .lock = ATOMIC_FLAG_INIT };
+
+static void lock_ring(void)
+{
+    while (atomic_flag_test_and_set_explicit(&ring.lock,
+                                             memory_order_acquire))
+        ;
+}
+
+static void unlock_ring(void)
+{
+    atomic_flag_clear_explicit(&ring.lock, memory_order_release);
+}
+
+static bool matches(const char *pattern, const char *name)
+{
+    regex_t re;
+    if (regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB))
+        return false;
+    bool match = !regexec(&re, name, 0, NULL, 0);
+    regfree(&re);
+    return match;
+}
+
+bool open_trace_ring(size_t size, unsigned sample, const char *include,
+                     const char *exclude)
+{
+    if (ring.bytes || size < TRACE_RING_MIN_SIZE || !sample)
+        return false;
+    ring.bytes = fsalloc(size);
+    ring.capacity = size;
+    ring.max_data = size / 4 - sizeof(record_header_t);
+    if (ring.max_data > MAX_RECORD_SIZE)
+        ring.max_data = MAX_RECORD_SIZE;
+    ring.sample = sample;
+    trace_ring_selected[TRACE_RING_TEXT] = true;
+    for (int event = 0; event < TRACE_RING_EVENTS; event++)
+        if (event != TRACE_RING_TEXT)
+            trace_ring_selected[event] =
+                include && matches(include, EVENT_NAMES[event]) &&
+                !(exclude && matches(exclude, EVENT_NAMES[event]));
+    return true;
+}
+
+static void put(const void *data, size_t size)
+{
+    size_t offset = ring.head % ring.capacity;
+    size_t first = ring.capacity - offset;
+    if (first > size)
+        first = size;
+    memcpy(ring.bytes + offset, data, first);
+    memcpy(ring.bytes, (const uint8_t *) data + first, size - first);
+    ring.head += size;
+}
+
+static void get(uint64_t position, void *data, size_t size)
+{
+    size_t offset = position % ring.capacity;
+    size_t first = ring.capacity - offset;
+    if (first > size)
+        first = size;
+    memcpy(data, ring.bytes + offset, first);
+    memcpy((uint8_t *) data + first, ring.bytes, size - first);
+}
+
+void trace_ring_record(trace_ring_event_t event, const void *data,
+                       size_t size)
+{
+    if (!ring.bytes)
+        return;
+    if (event != TRACE_RING_TEXT && ring.sample > 1 &&
+        atomic_fetch_add_explicit(&ring.counters[event], 1,
+                                  memory_order_relaxed) % ring.sample)
+        return;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    record_header_t header = {
+        .ns = ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec,
+        .length = size,
+        .size = size < ring.max_data ? size : ring.max_data,
+        .event = event,
+    };
+    lock_ring();
+    while (ring.head + sizeof header + header.size - ring.tail >
+           ring.capacity) {
+        record_header_t oldest;
+        get(ring.tail, &oldest, sizeof oldest);
+        ring.tail += sizeof oldest + oldest.size;
+    }
+    put(&header, sizeof header);
+    put(data, header.size);
+    unlock_ring();
+}
+
+static ssize_t write_text(void *cookie, const char *buf, size_t size)
+{
+    trace_ring_record(TRACE_RING_TEXT, buf, size);
+    return size;
+}
+
+FILE *trace_ring_stream(void)
+{
+    static FILE *stream;
+    if (!stream) {
+        cookie_io_functions_t functions = { .write = write_text };
+        stream = fopencookie(NULL, "w", functions);
+        setvbuf(stream, NULL, _IOLBF, BUFSIZ);
+    }
+    return stream;
+}
+
+/* The dump is formatted by hand because it may run in a signal
+ * handler. */
+typedef struct {
+    int fd;
+    size_t count;
+    char buffer[4096];
+} writer_t;
+
+static void flush(writer_t *w)
+{
+    const char *p = w->buffer;
+    while (w->count) {
+        ssize_t count = write(w->fd, p, w->count);
+        if (count <= 0)
+            break;
+        p += count;
+        w->count -= count;
+    }
+    w->count = 0;
+}
+
+static void put_char(writer_t *w, char c)
+{
+    if (w->count == sizeof w->buffer)
+        flush(w);
+    w->buffer[w->count++] = c;
+}
+
+static void put_string(writer_t *w, const char *s)
+{
+    while (*s)
+        put_char(w, *s++);
+}
+
+static void put_decimal(writer_t *w, uint64_t n, int min_digits)
+{
+    char digits[20];
+    int i = 0;
+    do {
+        digits[i++] = '0' + n % 10;
+        n /= 10;
+    } while (n || i < min_digits);
+    while (i)
+        put_char(w, digits[--i]);
+}
+
+/* Like fstrace's %A: printable ASCII as is, everything else
+ * percent-encoded. */
+static void put_data(writer_t *w, uint64_t position, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < size; i++) {
+        uint8_t c = ring.bytes[(position + i) % ring.capacity];
+        if (c > ' ' && c < 0x7f && c != '%')
+            put_char(w, c);
+        else {
+            put_char(w, '%');
+            put_char(w, hex[c >> 4]);
+            put_char(w, hex[c & 0xf]);
+        }
+    }
+}
+
+static void dump(int fd, const char *banner)
+{
+    static writer_t w;          /* too big for a signal stack */
+    w.fd = fd;
+    w.count = 0;
+    if (banner)
+        put_string(&w, banner);
+    for (uint64_t position = ring.tail; position < ring.head;) {
+        record_header_t header;
+        get(position, &header, sizeof header);
+        position += sizeof header;
+        if (header.event == TRACE_RING_TEXT) {
+            for (size_t i = 0; i < header.size; i++)
+                put_char(&w, ring.bytes[(position + i) % ring.capacity]);
+        } else if (header.event < TRACE_RING_EVENTS) {
+            put_decimal(&w, header.ns / 1000000000, 1);
+            put_char(&w, '.');
+            put_decimal(&w, header.ns / 1000 % 1000000, 6);
+            put_char(&w, ' ');
+            put_string(&w, EVENT_NAMES[header.event]);
+            put_string(&w, " LEN=");
+            put_decimal(&w, header.length, 1);
+            put_string(&w, " DATA=");
+            put_data(&w, position, header.size);
+            if (header.size < header.length)
+                put_string(&w, "...");
+            put_char(&w, '\n');
+        }
+        position += header.size;
+    }
+    flush(&w);
+}
+
+void dump_trace_ring(int fd)
+{
+    if (!ring.bytes)
+        return;
+    lock_ring();
+    dump(fd, NULL);
+    unlock_ring();
+}
+
+static void crashed(int signum)
+{
+    dump(STDERR_FILENO, "--- trace ring ---\n");
+    raise(signum);              /* SA_RESETHAND restored the default */
+}
+
+void dump_trace_ring_on_crash(void)
+{
+    static const int signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    struct sigaction sa = {
+        .sa_handler = crashed,
+        .sa_flags = SA_RESETHAND,
+    };
+    sigemptyset(&sa.sa_mask);
+    for (int i = 0; i < sizeof signals / sizeof signals[0]; i++)
+        sigaction(signals[i], &sa, NULL);
+}
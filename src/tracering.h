@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* An in-memory ring of binary trace records. The hot trace points
+ * record their raw arguments with a timestamp and nothing is
+ * formatted until the ring is dumped. Other fstrace events can be
+ * captured as text through trace_ring_stream(). The oldest records
+ * are overwritten when the ring is full. */
+typedef enum {
+    TRACE_RING_TEXT,            /* a line of fstrace output */
+    TRACE_RING_RECEIVED,        /* bytes read from the server */
+    TRACE_RING_ACT_ON,          /* a message without the CR LF */
+    TRACE_RING_DO_COMMAND,      /* the command being dispatched */
+    TRACE_RING_EMIT,            /* text queued for the server */
+    TRACE_RING_EVENTS
+} trace_ring_event_t;
+
+/* Indexed by event; all false until the ring is opened. */
+extern bool trace_ring_selected[TRACE_RING_EVENTS];
+
+#define TRACE_RING(event, data, size)                           \
+    do {                                                        \
+        if (trace_ring_selected[event])                         \
+            trace_ring_record(event, data, size);               \
+    } while (0)
+
+enum {
+    TRACE_RING_MIN_SIZE = 4096,
+};
+
+/* Allocate a ring of size (at least TRACE_RING_MIN_SIZE) bytes and
+ * select the binary events whose fstrace names (e.g., IRC_RECEIVED)
+ * match include but not exclude (extended regular expressions; either
+ * may be NULL). Only every sample-th record of each binary event is
+ * kept. */
+bool open_trace_ring(size_t size, unsigned sample, const char *include,
+                     const char *exclude);
+
+/* An extended regular expression matching the fstrace names of the
+ * binary events. Exclude them from fstrace to avoid duplicates. */
+extern const char *const TRACE_RING_NATIVE_EVENTS;
+
+/* A line-buffered stream whose lines are recorded as TRACE_RING_TEXT
+ * records; pass it to fstrace_direct(). */
+FILE *trace_ring_stream(void);
+
+void trace_ring_record(trace_ring_event_t event, const void *data,
+                       size_t size);
+
+/* Decode the ring to fd, oldest record first. The ring is not
+ * emptied. */
+void dump_trace_ring(int fd);
+
+/* Dump the ring to stderr on SIGSEGV, SIGBUS, SIGFPE, SIGILL and
+ * SIGABRT before letting the signal take its course. */
+void dump_trace_ring_on_crash(void);
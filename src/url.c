@@ -1,4 +1,4 @@
-#include "util.h"
+#include "core.h"
 #include <fsdyn/charstr.h>
 #include <nwutil.h>
 
@@ -1,4 +1,5 @@
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <assert.h>
 #include <encjson.h>
@@ -7,20 +8,25 @@
 #include "util.h"
 #include "intl.h"
 #include "url.h"
+#include "notify.h"
+#include "replay.h"
+#include "watchdog.h"
+#include "metrics.h"
 
 static const char *const IRC_DEFAULT_SERVER = "irc.oftc.net";
 static const int IRC_DEFAULT_PORT = 6697;
 static const bool IRC_DEFAULT_USE_TLS = true;
 static const char *const IRC_DEFAULT_CACHE_DIR = ".cache/lip/main";
+static const bool IRC_DEFAULT_CACHE_SYNC = false;
 
 GtkTextBuffer *get_console(app_t *app)
 {
-    return gtk_text_view_get_buffer(GTK_TEXT_VIEW(app->gui.console));
+    return gtk_text_view_get_buffer(GTK_TEXT_VIEW(app->gui->console));
 }
 
 static bool is_console_at_bottom(app_t *app)
 {
-    GtkScrolledWindow *sw = GTK_SCROLLED_WINDOW(app->gui.scrolled_window);
+    GtkScrolledWindow *sw = GTK_SCROLLED_WINDOW(app->gui->scrolled_window);
     GtkAdjustment *adj = gtk_scrolled_window_get_vadjustment(sw);
     gdouble value = gtk_adjustment_get_value(adj);
     gdouble page = gtk_adjustment_get_page_size(adj);
@@ -95,14 +101,15 @@ bool begin_console_line(app_t *app, GtkTextBuffer **console)
 {
     bool at_bottom = is_console_at_bottom(app);
     *console = get_console(app);
-    append_timestamp(&app->gui.timestamp, time(NULL), *console);
+    append_timestamp(&app->gui->timestamp, time(NULL), *console);
     return at_bottom;
 }
 
-static void delayed_console_scroll(app_t *app)
+static gboolean delayed_console_scroll(app_t *app)
 {
-    gtk_text_view_scroll_mark_onscreen(GTK_TEXT_VIEW(app->gui.console),
-                                       app->gui.end_of_console);
+    gtk_text_view_scroll_mark_onscreen(GTK_TEXT_VIEW(app->gui->console),
+                                       app->gui->end_of_console);
+    return G_SOURCE_REMOVE;
 }
 
 void console_scroll_maybe(app_t *app, bool scroll)
@@ -112,36 +119,7 @@ void console_scroll_maybe(app_t *app, bool scroll)
      * recommended on the net, but that seems to be too soon
      * sometimes, as well... */
     if (scroll)
-        async_timer_start(app->async, async_now(app->async) + 50 * ASYNC_MS,
-                          (action_1) { app, (act_1) delayed_console_scroll });
-}
-
-char *escape_xml(const char *text)
-{
-    list_t *snippets = make_list();
-    const char *p = text;
-    const char *q = p;
-    for (;;)
-        switch (*q) {
-            case '\0':
-                list_append(snippets, charstr_dupstr(p));
-                char *escaped = charstr_join("", snippets);
-                list_foreach(snippets, (void *) fsfree, NULL);
-                destroy_list(snippets);
-                return escaped;
-            case '&':
-                list_append(snippets, charstr_dupsubstr(p, q));
-                list_append(snippets, charstr_dupstr("&amp;"));
-                p = ++q;
-                break;
-            case '<':
-                list_append(snippets, charstr_dupsubstr(p, q));
-                list_append(snippets, charstr_dupstr("&lt;"));
-                p = ++q;
-                break;
-            default:
-                q++;
-        }
+        g_timeout_add(50, G_SOURCE_FUNC(delayed_console_scroll), app);
 }
 
 static void span(char **escaped_text, const char *key, const char *value)
@@ -175,47 +153,6 @@ static void tag_text(char **escaped_text, const char *tag_name)
     span(escaped_text, "strikethrough", "true");
 }
 
-typedef struct {
-    bool bold, underline, italic;
-    unsigned fg_color, bg_color;
-} irc_text_style_t;
-
-static const char *adjust_style(const char *q, irc_text_style_t *style)
-{
-    switch (*q++) {
-        default:
-            abort();
-        case 'B' & 0x1f:
-            style->bold = !style->bold;
-            return q;
-        case 'O' & 0x1f:
-            style->bold = style->underline = style->italic = false;
-            style->fg_color = style->bg_color = -1U;
-            return q;
-        case 'R' & 0x1f:
-            style->italic = !style->italic;
-            return q;
-        case 'U' & 0x1f:
-            style->underline = !style->underline;
-            return q;
-        case 'C' & 0x1f:
-            ;
-    }
-    if (!(charstr_char_class(*q) & CHARSTR_DIGIT)) {
-        style->fg_color = style->bg_color = -1;
-        return q;
-    }
-    style->fg_color = *q++ - '0';
-    if (charstr_char_class(*q) & CHARSTR_DIGIT)
-        style->fg_color = style->fg_color * 10 + *q++ - '0';
-    if (q[0] != ',' || !(charstr_char_class(q[1]) & CHARSTR_DIGIT))
-        return q;
-    style->bg_color = *++q - '0';
-    if (charstr_char_class(*++q) & CHARSTR_DIGIT)
-        style->bg_color = style->bg_color * 10 + *q++ - '0';
-    return q;
-}
-
 static void append_snippet(GtkTextBuffer *chat_buffer, const char *p,
                            const char *q, const irc_text_style_t *style,
                            const char *tag_name, GtkTextIter *end)
@@ -239,15 +176,16 @@ static void append_snippet(GtkTextBuffer *chat_buffer, const char *p,
     if (style->bg_color < 16)
         span(&snippet, "background", colors[style->bg_color]);
     tag_text(&snippet, tag_name);
+    const char *outer = enter_section("gtk_text_buffer_insert_markup");
     gtk_text_buffer_insert_markup(chat_buffer, end, snippet, -1);
+    leave_section(outer);
     fsfree(snippet);
 }
 
-void append_text(GtkTextBuffer *chat_buffer, const gchar *text,
-                 const char *tag_name)
+void insert_text(GtkTextBuffer *chat_buffer, GtkTextIter *iter,
+                 const gchar *text, const char *tag_name)
 {
-    GtkTextIter end;
-    gtk_text_buffer_get_end_iter(chat_buffer, &end);
+    alloc_subsystem_t outer = enter_alloc_subsystem(ALLOC_TEXT);
     char *escaped = escape_xml(text);
     irc_text_style_t style = {
         .fg_color = -1U,
@@ -258,15 +196,16 @@ void append_text(GtkTextBuffer *chat_buffer, const gchar *text,
     for (;;)
         switch (*q) {
             case '\0':
-                append_snippet(chat_buffer, p, q, &style, tag_name, &end);
+                append_snippet(chat_buffer, p, q, &style, tag_name, iter);
                 fsfree(escaped);
+                leave_alloc_subsystem(outer);
                 return;
             case 'B' & 0x1f:
             case 'C' & 0x1f:
             case 'O' & 0x1f:
             case 'R' & 0x1f:
             case 'U' & 0x1f:
-                append_snippet(chat_buffer, p, q, &style, tag_name, &end);
+                append_snippet(chat_buffer, p, q, &style, tag_name, iter);
                 p = q = adjust_style(q, &style);
                 break;
             default:
@@ -274,6 +213,14 @@ void append_text(GtkTextBuffer *chat_buffer, const gchar *text,
         }
 }
 
+void append_text(GtkTextBuffer *chat_buffer, const gchar *text,
+                 const char *tag_name)
+{
+    GtkTextIter end;
+    gtk_text_buffer_get_end_iter(chat_buffer, &end);
+    insert_text(chat_buffer, &end, text, tag_name);
+}
+
 static bool is_date_line(const gchar *line)
 {
     /* Each line begins either with a date or a time of day. Dates
@@ -283,6 +230,7 @@ static bool is_date_line(const gchar *line)
 
 static void forget_old_message(GtkTextBuffer *chat_buffer)
 {
+    const char *outer = enter_section("forget_old_message");
     /* The first line is the date; the second line is not the date */
     GtkTextIter line_start, line_end;
     gtk_text_buffer_get_iter_at_line(chat_buffer, &line_start, 1);
@@ -300,193 +248,112 @@ static void forget_old_message(GtkTextBuffer *chat_buffer)
         gtk_text_buffer_delete(chat_buffer, &start, &line_start);
     }
     g_free(line);
+    leave_section(outer);
 }
 
-void play_message(channel_t *channel, time_t t, const char *from,
-                  const char *tag_name, const char *text)
+/* The monotonic time lets lip-mockd compute end-to-end latencies. */
+FSTRACE_DECL(IRC_PLAY_MESSAGE, "CHANNEL=%s MONOTONIC-US=%64u TEXT=%s");
+
+static void append_chat_line(channel_t *channel, GtkTextBuffer *chat_buffer,
+                             time_t t, const char *from, const char *tag_name,
+                             const char *text)
 {
-    enum { MAX_LINE_COUNT = 1000 };
-    GtkTextBuffer *chat_buffer =
-        gtk_text_view_get_buffer(GTK_TEXT_VIEW(channel->chat_view));
     while (gtk_text_buffer_get_line_count(chat_buffer) >= MAX_LINE_COUNT)
         forget_old_message(chat_buffer);
-    append_timestamp(&channel->timestamp, t, chat_buffer);
+    append_timestamp(&channel->gui->timestamp, t, chat_buffer);
     if (from) {
         append_text(chat_buffer, from, NULL);
         append_text(chat_buffer, ">", NULL);
     }
     append_text(chat_buffer, text, tag_name);
     append_text(chat_buffer, "\n", NULL);
-    gtk_text_view_scroll_mark_onscreen(GTK_TEXT_VIEW(channel->chat_view),
-                                       channel->end_of_chat_view);
-}
-
-static void log_message(channel_t *channel, time_t t, const char *from,
-                        const char *tag_name, const char *text)
-{
-    app_t *app = channel->app;
-    struct tm umt_stamp;
-    gmtime_r(&t, &umt_stamp);
-    switch (rotatable_rotate_maybe(app->cache, &umt_stamp, 0, false)) {
-        default:
-            return;             /* ? */
-        case ROTATION_OK:
-        case ROTATION_ROTATED:
-            ;
-    }
-    FILE *cachef = rotatable_file(app->cache);
-    assert(cachef);
-    json_thing_t *message = json_make_object();
-    json_add_to_object(message, "channel", json_make_string(channel->key));
-    json_add_to_object(message, "time", json_make_unsigned(t));
-    if (from)
-        json_add_to_object(message, "from", json_make_string(from));
-    if (tag_name)
-        json_add_to_object(message, "tag", json_make_string(tag_name));
-    json_add_to_object(message, "text", json_make_string(text));
-    size_t size = json_utf8_encode(message, NULL, 0) + 1;
-    char *encoding = fsalloc(size);
-    json_utf8_encode(message, encoding, size);
-    json_destroy_thing(message);
-    fwrite(encoding, size, 1, cachef); /* include the terminating '\0' */
-    fsfree(encoding);
-    fflush(cachef);
-}
-
-/* Modifies text. */
-static void issue_notification(channel_t *channel, const char *from,
-                               char *text)
-{
-    char *p = text, *q = text;
-    while (*p)
-        if (charstr_char_class(*p) & CHARSTR_CONTROL)
-            p++;
-        else *q++ = *p++;
-    *q = '\0';
-    size_t length = q - text;
-    if (length > 50)
-        strcpy(text + 45, "[...]");
-    char *title = charstr_printf("%s: %s", _(APP_NAME), channel->name);
-    GNotification *notification = g_notification_new(title);
-    fsfree(title);
-    if (from) {
-        char *body = charstr_printf("%s> %s", from, text);
-        g_notification_set_body(notification, body);
-        fsfree(body);
-    } else g_notification_set_body(notification, text);
-    app_t *app = channel->app;
-    g_notification_set_icon(notification, G_ICON(app->gui.icon));
-    char *detailed_action = charstr_printf("app.notif-acked::%s", channel->key);
-    g_notification_set_default_action(notification, detailed_action);
-    fsfree(detailed_action);
-    g_application_send_notification(G_APPLICATION(app->gui.gapp), channel->key,
-                                    notification);
-    g_object_unref(notification);
-}
-
-static void append_message_va(channel_t *channel, const gchar *from,
-                              const gchar *tag_name, bool notify,
-                              const gchar *format, va_list ap)
-{
-    char *text = charstr_vprintf(format, ap);
-    time_t t = time(NULL);
-    play_message(channel, t, from, tag_name, text);
-    log_message(channel, t, from, tag_name, text);
-    if (notify)
-        issue_notification(channel, from, text);
-    fsfree(text);
+    FSTRACE(IRC_PLAY_MESSAGE, channel->key,
+            (uint64_t) g_get_monotonic_time(), text);
 }
 
-static void append_message(channel_t *channel, const gchar *from,
-                           const gchar *tag_name, const gchar *format, ...)
+void play_message(channel_t *channel, time_t t, const char *from,
+                  const char *tag_name, const char *text)
 {
-    va_list ap;
-    va_start(ap, format);
-    append_message_va(channel, from, tag_name, false, format, ap);
-    va_end(ap);
+    GtkTextBuffer *chat_buffer =
+        gtk_text_view_get_buffer(GTK_TEXT_VIEW(channel->gui->chat_view));
+    append_chat_line(channel, chat_buffer, t, from, tag_name, text);
+    gtk_text_view_scroll_mark_onscreen(GTK_TEXT_VIEW(channel->gui->chat_view),
+                                       channel->gui->end_of_chat_view);
 }
 
-void indicate_message(channel_t *channel, const gchar *from,
-                      const gchar *tag_name, const gchar *format, ...)
+void play_messages(channel_t *channel, list_t *messages)
 {
-    va_list ap;
-    va_start(ap, format);
-    append_message_va(channel, from, tag_name, true, format, ap);
-    va_end(ap);
+    GtkTextBuffer *chat_buffer =
+        gtk_text_view_get_buffer(GTK_TEXT_VIEW(channel->gui->chat_view));
+    for (list_elem_t *e = list_get_first(messages); e; e = list_next(e)) {
+        batched_message_t *message =
+            (batched_message_t *) list_elem_get_value(e);
+        append_chat_line(channel, chat_buffer, message->t, message->from,
+                         message->tag_name, message->text);
+    }
+    gtk_text_view_scroll_mark_onscreen(GTK_TEXT_VIEW(channel->gui->chat_view),
+                                       channel->gui->end_of_chat_view);
 }
 
-bool valid_server(const char *address)
+static bool begins_with_date(GtkTextBuffer *chat_buffer, const char *date)
 {
-    return *address != '\0';    /* TBD */
+    GtkTextIter start, end;
+    gtk_text_buffer_get_start_iter(chat_buffer, &start);
+    gtk_text_buffer_get_iter_at_line(chat_buffer, &end, 1);
+    gchar *line = gtk_text_buffer_get_text(chat_buffer, &start, &end, FALSE);
+    bool match = charstr_skip_prefix(line, date) != NULL;
+    g_free(line);
+    return match;
 }
 
-bool valid_tcp_port(const char *port, int *number)
+bool prepend_message(channel_t *channel, time_t t, const char *from,
+                     const char *tag_name, const char *text)
 {
-    uint64_t value;
-    if (charstr_to_unsigned(port, -1, 10, &value) < 0)
-        return false;
-    if (value < 1 || value > 0xffff)
+    GtkTextBuffer *chat_buffer =
+        gtk_text_view_get_buffer(GTK_TEXT_VIEW(channel->gui->chat_view));
+    if (gtk_text_buffer_get_line_count(chat_buffer) >= MAX_LINE_COUNT)
         return false;
-    *number = value;
-    return true;
-}
-
-bool valid_nick(const char *nick)
-{
-    switch (*nick) {
-        case '\0':
-        case '$':
-        case ':':
-        case '#':
-        case '&':
-            return false;
-        default:
-            ;
+    struct tm then;
+    localtime_r(&t, &then);
+    char date[100];
+    strftime(date, sizeof date, "(%F)", &then);
+    GtkTextIter iter;
+    if (gtk_text_buffer_get_char_count(chat_buffer) == 0) {
+        /* Later messages continue the same day. */
+        channel->gui->timestamp = then;
+        gtk_text_buffer_get_start_iter(chat_buffer, &iter);
+        insert_text(chat_buffer, &iter, date, "log");
+        insert_text(chat_buffer, &iter, "\n", "log");
+    } else if (begins_with_date(chat_buffer, date))
+        gtk_text_buffer_get_iter_at_line(chat_buffer, &iter, 1);
+    else {
+        gtk_text_buffer_get_start_iter(chat_buffer, &iter);
+        insert_text(chat_buffer, &iter, date, "log");
+        insert_text(chat_buffer, &iter, "\n", "log");
     }
-    for (const char *p = nick; *p; p++)
-        switch (*p) {
-            case ' ':
-            case ',':
-            case '*':
-            case '?':
-            case '!':
-            case '@':
-            case '.':
-                return false;
-            default:
-                if (charstr_char_class(*p) & CHARSTR_CONTROL)
-                    return false;
-        }
+    char tod[100];
+    strftime(tod, sizeof tod, TIMESTAMP_PATTERN, &then);
+    insert_text(chat_buffer, &iter, tod, "log");
+    if (from) {
+        insert_text(chat_buffer, &iter, from, NULL);
+        insert_text(chat_buffer, &iter, ">", NULL);
+    }
+    insert_text(chat_buffer, &iter, text, tag_name);
+    insert_text(chat_buffer, &iter, "\n", NULL);
     return true;
 }
 
-bool valid_name(const char *name)
-{
-    return true;                /* TBD */
-}
-
-void logged_command(app_t *app, const char *prefix, const char *command,
-                    list_t *params)
+static void append_message(channel_t *channel, const gchar *from,
+                           const gchar *tag_name, const gchar *format, ...)
 {
-    const char *mood = "log";
-    GtkTextBuffer *console;
-    bool at_bottom = begin_console_line(app, &console);
-    append_text(console, prefix, mood);
-    append_text(console, " ", mood);
-    append_text(console, command, mood);
-    if (!list_empty(params)) {
-        append_text(console, " ", mood);
-        list_elem_t *e = list_get_first(params);
-        for (;;) {
-            append_text(console, list_elem_get_value(e), mood);
-            e = list_next(e);
-            if (!e)
-                break;
-            append_text(console, " ▸", mood);
-        }
-    }
-    append_text(console, "\n", mood);
-    console_scroll_maybe(app, at_bottom);
+    va_list ap;
+    va_start(ap, format);
+    char *text = charstr_vprintf(format, ap);
+    va_end(ap);
+    time_t t = time(NULL);
+    play_message(channel, t, from, tag_name, text);
+    log_message(channel, t, from, tag_name, text);
+    fsfree(text);
 }
 
 static void get_app_settings(app_t *app, json_thing_t *cfg)
@@ -509,9 +376,17 @@ static void get_app_settings(app_t *app, json_thing_t *cfg)
     long long port;
     if (json_object_get_integer(cfg, "port", &port))
         app->config.port = port;
+    const char *last_address;
+    if (json_object_get_string(cfg, "last_address", &last_address)) {
+        fsfree(app->config.last_address);
+        app->config.last_address = charstr_dupstr(last_address);
+    }
     bool use_tls;
     if (json_object_get_boolean(cfg, "use_tls", &use_tls))
         app->config.use_tls = use_tls;
+    bool cache_sync;
+    if (json_object_get_boolean(cfg, "cache_sync", &cache_sync))
+        app->config.cache_sync = cache_sync;
 }
 
 void destroy_channel_id(channel_id_t *chid)
@@ -555,6 +430,7 @@ void load_session(app_t *app)
     app->config.server = charstr_dupstr(IRC_DEFAULT_SERVER);
     app->config.port = IRC_DEFAULT_PORT;
     app->config.use_tls = IRC_DEFAULT_USE_TLS;
+    app->config.cache_sync = IRC_DEFAULT_CACHE_SYNC;
     app->config.cache_directory =
         charstr_printf("%s/%s", app->home_dir, IRC_DEFAULT_CACHE_DIR);
     if (app->opts.reset || !app->opts.config_file)
@@ -582,7 +458,12 @@ static json_thing_t *build_settings(app_t *app)
     json_add_to_object(cfg, "full_name", json_make_string(app->config.name));
     json_add_to_object(cfg, "server", json_make_string(app->config.server));
     json_add_to_object(cfg, "port", json_make_integer(app->config.port));
+    if (app->config.last_address)
+        json_add_to_object(cfg, "last_address",
+                           json_make_string(app->config.last_address));
     json_add_to_object(cfg, "use_tls", json_make_boolean(app->config.use_tls));
+    json_add_to_object(cfg, "cache_sync",
+                       json_make_boolean(app->config.cache_sync));
     json_thing_t *channel_cfgs = json_make_array();
     json_add_to_object(cfg, "channels", channel_cfgs);
     for (avl_elem_t *ae = avl_tree_get_first(app->config.autojoins); ae;
@@ -607,20 +488,97 @@ void make_parent_dirs(const char *pathname)
     fsfree(copy);
 }
 
-void save_session(app_t *app)
+typedef struct {
+    char *path;
+    json_thing_t *cfg;
+} session_save_t;
+
+static void sync_parent_dir(const char *pathname)
 {
-    if (!app->opts.config_file)
+    char *dirpath = g_path_get_dirname(pathname);
+    int fd = open(dirpath, O_RDONLY | O_DIRECTORY);
+    g_free(dirpath);
+    if (fd < 0)
         return;
-    make_parent_dirs(app->opts.config_file);
-    FILE *cfgf = fopen(app->opts.config_file, "w");
+    fsync(fd);
+    close(fd);
+}
+
+FSTRACE_DECL(IRC_SESSION_SAVED, "PATH=%s");
+FSTRACE_DECL(IRC_SESSION_SAVE_FAIL, "PATH=%s ERR=%e");
+
+/* Run by the session writer thread. The configuration is written to a
+ * temporary file that replaces the old one only once it is on disk. */
+static void write_session(gpointer data, gpointer user_data)
+{
+    session_save_t *save = data;
+    make_parent_dirs(save->path);
+    char *tmp_path = charstr_printf("%s.tmp", save->path);
+    FILE *cfgf = fopen(tmp_path, "w");
     if (!cfgf) {
-        fprintf(stderr, _(PROGRAM ": cannot open %s\n"), app->opts.config_file);
+        FSTRACE(IRC_SESSION_SAVE_FAIL, tmp_path);
+        fprintf(stderr, _(PROGRAM ": cannot open %s\n"), tmp_path);
+    } else {
+        json_utf8_dump(save->cfg, cfgf);
+        bool ok = fflush(cfgf) == 0 && fsync(fileno(cfgf)) == 0;
+        ok = fclose(cfgf) == 0 && ok;
+        if (ok && rename(tmp_path, save->path) == 0) {
+            sync_parent_dir(save->path);
+            FSTRACE(IRC_SESSION_SAVED, save->path);
+        } else {
+            FSTRACE(IRC_SESSION_SAVE_FAIL, save->path);
+            fprintf(stderr, _(PROGRAM ": cannot save %s\n"), save->path);
+            unlink(tmp_path);
+        }
+    }
+    fsfree(tmp_path);
+    json_destroy_thing(save->cfg);
+    fsfree(save->path);
+    fsfree(save);
+}
+
+static void submit_session(app_t *app)
+{
+    if (!app->gui->session_writer)
+        /* A single thread keeps the saves in order. */
+        app->gui->session_writer =
+            g_thread_pool_new(write_session, NULL, 1, FALSE, NULL);
+    session_save_t *save = fsalloc(sizeof *save);
+    save->path = charstr_dupstr(app->opts.config_file);
+    save->cfg = build_settings(app);
+    g_thread_pool_push(app->gui->session_writer, save, NULL);
+}
+
+static gboolean save_session_now(app_t *app)
+{
+    app->gui->session_timer = 0;
+    submit_session(app);
+    return G_SOURCE_REMOVE;
+}
+
+enum {
+    SESSION_SAVE_DELAY_MS = 500,
+};
+
+void save_session(app_t *app)
+{
+    if (!app->opts.config_file || app->gui->session_timer)
         return;
+    app->gui->session_timer =
+        g_timeout_add(SESSION_SAVE_DELAY_MS, G_SOURCE_FUNC(save_session_now),
+                      app);
+}
+
+void flush_session(app_t *app)
+{
+    if (app->gui->session_timer) {
+        g_source_remove(app->gui->session_timer);
+        save_session_now(app);
+    }
+    if (app->gui->session_writer) {
+        g_thread_pool_free(app->gui->session_writer, FALSE, TRUE);
+        app->gui->session_writer = NULL;
     }
-    json_thing_t *cfg = build_settings(app);
-    json_utf8_dump(cfg, cfgf);
-    json_destroy_thing(cfg);
-    fclose(cfgf);
 }
 
 void set_autojoin(app_t *app, const char *name, bool enabled)
@@ -645,30 +603,6 @@ void set_autojoin(app_t *app, const char *name, bool enabled)
     }
 }
 
-static char scandinavian_lcase(char c)
-{
-    switch (c) {
-        case '[':
-            return '{';
-        case ']':
-            return '}';
-        case '\\':
-            return '|';
-        case '~':
-            return '^';
-        default:
-            return charstr_lcase_char(c);
-    }
-}
-
-char *lcase_string(const char *name)
-{
-    char *key = charstr_dupstr(name);
-    for (char *s = key; *s; s++)
-        *s = scandinavian_lcase(*s);
-    return key;
-}
-
 GtkWidget *build_passive_text_view()
 {
     GtkWidget *view = gtk_text_view_new();
@@ -734,186 +668,6 @@ static bool send_message(channel_t *channel, const gchar *text)
     return true;
 }
 
-static const char *BOLD_MARKUP = "🄱";
-static const char *ITALIC_MARKUP = "🄸";
-static const char *UNDERLINE_MARKUP = "🅄";
-static const char *ORIGINAL_MARKUP = "🄾";
-static const char *COLOR_MARKUP = "🄲";
-static const char *HIDE_MARKUP = "🗝";
-
-static char *markup_to_wire(const gchar *text)
-{
-    size_t length = strlen(text);
-    char *converted = fsalloc(length + 1);
-    char *q = converted;
-    const char *p = text;
-    const char *next;
-    for (; *p; p = next) {
-        if ((next = charstr_skip_prefix(p, BOLD_MARKUP)))
-            *q++ = BOLD_CONTROL;
-        else if ((next = charstr_skip_prefix(p, ITALIC_MARKUP)))
-            *q++ = ITALIC_CONTROL;
-        else if ((next = charstr_skip_prefix(p, UNDERLINE_MARKUP)))
-            *q++ = UNDERLINE_CONTROL;
-        else if ((next = charstr_skip_prefix(p, ORIGINAL_MARKUP)))
-            *q++ = ORIGINAL_CONTROL;
-        else if ((next = charstr_skip_prefix(p, COLOR_MARKUP)))
-            *q++ = COLOR_CONTROL;
-        else if (!(next = charstr_skip_prefix(p, HIDE_MARKUP))) {
-            next = charstr_decode_utf8_codepoint(p, NULL, NULL);
-            while (p != next)
-                *q++ = *p++;
-        }
-    }
-    *q = '\0';
-    return converted;
-}
-
-static char *markup_to_archive(const gchar *text)
-{
-    size_t length = strlen(text);
-    char *converted = fsalloc(length + 1);
-    char *q = converted;
-    const char *p = text;
-    const char *next;
-    for (; *p; p = next)
-        if ((next = charstr_skip_prefix(p, BOLD_MARKUP)))
-            *q++ = BOLD_CONTROL;
-        else if ((next = charstr_skip_prefix(p, ITALIC_MARKUP)))
-            *q++ = ITALIC_CONTROL;
-        else if ((next = charstr_skip_prefix(p, UNDERLINE_MARKUP)))
-            *q++ = UNDERLINE_CONTROL;
-        else if ((next = charstr_skip_prefix(p, ORIGINAL_MARKUP)))
-            *q++ = ORIGINAL_CONTROL;
-        else if ((next = charstr_skip_prefix(p, COLOR_MARKUP)))
-            *q++ = COLOR_CONTROL;
-        else if ((next = charstr_skip_prefix(p, HIDE_MARKUP))) {
-            while (p != next)
-                *q++ = *p++;
-            for (; *p; p = next) {
-                if ((next = charstr_skip_prefix(p, HIDE_MARKUP)))
-                    break;
-                next = charstr_decode_utf8_codepoint(p, NULL, NULL);
-            }
-        } else {
-            next = charstr_decode_utf8_codepoint(p, NULL, NULL);
-            while (p != next)
-                *q++ = *p++;
-        }
-    *q = '\0';
-    return converted;
-}
-
-static bool nick_break(int codepoint)
-{
-    switch (charstr_unicode_category(codepoint)) {
-        case UNICODE_CATEGORY_Ll:
-        case UNICODE_CATEGORY_Lm:
-        case UNICODE_CATEGORY_Lo:
-        case UNICODE_CATEGORY_Lt:
-        case UNICODE_CATEGORY_Lu:
-        case UNICODE_CATEGORY_Nd:
-        case UNICODE_CATEGORY_Nl:
-        case UNICODE_CATEGORY_No:
-            return false;
-        default:
-            return true;
-    }
-}
-
-static const char *skip_nick(channel_t *channel, const char *s)
-{
-    for (list_elem_t *e = list_get_first(channel->nicks_present); e;
-         e = list_next(e)) {
-        const char *nick = list_elem_get_value(e);
-        const char *skipped = charstr_skip_prefix(s, nick);
-        if (!skipped)
-            continue;
-        int codepoint;
-        if (!charstr_decode_utf8_codepoint(skipped, NULL, &codepoint) ||
-            nick_break(codepoint))
-            return skipped;
-    }
-    return NULL;
-}
-
-static char *wedge(const char *text, list_t *points, const char *joiner)
-{
-    list_t *snippets = make_list();
-    const char *p = text;
-    for (list_elem_t *e = list_get_first(points); e; e = list_next(e)) {
-        const char *q = text + as_intptr(list_elem_get_value(e));
-        list_append(snippets, charstr_dupsubstr(p, q));
-        p = q;
-    }
-    list_append(snippets, charstr_dupstr(p));
-    char *result = charstr_join(joiner, snippets);
-    list_foreach(snippets, (void *) fsfree, NULL);
-    destroy_list(snippets);
-    return result;
-}
-
-static char *highlight_nicks(channel_t *channel, const char *text)
-{
-    list_t *points = make_list();
-    char *lcase = lcase_string(text);
-    const char *s = lcase;
-    while (*s) {
-        const char *skipped = skip_nick(channel, s);
-        if (skipped) {
-            list_append(points, as_integer(s - lcase));
-            list_append(points, as_integer(skipped - lcase));
-            s = skipped;
-            continue;
-        }
-        for (;; s++) {
-            int codepoint;
-            const char *next =
-                charstr_decode_utf8_codepoint(s, NULL, &codepoint);
-            if (!next) {
-                s++;
-                break;
-            }
-            if (nick_break(codepoint)) {
-                s = next;
-                break;
-            }
-        }
-    }
-    fsfree(lcase);
-    static const char NICK_WEDGE[] = { BOLD_CONTROL, '\0' };
-    char *highlighted = wedge(text, points, NICK_WEDGE);
-    destroy_list(points);
-    return highlighted;
-}
-
-static char *highlight_urls(const char *text)
-{
-    list_t *points = make_list();
-    const char *p = text;
-    for (;;) {
-        const char *url_end;
-        const char *url = find_url(p, NULL, &url_end);
-        if (!url)
-            break;
-        list_append(points, as_integer(url - text));
-        list_append(points, as_integer(url_end - text));
-        p = url_end;
-    }
-    static const char URL_WEDGE[] = { UNDERLINE_CONTROL, '\0' };
-    char *highlighted = wedge(text, points, URL_WEDGE);
-    destroy_list(points);
-    return highlighted;
-}
-
-char *highlight(channel_t *channel, const char *text)
-{
-    char *h_nicks = highlight_nicks(channel, text);
-    char *h_urls = highlight_urls(h_nicks);
-    fsfree(h_nicks);
-    return h_urls;
-}
-
 static gboolean on_key_press(GtkWidget *view, GdkEventKey *event,
                              channel_t *channel)
 {
@@ -935,7 +689,7 @@ static gboolean on_key_press(GtkWidget *view, GdkEventKey *event,
                 break;
             }
             g_free(text);
-            modal_error_dialog(channel->window,
+            modal_error_dialog(channel->gui->window,
                                _("If you really want to send an initial '/', "
                                  "double it"));
             return TRUE;
@@ -947,7 +701,7 @@ static gboolean on_key_press(GtkWidget *view, GdkEventKey *event,
     fsfree(marked_up);
     if (!ok) {
         g_free(text);
-        modal_error_dialog(channel->window, _("Message too long"));
+        modal_error_dialog(channel->gui->window, _("Message too long"));
         return TRUE;
     }
     char *archived = markup_to_archive(msg_text);
@@ -963,16 +717,16 @@ static gboolean on_key_press(GtkWidget *view, GdkEventKey *event,
 
 static GtkWidget *build_send_pane(channel_t *channel)
 {
-    channel->input_view = gtk_text_view_new();
-    gtk_text_view_set_wrap_mode(GTK_TEXT_VIEW(channel->input_view),
+    channel->gui->input_view = gtk_text_view_new();
+    gtk_text_view_set_wrap_mode(GTK_TEXT_VIEW(channel->gui->input_view),
                                 GTK_WRAP_WORD);
-    g_signal_connect(G_OBJECT(channel->input_view), "key_press_event",
+    g_signal_connect(G_OBJECT(channel->gui->input_view), "key_press_event",
                      G_CALLBACK(on_key_press), channel);
     GtkWidget *sw = gtk_scrolled_window_new(NULL, NULL);
     gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(sw),
                                    GTK_POLICY_AUTOMATIC,
                                    GTK_POLICY_AUTOMATIC);
-    gtk_container_add(GTK_CONTAINER(sw), channel->input_view);
+    gtk_container_add(GTK_CONTAINER(sw), channel->gui->input_view);
     GtkWidget *hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
     gtk_box_pack_start(GTK_BOX(hbox), build_prompt(channel), FALSE, FALSE, 0);
     gtk_box_pack_start(GTK_BOX(hbox), sw, TRUE, TRUE, 0);
@@ -981,75 +735,29 @@ static GtkWidget *build_send_pane(channel_t *channel)
 
 static void destroy_channel_window(GtkWidget *, channel_t *channel)
 {
-    channel->window = NULL;
-}
-
-static int message_log_filter(const struct dirent *entity)
-{
-    return charstr_skip_prefix(entity->d_name, "messages") != NULL &&
-        charstr_ends_with(entity->d_name, ".log");
+    channel->gui->window = NULL;
+    channel->gui->window_serial++;   /* abandon any replay in progress */
+    withdraw_notification(channel);
 }
 
-static int message_log_cmp(const struct dirent **a, const struct dirent **b)
+static void channel_window_activated(GObject *, GParamSpec *,
+                                     channel_t *channel)
 {
-    return strcmp((*a)->d_name, (*b)->d_name);
-}
-
-char *read_file(const char *pathname, size_t *count)
-{
-    enum { MAX_SIZE = 1000000 };
-    FILE *f = fopen(pathname, "r");
-    if (!f)
-        return NULL;
-    char *content = fsalloc(MAX_SIZE);
-    *count = fread(content, 1, MAX_SIZE, f);
-    fclose(f);
-    return content;
+    if (gtk_window_is_active(GTK_WINDOW(channel->gui->window)))
+        withdraw_notification(channel);
 }
 
 static void replay_channel(channel_t *channel)
 {
     app_t *app = channel->app;
-    struct dirent **namelist;
-    int n = scandir(app->config.cache_directory, &namelist,
-                    message_log_filter, message_log_cmp);
-    assert(n >= 0);
-    for (int i = 0; i < n; i++) {
-        char *path = charstr_printf("%s/%s", app->config.cache_directory,
-                                    namelist[i]->d_name);
-        free(namelist[i]);
-        size_t count;
-        char *content = read_file(path, &count);
-        fsfree(path);
-        if (!content)
-            continue;
-        const char *end = content + count;
-        const char *cursor = content;
-        const char *p = content;
-        while (p < end)
-            if (!*p++) {
-                json_thing_t *message = json_utf8_decode_string(cursor);
-                if (message) {
-                    const char *key, *text;
-                    unsigned long long t;
-                    if (json_object_get_string(message, "channel", &key) &&
-                        !strcmp(key, channel->key) &&
-                        json_object_get_unsigned(message, "time", &t) &&
-                        json_object_get_string(message, "text", &text)) {
-                        const char *from, *tag;
-                        if (!json_object_get_string(message, "from", &from))
-                            from = NULL;
-                        if (!json_object_get_string(message, "tag", &tag))
-                            tag = NULL;
-                        play_message(channel, t, from, tag, text);
-                    }
-                    json_destroy_thing(message);
-                }
-                cursor = p;
-            }
-        fsfree(content);
+    if (app->replay_batch) {
+        list_append(app->replay_batch, channel);
+        return;
     }
-    free(namelist);
+    list_t *channels = make_list();
+    list_append(channels, channel);
+    replay_channels(app, channels);
+    destroy_list(channels);
 }
 
 static void close_activated(GSimpleAction *action, GVariant *parameter,
@@ -1071,7 +779,7 @@ static void autojoin_changed(GSimpleAction *action, GVariant *value,
 static void mark_up_input(channel_t *channel, const char *markup)
 {
     GtkTextBuffer *buffer =
-        gtk_text_view_get_buffer(GTK_TEXT_VIEW(channel->input_view));
+        gtk_text_view_get_buffer(GTK_TEXT_VIEW(channel->gui->input_view));
     gtk_text_buffer_insert_at_cursor(buffer, markup, -1);
 }
 
@@ -1105,45 +813,34 @@ static void hide_activated(GSimpleAction *action, GVariant *parameter,
     mark_up_input(user_data, HIDE_MARKUP);
 }
 
+/* The parameter is "" (no color), "FF" (a foreground color) or
+ * "FFBB" (foreground and background) in decimal digits. */
 static void color_activated(GSimpleAction *action, GVariant *parameter,
                             gpointer user_data)
 {
-    GValue value = { 0 };
-    g_object_get_property(G_OBJECT(action), "name", &value);
-    const char *suffix =
-        charstr_skip_prefix(g_value_get_string(&value), "color");
-    if (suffix[0]) {
-        char *markup;
-        if (suffix[2])
-            markup = charstr_printf("%s%c%c,%c%c", COLOR_MARKUP,
-                                    suffix[0], suffix[1], suffix[2], suffix[3]);
-        else markup = charstr_printf("%s%c%c", COLOR_MARKUP,
-                                     suffix[0], suffix[1]);
-        mark_up_input(user_data, markup);
-        fsfree(markup);
-    } else mark_up_input(user_data, COLOR_MARKUP);
-    g_value_unset(&value);
-}
-
-static void add_color_action(channel_t *channel, GActionGroup *actions,
-                             const char *name)
-{
-    GActionEntry entry = { name, color_activated };
-    g_action_map_add_action_entries(G_ACTION_MAP(actions), &entry, 1, channel);
-}
-
-static void add_color_actions(channel_t *channel, GActionGroup *actions)
-{
-    add_color_action(channel, actions, "color");
-    for (int fg = 0; fg < 16; fg++) {
-        char *name = charstr_printf("color%02d", fg);
-        add_color_action(channel, actions, name);
-        fsfree(name);
-        for (int bg = 0; bg < 16; bg++) {
-            char *name = charstr_printf("color%02d%02d", fg, bg);
-            add_color_action(channel, actions, name);
-            fsfree(name);
+    const char *code = g_variant_get_string(parameter, NULL);
+    for (const char *p = code; *p; p++)
+        if (!(charstr_char_class(*p) & CHARSTR_DIGIT))
+            return;
+    switch (strlen(code)) {
+        case 0:
+            mark_up_input(user_data, COLOR_MARKUP);
+            break;
+        case 2: {
+            char *markup = charstr_printf("%s%s", COLOR_MARKUP, code);
+            mark_up_input(user_data, markup);
+            fsfree(markup);
+            break;
         }
+        case 4: {
+            char *markup = charstr_printf("%s%.2s,%s", COLOR_MARKUP, code,
+                                          code + 2);
+            mark_up_input(user_data, markup);
+            fsfree(markup);
+            break;
+        }
+        default:
+            break;
     }
 }
 
@@ -1155,11 +852,11 @@ static void add_channel_actions(channel_t *channel, GActionGroup *actions)
         { "underline", underline_activated },
         { "original", original_activated },
         { "hide", hide_activated },
+        { "color", color_activated, "s" },
         { NULL }
     };
     g_action_map_add_action_entries(G_ACTION_MAP(actions),
                                     win_entries, -1, channel);
-    add_color_actions(channel, actions);
     GSimpleAction *autojoin =
         g_simple_action_new_stateful("autojoin", NULL,
                                      g_variant_new_boolean(channel->autojoin));
@@ -1197,55 +894,121 @@ GtkWidget *build_chat_log(GtkWidget **view, GtkTextMark **end_mark)
     return sw;
 }
 
+FSTRACE_DECL(IRC_CHANNEL_WINDOW_BUILT, "CHANNEL=%s US=%64u");
+
 void furnish_channel(channel_t *channel)
 {
-    if (channel->window)
+    if (!channel->gui) {
+        channel->gui = fsalloc(sizeof *channel->gui);
+        channel->gui->window = NULL;
+        channel->gui->window_serial = 0;
+        memset(&channel->gui->notification, 0,
+               sizeof channel->gui->notification);
+    }
+    if (channel->gui->window)
         return;
     app_t *app = channel->app;
-    channel->window = gtk_application_window_new(app->gui.gapp);
-    gtk_window_set_icon(GTK_WINDOW(channel->window), app->gui.icon);
+    gint64 begin = g_get_monotonic_time();
+    channel->gui->window = gtk_application_window_new(app->gui->gapp);
+    gtk_window_set_icon(GTK_WINDOW(channel->gui->window), app->gui->icon);
     /* TODO: sanitize name */
     char *window_name = charstr_printf("%s: %s", APP_NAME, channel->name);
-    gtk_window_set_title(GTK_WINDOW(channel->window), window_name);
+    gtk_window_set_title(GTK_WINDOW(channel->gui->window), window_name);
     fsfree(window_name);
-    add_window_actions(channel->window, channel);
-    gtk_window_set_default_size(GTK_WINDOW(channel->window),
-                                app->gui.default_width,
-                                app->gui.default_height);
+    add_window_actions(channel->gui->window, channel);
+    gtk_window_set_default_size(GTK_WINDOW(channel->gui->window),
+                                app->gui->default_width,
+                                app->gui->default_height);
     GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
     GtkWidget *log =
-        build_chat_log(&channel->chat_view, &channel->end_of_chat_view);
+        build_chat_log(&channel->gui->chat_view,
+                       &channel->gui->end_of_chat_view);
     gtk_box_pack_start(GTK_BOX(vbox), log, TRUE, TRUE, 0);
     GtkWidget *sep = gtk_separator_new(GTK_ORIENTATION_HORIZONTAL);
     gtk_box_pack_start(GTK_BOX(vbox), sep, FALSE, FALSE, 0);
     GtkWidget *send_pane = build_send_pane(channel);
     gtk_box_pack_start(GTK_BOX(vbox), send_pane, FALSE, FALSE, 0);
-    gtk_container_add(GTK_CONTAINER(channel->window), vbox);
-    gtk_widget_show_all(channel->window);
-    g_signal_connect(G_OBJECT(channel->window), "destroy",
+    gtk_container_add(GTK_CONTAINER(channel->gui->window), vbox);
+    gtk_widget_show_all(channel->gui->window);
+    g_signal_connect(G_OBJECT(channel->gui->window), "destroy",
                      G_CALLBACK(destroy_channel_window), channel);
+    g_signal_connect(G_OBJECT(channel->gui->window), "notify::is-active",
+                     G_CALLBACK(channel_window_activated), channel);
+    FSTRACE(IRC_CHANNEL_WINDOW_BUILT, channel->name,
+            g_get_monotonic_time() - begin);
+    time_t t0 = 0;
+    localtime_r(&t0, &channel->gui->timestamp);
     replay_channel(channel);
-    gtk_widget_grab_focus(channel->input_view);
+    gtk_widget_grab_focus(channel->gui->input_view);
 }
 
-channel_t *get_channel(app_t *app, const gchar *name)
+static void sink_furnish_channel(void *obj, channel_t *channel)
 {
-    char *key = lcase_string(name);
-    avl_elem_t *ae = avl_tree_get(app->channels, key);
-    fsfree(key);
-    if (!ae)
-        return NULL;
-    channel_t *channel = (channel_t *) avl_elem_get_value(ae);
     furnish_channel(channel);
-    return channel;
 }
 
-void reset_nick(app_t *app, const char *new_nick)
+static void sink_render_message(void *obj, channel_t *channel, time_t t,
+                                const char *from, const char *tag_name,
+                                const char *text)
+{
+    play_message(channel, t, from, tag_name, text);
+    notify_message(channel, from, tag_name, text);
+}
+
+static void sink_render_batch(void *obj, channel_t *channel,
+                              list_t *messages)
 {
-    fsfree(app->config.nick);
-    app->config.nick = charstr_dupstr(new_nick);
-    char *title = charstr_printf("%s@%s", APP_NAME, app->config.nick);
-    gtk_window_set_title(GTK_WINDOW(app->gui.app_window), title);
+    play_messages(channel, messages);
+    for (list_elem_t *e = list_get_first(messages); e; e = list_next(e)) {
+        batched_message_t *message =
+            (batched_message_t *) list_elem_get_value(e);
+        notify_message(channel, message->from, message->tag_name,
+                       message->text);
+    }
+}
+
+static void sink_log_line(void *obj, const char *mood, const char *line)
+{
+    app_t *app = obj;
+    GtkTextBuffer *console;
+    bool at_bottom = begin_console_line(app, &console);
+    append_text(console, line, mood);
+    append_text(console, "\n", mood);
+    console_scroll_maybe(app, at_bottom);
+}
+
+void update_main_title(app_t *app)
+{
+    if (!app->gui->app_window)
+        return;
+    char *title;
+    if (!metrics.lag.samples)
+        title = charstr_printf("%s@%s", APP_NAME, app->config.nick);
+    else title = charstr_printf(_("%s@%s (lag %llu ms)"), APP_NAME,
+                                app->config.nick,
+                                (unsigned long long)
+                                (metrics.lag.rtt_us +
+                                 metrics.lag.local_us) / 1000);
+    gtk_window_set_title(GTK_WINDOW(app->gui->app_window), title);
     fsfree(title);
+}
+
+static void sink_nick_changed(void *obj, const char *nick)
+{
+    app_t *app = obj;
+    update_main_title(app);
     save_session(app);
 }
+
+static const struct sink_1_vt gui_sink_vt = {
+    .furnish_channel = sink_furnish_channel,
+    .render_message = sink_render_message,
+    .log_line = sink_log_line,
+    .nick_changed = sink_nick_changed,
+    .render_batch = sink_render_batch,
+};
+
+sink_1 gui_sink(app_t *app)
+{
+    return (sink_1) { app, &gui_sink_vt };
+}
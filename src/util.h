@@ -1,53 +1,46 @@
 #pragma once
 
 #include "lip.h"
+#include "markup.h"
+
+enum { MAX_LINE_COUNT = 1000 };  /* kept in a chat view */
 
 extern const char *TIMESTAMP_PATTERN;
 int one_em();
 int one_ex();
 bool begin_console_line(app_t *app, GtkTextBuffer **console);
 void console_scroll_maybe(app_t *app, bool scroll);
-char *escape_xml(const char *text);
 void append_text(GtkTextBuffer *chat_buffer, const gchar *text,
                  const gchar *tag_name);
+void insert_text(GtkTextBuffer *chat_buffer, GtkTextIter *iter,
+                 const gchar *text, const gchar *tag_name);
 void play_message(channel_t *channel, time_t t, const char *from,
                   const char *tag_name, const char *text);
-void indicate_message(channel_t *channel, const gchar *from,
-                      const gchar *tag_name, const gchar *format, ...);
-
-bool valid_server(const char *address);
-bool valid_tcp_port(const char *port, int *number);
-bool valid_nick(const char *nick);
-bool valid_name(const char *name);
-
-void logged_command(app_t *app, const char *prefix, const char *command,
-                    list_t *params);
+/* Play a batch of messages (batched_message_t) and scroll once. */
+void play_messages(channel_t *channel, list_t *messages);
+/* Insert an older message above the existing ones. Return false if
+ * the chat view is full. */
+bool prepend_message(channel_t *channel, time_t t, const char *from,
+                     const char *tag_name, const char *text);
 
 void destroy_channel_id(channel_id_t *chid);
 void clear_autojoins(app_t *app);
 void load_session(app_t *app);
+/* Save the configuration shortly, off the main thread; the changes
+ * made in the meantime are saved together. */
 void save_session(app_t *app);
+/* Save any pending changes and wait for the saves to finish. */
+void flush_session(app_t *app);
 void make_parent_dirs(const char *pathname);
 void set_autojoin(app_t *app, const char *name, bool enabled);
-char *lcase_string(const char *name);
 GtkWidget *build_passive_text_view();
 bool is_enter_key(GdkEventKey *event);
 void modal_error_dialog(GtkWidget *parent, const gchar *text);
-char *highlight(channel_t *channel, const char *text);
-char *read_file(const char *pathname, size_t *count);
 void add_window_actions(GtkWidget *window, channel_t *channel);
 GtkWidget *build_chat_log(GtkWidget **view, GtkTextMark **end_mark);
 void furnish_channel(channel_t *channel);
-channel_t *get_channel(app_t *app, const gchar *name);
-void reset_nick(app_t *app, const char *new_nick);
-
-#define _stringify(x) #x
-#define stringify(x) _stringify(x)
+/* Show the nick and the smoothed lag in the main window title. */
+void update_main_title(app_t *app);
 
-enum {
-    BOLD_CONTROL = 'B' & 0x1f,
-    ITALIC_CONTROL = 'R' & 0x1f,
-    UNDERLINE_CONTROL = 'U' & 0x1f,
-    ORIGINAL_CONTROL = 'O' & 0x1f,
-    COLOR_CONTROL = 'C' & 0x1f,
-};
+/* The sink through which the protocol core updates the GUI. */
+sink_1 gui_sink(app_t *app);
@@ -0,0 +1,222 @@
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <glib.h>
+#include <fsdyn/charstr.h>
+#include <fsdyn/fsalloc.h>
+#include <fstrace.h>
+#include "watchdog.h"
+
+enum {
+    MAX_FRAMES = 32,
+    SKIPPED_FRAMES = 2,         /* the signal handler and trampoline */
+    MAX_STALLS = 16,
+    SAMPLE_TIMEOUT_MS = 20,
+};
+
+static _Atomic(const char *) current_section;
+
+/* Set by the main loop after poll returns and cleared before it
+ * polls again (monotonic µs). */
+static atomic_int_fast64_t busy_since;
+
+static struct {
+    GThread *thread;
+    GSource *source;
+    pthread_t main_thread;
+    gint64 threshold;           /* µs */
+    GMutex lock;
+    GCond wakeup;
+    bool stopping;
+    stall_t stalls[MAX_STALLS]; /* a ring */
+    unsigned stall_count, next_stall;
+} watchdog;
+
+/* Filled in by the signal handler on the main thread. */
+static void *frames[MAX_FRAMES];
+static int frame_count;
+static atomic_bool sampled;
+
+const char *enter_section(const char *name)
+{
+    return atomic_exchange_explicit(&current_section, name,
+                                    memory_order_relaxed);
+}
+
+void leave_section(const char *outer)
+{
+    atomic_store_explicit(&current_section, outer, memory_order_relaxed);
+}
+
+static gboolean heartbeat_prepare(GSource *source, gint *timeout)
+{
+    atomic_store(&busy_since, 0);
+    *timeout = -1;
+    return FALSE;
+}
+
+static gboolean heartbeat_check(GSource *source)
+{
+    atomic_store(&busy_since, g_get_monotonic_time());
+    return FALSE;
+}
+
+static gboolean heartbeat_dispatch(GSource *source, GSourceFunc callback,
+                                   gpointer user_data)
+{
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs heartbeat_funcs = {
+    .prepare = heartbeat_prepare,
+    .check = heartbeat_check,
+    .dispatch = heartbeat_dispatch,
+};
+
+static void take_sample(int signum)
+{
+    frame_count = backtrace(frames, MAX_FRAMES);
+    atomic_store(&sampled, true);
+}
+
+static char *sample_main_thread(void)
+{
+    atomic_store(&sampled, false);
+    if (pthread_kill(watchdog.main_thread, SIGRTMIN))
+        return NULL;
+    gint64 deadline =
+        g_get_monotonic_time() + SAMPLE_TIMEOUT_MS * G_TIME_SPAN_MILLISECOND;
+    while (!atomic_load(&sampled)) {
+        if (g_get_monotonic_time() > deadline)
+            return NULL;
+        g_usleep(G_TIME_SPAN_MILLISECOND);
+    }
+    char **symbols = backtrace_symbols(frames, frame_count);
+    if (!symbols)
+        return NULL;
+    list_t *parts = make_list();
+    for (int i = SKIPPED_FRAMES; i < frame_count; i++)
+        list_append(parts, symbols[i]);
+    char *text = charstr_join(" < ", parts);
+    destroy_list(parts);
+    free(symbols);
+    return text;
+}
+
+FSTRACE_DECL(IRC_STALL, "SECTION=%s BACKTRACE=%s");
+FSTRACE_DECL(IRC_STALL_OVER, "SECTION=%s MS=%64u");
+
+static stall_t *record_stall(const char *section, char *backtrace)
+{
+    stall_t *stall = &watchdog.stalls[watchdog.next_stall];
+    if (watchdog.stall_count == MAX_STALLS)
+        fsfree(stall->backtrace);
+    else watchdog.stall_count++;
+    watchdog.next_stall = (watchdog.next_stall + 1) % MAX_STALLS;
+    stall->t = time(NULL);
+    stall->ms = 0;
+    stall->section = section;
+    stall->backtrace = backtrace;
+    return stall;
+}
+
+static gpointer watch(gpointer data)
+{
+    stall_t *stall = NULL;
+    gint64 stall_began = 0;
+    g_mutex_lock(&watchdog.lock);
+    while (!watchdog.stopping) {
+        g_cond_wait_until(&watchdog.wakeup, &watchdog.lock,
+                          g_get_monotonic_time() + watchdog.threshold / 4);
+        gint64 since = atomic_load(&busy_since);
+        gint64 now = g_get_monotonic_time();
+        if (stall && since != stall_began) {
+            FSTRACE(IRC_STALL_OVER, stall->section ? stall->section : "-",
+                    stall->ms);
+            stall = NULL;
+        }
+        if (!stall && since && now - since >= watchdog.threshold) {
+            const char *section = atomic_load(&current_section);
+            g_mutex_unlock(&watchdog.lock);
+            char *backtrace = sample_main_thread();
+            FSTRACE(IRC_STALL, section ? section : "-",
+                    backtrace ? backtrace : "-");
+            g_mutex_lock(&watchdog.lock);
+            stall = record_stall(section, backtrace);
+            stall_began = since;
+        }
+        if (stall)
+            stall->ms = (now - stall_began) / G_TIME_SPAN_MILLISECOND;
+    }
+    g_mutex_unlock(&watchdog.lock);
+    return NULL;
+}
+
+void start_watchdog(unsigned threshold_ms)
+{
+    watchdog.main_thread = pthread_self();
+    watchdog.threshold = threshold_ms * G_TIME_SPAN_MILLISECOND;
+    struct sigaction sa = {
+        .sa_handler = take_sample,
+        .sa_flags = SA_RESTART,
+    };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGRTMIN, &sa, NULL);
+    /* backtrace() loads libgcc on first use, which is not safe in a
+     * signal handler. */
+    backtrace(frames, MAX_FRAMES);
+    watchdog.source = g_source_new(&heartbeat_funcs, sizeof(GSource));
+    g_source_attach(watchdog.source, NULL);
+    g_mutex_init(&watchdog.lock);
+    g_cond_init(&watchdog.wakeup);
+    watchdog.stopping = false;
+    watchdog.thread = g_thread_new("lip-watchdog", watch, NULL);
+}
+
+void stop_watchdog(void)
+{
+    if (!watchdog.thread)
+        return;
+    g_mutex_lock(&watchdog.lock);
+    watchdog.stopping = true;
+    g_cond_signal(&watchdog.wakeup);
+    g_mutex_unlock(&watchdog.lock);
+    g_thread_join(watchdog.thread);
+    watchdog.thread = NULL;
+    g_source_destroy(watchdog.source);
+    g_source_unref(watchdog.source);
+    for (unsigned i = 0; i < watchdog.stall_count; i++)
+        fsfree(watchdog.stalls[i].backtrace);
+    watchdog.stall_count = watchdog.next_stall = 0;
+    g_cond_clear(&watchdog.wakeup);
+    g_mutex_clear(&watchdog.lock);
+}
+
+list_t *get_stalls(void)
+{
+    list_t *stalls = make_list();
+    if (!watchdog.thread)
+        return stalls;
+    g_mutex_lock(&watchdog.lock);
+    unsigned first =
+        (watchdog.next_stall + MAX_STALLS - watchdog.stall_count) %
+        MAX_STALLS;
+    for (unsigned i = 0; i < watchdog.stall_count; i++) {
+        const stall_t *stall = &watchdog.stalls[(first + i) % MAX_STALLS];
+        stall_t *copy = fsalloc(sizeof *copy);
+        *copy = *stall;
+        if (stall->backtrace)
+            copy->backtrace = charstr_dupstr(stall->backtrace);
+        list_append(stalls, copy);
+    }
+    g_mutex_unlock(&watchdog.lock);
+    return stalls;
+}
+
+void destroy_stall(stall_t *stall)
+{
+    fsfree(stall->backtrace);
+    fsfree(stall);
+}
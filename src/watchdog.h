@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include <fsdyn/list.h>
+
+/* A thread that notices when the main loop has been busy without
+ * returning to poll for longer than a threshold. It blames the
+ * innermost instrumented section and samples a backtrace of the main
+ * thread. Stalls are traced (IRC_STALL, IRC_STALL_OVER) and the
+ * recent ones are kept for the diagnostics view. */
+
+typedef struct {
+    time_t t;                   /* when the stall was noticed */
+    uint64_t ms;                /* so far, if ongoing */
+    const char *section;        /* NULL if outside every section */
+    char *backtrace;            /* NULL if no sample was taken */
+} stall_t;
+
+/* Start watching the default main context. Must be called from the
+ * thread that runs it. */
+void start_watchdog(unsigned threshold_ms);
+void stop_watchdog(void);
+
+/* Mark a section of main thread work. Sections nest:
+ *
+ *   const char *outer = enter_section("replay");
+ *   ...
+ *   leave_section(outer);
+ *
+ * The name must be a static string. */
+const char *enter_section(const char *name);
+void leave_section(const char *outer);
+
+/* Return a list of copies of the recent stalls, oldest first. */
+list_t *get_stalls(void);
+void destroy_stall(stall_t *stall);